@@ -0,0 +1,26 @@
+# Run two builds of z80bench on the same random instructions (-r), and
+# fail unless they end up in the same states.
+#
+#   cmake -DFIRST=z80bench -DSECOND=z80bench-lazy -DCASES=# -P samestate.cmake
+
+foreach(prog FIRST SECOND)
+  execute_process(COMMAND ${${prog}} -r ${CASES}
+                  RESULT_VARIABLE status
+                  OUTPUT_VARIABLE out_${prog})
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "${${prog}} -r ${CASES}: ${status}")
+  endif()
+endforeach()
+
+if(NOT out_FIRST STREQUAL out_SECOND)
+  string(REPLACE "\n" ";" lines_FIRST "${out_FIRST}")
+  string(REPLACE "\n" ";" lines_SECOND "${out_SECOND}")
+  foreach(line ${lines_FIRST})
+    list(GET lines_SECOND 0 other)
+    list(REMOVE_AT lines_SECOND 0)
+    if(NOT line STREQUAL other)
+      message(FATAL_ERROR "States differ by case (number, digest):\n"
+              "  ${FIRST}: ${line}\n  ${SECOND}: ${other}")
+    endif()
+  endforeach()
+endif()
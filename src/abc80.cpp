@@ -3,14 +3,18 @@ extern "C"
 #include "compiler.h"
 
 #include "abcio.h"
+#include "abcmem.h"
 #include "abcprintd.h"
 #include "clock.h"
 #include "console.h"
+#include "hle.h"
 #include "hostfile.h"
 #include "patchlevel.h"
+#include "profile.h"
 #include "screen.h"
 #include "trace.h"
 #include "z80.h"
+#include "z80jit.h"
 
 #include <SDL_main.h>
 #include <SDL_thread.h>
@@ -28,6 +32,12 @@ extern "C"
 
 static int z80_thread(void*);
 static double mhz = 1000.0;
+static bool speed_set = false;
+static bool virtual_time = false;
+static int64_t virtual_epoch = 315532800; /* 1980-01-01 00:00:00 UTC */
+static bool use_jit = false;
+static bool idle_loops = true; /* Use the built-in idle loops */
+static bool watching = false;  /* Some --watch given */
 
 static const char version_string[] = VERSION;
 const char* program_name;
@@ -123,6 +133,18 @@ static void load_sysfile(FILE* sysfile)
    "  -v, - -version           print the version string\n"
    "  -h,  --help              print this help message\n"
    "  -s,  --speed #.#|max     set the CPU frequency to #.# MHz [3.0]\n"
+   "       --virtual-time      run flat out, with all timing by the CPU clock\n"
+   "       --epoch #           RTC time at start in virtual time [315532800]\n"
+   "       --cpu interp|jit    interpret, or translate hot code to native [interp]\n"
+   "       --idle addr,...     skip ahead in the wait loop at hex addr when idle\n"
+   "       --no-idle           not in the built-in one (ABC80 BASIC keyboard)\n"
+   "       --watch addr[-addr][:r|:w|:rw],...  report accesses to hex addresses\n"
+   "       --hle routine,...   run ROM routines natively (see \"--hle help\")\n"
+   "       --hle-cost name=#,... T-states charged for a native routine; by\n"
+   "                           default the ROM code's average, so single calls\n"
+   "                           are not timed exactly (see \"--hle help\")\n"
+   "       --profile kind,...  profile the Z80 code (see \"--profile help\")\n"
+   "       --profile-symbols file  symbols (hex address, name) for the profile\n"
    "       --color             allow ABC800C-style color (default)\n"
    "       --no-color          black and white only\n"
    "  -Dd, --diskdir dir       set directory for disk images [abcdisk]\n"
@@ -156,6 +178,8 @@ static void load_sysfile(FILE* sysfile)
    "  Alt-n    send NMI\n"
    "  Alt-m    dump memory as currently seen from the CPU\n"
    "  Alt-u    dump underlying RAM only (even nonexistent)\n"
+   "  Alt-o    dump opcode statistics (if built with Z80_OPSTATS)\n"
+   "  Alt-b    print the BASIC line profile (with --trace basic)\n"
    "  Alt-f    turn faketype on or off\n"
    , program_name);
     // clang-format on
@@ -175,6 +199,8 @@ static void parse_trace(char* arg)
                       {"disk", TRACE_DISK, "disk commands"},
                       {"cas", TRACE_CAS, "cassette I/O"},
                       {"pr", TRACE_PR, "printer interface"},
+                      {"basic", TRACE_BASIC, "BASIC line profile (sampled)"},
+                      {"pace", TRACE_PACE, "pacing histogram and spin time"},
                       {NULL, 0, NULL}};
     const struct trace_args* trp;
 
@@ -209,9 +235,219 @@ static void parse_trace(char* arg)
     }
 }
 
+static void parse_hle(char* arg)
+{
+    static const struct hle_args
+    {
+        const char* name;
+        unsigned int mask;
+        const char* help;
+    } hle_args[] = {{"all", HLE_ALL, "all routines with native versions"},
+                    {"fp", HLE_FP, "BASIC floating point arithmetic"},
+                    {"screen", HLE_SCREEN, "scrolling and clearing the screen"},
+                    {"verify", HLE_VERIFY, "run the ROM code too and compare"},
+                    {NULL, 0, NULL}};
+    const struct hle_args* hp;
+
+    if (!strcmp(arg, "help")) {
+        printf("Option: %s --hle [no-]routine[,[no-]routine...]\n"
+               "    The \"no-\" prefix disables a routine.\n"
+               "    The following routines can be run natively:\n",
+               program_name);
+        for (hp = hle_args; hp->name; hp++)
+            printf("        %-7s %s\n", hp->name, hp->help);
+        printf("    fp is + - * /, only single precision on the ABC802, and on\n"
+               "    the ABC80 also the conversion from integer to float.\n");
+        printf("    A native routine does all its work at once, and then takes\n"
+               "    the time of the ROM code; interrupts due during a long one\n"
+               "    such as a scroll are taken then, after it is done.\n");
+        printf("    Each call is charged a fixed number of T-states, the\n"
+               "    average the ROM code takes (set with --hle-cost):\n");
+        hle_list_costs();
+        exit(0);
+    }
+
+    for (arg = strtok(arg, ","); arg; arg = strtok(NULL, ",")) {
+        bool invert = false;
+        if (!strcmp(arg, "none")) {
+            hle_flags = 0;
+            continue;
+        }
+        if (!strncmp(arg, "no-", 3)) {
+            arg += 3;
+            invert = true;
+        }
+        for (hp = hle_args; hp->name; hp++) {
+            if (!strcmp(arg, hp->name)) {
+                if (invert)
+                    hle_flags &= ~hp->mask;
+                else
+                    hle_flags |= hp->mask;
+            }
+        }
+    }
+}
+
+static void set_hle_cost(char* arg)
+{
+    char *eq, *ep;
+
+    for (arg = strtok(arg, ","); arg; arg = strtok(NULL, ",")) {
+        unsigned long cost = 0;
+
+        eq = strchr(arg, '=');
+        if (eq) {
+            *eq = '\0';
+            cost = strtoul(eq + 1, &ep, 0);
+        }
+        if (!eq || *ep || !hle_set_cost(arg, cost)) {
+            fprintf(stderr, "%s: invalid HLE cost: %s\n", program_name, arg);
+            usage();
+        }
+    }
+}
+
+static void parse_profile(char* arg)
+{
+    static const struct profile_args
+    {
+        const char* name;
+        unsigned int mask;
+        const char* help;
+    } profile_args[] = {
+        {"exact", PROFILE_EXACT, "T-states per address and call (slow)"},
+        {"sample", PROFILE_SAMPLE, "sample PC every # T-states (sample=#)"},
+        {NULL, 0, NULL}};
+    const struct profile_args* pp;
+    char *eq, *ep;
+
+    if (!strcmp(arg, "help")) {
+        printf("Option: %s --profile [no-]kind[,[no-]kind...]\n"
+               "    The \"no-\" prefix disables a kind of profile.\n"
+               "    The following kinds of profile are available:\n",
+               program_name);
+        for (pp = profile_args; pp->name; pp++)
+            printf("        %-7s %s\n", pp->name, pp->help);
+        printf("    The report is written to the dump directory on exit.\n");
+        exit(0);
+    }
+
+    for (arg = strtok(arg, ","); arg; arg = strtok(NULL, ",")) {
+        bool invert = false;
+        if (!strcmp(arg, "none")) {
+            profile_flags = 0;
+            continue;
+        }
+        if (!strncmp(arg, "no-", 3)) {
+            arg += 3;
+            invert = true;
+        }
+        eq = strchr(arg, '=');
+        if (eq) {
+            *eq = '\0';
+            profile_interval = strtoul(eq + 1, &ep, 0);
+            if (*ep || !profile_interval) {
+                fprintf(stderr, "%s: invalid profile interval: %s\n",
+                        program_name, eq + 1);
+                usage();
+            }
+        }
+        for (pp = profile_args; pp->name; pp++) {
+            if (!strcmp(arg, pp->name)) {
+                if (invert)
+                    profile_flags &= ~pp->mask;
+                else
+                    profile_flags |= pp->mask;
+            }
+        }
+    }
+}
+
+static void add_profile_symbols(const char* arg)
+{
+    if (!profile_add_symbols(arg)) {
+        fprintf(stderr, "%s: Can't read symbol file: %s: %s\n", program_name,
+                arg, strerror(errno));
+        exit(1);
+    }
+}
+
 static void set_speed(const char* arg)
 {
     mhz = atof(arg);
+    speed_set = true;
+}
+
+static void set_epoch(const char* arg)
+{
+    char* ep;
+
+    errno = 0;
+    virtual_epoch = strtoll(arg, &ep, 0);
+    if (ep == arg || *ep || errno) {
+        fprintf(stderr, "%s: invalid epoch: %s\n", program_name, arg);
+        usage();
+    }
+}
+
+static void set_cpu(const char* arg)
+{
+    if (!strcmp(arg, "interp")) {
+        use_jit = false;
+    } else if (!strcmp(arg, "jit")) {
+        use_jit = true;
+    } else {
+        fprintf(stderr, "%s: unknown CPU backend: %s\n", program_name, arg);
+        usage();
+    }
+}
+
+static void set_idle(char* arg)
+{
+    char* ep;
+
+    for (arg = strtok(arg, ","); arg; arg = strtok(NULL, ",")) {
+        unsigned long pc = strtoul(arg, &ep, 16);
+        if (*ep || pc >= Z80_ADDRESS_LIMIT) {
+            fprintf(stderr, "%s: invalid idle loop address: %s\n",
+                    program_name, arg);
+            usage();
+        }
+        z80_add_idle_loop(pc);
+    }
+}
+
+/*
+ * Ranges of hex addresses, first[-last], each with :r, :w or :rw for
+ * reads, writes or both; writes if not given
+ */
+static void set_watch(char* arg)
+{
+    char* ep;
+
+    for (arg = strtok(arg, ","); arg; arg = strtok(NULL, ",")) {
+        unsigned long first, last;
+        unsigned int flags = MEM_WATCH_WRITE;
+
+        first = last = strtoul(arg, &ep, 16);
+        if (ep != arg && *ep == '-')
+            last = strtoul(ep + 1, &ep, 16);
+
+        if (!strcmp(ep, ":r"))
+            flags = MEM_WATCH_READ;
+        else if (!strcmp(ep, ":rw"))
+            flags = MEM_WATCH_READ | MEM_WATCH_WRITE;
+        else if (*ep && strcmp(ep, ":w"))
+            ep = arg; /* Invalid */
+
+        if (ep == arg || last >= Z80_ADDRESS_LIMIT ||
+            !mem_add_watch(first, last, flags)) {
+            fprintf(stderr, "%s: invalid or too many watchpoints: %s\n",
+                    program_name, arg);
+            usage();
+        }
+        watching = true;
+    }
 }
 
 static void add_casfile(const char* what, const char** pvt)
@@ -389,6 +625,33 @@ int main(int argc, char** argv)
                        !strcmp(optstr, "speed") ||
                        !strcmp(optstr, "frequency")) {
                 set_speed(LONG_ARG());
+            } else if (!strcmp(optstr, "virtual-time")) {
+                virtual_time = enable;
+            } else if (!strcmp(optstr, "epoch")) {
+                set_epoch(LONG_ARG());
+            } else if (!strcmp(optstr, "cpu")) {
+                set_cpu(LONG_ARG());
+            } else if (!strcmp(optstr, "idle")) {
+                if (enable)
+                    set_idle(LONG_ARG());
+                else
+                    idle_loops = false;
+            } else if (!strcmp(optstr, "watch")) {
+                set_watch(LONG_ARG());
+            } else if (!strcmp(optstr, "hle")) {
+                if (enable)
+                    parse_hle(LONG_ARG());
+                else
+                    hle_flags = 0;
+            } else if (!strcmp(optstr, "hle-cost")) {
+                set_hle_cost(LONG_ARG());
+            } else if (!strcmp(optstr, "profile")) {
+                if (enable)
+                    parse_profile(LONG_ARG());
+                else
+                    profile_flags = 0;
+            } else if (!strcmp(optstr, "profile-symbols")) {
+                add_profile_symbols(LONG_ARG());
             } else if (!strcmp(optstr, "faketype")) {
                 faketype = enable;
                 faketype_set = true;
@@ -464,8 +727,12 @@ int main(int argc, char** argv)
         }
     }
 
+    /* Virtual time goes by the nominal speed unless told otherwise */
+    if (virtual_time && (!speed_set || mhz <= 0.001 || mhz >= 1.0e+6))
+        mhz = 3.0;
+
     bool limit_speed;
-    if (mhz <= 0.001 || mhz >= 1.0e+6) {
+    if (virtual_time || mhz <= 0.001 || mhz >= 1.0e+6) {
         limit_speed = false;
     } else {
         limit_speed = true;
@@ -484,7 +751,19 @@ int main(int argc, char** argv)
                         "other than ABC802 - not possible\n");
     }
 
-    if (traceflags) {
+    /* The keyboard wait loop of all the ABC80 BASIC versions */
+    if (idle_loops && model == MODEL_ABC80 && !(memflags & MEMFL_NOBASIC))
+        z80_add_idle_loop(0x02f1);
+
+    hle_init(memflags);
+    profile_init(memflags);
+
+    if (use_jit && !z80_jit_init()) {
+        fprintf(stderr, "WARNING: --cpu jit is not available on this "
+                        "system, interpreting instead\n");
+    }
+
+    if (traceflags || watching) {
         if (is_stdio(tracefile)) {
             tracef = stdout;
         } else {
@@ -493,6 +772,7 @@ int main(int argc, char** argv)
                 fprintf(stderr, "%s: Unable to open trace file %s: %s\n",
                         program_name, tracefile, strerror(errno));
                 traceflags = TRACE_NONE;
+                tracef = stderr; /* Still report watchpoint hits */
             }
         }
     }
@@ -516,6 +796,8 @@ int main(int argc, char** argv)
 
     mem_init(memflags, memfile);
     io_init();
+    if (virtual_time)
+        rtc_virtual_time(virtual_epoch, mhz);
 
     /*
      * Load any other program files the
@@ -539,7 +821,14 @@ int main(int argc, char** argv)
     cpu_thread = SDL_CreateThread(z80_thread, NULL);
     event_loop(); /* Handling external events and screen */
     z80_quit = true;
+    z80_attention(Z80_ATTN_QUIT);
     SDL_WaitThread(cpu_thread, NULL);
+    hle_report();
+    profile_report();
+    basic_profile_report();
+    timer_report();
+    if (Z80_OPSTATS)
+        z80_opstats_dump();
 
     screen_reset();
     exit(0);
@@ -550,7 +839,7 @@ int z80_thread(void* data)
     (void)data;
 
     z80_reset();
-    timer_init(mhz);
+    timer_init(mhz, virtual_time);
 
     z80_run(true, false);
 
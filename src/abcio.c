@@ -424,6 +424,60 @@ static uint8_t abc802_in(uint8_t port)
 
 static uint8_t (*do_in)(uint8_t port);
 
+/*
+ * Block transfers for INIR/INDR/OTIR/OTDR to the ABC-bus data port.
+ * These move up to count bytes in one go if the selected device can
+ * do that, returning the number of bytes transferred; the CPU does
+ * the rest one byte at a time.
+ */
+static bool abcbus_data_port(uint8_t port)
+{
+    if (model == MODEL_ABC80)
+        return (port & 0x17) == 0;
+    else
+        return abc800_mangle_port(port) == 0;
+}
+
+size_t z80_out_block(int port, const uint8_t* buf, size_t count)
+{
+    if (tracing(TRACE_IO) || !abcbus_data_port(port))
+        return 0;
+
+    switch (abcbus_select) {
+    case 36: /* HDx: */
+    case 44: /* MFx: */
+    case 45: /* MOx: */
+    case 46: /* SFx: */
+        return disk_out_block(abcbus_select, buf, count);
+
+    case 60: /* PRx: */
+        return printer_out_block(abcbus_select, buf, count);
+
+    default:
+        return 0;
+    }
+}
+
+size_t z80_in_block(int port, uint8_t* buf, size_t count)
+{
+    if (tracing(TRACE_IO) || !abcbus_data_port(port))
+        return 0;
+
+    switch (abcbus_select) {
+    case 36: /* HDx: */
+    case 44: /* MFx: */
+    case 45: /* MOx: */
+    case 46: /* SFx: */
+        return disk_in_block(abcbus_select, buf, count);
+
+    case 60: /* PRx: */
+        return printer_in_block(abcbus_select, buf, count);
+
+    default:
+        return 0;
+    }
+}
+
 int z80_in(int port)
 {
     uint8_t sel, v;
@@ -30,9 +30,12 @@ extern void abc802_set_mem(bool);
 extern void disk_reset(void);
 extern void disk_out(int sel, int port, int value);
 extern int disk_in(int sel, int port);
+extern size_t disk_out_block(int sel, const uint8_t* buf, size_t count);
+extern size_t disk_in_block(int sel, uint8_t* buf, size_t count);
 
 /* This is the "fake" ABCbus-connected RTC */
 extern int rtc_in(int sel, int port);
+extern void rtc_virtual_time(int64_t epoch, double mhz);
 
 /* ABC806 RTC */
 extern uint8_t abc806_rtc_in(uint8_t port);
@@ -45,6 +48,8 @@ extern void abc800_ctc_init(void);
 extern void printer_reset(void);
 extern void printer_out(int sel, int port, int value);
 extern int printer_in(int sel, int port);
+extern size_t printer_out_block(int sel, const uint8_t* buf, size_t count);
+extern size_t printer_in_block(int sel, uint8_t* buf, size_t count);
 extern void dart_pr_out(uint8_t port, uint8_t v);
 extern uint8_t dart_pr_in(uint8_t port);
 
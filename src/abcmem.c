@@ -1,5 +1,6 @@
 #include "abcfile.h"
 #include "abcio.h"
+#include "abcmem.h"
 #include "compiler.h"
 #include "hostfile.h"
 #include "rom.h"
@@ -10,41 +11,118 @@
 
 uint8_t ram[MEMORY_SIZE];
 
-typedef void (*write_func)(uint8_t* p, uint8_t v);
-struct mem_page
-{
-    uint8_t* data;
-    write_func write;
-};
-
-static void write_rom(uint8_t* p, uint8_t v);
+static void write_rom(const struct mem_page* pg, uint8_t* p, uint8_t v);
+static void write_code(const struct mem_page* pg, uint8_t* p, uint8_t v);
 #define write_ram NULL /* Optimized fast path */
 #define write_screen write_ram
 
-#define PAGE_SHIFT 10
-#define PAGE_SIZE (1U << PAGE_SHIFT)
-#define PAGE_MASK (PAGE_SIZE - 1)
-#define PAGE_COUNT (Z80_ADDRESS_LIMIT / PAGE_SIZE)
+#define PAGE_SHIFT MEM_PAGE_SHIFT
+#define PAGE_SIZE MEM_PAGE_SIZE
+#define PAGE_MASK MEM_PAGE_MASK
+#define PAGE_COUNT MEM_PAGE_COUNT
 
-/* Up to 8 memory maps */
-#define MEM_MAPS 8
 static struct mem_page memmaps[MEM_MAPS][PAGE_COUNT];
 
 /* Latch the last M1 address fetched, like ABC800 does */
-static uint16_t last_m1_address;
+uint16_t last_m1_address;
+
+/* Currently active memory map(s) */
+const struct mem_page* mem_current_map[2];
+
+/* ...as the CPU sees them, outside and inside the 0x7800 window */
+static struct mem_view mem_views[2];
+const struct mem_view* mem_view = &mem_views[0];
+bool mem_in_window;
+
+/* Where writes to ROM go */
+static uint8_t mem_sink[PAGE_SIZE];
+
+/* Pages with watched ranges in them, by address (MEM_WATCH_*) */
+static uint8_t watch_pages[PAGE_COUNT];
+
+/* Set to all dirty by mem_init() */
+uint8_t mem_dirty[MEM_DIRTY_PAGES + 2];
+
+static uint8_t* dirty_byte(const struct mem_page* pg)
+{
+    const uintptr_t r = (uintptr_t)pg->data - (uintptr_t)ram;
+    const uintptr_t v = (uintptr_t)pg->data - (uintptr_t)video_ram;
+    const uintptr_t d = (uintptr_t)pg->data - (uintptr_t)abc80_devs;
+
+    if (pg->write == write_rom)
+        return &mem_dirty[MEM_DIRTY_ROM];
+    if (r < MEMORY_SIZE)
+        return &mem_dirty[MEM_DIRTY_RAM + (r >> PAGE_SHIFT)];
+    if (v < MEM_DIRTY_VIDEO_PAGES * PAGE_SIZE)
+        return &mem_dirty[MEM_DIRTY_VIDEO + (v >> PAGE_SHIFT)];
+    if (d < MEM_DIRTY_DEVS_PAGES * PAGE_SIZE)
+        return &mem_dirty[MEM_DIRTY_DEVS + (d >> PAGE_SHIFT)];
+    return &mem_dirty[MEM_DIRTY_OTHER];
+}
 
 /*
- * Currently active memory map(s)
- *
- * ABC800 can have two memory maps: the second kicks in when executing code
- * in the range 0x7800-0x7fff
+ * Get and clear the pages from first onwards (up to 64) which have been
+ * written to since who last looked, as a bitmap
  */
-static const struct mem_page* current_map[2];
+uint64_t mem_dirty_fetch(enum mem_dirty_consumer who, unsigned int first,
+                         unsigned int count)
+{
+    const uint8_t bit = 1U << who;
+    uint64_t dirty = 0;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        uint8_t* d = &mem_dirty[first + i];
 
-static inline const struct mem_page* get_page(uint16_t addr)
+        if ((*d & bit) && (atomic_fetch_and(d, ~bit) & bit))
+            dirty |= UINT64_C(1) << i;
+    }
+    return dirty;
+}
+
+static void build_view(struct mem_view* v, const struct mem_page* map)
 {
-    size_t map = (last_m1_address & 0xf800) == 0x7800;
-    return &current_map[map][addr >> PAGE_SHIFT];
+    size_t i;
+
+    v->map = map;
+    for (i = 0; i < PAGE_COUNT; i++) {
+        v->read[i] = map[i].data;
+        v->dirty[i] = dirty_byte(&map[i]);
+        if (watch_pages[i] & MEM_WATCH_WRITE)
+            v->write[i] = NULL;
+        else if (map[i].write == write_ram)
+            v->write[i] = map[i].data;
+        else if (map[i].write == write_rom)
+            v->write[i] = mem_sink;
+        else
+            v->write[i] = NULL;
+    }
+}
+
+/* Called whenever the current maps or their write functions change */
+static void refresh_views(void)
+{
+    if (!mem_current_map[0])
+        return; /* Not set up yet */
+
+    build_view(&mem_views[0], mem_current_map[0]);
+    build_view(&mem_views[1], mem_current_map[1]);
+}
+
+void mem_set_current_map(const struct mem_page* map0,
+                         const struct mem_page* map1)
+{
+    mem_current_map[0] = map0;
+    mem_current_map[1] = map1;
+    refresh_views();
+    z80_code_changed();
+}
+
+/* An M1 cycle has crossed into or out of the 0x7800 window */
+void mem_switch_window(void)
+{
+    mem_in_window = !mem_in_window;
+    mem_view = &mem_views[mem_in_window];
 }
 
 /*
@@ -61,12 +139,8 @@ struct mem_trace
 static struct mem_trace mem_traces[MAX_TRACES + 1];
 static struct mem_trace* mem_trace_tail = mem_traces;
 
-static inline void mem_trace_record(uint16_t addr, uint16_t data, uint8_t size,
-                                    bool written)
+void mem_trace(uint16_t addr, uint16_t data, uint8_t size, bool written)
 {
-    if (!tracing(TRACE_CPU))
-        return;
-
     if (mem_trace_tail <= &mem_traces[MAX_TRACES]) {
         mem_trace_tail->addr = addr;
         mem_trace_tail->data = data;
@@ -76,6 +150,13 @@ static inline void mem_trace_record(uint16_t addr, uint16_t data, uint8_t size,
     }
 }
 
+static inline void mem_trace_record(uint16_t addr, uint16_t data, uint8_t size,
+                                    bool written)
+{
+    if (tracing(TRACE_CPU))
+        mem_trace(addr, data, size, written);
+}
+
 /* Write memory trace data to screen */
 void tracemem(void)
 {
@@ -107,14 +188,19 @@ void tracemem(void)
     mem_trace_tail = mem_traces;
 }
 
-static inline uint8_t do_mem_read(uint16_t address)
+/* A data read, as looked at by read watchpoints */
+static inline uint8_t read_watched(uint16_t address)
 {
-    return get_page(address)->data[address & PAGE_MASK];
+    uint8_t value = mem_read_notrace(address);
+
+    if (unlikely(mem_watch_reads))
+        mem_watch_read(address, value);
+    return value;
 }
 
 uint8_t mem_read(uint16_t address)
 {
-    uint8_t value = do_mem_read(address);
+    uint8_t value = read_watched(address);
 
     mem_trace_record(address, value, 1, false);
     return value;
@@ -123,33 +209,22 @@ uint8_t mem_read(uint16_t address)
 uint8_t mem_fetch(uint16_t address)
 {
     /* Don't trace instruction fetches */
-    return do_mem_read(address);
+    return mem_read_notrace(address);
 }
 
 /* This is called when fetching the first opcode byte, corresponding to M1# */
 uint8_t mem_fetch_m1(uint16_t address)
 {
     /* Don't trace instruction fetches */
-    last_m1_address = address;
-    return do_mem_read(address);
-}
-
-/*
- * Words are stored with the low-order byte in the lower address.
- */
-static inline uint16_t do_mem_read_word(uint16_t address)
-{
-    uint8_t b0, b1;
-
-    b0 = do_mem_read(address);
-    b1 = do_mem_read(address + 1);
-
-    return (b1 << 8) + b0;
+    mem_set_m1_page(address);
+    return mem_read_notrace(address);
 }
 
 uint16_t mem_read_word(uint16_t address)
 {
-    uint16_t value = do_mem_read_word(address);
+    uint16_t value = read_watched(address);
+
+    value += read_watched(address + 1) << 8;
     mem_trace_record(address, value, 2, false);
     return value;
 }
@@ -157,42 +232,210 @@ uint16_t mem_read_word(uint16_t address)
 uint16_t mem_fetch_word(uint16_t address)
 {
     /* Don't trace instruction fetches */
-    return do_mem_read_word(address);
+    return mem_read_word_notrace(address);
 }
 
 /*
  * Simple write operations
  */
-static void write_rom(uint8_t* p, uint8_t v)
+static void write_rom(const struct mem_page* pg, uint8_t* p, uint8_t v)
 {
     /* Do nothing */
+    (void)pg;
     (void)p;
     (void)v;
 }
-static void do_mem_write(uint16_t address, uint8_t value)
+
+static void watch_hit(uint16_t address, uint8_t old, uint8_t value,
+                      unsigned int flag);
+
+/* A write to a page with a write function, or a watched one */
+void mem_write_hooked(uint16_t address, uint8_t value)
 {
-    const struct mem_page* page;
-    uint8_t* p;
+    const struct mem_page* pg = mem_get_page(address);
+    uint8_t* p = &pg->data[address & PAGE_MASK];
 
-    page = get_page(address);
-    p = &page->data[address & PAGE_MASK];
-    if (likely(!page->write))
-        *p = value;
+    if (unlikely(watch_pages[address >> PAGE_SHIFT] & MEM_WATCH_WRITE))
+        watch_hit(address, *p, value, MEM_WATCH_WRITE);
+    if (pg->write)
+        pg->write(pg, p, value);
     else
-        page->write(p, value);
+        *p = value;
+    *mem_view->dirty[address >> PAGE_SHIFT] = MEM_DIRTY_ALL;
 }
 
 void mem_write(uint16_t address, uint8_t value)
 {
     mem_trace_record(address, value, 1, true);
-    do_mem_write(address, value);
+    mem_write_notrace(address, value);
 }
 
 void mem_write_word(uint16_t address, uint16_t value)
 {
     mem_trace_record(address, value, 2, true);
-    do_mem_write(address, value);
-    do_mem_write(address + 1, value >> 8);
+    mem_write_word_notrace(address, value);
+}
+
+/*
+ * Watchpoints
+ */
+#define MAX_WATCHES 16
+#define MAX_WATCH_HITS 8 /* In one instruction */
+
+static struct mem_watch
+{
+    uint16_t first, last;
+    unsigned int flags;
+} watches[MAX_WATCHES];
+static unsigned int nwatches;
+
+static struct watch_hit
+{
+    uint16_t pc, address;
+    uint8_t old, value;
+    bool written;
+} watch_hits[MAX_WATCH_HITS];
+static unsigned int nwatch_hits, watch_hits_lost;
+
+bool mem_watch_reads; /* Some range is watched for reads */
+
+bool mem_add_watch(uint16_t first, uint16_t last, unsigned int flags)
+{
+    struct mem_watch* w;
+    unsigned int page;
+
+    if (nwatches >= MAX_WATCHES || first > last)
+        return false;
+
+    w = &watches[nwatches++];
+    w->first = first;
+    w->last = last;
+    w->flags = flags;
+
+    for (page = first >> PAGE_SHIFT; page <= (unsigned int)last >> PAGE_SHIFT;
+         page++)
+        watch_pages[page] |= flags;
+    if (flags & MEM_WATCH_READ)
+        mem_watch_reads = true;
+
+    refresh_views();
+    return true;
+}
+
+/*
+ * Record a hit for mem_watch_report(), which is called at the next
+ * instruction boundary.  The JIT leaves its block after any write which
+ * changes code, so pretending that this one did makes that come right
+ * after the instruction there too.
+ */
+static void watch_hit(uint16_t address, uint8_t old, uint8_t value,
+                      unsigned int flag)
+{
+    const struct mem_watch* w;
+    struct watch_hit* hit;
+
+    for (w = watches; w < &watches[nwatches]; w++) {
+        if ((w->flags & flag) && address >= w->first && address <= w->last)
+            break;
+    }
+    if (w >= &watches[nwatches])
+        return; /* Elsewhere in the page */
+
+    if (nwatch_hits >= MAX_WATCH_HITS) {
+        watch_hits_lost++;
+    } else {
+        hit = &watch_hits[nwatch_hits++];
+        hit->pc = last_m1_address;
+        hit->address = address;
+        hit->old = old;
+        hit->value = value;
+        hit->written = flag == MEM_WATCH_WRITE;
+    }
+    z80_attention(Z80_ATTN_WATCH);
+    z80_code_changed();
+}
+
+void mem_watch_read(uint16_t address, uint8_t value)
+{
+    if (watch_pages[address >> PAGE_SHIFT] & MEM_WATCH_READ)
+        watch_hit(address, value, value, MEM_WATCH_READ);
+}
+
+/*
+ * Report the hits since the last time; tc is the T-state at the end of
+ * the instruction which made them, and PC that of its opcode (after any
+ * prefix bytes.)
+ */
+void mem_watch_report(uint64_t tc)
+{
+    const struct watch_hit* hit;
+
+    for (hit = watch_hits; hit < &watch_hits[nwatch_hits]; hit++) {
+        fprintf(tracef, "[%12" PRIu64 "] WATCH: PC=%04X ", tc, hit->pc);
+        if (hit->written) {
+            fprintf(tracef, "write (%04X) %02X -> %02X\n", hit->address,
+                    hit->old, hit->value);
+        } else {
+            fprintf(tracef, "read (%04X) %02X\n", hit->address, hit->value);
+        }
+    }
+    if (watch_hits_lost)
+        fprintf(tracef, "[%12" PRIu64 "] WATCH: %u more\n", tc,
+                watch_hits_lost);
+
+    nwatch_hits = watch_hits_lost = 0;
+}
+
+/*
+ * Bulk writes, as done by native versions of ROM routines: a page at a
+ * time where the memory is plain RAM or ROM, byte by byte through the
+ * write function otherwise.  Not traced.  mem_move() copies upwards, like
+ * LDIR, so dst must not be inside the source.
+ */
+static unsigned int bulk_len(uint16_t a, uint16_t b, unsigned int len)
+{
+    unsigned int n = MEM_PAGE_SIZE - (a & PAGE_MASK);
+
+    if (n > MEM_PAGE_SIZE - (b & PAGE_MASK))
+        n = MEM_PAGE_SIZE - (b & PAGE_MASK);
+    return n < len ? n : len;
+}
+
+void mem_move(uint16_t dst, uint16_t src, unsigned int len)
+{
+    uint8_t* p;
+    unsigned int n, i;
+
+    for (; len; len -= n, dst += n, src += n) {
+        n = bulk_len(dst, src, len);
+        p = mem_view->write[dst >> PAGE_SHIFT];
+        if (p && !mem_watch_reads) {
+            memmove(&p[dst & PAGE_MASK],
+                    &mem_view->read[src >> PAGE_SHIFT][src & PAGE_MASK], n);
+            *mem_view->dirty[dst >> PAGE_SHIFT] = MEM_DIRTY_ALL;
+        } else {
+            for (i = 0; i < n; i++)
+                mem_write_notrace(dst + i, read_watched(src + i));
+        }
+    }
+}
+
+void mem_fill(uint16_t dst, uint8_t value, unsigned int len)
+{
+    uint8_t* p;
+    unsigned int n, i;
+
+    for (; len; len -= n, dst += n) {
+        n = bulk_len(dst, dst, len);
+        p = mem_view->write[dst >> PAGE_SHIFT];
+        if (p) {
+            memset(&p[dst & PAGE_MASK], value, n);
+            *mem_view->dirty[dst >> PAGE_SHIFT] = MEM_DIRTY_ALL;
+        } else {
+            for (i = 0; i < n; i++)
+                mem_write_notrace(dst + i, value);
+        }
+    }
 }
 
 /*
@@ -204,7 +447,7 @@ static unsigned int abc80_map;
 void abc80_mem_mode40(bool mode40)
 {
     abc80_map = (abc80_map & ~1) | mode40;
-    current_map[0] = current_map[1] = memmaps[abc80_map];
+    mem_set_current_map(memmaps[abc80_map], memmaps[abc80_map]);
 }
 void abc80_mem_setmap(unsigned int map)
 {
@@ -212,7 +455,7 @@ void abc80_mem_setmap(unsigned int map)
         return; /* Only 64K models can remap memory */
 
     abc80_map = ((map & 3) << 1) | (abc80_map & ~6);
-    current_map[0] = current_map[1] = memmaps[abc80_map];
+    mem_set_current_map(memmaps[abc80_map], memmaps[abc80_map]);
 }
 
 /*
@@ -220,8 +463,114 @@ void abc80_mem_setmap(unsigned int map)
  */
 void abc802_set_mem(bool opened)
 {
-    current_map[0] = memmaps[opened ? 2 : 0];
-    current_map[1] = memmaps[opened ? 2 : 1];
+    mem_set_current_map(memmaps[opened ? 2 : 0], memmaps[opened ? 2 : 1]);
+}
+
+/* The memory map code at pc is run from, as an index */
+unsigned int mem_code_map(uint16_t pc)
+{
+    return (mem_current_map[(pc & 0xf800) == 0x7800] - memmaps[0]) /
+           PAGE_COUNT;
+}
+
+/* Memory map number map, for looking at code as it was run */
+const struct mem_page* mem_map(unsigned int map)
+{
+    return memmaps[map];
+}
+
+/*
+ * Decoded instruction cache support.  A code_page is shared by all
+ * mappings of the same memory.  ROM pages are never invalidated; RAM
+ * pages get the write_code hook while they hold decoded instructions,
+ * so that the first write to the page marks it stale and puts the
+ * page back on the fast write path.  Pages which keep getting written
+ * to (code sharing a page with data or the stack) are eventually
+ * given up on and always interpreted.
+ */
+#define CODE_PAGE_MAX_RESETS 64
+
+/* Set the write hook on all RAM mappings of the same memory */
+static void hook_code_page(const uint8_t* data, write_func from, write_func to)
+{
+    struct mem_page* mp;
+
+    for (mp = &memmaps[0][0]; mp < &memmaps[0][0] + MEM_MAPS * PAGE_COUNT;
+         mp++) {
+        if (mp->data == data && mp->write == from)
+            mp->write = to;
+    }
+    refresh_views();
+}
+
+static void write_code(const struct mem_page* pg, uint8_t* p, uint8_t v)
+{
+    *p = v;
+    pg->code->stale = true;
+    pg->code->hooked = false;
+    z80_code_changed();
+    hook_code_page(pg->data, write_code, write_ram);
+}
+
+/*
+ * Get the code page for executing at a specific address, or NULL
+ * if instructions there should not be cached.
+ */
+struct code_page* mem_code_page(uint16_t addr)
+{
+    const struct mem_page* pg;
+    struct code_page* cp;
+    struct mem_page* mp;
+
+    pg = &mem_current_map[(addr & 0xf800) == 0x7800][addr >> PAGE_SHIFT];
+    cp = pg->code;
+
+    if (unlikely(!cp)) {
+        for (mp = &memmaps[0][0]; mp < &memmaps[0][0] + MEM_MAPS * PAGE_COUNT;
+             mp++) {
+            if (mp->data == pg->data && mp->write != write_rom &&
+                mp->write != write_ram)
+                return NULL; /* Some other kind of memory */
+        }
+
+        cp = calloc(1, sizeof *cp);
+        if (!cp)
+            return NULL;
+
+        for (mp = &memmaps[0][0]; mp < &memmaps[0][0] + MEM_MAPS * PAGE_COUNT;
+             mp++) {
+            if (mp->data == pg->data)
+                mp->code = cp;
+        }
+    }
+
+    if (cp->stale) {
+        if (cp->resets >= CODE_PAGE_MAX_RESETS)
+            return NULL;
+        memset(cp->insn, 0, sizeof cp->insn);
+        cp->stale = false;
+        cp->resets++;
+    }
+
+    if (!cp->hooked) {
+        hook_code_page(pg->data, write_ram, write_code);
+        cp->hooked = true;
+    }
+
+    return cp;
+}
+
+/* Discard all decoded instructions */
+void mem_flush_code(void)
+{
+    struct mem_page* mp;
+
+    for (mp = &memmaps[0][0]; mp < &memmaps[0][0] + MEM_MAPS * PAGE_COUNT;
+         mp++) {
+        if (mp->code)
+            memset(mp->code->insn, 0, sizeof mp->code->insn);
+    }
+    z80_code_changed();
 }
 
 #define K(x) ((x)*1024)
@@ -375,6 +724,8 @@ void mem_init(unsigned int flags, const char* memfile)
         abc802_set_mem(false); /* On start, MEM area closed */
         break;
     }
+    refresh_views();
+    memset(mem_dirty, MEM_DIRTY_ALL, sizeof mem_dirty);
 
     load_memfile(memfile);
 }
@@ -386,7 +737,7 @@ const char* memdump_path;
 
 void dump_memory(bool ramonly)
 {
-    const struct mem_page* map = ramonly ? memmaps[7] : current_map[0];
+    const struct mem_page* map = ramonly ? memmaps[7] : mem_current_map[0];
     struct host_file* hf;
     size_t i;
 
@@ -0,0 +1,166 @@
+#ifndef ABCMEM_H
+#define ABCMEM_H
+
+#include "compiler.h"
+#include "z80.h"
+
+/*
+ * Memory is mapped in MEM_PAGE_SIZE pages.  Pages without a write
+ * function are plain RAM.
+ */
+struct mem_page;
+typedef void (*write_func)(const struct mem_page* pg, uint8_t* p, uint8_t v);
+struct mem_page
+{
+    uint8_t* data;
+    write_func write;
+    struct code_page* code; /* Decoded instructions, if any */
+};
+
+/*
+ * Currently active memory map(s)
+ *
+ * ABC800 can have two memory maps: the second kicks in when executing code
+ * in the range 0x7800-0x7fff
+ */
+extern const struct mem_page* mem_current_map[2];
+
+/* Up to 8 memory maps */
+#define MEM_MAPS 8
+
+extern unsigned int mem_code_map(uint16_t pc);
+extern const struct mem_page* mem_map(unsigned int map);
+extern void mem_set_current_map(const struct mem_page* map0,
+                                const struct mem_page* map1);
+
+/*
+ * The current maps as the CPU sees them, flattened into data pointers
+ * for reading and writing: one view for code outside the 0x7800-0x7fff
+ * window and one for inside it.  Writes to ROM go to a sink page, which
+ * is never read; pages with a write function have no write pointer.
+ * Which view is used is only looked at when an M1 cycle goes to another
+ * page, and changes when that crosses the edge of the window.
+ */
+struct mem_view
+{
+    uint8_t* read[MEM_PAGE_COUNT];
+    uint8_t* write[MEM_PAGE_COUNT];
+    uint8_t* dirty[MEM_PAGE_COUNT]; /* In mem_dirty[] */
+    const struct mem_page* map;
+};
+
+extern const struct mem_view* mem_view;
+extern bool mem_in_window;
+extern void mem_switch_window(void);
+extern void mem_write_hooked(uint16_t address, uint8_t value);
+
+/*
+ * Dirty page tracking.  Each page of RAM, video RAM and the ABC80
+ * device ROM area (which can be written to) has a byte in mem_dirty[]
+ * with a bit per consumer.  A write sets all the bits, and each
+ * consumer clears its own as it catches up, so that it only has to
+ * look at what has changed since the last time, independently of the
+ * others.
+ */
+enum mem_dirty_consumer
+{
+    MEM_DIRTY_IDLE,   /* Idle loop detection (z80.c) */
+    MEM_DIRTY_SCREEN, /* Screen refresh */
+};
+
+#define MEM_DIRTY_ALL 0xff
+#define MEM_DIRTY_RAM 0                /* First page of ram[] */
+#define MEM_DIRTY_VIDEO MEM_PAGE_COUNT /* ...of video_ram[] */
+#define MEM_DIRTY_VIDEO_PAGES 2
+#define MEM_DIRTY_DEVS (MEM_DIRTY_VIDEO + MEM_DIRTY_VIDEO_PAGES) /* ...ROM */
+#define MEM_DIRTY_DEVS_PAGES 16
+#define MEM_DIRTY_PAGES (MEM_DIRTY_DEVS + MEM_DIRTY_DEVS_PAGES)
+#define MEM_DIRTY_OTHER MEM_DIRTY_PAGES    /* Anything else: not tracked */
+#define MEM_DIRTY_ROM (MEM_DIRTY_PAGES + 1) /* Writes which change nothing */
+
+extern uint8_t mem_dirty[MEM_DIRTY_PAGES + 2];
+extern uint64_t mem_dirty_fetch(enum mem_dirty_consumer who,
+                                unsigned int first, unsigned int count);
+
+/*
+ * Watchpoints on ranges of addresses as the CPU sees them.  The pages
+ * holding a range watched for writes get no write pointer in the views,
+ * so only writes to them go through mem_write_hooked(), which looks for
+ * the exact range.  Reads are looked at by mem_read() and the CPU core
+ * only while some range is watched for reads, by mem_watch_read(), and
+ * only in the pages in its table.  Hits are collected as they happen,
+ * and reported to the trace output by mem_watch_report() when the
+ * instruction making them is done.
+ */
+enum mem_watch_flags
+{
+    MEM_WATCH_READ = 0x01,
+    MEM_WATCH_WRITE = 0x02,
+};
+
+extern bool mem_watch_reads;
+extern bool mem_add_watch(uint16_t first, uint16_t last, unsigned int flags);
+extern void mem_watch_read(uint16_t address, uint8_t value);
+extern void mem_watch_report(uint64_t tc);
+
+/*
+ * Latch an M1 address without fetching, when it may be in another page
+ * than the last one; within the same page mem_set_m1() will do.
+ */
+static inline void mem_set_m1_page(uint16_t address)
+{
+    last_m1_address = address;
+    if (unlikely(((address & 0xf800) == 0x7800) != mem_in_window))
+        mem_switch_window();
+}
+
+static inline const struct mem_page* mem_get_page(uint16_t addr)
+{
+    return &mem_view->map[addr >> MEM_PAGE_SHIFT];
+}
+
+/*
+ * Memory accesses without tracing.  These are what mem_read() etc.
+ * do, and are inline so the CPU core can use them directly; it records
+ * accesses with mem_trace() itself when tracing.
+ */
+static inline uint8_t mem_read_notrace(uint16_t address)
+{
+    return mem_view->read[address >> MEM_PAGE_SHIFT][address & MEM_PAGE_MASK];
+}
+
+/*
+ * Words are stored with the low-order byte in the lower address.
+ */
+static inline uint16_t mem_read_word_notrace(uint16_t address)
+{
+    uint8_t b0, b1;
+
+    b0 = mem_read_notrace(address);
+    b1 = mem_read_notrace(address + 1);
+
+    return (b1 << 8) + b0;
+}
+
+static inline void mem_write_notrace(uint16_t address, uint8_t value)
+{
+    uint8_t* p = mem_view->write[address >> MEM_PAGE_SHIFT];
+
+    if (likely(p)) {
+        p[address & MEM_PAGE_MASK] = value;
+        *mem_view->dirty[address >> MEM_PAGE_SHIFT] = MEM_DIRTY_ALL;
+    } else {
+        mem_write_hooked(address, value);
+    }
+}
+
+static inline void mem_write_word_notrace(uint16_t address, uint16_t value)
+{
+    mem_write_notrace(address, value);
+    mem_write_notrace(address + 1, value >> 8);
+}
+
+extern void mem_trace(uint16_t addr, uint16_t data, uint8_t size,
+                      bool written);
+
+#endif /* ABCMEM_H */
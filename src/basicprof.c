@@ -0,0 +1,229 @@
+/*
+ * Profile of the BASIC program being run, by line number
+ *
+ * At each profile sample, the line the interpreter is on is found from
+ * its own pointer into the program text, and charged the samples.  The
+ * interpreter does not know the line number itself, so the lines are
+ * walked from the start of the program to the one holding the pointer.
+ *
+ * The result goes to the trace output (--trace basic) when BASIC gets
+ * back to the command prompt after running the program, at exit and
+ * with Alt-b, and the counts start over.
+ */
+#include "profile.h"
+#include "abcio.h"
+#include "abcmem.h"
+#include "compiler.h"
+#include "rom.h"
+#include "trace.h"
+#include "z80.h"
+
+/*
+ * In both interpreters a line is a length byte, which counts the whole
+ * line, the line number and the statements; a length of 1 ends the
+ * program.
+ */
+struct basic_rom
+{
+    const uint8_t* images[2];
+    uint16_t text;        /* Points to the program */
+    uint16_t text_offset; /* From there to the first line */
+    uint16_t line;        /* Points into the line being run */
+    uint16_t mode;        /* Nonzero unless running a program, or 0 */
+    uint16_t prompt;      /* Where BASIC reads a command */
+    uint16_t run;         /* Where it starts running statements, or 0 */
+};
+
+// clang-format off
+/*
+ * ABC80: the line pointer is set at the start of each line, and the
+ * mode byte is set at the command prompt and cleared by RUN.
+ */
+static const struct basic_rom basic_abc80n = {
+    { abc80bas40n, abc80bas80n }, 0xfe1c, 0, 0xfe2c, 0xfe24, 0x00de, 0
+};
+static const struct basic_rom basic_abc80o = {
+    { abc80bas40o, abc80bas80o }, 0xfe1c, 0, 0xfe2c, 0xfe24, 0x00de, 0
+};
+
+/*
+ * ABC802: BASIC II keeps its text pointer in DE, but saves it at the
+ * start of each statement.  There is no mode byte to go by, so whether
+ * a program is running is told by the entry points.
+ */
+static const struct basic_rom basic_abc802 = {
+    { abc802rom, NULL }, 0xff06, 0x15, 0xff3a, 0, 0x0131, 0x1c90
+};
+// clang-format on
+
+static const struct basic_rom* rom;
+static bool started; /* Not until BASIC has set itself up */
+static bool running;
+static uint64_t* line_samples; /* By line number */
+static uint64_t other_samples; /* Running, but not in a line */
+static uint64_t run_samples;
+
+/* The line found last time, which is most likely the one still running */
+static struct
+{
+    uint16_t addr;
+    uint8_t len;
+} last;
+
+static bool rom_mapped(uint16_t pc)
+{
+    const uint8_t* data = mem_get_page(pc)->data;
+    const uint16_t page = pc & ~MEM_PAGE_MASK;
+
+    return data == rom->images[0] + page ||
+           (rom->images[1] && data == rom->images[1] + page);
+}
+
+static bool basic_prompt(void* arg)
+{
+    (void)arg;
+
+    if (rom_mapped(rom->prompt)) {
+        started = true;
+        running = false;
+        last.len = 0; /* The program may be edited */
+        if (run_samples)
+            basic_profile_report();
+    }
+    return false;
+}
+
+static bool basic_run(void* arg)
+{
+    (void)arg;
+
+    if (rom_mapped(rom->run))
+        running = true;
+    return false;
+}
+
+void basic_profile_init(unsigned int memflags)
+{
+    switch (model) {
+    case MODEL_ABC80:
+        if (memflags & MEMFL_NOBASIC)
+            return;
+        rom = old_basic ? &basic_abc80o : &basic_abc80n;
+        break;
+    case MODEL_ABC802:
+        rom = &basic_abc802;
+        break;
+    }
+    if (!rom)
+        return;
+
+    line_samples = calloc(Z80_ADDRESS_LIMIT, sizeof *line_samples);
+    if (!line_samples) {
+        rom = NULL;
+        return;
+    }
+
+    z80_add_trap(rom->prompt, basic_prompt, NULL);
+    if (rom->run)
+        z80_add_trap(rom->run, basic_run, NULL);
+}
+
+/* The line holding p, or -1 */
+static int find_line(uint16_t p)
+{
+    unsigned int addr, len, walked;
+
+    if (last.len && (uint16_t)(p - last.addr) < last.len &&
+        mem_read(last.addr) == last.len)
+        return mem_read_word(last.addr + 1);
+
+    addr = (uint16_t)(mem_read_word(rom->text) + rom->text_offset);
+    for (walked = 0; walked < Z80_ADDRESS_LIMIT; walked += len) {
+        len = mem_read(addr);
+        if (len <= 1)
+            break;
+        if ((uint16_t)(p - addr) < len) {
+            last.addr = addr;
+            last.len = len;
+            return mem_read_word(addr + 1);
+        }
+        addr = (uint16_t)(addr + len);
+    }
+    return -1;
+}
+
+/* Called from profile_sample() with the number of samples due */
+void basic_profile_sample(unsigned int n)
+{
+    int line;
+
+    if (!started || !rom_mapped(rom->prompt))
+        return;
+    if (rom->mode ? mem_read(rom->mode) != 0 : !running)
+        return;
+
+    run_samples += n;
+    line = find_line(mem_read_word(rom->line));
+    if (line < 0)
+        other_samples += n;
+    else
+        line_samples[line] += n;
+}
+
+struct line_count
+{
+    uint16_t line;
+    uint64_t samples;
+};
+
+static int line_count_cmp(const void* a, const void* b)
+{
+    const struct line_count *la = a, *lb = b;
+
+    if (la->samples != lb->samples)
+        return la->samples < lb->samples ? 1 : -1;
+    return (int)la->line - (int)lb->line;
+}
+
+/*
+ * Print the lines by the time spent in them, and start over
+ */
+void basic_profile_report(void)
+{
+    struct line_count* lines;
+    unsigned int i, n;
+
+    if (!rom || !run_samples || !tracing(TRACE_BASIC))
+        return;
+
+    lines = malloc(Z80_ADDRESS_LIMIT * sizeof *lines);
+    if (!lines)
+        return;
+
+    n = 0;
+    for (i = 0; i < Z80_ADDRESS_LIMIT; i++) {
+        if (line_samples[i]) {
+            lines[n].line = i;
+            lines[n].samples = line_samples[i];
+            n++;
+        }
+    }
+    qsort(lines, n, sizeof *lines, line_count_cmp);
+
+    fprintf(tracef, "BASIC: line profile, %" PRIu64 " samples every %u "
+            "T-states\n", run_samples, profile_interval);
+    fprintf(tracef, "BASIC:  line    samples       %%\n");
+    for (i = 0; i < n; i++) {
+        fprintf(tracef, "BASIC: %5u %10" PRIu64 " %6.2f%%\n", lines[i].line,
+                lines[i].samples, 100.0 * lines[i].samples / run_samples);
+    }
+    if (other_samples) {
+        fprintf(tracef, "BASIC: other %10" PRIu64 " %6.2f%%\n",
+                other_samples, 100.0 * other_samples / run_samples);
+    }
+
+    free(lines);
+    memset(line_samples, 0, Z80_ADDRESS_LIMIT * sizeof *line_samples);
+    other_samples = 0;
+    run_samples = 0;
+}
@@ -2,180 +2,410 @@
 #include "abcio.h"
 #include "compiler.h"
 #include "nstime.h"
+#include "profile.h"
 #include "screen.h"
+#include "trace.h"
 #include "z80.h"
 #include "z80irq.h"
 
 static double ns_per_tstate = 1000.0 / 3.0; /* Nanoseconds per tstate (clock cycle) */
 static double tstate_per_ns = 3.0 / 1000.0; /* Inverse of the above = freq in GHz */
 
-static void abc80_clock_tick(void);
-static void abc800_clock_tick(void);
-static struct abctimer* ctc_timer[4];
-
 static bool limit_speed;
+static bool wall_ticks; /* Clock ticks by the wall clock, running flat out */
+
+#define MS(x) ((x)*INT64_C(1000000))
+
+uint64_t timer_tstates(uint64_t ns)
+{
+    return ns * tstate_per_ns + 0.5;
+}
 
 /*
- * Initialize the time for next event
+ * The timer queue: a binary min-heap on the T-state timers are due,
+ * with queue[1] first.  Each timer knows its slot, so that it can be
+ * cancelled or moved without searching.
  */
-struct abctimer
+#define MAX_TIMERS 32
+static struct abctimer* queue[MAX_TIMERS + 1];
+static unsigned int nqueued;
+
+static inline void queue_place(struct abctimer* t, unsigned int slot)
+{
+    queue[slot] = t;
+    t->slot = slot;
+}
+
+static void sift_up(struct abctimer* t, unsigned int slot)
+{
+    while (slot > 1 && queue[slot / 2]->when > t->when) {
+        queue_place(queue[slot / 2], slot);
+        slot /= 2;
+    }
+    queue_place(t, slot);
+}
+
+static void sift_down(struct abctimer* t, unsigned int slot)
+{
+    unsigned int child;
+
+    while ((child = 2 * slot) <= nqueued) {
+        if (child < nqueued && queue[child + 1]->when < queue[child]->when)
+            child++;
+        if (queue[child]->when >= t->when)
+            break;
+        queue_place(queue[child], slot);
+        slot = child;
+    }
+    queue_place(t, slot);
+}
+
+void timer_cancel(struct abctimer* t)
+{
+    const unsigned int slot = t->slot;
+    struct abctimer* last;
+
+    if (!slot)
+        return;
+
+    t->slot = 0;
+    last = queue[nqueued--];
+    if (last != t) {
+        /* Move the last one into the hole, whichever way it has to go */
+        sift_down(last, slot);
+        if (last->slot == slot)
+            sift_up(last, slot);
+    }
+}
+
+void timer_arm(struct abctimer* t, uint64_t when, uint64_t period)
+{
+    timer_cancel(t);
+
+    if (nqueued >= MAX_TIMERS)
+        abort();
+
+    t->when = when;
+    t->period = period;
+    sift_up(t, ++nqueued);
+
+    /* Armed by a device in the middle of z80_run_until() */
+    z80_shorten_run(when);
+}
+
+/* The T-state the first timer is due */
+static inline uint64_t timer_next(void)
 {
+    return nqueued ? queue[1]->when : UINT64_MAX;
+}
+
+/* Run the timers which are due */
+static void run_timers(void)
+{
+    struct abctimer* t;
+
+    while (nqueued && (t = queue[1])->when <= TSTATE) {
+        if (t->period) {
+            t->when += t->period;
+            sift_down(t, 1);
+        } else {
+            timer_cancel(t);
+        }
+        t->func(t);
+    }
+}
+
+/*
+ * The periodic clock signals of the machine.  With the speed limited,
+ * or in virtual time, these are plain periodic timers; running flat out
+ * otherwise, they still come in real time, by arming the timer for the
+ * current T-state whenever the wall clock says a tick is due.
+ */
+struct clock_tick
+{
+    struct abctimer timer;
     uint64_t period; /* Period in ns */
-    uint64_t last;   /* Last checkpoint in ns */
-    uint64_t ltst;   /* TSTATE value for last checkpoint */
-    void (*func)(void);
+    uint64_t next;   /* Next tick in ns, when running flat out */
 };
 
-#define MAX_TIMERS 2
-static struct abctimer timers[MAX_TIMERS];
-static int ntimers;
+#define MAX_TICKS 2
+static struct clock_tick ticks[MAX_TICKS];
+static unsigned int nticks;
 
-#define MS(x) ((x)*INT64_C(1000000))
+static void abc80_clock_tick(struct abctimer* t);
+static void abc800_clock_tick(struct abctimer* t);
+static void abc802_vsync_tick(struct abctimer* t);
+static struct clock_tick* ctc_tick[4];
 
-static struct abctimer* create_timer(uint64_t period, void (*func)(void))
+static struct clock_tick* create_tick(uint64_t period,
+                                      void (*func)(struct abctimer* t))
 {
-    struct abctimer* t;
+    struct clock_tick* t;
+    uint64_t tstates;
 
-    if (ntimers >= MAX_TIMERS)
+    if (nticks >= MAX_TICKS)
         abort();
 
-    t = &timers[ntimers++];
+    t = &ticks[nticks++];
 
     t->period = period;
-    t->func = func;
-    t->last = 0;
-    t->ltst = 0;
+    t->timer.func = func;
+    if (!wall_ticks) {
+        tstates = timer_tstates(period);
+        timer_arm(&t->timer, TSTATE + tstates, tstates);
+    } else {
+        t->next = nstime() + period;
+    }
 
     return t;
 }
 
-static unsigned int poll_tstate_period;
+/* Arm the ticks which are due by now; returns when the next one is */
+static uint64_t poll_ticks(uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+    unsigned int i;
+
+    for (i = 0; i < nticks; i++) {
+        struct clock_tick* t = &ticks[i];
+
+        if (unlikely(now >= t->next)) {
+            t->next += t->period;
+            if (unlikely(now >= t->next)) {
+                /* Missed tick(s), advance to skip missed */
+                t->next = now - (now - t->next) % t->period + t->period;
+            }
+            timer_arm(&t->timer, TSTATE, 0);
+        }
+        if (next > t->next)
+            next = t->next;
+    }
+    return next;
+}
+
+/*
+ * Frame pacing.  With the speed limited, the CPU runs a frame's worth
+ * of T-states flat out, and then waits once for the wall-clock time
+ * that the frame should end.  That is worked out from a reference point
+ * rather than from the end of the last frame, so that oversleeping and
+ * rounding do not add up and the long-term speed stays exact.  A wait
+ * sleeps until spin ns before the deadline and spins for the rest;
+ * spin follows how late the host has been waking us up lately.
+ */
+#define FRAME_NS MS(20)
+#define SPIN_MIN_NS 20000
+#define SPIN_MAX_NS 200000 /* Burn at most 1% of a frame */
+#define PACE_BUCKETS 18 /* < 1 us, < 2 us, ... < 65.536 ms, more */
+
+static uint64_t frame_tstates;
+static uint64_t next_frame = UINT64_MAX; /* T-state the frame ends */
+
+static struct
+{
+    uint64_t frames, resyncs;
+    uint64_t start, spun; /* Wall-clock time: started, spent spinning */
+    uint64_t late[PACE_BUCKETS];    /* Woken up this late */
+    uint64_t overrun[PACE_BUCKETS]; /* Frames which ended this late */
+    int64_t spin;
+} pace = {.spin = SPIN_MIN_NS};
+
+static unsigned int pace_bucket(uint64_t ns)
+{
+    unsigned int b = 0;
+
+    for (ns /= 1000; ns && b < PACE_BUCKETS - 1; ns >>= 1)
+        b++;
+    return b;
+}
+
+static void pace_frame(void)
+{
+    static uint64_t ref_time, ref_tstate;
+    const uint64_t tc = next_frame;
+    uint64_t now = nstime(), when, wake, spin_start;
+    int64_t ahead, over;
+
+    next_frame += frame_tstates;
+
+    if (unlikely(!ref_time))
+        goto resync;
+
+    when = ref_time + (tc - ref_tstate) * ns_per_tstate;
+    ahead = when - now;
+
+    /* Sanity range check: 200 ms behind or 100 ms ahead of schedule */
+    if (unlikely(ahead <= -MS(200) || ahead >= MS(100))) {
+        pace.resyncs++;
+        goto resync;
+    }
+
+    pace.frames++;
+    if (ahead < 0) {
+        pace.overrun[pace_bucket(-ahead)]++;
+        return;
+    }
+
+    if (ahead > pace.spin) {
+        wake = when - pace.spin;
+        mynssleep(wake, now);
+        now = nstime();
+
+        /* Move towards the oversleep plus a margin, up faster than down */
+        over = now - wake + SPIN_MIN_NS;
+        if (over > SPIN_MAX_NS)
+            over = SPIN_MAX_NS;
+        if (over > pace.spin)
+            pace.spin += (over - pace.spin) / 4;
+        else
+            pace.spin -= (pace.spin - over) / 32;
+    }
+    spin_start = now;
+    while (now < when)
+        now = nstime();
+    pace.spun += now - spin_start;
+
+    pace.late[pace_bucket(now - when)]++;
+    return;
+
+resync:
+    /* We fell too far behind, got suspended, or the clock jumped... */
+    if (!pace.start)
+        pace.start = now;
+    ref_time = now;
+    ref_tstate = tc;
+}
+
+/* The histograms, with --trace pace */
+void timer_report(void)
+{
+    unsigned int i, last;
+    uint64_t wall;
+
+    if (!tracing(TRACE_PACE) || !frame_tstates)
+        return;
+
+    wall = pace.start ? nstime() - pace.start : 0;
+    fprintf(tracef, "PACE: %" PRIu64 " frames of %u ms, %" PRIu64
+            " resyncs, spinning %" PRId64 " us\n", pace.frames,
+            (unsigned int)(FRAME_NS / MS(1)), pace.resyncs, pace.spin / 1000);
+    fprintf(tracef, "PACE: spun %" PRIu64 " ms of %" PRIu64 " ms (%.2f%%)\n",
+            pace.spun / MS(1), wall / MS(1),
+            wall ? 100.0 * pace.spun / wall : 0.0);
+
+    for (last = PACE_BUCKETS - 1; last > 0; last--) {
+        if (pace.late[last] || pace.overrun[last])
+            break;
+    }
+
+    fprintf(tracef, "PACE:    late by     woken   overrun\n");
+    for (i = 0; i <= last; i++) {
+        if (i == PACE_BUCKETS - 1)
+            fprintf(tracef, "PACE: >= %5u us", 1U << (i - 1));
+        else
+            fprintf(tracef, "PACE:  < %5u us", 1U << i);
+        fprintf(tracef, " %9" PRIu64 " %9" PRIu64 "\n", pace.late[i],
+                pace.overrun[i]);
+    }
+}
+
+/* Running flat out, look at the wall clock this often */
 #define MAX_TSTATE_PERIOD 512
+static uint64_t next_wall_check;
 
-void timer_init(double mhz)
+/*
+ * In virtual time, the speed is only what the clock ticks go by, and
+ * the CPU runs flat out; nothing looks at the wall clock.
+ */
+void timer_init(double mhz, bool virtual_time)
 {
     if (mhz <= 0.001 || mhz >= 1.0e+6) {
         limit_speed = false;
     } else {
-        limit_speed = true;
+        limit_speed = !virtual_time;
         ns_per_tstate = 1000.0 / mhz;
         tstate_per_ns = mhz / 1000.0;
     }
+    wall_ticks = !limit_speed && !virtual_time;
     nstime_init();
 
-    /* Limit polling to once every μs simulated time */
-    poll_tstate_period = 1000 * ns_per_tstate;
-    if (!limit_speed || poll_tstate_period > MAX_TSTATE_PERIOD)
-        poll_tstate_period = MAX_TSTATE_PERIOD;
+    if (limit_speed) {
+        frame_tstates = timer_tstates(FRAME_NS);
+        next_frame = TSTATE + frame_tstates;
+    }
 
     switch (model) {
     case MODEL_ABC80:
         /* 20 ms = 50 Hz */
-        create_timer(MS(20), abc80_clock_tick);
+        create_tick(MS(20), abc80_clock_tick);
         break;
     case MODEL_ABC802:
         /* 10.67 ms = 93.75 Hz */
-        ctc_timer[3] = create_timer(10666667, abc800_clock_tick);
+        ctc_tick[3] = create_tick(10666667, abc800_clock_tick);
 
         /* 20 ms = 50 Hz */
-        create_timer(MS(20), abc802_vsync);
+        create_tick(MS(20), abc802_vsync_tick);
         break;
     }
 }
 
-/* See if it is time to slow down a bit */
-static void consider_napping(uint64_t now, uint64_t next)
-{
-    uint64_t when;
-    int64_t ahead, behind;
-    static uint64_t ref_time, ref_tstate;
-
-    if (unlikely(now <= ref_time || TSTATE <= ref_tstate))
-        goto weird;
-
-    when = ref_time + (TSTATE - ref_tstate) * ns_per_tstate;
-    behind = now - when;
-    ahead = when - next;
-
-    /* Sanity range check: 100 ms behind or 100 ms ahead of schedule */
-    if (unlikely(behind >= MS(200) || ahead >= MS(100)))
-        goto weird;
-
-    /* If we are ahead of the next event, hold off and wait for it */
-    if (ahead >= 0)
-        mynssleep(next, now);
-    return;
-
-weird:
-    /* We fell too far behind, got suspended, or the clock jumped... */
-    ref_time = now;
-    ref_tstate = TSTATE;
-}
-
 /* Poll for timers - these the only external event we look for */
 volatile bool z80_quit;
 
 bool z80_poll_external(void)
 {
-    uint64_t now;
-    static uint64_t next = 0;
-    int i;
-    bool sleepy = limit_speed;
-    static uint64_t next_check_tstate;
+    uint64_t now, next_tick;
+    const bool idle = z80_idle;
 
     if (z80_quit)
         return true; /* Terminate CPU loop */
 
-    if (likely(TSTATE < next_check_tstate))
-        return false;
-
-    now = nstime();
-
-    if (unlikely(now >= next)) {
-        next = UINT64_MAX;
-
-        for (i = 0; i < ntimers; i++) {
-            struct abctimer* t = &timers[i];
-            if (t->period) {
-                uint64_t tnext = t->last + t->period;
-                if (unlikely(now >= tnext)) {
-                    t->last += t->period;
-                    if (unlikely(now >= tnext)) {
-                        /* Missed tick(s), advance to skip missed */
-                        t->last = now - (now - t->last) % t->period;
-                        tnext = t->last + t->period;
-                    }
-                    /* TSTATE value corresponding to t->last */
-                    t->ltst = TSTATE - (now - t->last) * tstate_per_ns;
-                    t->func();
-                    sleepy =
-                        false; /* Just in case "now" is too far behind now */
-                }
-                if (next > tnext)
-                    next =
-                        tnext; /* The next event is closer than you thought */
-            }
-        }
-    }
+    z80_idle = false;
 
-    next_check_tstate = TSTATE + poll_tstate_period;
-    if (limit_speed) {
-        uint64_t next_ev = TSTATE + (next - now) * tstate_per_ns;
-        if (next_ev < next_check_tstate)
-            next_check_tstate = next_ev;
+    if (unlikely(TSTATE >= profile_next_sample))
+        profile_sample();
+
+    if (wall_ticks && TSTATE >= next_wall_check) {
+        now = nstime();
+        next_tick = poll_ticks(now);
+        next_wall_check = TSTATE + MAX_TSTATE_PERIOD;
+
+        /* Flat out, but nothing to do until the next tick */
+        if (idle && timer_next() > TSTATE && next_tick != UINT64_MAX) {
+            mynssleep(next_tick, now);
+            next_wall_check = TSTATE;
+        }
     }
 
-    if (sleepy)
-        consider_napping(now, next);
+    if (TSTATE >= next_frame)
+        pace_frame();
+    if (TSTATE >= timer_next())
+        run_timers();
 
     return false;
 }
 
+/* TSTATE before which z80_poll_external() is guaranteed to do nothing */
+uint64_t z80_poll_deadline(void)
+{
+    uint64_t deadline = timer_next();
+
+    if (deadline > next_frame)
+        deadline = next_frame;
+    if (wall_ticks && deadline > next_wall_check)
+        deadline = next_wall_check;
+    if (deadline > profile_next_sample)
+        deadline = profile_next_sample;
+
+    return deadline;
+}
+
 /*
  * ABC80: Trig a non maskable interrupt in the Z80 on the clock signal.
  */
-static void abc80_clock_tick(void)
+static void abc80_clock_tick(struct abctimer* t)
 {
+    (void)t;
+
     vsync_screen(); /* Also vertical retrace */
     z80_nmi();
 }
@@ -191,12 +421,21 @@ static struct z80_irq ctc_irq[4] = {
     IRQ(IRQ800_CTC3, NULL, NULL, NULL),
 };
 
-static void abc800_clock_tick(void)
+static void abc800_clock_tick(struct abctimer* t)
 {
+    (void)t;
+
     if ((ctc_ctl[3] & 0xc0) == 0x80)
         z80_interrupt(&ctc_irq[3]);
 }
 
+static void abc802_vsync_tick(struct abctimer* t)
+{
+    (void)t;
+
+    abc802_vsync();
+}
+
 /*
  * CTC I/O
  */
@@ -226,27 +465,30 @@ void abc800_ctc_out(uint8_t port, uint8_t v)
 
 uint8_t abc800_ctc_in(uint8_t port)
 {
-    uint8_t v, div;
-    const struct abctimer* t;
+    const struct clock_tick* t;
+    int64_t left, period;
 
     port &= 3;
-    t = ctc_timer[port];
-    div = ctc_div[port];
+    t = ctc_tick[port];
 
     if (!t)
         return -1;
 
-    if (limit_speed) {
+    if (!wall_ticks) {
         /* Interpolate based on TSTATEs (virtual time) */
-        v = ((int64_t)t->period -
-             (int64_t)(((TSTATE - t->ltst) * ns_per_tstate)) * div) /
-            t->period;
+        left = t->timer.when - TSTATE;
+        period = t->timer.period;
     } else {
         /* Interpolate based on nanoseconds (real time) */
-        v = ((t->period - (nstime() - t->last)) * div) / t->period;
+        left = t->next - nstime();
+        period = t->period;
     }
+    if (left < 0)
+        left = 0;
+    if (left > period)
+        left = period;
 
-    return v;
+    return left * ctc_div[port] / period;
 }
 
 void abc800_ctc_init(void)
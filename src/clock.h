@@ -1,10 +1,36 @@
 #ifndef CLOCK_H
 #define CLOCK_H
 
-#include <stdbool.h>
+#include "compiler.h"
 
-extern void timer_init(double mhz);
-extern void timer_poll(void);
+/*
+ * Events scheduled in T-states.  Any device can arm, re-arm and cancel
+ * its own; a periodic one is re-armed period T-states after it was due
+ * before func is called, so that func may re-arm or cancel it itself.
+ * Arming an armed timer moves it.  The CPU runs until the first one is
+ * due (see z80_poll_deadline()), or with the speed limited, until the
+ * end of the frame if that comes first; only the ends of frames are
+ * mapped to wall-clock time.
+ */
+struct abctimer
+{
+    uint64_t when;     /* T-state it is due */
+    uint64_t period;   /* T-states, or 0 for a one-shot timer */
+    unsigned int slot; /* In the queue, or 0 if not armed */
+    void (*func)(struct abctimer* t);
+};
+
+extern void timer_arm(struct abctimer* t, uint64_t when, uint64_t period);
+extern void timer_cancel(struct abctimer* t);
+extern uint64_t timer_tstates(uint64_t ns);
+
+static inline bool timer_armed(const struct abctimer* t)
+{
+    return t->slot != 0;
+}
+
+extern void timer_init(double mhz, bool virtual_time);
+extern void timer_report(void);
 extern void vsync_screen(void);
 
 extern volatile bool z80_quit;
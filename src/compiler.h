@@ -28,6 +28,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #ifdef HAVE_FCNTL_H
@@ -63,10 +64,14 @@
 #    include <direct.h>
 #endif
 
-#include <SDL.h> /* This includes endian definitions */
-
-#define WORDS_LITTLEENDIAN (SDL_BYTEORDER == SDL_LIL_ENDIAN)
-#define WORDS_BIGENDIAN (SDL_BYTEORDER == SDL_BIG_ENDIAN)
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+#    define WORDS_LITTLEENDIAN (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#    define WORDS_BIGENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#else
+#    include <endian.h>
+#    define WORDS_LITTLEENDIAN (__BYTE_ORDER == __LITTLE_ENDIAN)
+#    define WORDS_BIGENDIAN (__BYTE_ORDER == __BIG_ENDIAN)
+#endif
 
 #ifndef __cplusplus /* C++ has false, true, bool as keywords */
 #    ifdef HAVE_STDBOOL_H
@@ -172,6 +177,15 @@ typedef int mode_t;
 #    define pure_func
 #endif
 
+/*
+ * This function is rarely called
+ */
+#ifdef HAVE_FUNC_ATTRIBUTE_COLD
+#    define cold_func __attribute__((cold))
+#else
+#    define cold_func
+#endif
+
 /* Determine probabilistically if something is a compile-time constant */
 #ifdef HAVE___BUILTIN_CONSTANT_P
 #    define is_constant(x) __builtin_constant_p(x)
@@ -187,6 +201,8 @@ typedef int mode_t;
         likely(__atomic_compare_exchange_n(                                    \
             (p), (e), (d), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
 #    define xchg(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#    define atomic_fetch_and(p, v)                                             \
+        __atomic_fetch_and((p), (v), __ATOMIC_ACQ_REL)
 #    define barrier() __atomic_thread_fence(__ATOMIC_ACQ_REL)
 
 #    if 0 // defined(__i386__) || defined(__x86_64__)
@@ -330,3 +330,58 @@ int disk_in(int sel, int port)
     }
     return v;
 }
+
+/*
+ * Block transfers through port 0 (see z80_out_block() and
+ * z80_in_block()), for sector data only
+ */
+size_t disk_out_block(int sel, const uint8_t* buf, size_t count)
+{
+    struct ctl_state* state = sel_to_state[sel];
+    size_t done = 0;
+    size_t len;
+
+    if (tracing(TRACE_DISK))
+        return 0;
+
+    while (done < count && state && state->state == disk_upload) {
+        len = 256 - state->out_ptr;
+        if (len > count - done)
+            len = count - done;
+        memcpy(&state->buf[state->k[1] >> 6][state->out_ptr], buf + done,
+               len);
+        state->out_ptr += len;
+        done += len;
+        if (state->out_ptr >= 256)
+            do_next_command(state);
+    }
+
+    return done;
+}
+
+size_t disk_in_block(int sel, uint8_t* buf, size_t count)
+{
+    struct ctl_state* state = sel_to_state[sel];
+    size_t done = 0;
+    size_t len;
+
+    if (tracing(TRACE_DISK))
+        return 0;
+
+    while (done < count && state && state->state != disk_need_init &&
+           state->in_ptr >= 0) {
+        len = 256 - state->in_ptr;
+        if (len > count - done)
+            len = count - done;
+        memcpy(buf + done, &state->buf[state->k[1] >> 6][state->in_ptr],
+               len);
+        state->in_ptr += len;
+        done += len;
+        if (state->in_ptr >= 256) {
+            state->in_ptr = -1;
+            do_next_command(state);
+        }
+    }
+
+    return done;
+}
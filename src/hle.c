@@ -0,0 +1,293 @@
+/*
+ * High-level emulation of ROM routines
+ */
+#include "hle.h"
+#include "abcio.h"
+#include "abcmem.h"
+#include "compiler.h"
+#include "rom.h"
+#include "z80.h"
+
+unsigned int hle_flags;
+
+/* A routine which takes longer than this in the ROM is not coming back */
+#define HLE_VERIFY_LIMIT 1000000
+
+#define MAX_HLE_TRAPS 32
+
+static struct hle_trap
+{
+    uint16_t pc;
+    struct hle_routine* routine;
+    unsigned int arg;
+    const uint8_t* const* images;
+} traps[MAX_HLE_TRAPS];
+static unsigned int ntraps;
+
+static struct hle_routine* const* const hle_routines[] = {
+    hle_fp_routines, hle_screen_routines, NULL};
+
+/* Is one of the images the code at pc comes from? */
+static bool rom_mapped(uint16_t pc, const uint8_t* const* images)
+{
+    const uint8_t* data = mem_get_page(pc)->data;
+    const uint16_t page = pc & ~MEM_PAGE_MASK;
+
+    return data == images[0] + page || (images[1] && data == images[1] + page);
+}
+
+/* Return from the routine, with the stack as it was on entry */
+void hle_return(void)
+{
+    REG_PC = mem_read_word(REG_SP);
+    REG_SP += 2;
+}
+
+/*
+ * The registers, as far as a native version has to get them right
+ */
+struct hle_regs
+{
+    wordregister regs[12]; /* AF through HL' */
+    uint8_t i;
+};
+
+static void save_regs(struct hle_regs* r)
+{
+    memcpy(r->regs, &z80_state, sizeof r->regs);
+    r->i = z80_state.i;
+}
+
+static void restore_regs(const struct hle_regs* r)
+{
+    memcpy(&z80_state, r->regs, sizeof r->regs);
+    z80_state.i = r->i;
+}
+
+static void save_mem(uint8_t* mem)
+{
+    unsigned int addr;
+
+    for (addr = 0; addr < Z80_ADDRESS_LIMIT; addr += MEM_PAGE_SIZE)
+        memcpy(&mem[addr], mem_get_page(addr)->data, MEM_PAGE_SIZE);
+}
+
+static void report_mismatch(const struct hle_trap* t, const char* what,
+                            unsigned int native, unsigned int rom)
+{
+    fprintf(stderr, "%s: HLE %s at %04X differs: %s is %02X, should be %02X\n",
+            program_name, t->routine->name, t->pc, what, native, rom);
+}
+
+/*
+ * Run the native version, undo it, run the ROM code and compare the
+ * results.  The ROM results are kept either way.
+ */
+static bool hle_verify(struct hle_trap* t)
+{
+    static const char* const regnames[12] = {
+        "AF", "BC", "DE", "HL", "IX", "IY", "SP", "PC",
+        "AF'", "BC'", "DE'", "HL'"};
+    static uint8_t before[Z80_ADDRESS_LIMIT], native[Z80_ADDRESS_LIMIT];
+    struct hle_routine* r = t->routine;
+    struct hle_regs entry, native_regs, rom_regs;
+    const uint64_t start = TSTATE;
+    uint64_t native_tstates;
+    unsigned int addr, stack, i;
+    bool same = true;
+
+    save_regs(&entry);
+    save_mem(before);
+    if (!r->func(t->arg)) {
+        r->declined++;
+        return false;
+    }
+    native_tstates = TSTATE - start;
+    save_regs(&native_regs);
+    save_mem(native);
+
+    for (addr = 0; addr < Z80_ADDRESS_LIMIT; addr++) {
+        if (native[addr] != before[addr])
+            mem_write(addr, before[addr]);
+    }
+    restore_regs(&entry);
+    TSTATE = start;
+
+    if (!z80_run_subroutine(HLE_VERIFY_LIMIT)) {
+        fprintf(stderr, "%s: HLE %s at %04X: ROM code did not return\n",
+                program_name, r->name, t->pc);
+        r->mismatches++;
+        return true;
+    }
+    r->calls++;
+    r->rom_tstates += TSTATE - start;
+
+    save_regs(&rom_regs);
+    for (i = 0; i < 12; i++) {
+        if (i < 6 && (r->clobbers & (1U << i)))
+            continue;
+        if (native_regs.regs[i].word != rom_regs.regs[i].word) {
+            report_mismatch(t, regnames[i], native_regs.regs[i].word,
+                            rom_regs.regs[i].word);
+            same = false;
+        }
+    }
+    if (!(r->clobbers & HLE_REG_T) && native_tstates != TSTATE - start) {
+        report_mismatch(t, "T-states", native_tstates, TSTATE - start);
+        same = false;
+    }
+
+    /* Anything below the stack pointer is fair game */
+    stack = (uint16_t)(REG_SP - 256);
+    for (addr = 0; addr < Z80_ADDRESS_LIMIT; addr++) {
+        if ((uint16_t)(addr - stack) < 256)
+            continue;
+        if (native[addr] != mem_read(addr)) {
+            char where[8];
+
+            snprintf(where, sizeof where, "(%04X)", addr);
+            report_mismatch(t, where, native[addr], mem_read(addr));
+            same = false;
+        }
+    }
+
+    if (!same)
+        r->mismatches++;
+    return true;
+}
+
+static bool hle_trap(void* arg)
+{
+    struct hle_trap* t = arg;
+    struct hle_routine* r = t->routine;
+    const uint64_t start = TSTATE;
+
+    if (!rom_mapped(t->pc, t->images))
+        return false;
+    if (hle_flags & HLE_VERIFY)
+        return hle_verify(t);
+
+    if (!r->func(t->arg)) {
+        r->declined++;
+        return false;
+    }
+    r->calls++;
+
+    /* Let the CPU loop charge the time, so interrupts are taken in it */
+    z80_stall(TSTATE - start + r->cost);
+    TSTATE = start;
+    return true;
+}
+
+static void add_traps(const struct hle_rom* roms,
+                      const uint8_t* const* images)
+{
+    const struct hle_rom* rom;
+    const struct hle_entry* e;
+
+    for (rom = roms; rom->entries; rom++) {
+        if (rom->images[0] != images[0])
+            continue;
+        for (e = rom->entries; e->routine; e++) {
+            struct hle_trap* t;
+
+            if (ntraps >= MAX_HLE_TRAPS)
+                return;
+            t = &traps[ntraps++];
+            t->pc = e->pc;
+            t->routine = e->routine;
+            t->arg = e->arg;
+            t->images = rom->images;
+            z80_add_trap(t->pc, hle_trap, t);
+        }
+    }
+}
+
+/*
+ * Set up the traps for the ROM images in use, according to hle_flags.
+ */
+void hle_init(unsigned int memflags)
+{
+    const uint8_t* images[2] = {NULL, NULL};
+
+    switch (model) {
+    case MODEL_ABC80:
+        if (memflags & MEMFL_NOBASIC)
+            return;
+        images[0] = old_basic ? abc80bas40o : abc80bas40n;
+        break;
+    case MODEL_ABC802:
+        images[0] = abc802rom;
+        break;
+    }
+
+    if (hle_flags & HLE_FP)
+        add_traps(hle_fp_roms, images);
+    if (hle_flags & HLE_SCREEN)
+        add_traps(hle_screen_roms, images);
+}
+
+bool hle_set_cost(const char* name, unsigned int cost)
+{
+    struct hle_routine* const* const* rl;
+    struct hle_routine* const* rp;
+
+    for (rl = hle_routines; *rl; rl++) {
+        for (rp = *rl; *rp; rp++) {
+            if (!strcmp((*rp)->name, name)) {
+                (*rp)->cost = cost;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* List the routines which are charged a cost, for --hle help */
+void hle_list_costs(void)
+{
+    struct hle_routine* const* const* rl;
+    struct hle_routine* const* rp;
+
+    printf("       ");
+    for (rl = hle_routines; *rl; rl++) {
+        for (rp = *rl; *rp; rp++) {
+            if ((*rp)->clobbers & HLE_REG_T)
+                printf(" %s=%u", (*rp)->name, (*rp)->cost);
+        }
+    }
+    putchar('\n');
+}
+
+/*
+ * Print what was run natively; in verify mode, this includes what the
+ * ROM code took, as a guide to the cost.
+ */
+void hle_report(void)
+{
+    struct hle_routine* const* const* rl;
+    struct hle_routine* const* rp;
+
+    if (!hle_flags)
+        return;
+
+    for (rl = hle_routines; *rl; rl++) {
+        for (rp = *rl; *rp; rp++) {
+            const struct hle_routine* r = *rp;
+
+            if (!r->calls && !r->declined)
+                continue;
+            fprintf(stderr,
+                    "%s: HLE %-8s %10" PRIu64 " calls, %8" PRIu64
+                    " declined",
+                    program_name, r->name, r->calls, r->declined);
+            if (hle_flags & HLE_VERIFY) {
+                fprintf(stderr, ", %" PRIu64 " mismatches, %" PRIu64
+                        " T-states average in ROM",
+                        r->mismatches,
+                        r->calls ? r->rom_tstates / r->calls : 0);
+            }
+            fputc('\n', stderr);
+        }
+    }
+}
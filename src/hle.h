@@ -0,0 +1,89 @@
+#ifndef HLE_H
+#define HLE_H
+
+#include "compiler.h"
+
+/*
+ * High-level emulation: native versions of ROM routines, which are
+ * run instead of the Z80 code when the CPU gets to their entry points
+ * (see z80_add_trap()), as long as the ROM they belong to is mapped
+ * there.
+ */
+enum hle_flags
+{
+    HLE_FP = 0x01,     /* BASIC floating point arithmetic */
+    HLE_SCREEN = 0x02, /* Scrolling and clearing the screen */
+    HLE_ALL = 0x03,
+    HLE_VERIFY = 0x80, /* Run the ROM code too, and compare the results */
+};
+
+extern unsigned int hle_flags;
+
+/*
+ * A native version starts with the CPU at the entry point, and either
+ * leaves it as the routine would have returned, or returns false
+ * without having changed anything to have the ROM code run after all.
+ * Registers in clobbers (REG_ bit masks, below) are left undefined,
+ * and so is the stack below SP.  The T-state counter counts as a
+ * register: a native version which does not advance it exactly like
+ * the ROM code clobbers HLE_REG_T, and is charged cost instead.
+ *
+ * The work is done all at once, and the time it took in the ROM is
+ * then charged at the return address (see z80_stall()).  Interrupts
+ * due in that time are taken then, as they would have been in the ROM
+ * code, but their handlers see the memory as the routine leaves it;
+ * an interrupt handler which looks at the screen while it is being
+ * scrolled sees it already scrolled, and so on.
+ */
+struct hle_routine
+{
+    const char* name;           /* For --hle-cost and the statistics */
+    bool (*func)(unsigned int); /* Native version, given hle_entry.arg */
+    unsigned int cost;          /* T-states charged on top */
+    unsigned int clobbers;
+    uint64_t calls;             /* Statistics */
+    uint64_t declined;
+    uint64_t mismatches;
+    uint64_t rom_tstates;       /* Time taken by the ROM code (verify mode) */
+};
+
+enum hle_reg
+{
+    HLE_REG_AF = 0x001,
+    HLE_REG_BC = 0x002,
+    HLE_REG_DE = 0x004,
+    HLE_REG_HL = 0x008,
+    HLE_REG_IX = 0x010,
+    HLE_REG_IY = 0x020,
+    HLE_REG_T = 0x100,
+};
+
+/*
+ * The routines in one ROM image, or several images which only differ
+ * elsewhere.  Images are mapped at address 0.
+ */
+struct hle_entry
+{
+    uint16_t pc;
+    struct hle_routine* routine;
+    unsigned int arg; /* What differs between the images */
+};
+
+struct hle_rom
+{
+    const uint8_t* images[2];
+    const struct hle_entry* entries; /* Terminated by a NULL routine */
+};
+
+extern const struct hle_rom hle_fp_roms[];
+extern struct hle_routine* const hle_fp_routines[];
+extern const struct hle_rom hle_screen_roms[];
+extern struct hle_routine* const hle_screen_routines[];
+
+extern void hle_init(unsigned int memflags);
+extern bool hle_set_cost(const char* name, unsigned int cost);
+extern void hle_list_costs(void);
+extern void hle_report(void);
+extern void hle_return(void);
+
+#endif /* HLE_H */
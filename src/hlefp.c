@@ -0,0 +1,615 @@
+/*
+ * Native versions of the BASIC floating point arithmetic
+ *
+ * ABC80: numbers are five bytes, addressed by their last byte: the
+ * exponent (excess 80h, 0 for zero), then going downwards the sign (bit
+ * 0 set for negative) and six BCD digits, most significant first.  The
+ * routines take x in DE and y in HL, and leave the result in the number
+ * at BC; everything but AF and IX is preserved.  The conversion from an
+ * integer is here too; the one back goes through INT(), and is left to
+ * the ROM code.
+ *
+ * ABC802: see below.
+ *
+ * Overflow, division by zero and the like go to BASIC's error handling,
+ * which is left to the ROM code.
+ */
+#include "hle.h"
+#include "z80.h"
+#include "rom.h"
+
+/* The routines leave IX pointing to their work area, below the stack */
+#define FP_FRAME 0x2f
+
+#define FP_LIMIT 1000000 /* One more than the largest mantissa */
+
+static const uint32_t pow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+/* Fetch the mantissa of the number at p, if it is valid BCD */
+static bool get_mantissa(uint16_t p, uint32_t* m)
+{
+    uint32_t v = 0;
+    unsigned int i;
+
+    for (i = 4; i >= 2; i--) {
+        const uint8_t b = mem_read(p - i);
+
+        if (b > 0x99 || (b & 0x0f) > 9)
+            return false;
+        v = v * 100 + (b >> 4) * 10 + (b & 0x0f);
+    }
+
+    *m = v;
+    return true;
+}
+
+static void put_number(uint16_t p, uint32_t m, uint8_t sign, uint8_t exp)
+{
+    unsigned int i;
+
+    mem_write(p, exp);
+    mem_write(p - 1, sign);
+    for (i = 2; i <= 4; i++) {
+        mem_write(p - i, (m % 10) | ((m / 10 % 10) << 4));
+        m /= 100;
+    }
+}
+
+static bool fp_done(uint16_t p, uint32_t m, uint8_t sign, uint8_t exp)
+{
+    put_number(p, m, sign, exp);
+    REG_IX = REG_SP - FP_FRAME;
+    hle_return();
+    return true;
+}
+
+/* Round m up, returning false if that overflows the exponent */
+static bool round_up(uint32_t* m, uint8_t* exp)
+{
+    if (++*m < FP_LIMIT)
+        return true;
+    *m = FP_LIMIT / 10;
+    return ++*exp != 0;
+}
+
+static bool addsub(bool sub)
+{
+    const uint16_t x = REG_DE, y = REG_HL;
+    const bool swap = mem_read(x) < mem_read(y);
+    const uint16_t big = swap ? y : x, small = swap ? x : y;
+    const unsigned int d = mem_read(big) - mem_read(small);
+    const unsigned int ds = d < 6 ? d : 6;
+    const uint8_t bsign = mem_read(big - 1);
+    uint8_t sign, exp = mem_read(big);
+    uint32_t m, s;
+    unsigned int lz;
+    bool round;
+
+    if (!get_mantissa(big, &m) || !get_mantissa(small, &s))
+        return false;
+
+    /* The smaller operand is aligned, rounding on the first digit out */
+    round = ds && s / pow10[ds - 1] % 10 >= 5;
+    s = s / pow10[ds] + round;
+
+    sign = bsign ^ (sub && swap);
+    if (!((mem_read(small - 1) ^ sub ^ bsign) & 1)) {
+        m += s;
+        if (m >= FP_LIMIT) {
+            if (!++exp)
+                return false; /* Overflow */
+            m /= 10;
+        }
+        return fp_done(REG_BC, m, sign, exp);
+    }
+
+    if (m >= s) {
+        m -= s;
+    } else {
+        m = s - m;
+        sign ^= 1;
+    }
+    if (!m)
+        return fp_done(REG_BC, 0, sign, 0);
+    for (lz = 0; m < FP_LIMIT / 10; lz++)
+        m *= 10;
+    if (exp <= lz)
+        return false; /* Underflow, with the wrong sign */
+    exp -= lz;
+    return fp_done(REG_BC, m, sign, exp);
+}
+
+static bool fadd(unsigned int arg)
+{
+    (void)arg;
+    return addsub(false);
+}
+
+static bool fsub(unsigned int arg)
+{
+    (void)arg;
+    return addsub(true);
+}
+
+static bool fmul(unsigned int arg)
+{
+    const uint16_t x = REG_DE, y = REG_HL;
+    const uint8_t sign = mem_read(x - 1) ^ mem_read(y - 1);
+    const unsigned int ex = mem_read(x), ey = mem_read(y);
+    unsigned int s;
+    uint32_t mx, my, m;
+    uint64_t p;
+    uint8_t exp;
+    bool round;
+
+    (void)arg;
+
+    s = ex + ey;
+    if (!ex || !ey || s < 0x80)
+        return fp_done(REG_BC, 0, sign, 0);
+    if (s >= 0x180)
+        return false; /* Overflow */
+    exp = s - 0x80;
+    if (!exp)
+        return fp_done(REG_BC, 0, sign, 0);
+
+    if (!get_mantissa(x, &mx) || !get_mantissa(y, &my))
+        return false;
+
+    p = (uint64_t)mx * my;
+    if (p >= (uint64_t)FP_LIMIT * FP_LIMIT / 10) {
+        m = p / pow10[6];
+        round = p / pow10[5] % 10 >= 5;
+    } else {
+        if (!--exp)
+            return false; /* Underflow, with the wrong sign */
+        m = p / pow10[5];
+        round = p / pow10[4] % 10 >= 5;
+    }
+
+    if (round && !round_up(&m, &exp))
+        return false;
+
+    return fp_done(REG_BC, m, sign, exp);
+}
+
+static bool fdiv(unsigned int arg)
+{
+    const uint16_t x = REG_DE, y = REG_HL;
+    const uint8_t sign = mem_read(x - 1) ^ mem_read(y - 1);
+    const uint8_t ex = mem_read(x), ey = mem_read(y);
+    const uint8_t diff = ex - ey;
+    uint32_t w, my, q, m;
+    unsigned int digits, d;
+    uint8_t exp;
+
+    (void)arg;
+
+    if (!ey)
+        return false; /* Division by zero */
+    if (!ex)
+        return fp_done(REG_BC, 0, sign, 0);
+    if (ex < ey && !(diff & 0x80))
+        return fp_done(REG_BC, 0, sign, 0);
+    if (ex >= ey && (diff & 0x80))
+        return false; /* Overflow */
+    exp = diff + 0x81;
+
+    if (!get_mantissa(x, &w) || !get_mantissa(y, &my) || !my)
+        return false;
+
+    /* Seven digits by repeated subtraction, the last one for rounding */
+    q = 0;
+    for (digits = 0; digits < 7;) {
+        d = w / my;
+        if (d > 9)
+            return false;
+        w = (w - d * my) * 10;
+        if (!d && !digits) {
+            if (!--exp)
+                return false;
+            continue;
+        }
+        q = q * 10 + d;
+        digits++;
+    }
+
+    m = q / 10;
+    d = q % 10;
+    /* A 5 rounds up unless (IY+3) bit 7 asks for truncation */
+    if ((d > 5 || (d == 5 && !(mem_read(REG_IY + 3) & 0x80))) &&
+        !round_up(&m, &exp))
+        return false;
+
+    return fp_done(REG_BC, m, sign, exp);
+}
+
+/*
+ * Integer to float: HL into the number at DE, a digit at a time by a
+ * recursive division by 10 (at 377Fh), whose time depends on the bits
+ * of the quotient.  Registers, flags and T-states are left as the ROM
+ * code leaves them.
+ */
+#define ITOF_ZERO 178     /* Returning early for 0 */
+#define ITOF_START 258    /* Up to and back from the first digit */
+#define ITOF_NEGATE 66    /* Extra for a negative number */
+#define ITOF_DIGIT 1579   /* Each digit, when all quotient bits are 1 */
+#define ITOF_ZERO_BIT 18  /* ... and for each 0 bit */
+
+/* Sign, zero and parity flags, as logical operations leave them */
+static uint8_t szp_flags(uint8_t v)
+{
+    unsigned int p = v;
+
+    p ^= p >> 4;
+    p ^= p >> 2;
+    p ^= p >> 1;
+    return (v & SIGN_MASK) | (v ? 0 : ZERO_MASK) | (p & 1 ? 0 : PARITY_MASK);
+}
+
+static unsigned int zero_bits(uint16_t v)
+{
+    unsigned int n = 16;
+
+    for (; v; v &= v - 1)
+        n--;
+    return n;
+}
+
+static bool itof(unsigned int arg)
+{
+    const uint16_t p = REG_DE;
+    uint16_t v = REG_HL;
+    uint8_t digit[5], last = 0;
+    unsigned int n, i;
+    uint64_t t;
+
+    (void)arg;
+
+    for (i = 0; i <= 4; i++)
+        mem_write(p - i, 0);
+    REG_BC = p;
+
+    if (!v) {
+        REG_A = 0;
+        REG_F = (REG_F & ~ALL_FLAGS_MASK) | ZERO_MASK | PARITY_MASK;
+        REG_DE = p - 4;
+        TSTATE += ITOF_ZERO;
+        hle_return();
+        return true;
+    }
+
+    t = ITOF_START;
+    if (v & 0x8000) {
+        v = -v;
+        mem_write(p - 1, 1);
+        t += ITOF_NEGATE;
+    }
+
+    /* Least significant digit first, as the recursion goes down */
+    for (n = 0; v; n++) {
+        digit[n] = v % 10;
+        v /= 10;
+        t += ITOF_DIGIT + ITOF_ZERO_BIT * zero_bits(v);
+    }
+    /* No CALL NZ for the most significant digit */
+    t -= 7;
+
+    /* Packed on the way back up, the odd ones with RRD */
+    for (i = 0; i < n; i++) {
+        const uint16_t q = p - 4 + i / 2;
+
+        if (i & 1) {
+            last = mem_read(q) | digit[n - 1 - i];
+            mem_write(q, last);
+            t -= 3; /* OR (HL) rather than RRD */
+        } else {
+            mem_write(q, digit[n - 1 - i] << 4);
+        }
+    }
+
+    mem_write(p, 0x80 + n);
+    REG_A = 0x80 + n;
+    REG_F = (REG_F & ~ALL_FLAGS_MASK) |
+            (n & 1 ? ZERO_MASK | PARITY_MASK : szp_flags(last));
+    REG_DE = p - 4 + n / 2;
+    REG_HL = 0;
+    TSTATE += t;
+    hle_return();
+    return true;
+}
+
+/*
+ * ABC802 BASIC II: single precision numbers are four bytes, upwards
+ * from the binary exponent (excess 80h, 0 for zero), then the sign in
+ * bit 7 over the rest of a 24-bit mantissa whose top bit is left out.
+ * x and y are on the stack, y on top, and the result replaces them.
+ * (IY+1Eh) is the size of a number; with double precision the routines
+ * jump elsewhere, which is left to the ROM code.
+ *
+ * The mantissa is worked on as 32 bits, the bottom 8 for rounding, as
+ * in BCDE in the ROM code.  All the registers are left as it leaves
+ * them, including the other set, which fmul and fdiv use.
+ */
+#define BF_SIZE 4
+#define BF_SIZE_OFFSET 0x1e
+
+static uint32_t bf_mantissa(uint16_t p)
+{
+    return (uint32_t)(mem_read(p + 1) | 0x80) << 24 |
+           (uint32_t)mem_read(p + 2) << 16 | (uint32_t)mem_read(p + 3) << 8;
+}
+
+/*
+ * Normalize and round, as the code at 50E6h does, 0 in *exp for zero;
+ * false on overflow
+ */
+static bool bf_round(uint32_t* m, uint8_t* exp)
+{
+    uint32_t v = *m;
+    uint8_t e = *exp;
+
+    if (!(v >> 24)) {
+        if (!v)
+            goto zero;
+        do {
+            if (e < 9)
+                goto zero;
+            e -= 8;
+            v <<= 8;
+        } while (!(v >> 24));
+    }
+    while (!(v & 0x80000000)) {
+        if (!--e)
+            goto zero;
+        v <<= 1;
+    }
+
+    if (v & 0x80) {
+        v = (v >> 8) + 1;
+        if (v >> 24) {
+            v = 0x800000;
+            e++;
+        }
+    } else {
+        v >>= 8;
+    }
+    if (!e)
+        return false; /* Overflow */
+
+    *m = v;
+    *exp = e;
+    return true;
+
+zero:
+    *m = 0;
+    *exp = 0;
+    return true;
+}
+
+/* Replace x and y with the result, and return */
+static bool bf_done(uint32_t m, uint8_t exp, bool neg)
+{
+    const uint16_t sp = REG_SP;
+    const uint16_t ret = mem_read_word(sp);
+    const uint8_t m1 = exp ? ((m >> 16) & 0x7f) | (neg ? 0x80 : 0) : 0;
+
+    mem_write(sp + 6, exp);
+    mem_write(sp + 7, m1);
+    mem_write(sp + 8, m >> 8);
+    mem_write(sp + 9, m);
+
+    REG_A = 0;
+    REG_F = (REG_F & ~ALL_FLAGS_MASK) | ZERO_MASK | HALF_CARRY_MASK |
+            PARITY_MASK;
+    REG_BC = (m & 0xff) << 8 | ((m >> 8) & 0xff);
+    REG_DE = m1 << 8 | exp;
+    REG_HL = ret;
+    REG_HL_PRIME = sp + 10;
+    REG_SP = sp + 6;
+    REG_PC = ret;
+    return true;
+}
+
+static bool bf_single(void)
+{
+    return mem_read(REG_IY + BF_SIZE_OFFSET) == BF_SIZE;
+}
+
+static bool bf_addsub(bool sub)
+{
+    const uint16_t y = REG_SP + 2, x = y + BF_SIZE;
+    const uint8_t sx = mem_read(x + 1), sy = mem_read(y + 1) ^ (sub ? 0x80 : 0);
+    const bool swap = mem_read(x) < mem_read(y);
+    const uint16_t big = swap ? y : x, small = swap ? x : y;
+    const uint8_t bsign = swap ? sy : sx, ssign = swap ? sx : sy;
+    unsigned int d = mem_read(big) - mem_read(small);
+    uint8_t exp = mem_read(big);
+    bool neg = bsign & 0x80;
+    uint32_t m = bf_mantissa(big), s;
+
+    if (!bf_single())
+        return false;
+
+    if (!mem_read(small)) {
+        if (!d)
+            return bf_done(0, 0, false);
+        d = 25;
+    }
+    s = bf_mantissa(small) >> (d < 25 ? d : 25);
+
+    if (!((bsign ^ ssign) & 0x80)) {
+        /* Straight to the rounding, with the carry shifted back in */
+        if (m + s < m) {
+            m = (m + s) >> 1 | 0x80000000;
+            exp++;
+        } else {
+            m += s;
+        }
+    } else if (m >= s) {
+        m -= s;
+    } else {
+        m = s - m;
+        neg = !neg;
+    }
+
+    if (!bf_round(&m, &exp))
+        return false;
+    return bf_done(m, exp, neg);
+}
+
+static bool fadd802(unsigned int arg)
+{
+    (void)arg;
+    return bf_addsub(false);
+}
+
+static bool fsub802(unsigned int arg)
+{
+    (void)arg;
+    return bf_addsub(true);
+}
+
+static bool fmul802(unsigned int arg)
+{
+    const uint16_t y = REG_SP + 2, x = y + BF_SIZE;
+    const unsigned int ex = mem_read(x), ey = mem_read(y);
+    const bool neg = (mem_read(x + 1) ^ mem_read(y + 1)) & 0x80;
+    unsigned int s = ex - 1 + ey;
+    uint64_t p;
+    uint32_t m;
+    uint8_t exp;
+
+    (void)arg;
+
+    if (!bf_single())
+        return false;
+    if (!ex || !ey || s < 0x80)
+        return bf_done(0, 0, false);
+    if (s >= 0x180)
+        return false; /* Overflow */
+    exp = s + 0x81;
+
+    /* Shift and add, the low bits going into D' */
+    p = (uint64_t)(bf_mantissa(x) >> 8) * (bf_mantissa(y) >> 8);
+    m = p >> 16;
+    if (!bf_round(&m, &exp))
+        return false;
+
+    REG_BC_PRIME = 0;
+    z80_state.de_prime.byte.high = p >> 16;
+    return bf_done(m, exp, neg);
+}
+
+static bool fdiv802(unsigned int arg)
+{
+    const uint16_t y = REG_SP + 2, x = y + BF_SIZE;
+    const int ex = mem_read(x), ey = mem_read(y);
+    const bool neg = (mem_read(x + 1) ^ mem_read(y + 1)) & 0x80;
+    const uint32_t dy = bf_mantissa(y) >> 8;
+    uint32_t r = bf_mantissa(x) >> 8, q = 0, m;
+    unsigned int i;
+    uint8_t exp;
+
+    (void)arg;
+
+    if (!bf_single())
+        return false;
+    if (!ey)
+        return false; /* Division by zero */
+    if (!ex || ex - ey < -0x80)
+        return bf_done(0, 0, false);
+    if (ex - ey >= 0x80)
+        return false; /* Overflow */
+    exp = ex - ey + 0x81;
+
+    /* 24 bits and two more for rounding, by repeated subtraction */
+    for (i = 0; i < 26; i++) {
+        bool carry = false;
+
+        if (i) {
+            r <<= 1;
+            carry = r >> 24;
+            r &= 0xffffff;
+        }
+        q <<= 1;
+        if (carry || r >= dy) {
+            r = (r - dy) & 0xffffff;
+            q |= 1;
+        }
+    }
+    m = q << 6;
+    if (!bf_round(&m, &exp))
+        return false;
+
+    /* The divisor and what is left of x, in the other set */
+    REG_BC_PRIME = dy >> 8;
+    REG_DE_PRIME = (dy & 0xff) << 8 | r >> 16;
+    return bf_done(m, exp, neg);
+}
+
+/*
+ * The costs are what the ROM code takes on average, as measured with
+ * --hle fp,verify, so BASIC programs keep their speed; a single call
+ * can be off by thousands of T-states either way.
+ *
+ * The ABC80 arithmetic leaves A and F as they were: the ROM code exits
+ * with whatever its digit loops last put there.  No caller looks at
+ * them.  Following the code after every call, tail jump and operator
+ * table entry for these routines, in all four images, A and all the
+ * flags are overwritten before anything reads them: by the next
+ * bytecode dispatch (RST 30h), or at the start of the next arithmetic
+ * routine.
+ */
+// clang-format off
+static struct hle_routine hle_fadd = { "fadd", fadd, 2100, HLE_REG_AF | HLE_REG_T, 0, 0, 0, 0 };
+static struct hle_routine hle_fsub = { "fsub", fsub, 2350, HLE_REG_AF | HLE_REG_T, 0, 0, 0, 0 };
+static struct hle_routine hle_fmul = { "fmul", fmul, 9400, HLE_REG_AF | HLE_REG_T, 0, 0, 0, 0 };
+static struct hle_routine hle_fdiv = { "fdiv", fdiv, 22400, HLE_REG_AF | HLE_REG_T, 0, 0, 0, 0 };
+static struct hle_routine hle_itof = { "itof", itof, 0, 0, 0, 0, 0, 0 };
+static struct hle_routine hle_fadd802 = { "fadd802", fadd802, 960, HLE_REG_T, 0, 0, 0, 0 };
+static struct hle_routine hle_fsub802 = { "fsub802", fsub802, 1100, HLE_REG_T, 0, 0, 0, 0 };
+static struct hle_routine hle_fmul802 = { "fmul802", fmul802, 2850, HLE_REG_T, 0, 0, 0, 0 };
+static struct hle_routine hle_fdiv802 = { "fdiv802", fdiv802, 3450, HLE_REG_T, 0, 0, 0, 0 };
+
+struct hle_routine* const hle_fp_routines[] = {
+    &hle_fadd, &hle_fsub, &hle_fmul, &hle_fdiv, &hle_itof,
+    &hle_fadd802, &hle_fsub802, &hle_fmul802, &hle_fdiv802, NULL
+};
+
+/* BASIC 1.2; the 40 and 80 column versions share the arithmetic */
+static const struct hle_entry fp_new[] = {
+    { 0x33ee, &hle_fadd, 0 },
+    { 0x3457, &hle_fsub, 0 },
+    { 0x34d6, &hle_fmul, 0 },
+    { 0x35e5, &hle_fdiv, 0 },
+    { 0x3f11, &hle_itof, 0 },
+    { 0, NULL, 0 }
+};
+
+/* BASIC 1.0: the same code, 9 bytes further up (7 for the conversion) */
+static const struct hle_entry fp_old[] = {
+    { 0x33f7, &hle_fadd, 0 },
+    { 0x3460, &hle_fsub, 0 },
+    { 0x34df, &hle_fmul, 0 },
+    { 0x35ee, &hle_fdiv, 0 },
+    { 0x3f18, &hle_itof, 0 },
+    { 0, NULL, 0 }
+};
+
+/* Single precision; fsub changes the sign of y and goes on into fadd */
+static const struct hle_entry fp_abc802[] = {
+    { 0x4f39, &hle_fsub802, 0 },
+    { 0x4f41, &hle_fadd802, 0 },
+    { 0x4fea, &hle_fmul802, 0 },
+    { 0x505f, &hle_fdiv802, 0 },
+    { 0, NULL, 0 }
+};
+
+const struct hle_rom hle_fp_roms[] = {
+    { { abc80bas40n, abc80bas80n }, fp_new },
+    { { abc80bas40o, abc80bas80o }, fp_old },
+    { { abc802rom, NULL }, fp_abc802 },
+    { { NULL, NULL }, NULL }
+};
+// clang-format on
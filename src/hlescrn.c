@@ -0,0 +1,149 @@
+/*
+ * Native versions of the ROM routines which scroll and clear the screen
+ *
+ * These are copy and fill loops over the whole of video RAM, and take
+ * most of the time when a program prints a lot.  They are done here
+ * with mem_move() and mem_fill(), leaving the registers, flags and
+ * T-state counter as the ROM code does.
+ */
+#include "hle.h"
+#include "z80.h"
+#include "rom.h"
+
+#define LINES 24
+
+/*
+ * ABC80: the line addresses are in a table in the ROM, as the lines are
+ * not evenly spaced, and the line length is the operand of an LD BC,nn
+ * in the scroll routine, whose address is given as the argument.  All
+ * the BASIC versions share the code, apart from the operand.
+ */
+#define ABC80_LINE_TABLE 0x0374
+#define ABC80_CURSOR 0xfdf3 /* Row, column */
+
+static uint16_t abc80_line(unsigned int y)
+{
+    return mem_read_word(ABC80_LINE_TABLE + 2 * y);
+}
+
+/*
+ * The flags as left by the final DEC A (with A = 0), then LDIR; the CPU
+ * core leaves the undocumented ones alone
+ */
+static void dec_flags(void)
+{
+    REG_F = (REG_F & (CARRY_MASK | ~ALL_FLAGS_MASK)) | ZERO_MASK |
+            SUBTRACT_MASK;
+}
+
+static void ldir_flags(void)
+{
+    REG_F &= ~(HALF_CARRY_MASK | SUBTRACT_MASK | OVERFLOW_MASK);
+}
+
+static bool abc80_scroll(unsigned int arg)
+{
+    const unsigned int width = mem_read_word(arg);
+    unsigned int y;
+
+    for (y = 0; y < LINES - 1; y++)
+        mem_move(abc80_line(y), abc80_line(y + 1), width);
+    mem_fill(abc80_line(y), ' ', width);
+
+    REG_A = 0;
+    dec_flags();
+    ldir_flags();
+    REG_DE = abc80_line(y) + width;
+    REG_IX = ABC80_LINE_TABLE + 2 * y;
+    TSTATE += 2997 + 504 * width;
+    hle_return();
+    return true;
+}
+
+static bool abc80_clear(unsigned int arg)
+{
+    const unsigned int width = mem_read_word(arg);
+    unsigned int y;
+
+    for (y = 0; y < LINES; y++)
+        mem_fill(abc80_line(y), ' ', width);
+    mem_write_word(ABC80_CURSOR, 0);
+
+    REG_A = 0;
+    dec_flags();
+    REG_DE = 0;
+    REG_IX = ABC80_LINE_TABLE + 2 * y;
+    TSTATE += 3678 + 504 * width;
+    hle_return();
+    return true;
+}
+
+/*
+ * ABC802: the screen is 24 lines of 80 bytes; in 40-column mode every
+ * other byte is used.
+ */
+#define ABC802_SCREEN 0x7800
+#define ABC802_WIDTH 80
+#define ABC802_SIZE (LINES * ABC802_WIDTH)
+#define ABC802_CURSOR 0xff52 /* Column, row */
+
+static bool abc802_scroll(unsigned int arg)
+{
+    (void)arg;
+
+    mem_move(ABC802_SCREEN, ABC802_SCREEN + ABC802_WIDTH,
+             ABC802_SIZE - ABC802_WIDTH);
+    mem_fill(ABC802_SCREEN + ABC802_SIZE - ABC802_WIDTH, ' ', ABC802_WIDTH);
+
+    ldir_flags();
+    REG_DE = ABC802_SCREEN + ABC802_SIZE;
+    TSTATE += 40423;
+    hle_return();
+    return true;
+}
+
+static bool abc802_clear(unsigned int arg)
+{
+    (void)arg;
+
+    mem_fill(ABC802_SCREEN, ' ', ABC802_SIZE);
+    mem_write_word(ABC802_CURSOR, 0);
+
+    ldir_flags();
+    REG_DE = ABC802_SCREEN + ABC802_SIZE;
+    TSTATE += 40422;
+    hle_return();
+    return true;
+}
+
+// clang-format off
+static struct hle_routine hle_abc80_scroll = { "scroll", abc80_scroll, 0, 0, 0, 0, 0, 0 };
+static struct hle_routine hle_abc80_clear = { "clear", abc80_clear, 0, 0, 0, 0, 0, 0 };
+static struct hle_routine hle_abc802_scroll = { "scroll802", abc802_scroll, 0, 0, 0, 0, 0, 0 };
+static struct hle_routine hle_abc802_clear = { "clear802", abc802_clear, 0, 0, 0, 0, 0, 0 };
+
+struct hle_routine* const hle_screen_routines[] = {
+    &hle_abc80_scroll, &hle_abc80_clear,
+    &hle_abc802_scroll, &hle_abc802_clear, NULL
+};
+
+/* All the ABC80 BASIC versions */
+static const struct hle_entry screen_abc80[] = {
+    { 0x0245, &hle_abc80_scroll, 0x024e },
+    { 0x0276, &hle_abc80_clear, 0x024e },
+    { 0, NULL, 0 }
+};
+
+static const struct hle_entry screen_abc802[] = {
+    { 0x02a9, &hle_abc802_scroll, 0 },
+    { 0x02e1, &hle_abc802_clear, 0 },
+    { 0, NULL, 0 }
+};
+
+const struct hle_rom hle_screen_roms[] = {
+    { { abc80bas40n, abc80bas80n }, screen_abc80 },
+    { { abc80bas40o, abc80bas80o }, screen_abc80 },
+    { { abc802rom, NULL }, screen_abc802 },
+    { { NULL, NULL }, NULL }
+};
+// clang-format on
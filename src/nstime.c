@@ -12,8 +12,6 @@
 #    include <unistd.h>
 #endif
 
-#include <SDL.h>
-
 #ifdef _POSIX_TIMERS
 
 #    ifdef _POSIX_MONOTONIC_CLOCK
@@ -146,6 +144,8 @@ void mynssleep(uint64_t until, uint64_t since)
 
 #elif !defined(__WIN32__)
 
+#    include <SDL.h>
+
 void mynssleep(uint64_t until, uint64_t since)
 {
     until -= since;
@@ -0,0 +1,445 @@
+/*
+ * Profiling of the Z80 code: where the emulated time goes
+ *
+ * The exact profile adds up the T-states from the fetch of each
+ * instruction to the next one (so an interrupt is charged to the
+ * instruction it came after) and counts the executions, per address
+ * and memory map.  It also follows the calls: a CALL or RST which
+ * pushed its return address starts a frame, which ends when SP gets
+ * back above it, and the time in between goes to the call edge.
+ *
+ * The sampled profile only counts PC every profile_interval T-states,
+ * which is next to free.
+ *
+ * Both are written when the simulator exits: a report with the
+ * hotspots and call edges, and the executed addresses as a bitmap.
+ */
+#include "profile.h"
+#include "abcio.h"
+#include "abcmem.h"
+#include "compiler.h"
+#include "hostfile.h"
+#include "trace.h"
+#include "z80.h"
+
+unsigned int profile_flags;
+unsigned int profile_interval; /* 0 for the default */
+uint64_t profile_next_sample = UINT64_MAX;
+
+#define PROFILE_TOP 50 /* Lines per section of the report */
+
+struct profile_map
+{
+    uint64_t tstates[Z80_ADDRESS_LIMIT];
+    uint32_t count[Z80_ADDRESS_LIMIT];
+    uint32_t samples[Z80_ADDRESS_LIMIT];
+};
+
+static struct profile_map* maps[MEM_MAPS];
+static uint64_t total_samples;
+
+/* The instruction running, for the exact profile */
+static struct
+{
+    struct profile_map* map; /* NULL if none */
+    uint16_t pc, sp;
+    uint8_t op;
+    uint64_t start;
+} cur;
+
+#define MAX_EDGES 4096 /* Power of 2 */
+#define MAX_FRAMES 64
+
+static struct call_edge
+{
+    uint16_t site, target;
+    uint64_t calls;   /* 0 = free */
+    uint64_t tstates; /* Until the matching return */
+} edges[MAX_EDGES];
+static unsigned int nedges;
+static uint64_t lost_calls;
+
+static struct call_frame
+{
+    uint16_t sp; /* After pushing the return address */
+    struct call_edge* edge;
+    uint64_t start;
+} frames[MAX_FRAMES];
+static unsigned int nframes;
+
+static struct symbol
+{
+    uint16_t addr;
+    char* name;
+}* symbols;
+static size_t nsymbols, symbols_size;
+
+static struct profile_map* get_map(unsigned int m)
+{
+    if (unlikely(!maps[m]))
+        maps[m] = calloc(1, sizeof *maps[m]);
+    return maps[m];
+}
+
+void profile_init(unsigned int memflags)
+{
+    if (tracing(TRACE_BASIC))
+        basic_profile_init(memflags);
+
+    if ((profile_flags & PROFILE_SAMPLE) || tracing(TRACE_BASIC)) {
+        if (!profile_interval)
+            profile_interval = (profile_flags & PROFILE_SAMPLE)
+                                   ? PROFILE_INTERVAL
+                                   : BASIC_PROFILE_INTERVAL;
+        profile_next_sample = TSTATE + profile_interval;
+    }
+}
+
+static bool is_call(uint8_t op)
+{
+    return op == 0xcd || (op & 0xc7) == 0xc4 || (op & 0xc7) == 0xc7;
+}
+
+static struct call_edge* find_edge(uint16_t site, uint16_t target)
+{
+    unsigned int h = (site * 40503U ^ target) & (MAX_EDGES - 1);
+    struct call_edge* e;
+
+    for (;;) {
+        e = &edges[h];
+        if (!e->calls) {
+            if (nedges >= MAX_EDGES * 3 / 4)
+                return NULL;
+            nedges++;
+            e->site = site;
+            e->target = target;
+            return e;
+        }
+        if (e->site == site && e->target == target)
+            return e;
+        h = (h + 1) & (MAX_EDGES - 1);
+    }
+}
+
+/* The instruction at pc is about to run; the previous one is done */
+void profile_insn(uint16_t pc, uint16_t sp, uint64_t now)
+{
+    struct profile_map* map;
+    struct call_edge* e;
+
+    while (nframes && sp > frames[nframes - 1].sp) {
+        const struct call_frame* f = &frames[--nframes];
+
+        f->edge->tstates += now - f->start;
+    }
+
+    if (cur.map) {
+        cur.map->tstates[cur.pc] += now - cur.start;
+        if (is_call(cur.op) && sp == (uint16_t)(cur.sp - 2)) {
+            e = find_edge(cur.pc, pc);
+            if (!e || nframes >= MAX_FRAMES) {
+                lost_calls++;
+            } else {
+                e->calls++;
+                frames[nframes].sp = sp;
+                frames[nframes].edge = e;
+                frames[nframes].start = cur.start;
+                nframes++;
+            }
+        }
+    }
+
+    map = get_map(mem_code_map(pc));
+    if (map)
+        map->count[pc]++;
+
+    cur.map = map;
+    cur.pc = pc;
+    cur.sp = sp;
+    cur.op = mem_fetch(pc);
+    cur.start = now;
+}
+
+/* Called from z80_poll_external() once profile_next_sample is reached */
+void profile_sample(void)
+{
+    const uint16_t pc = REG_PC;
+    struct profile_map* map;
+    unsigned int n;
+
+    /* Any samples missed land here too */
+    n = (TSTATE - profile_next_sample) / profile_interval + 1;
+    profile_next_sample += (uint64_t)n * profile_interval;
+
+    if (profile_flags & PROFILE_SAMPLE) {
+        total_samples += n;
+        map = get_map(mem_code_map(pc));
+        if (map)
+            map->samples[pc] += n;
+    }
+    if (tracing(TRACE_BASIC))
+        basic_profile_sample(n);
+}
+
+static int symbol_cmp(const void* a, const void* b)
+{
+    const struct symbol *sa = a, *sb = b;
+
+    return (int)sa->addr - (int)sb->addr;
+}
+
+/*
+ * Read a symbol file: lines with a hex address and a name, and
+ * comments starting with ; or #.  The names apply in all the maps.
+ */
+bool profile_add_symbols(const char* filename)
+{
+    char line[256], name[64];
+    unsigned int addr;
+    FILE* f;
+
+    f = fopen(filename, "r");
+    if (!f)
+        return false;
+
+    while (fgets(line, sizeof line, f)) {
+        if (line[0] == ';' || line[0] == '#')
+            continue;
+        if (sscanf(line, "%x %63s", &addr, name) != 2 ||
+            addr >= Z80_ADDRESS_LIMIT)
+            continue;
+        if (nsymbols >= symbols_size) {
+            size_t size = symbols_size ? symbols_size * 2 : 256;
+            struct symbol* s = realloc(symbols, size * sizeof *s);
+
+            if (!s)
+                break;
+            symbols = s;
+            symbols_size = size;
+        }
+        symbols[nsymbols].addr = addr;
+        symbols[nsymbols].name = strdup(name);
+        if (symbols[nsymbols].name)
+            nsymbols++;
+    }
+    fclose(f);
+
+    qsort(symbols, nsymbols, sizeof *symbols, symbol_cmp);
+    return true;
+}
+
+/* The nearest symbol at or below addr, as name+offset */
+static const char* symbolize(uint16_t addr, char* buf, size_t len)
+{
+    size_t lo = 0, hi = nsymbols;
+
+    while (hi - lo > 1) {
+        const size_t mid = (lo + hi) / 2;
+
+        if (symbols[mid].addr <= addr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    if (!nsymbols || symbols[lo].addr > addr)
+        buf[0] = '\0';
+    else if (symbols[lo].addr == addr)
+        snprintf(buf, len, "%s", symbols[lo].name);
+    else
+        snprintf(buf, len, "%s+%X", symbols[lo].name, addr - symbols[lo].addr);
+    return buf;
+}
+
+/*
+ * The report
+ */
+struct hotspot
+{
+    unsigned int map;
+    uint16_t pc;
+    uint64_t value;
+};
+
+static int hotspot_cmp(const void* a, const void* b)
+{
+    const struct hotspot *ha = a, *hb = b;
+
+    return ha->value < hb->value ? 1 : ha->value > hb->value ? -1 : 0;
+}
+
+static int edge_cmp(const void* a, const void* b)
+{
+    const struct call_edge *ea = a, *eb = b;
+
+    return ea->tstates < eb->tstates ? 1 : ea->tstates > eb->tstates ? -1 : 0;
+}
+
+/* Disassemble the instruction at pc in map m */
+static void disassemble_in_map(unsigned int m, uint16_t pc, char* buf)
+{
+    const struct mem_page* saved[2];
+
+    saved[0] = mem_current_map[0];
+    saved[1] = mem_current_map[1];
+    mem_set_current_map(mem_map(m), mem_map(m));
+    DAsm(pc, buf, NULL);
+    mem_set_current_map(saved[0], saved[1]);
+}
+
+static void report_hotspots(FILE* f, bool sampled, uint64_t total)
+{
+    struct hotspot* spots;
+    size_t nspots = 0, i;
+    unsigned int m, pc;
+    char dis[80], sym[80];
+    uint64_t v;
+
+    spots = malloc(MEM_MAPS * Z80_ADDRESS_LIMIT * sizeof *spots);
+    if (!spots)
+        return;
+
+    for (m = 0; m < MEM_MAPS; m++) {
+        if (!maps[m])
+            continue;
+        for (pc = 0; pc < Z80_ADDRESS_LIMIT; pc++) {
+            v = sampled ? maps[m]->samples[pc] : maps[m]->tstates[pc];
+            if (v) {
+                spots[nspots].map = m;
+                spots[nspots].pc = pc;
+                spots[nspots].value = v;
+                nspots++;
+            }
+        }
+    }
+    qsort(spots, nspots, sizeof *spots, hotspot_cmp);
+
+    fprintf(f, "%14s %6s %10s %-7s %-20s %s\n",
+            sampled ? "Samples" : "T-states", "%", "Count", "Address",
+            "Symbol", "Instruction");
+    for (i = 0; i < nspots && i < PROFILE_TOP; i++) {
+        const struct hotspot* s = &spots[i];
+
+        disassemble_in_map(s->map, s->pc, dis);
+        fprintf(f, "%14" PRIu64 " %6.2f %10" PRIu32 " %u:%04X  %-20s %s\n",
+                s->value, total ? 100.0 * s->value / total : 0.0,
+                maps[s->map]->count[s->pc], s->map, s->pc,
+                symbolize(s->pc, sym, sizeof sym), dis);
+    }
+    fputc('\n', f);
+    free(spots);
+}
+
+static void report_calls(FILE* f)
+{
+    static struct call_edge sorted[MAX_EDGES];
+    char site[80], target[80];
+    unsigned int i, n = 0;
+
+    for (i = 0; i < MAX_EDGES; i++) {
+        if (edges[i].calls)
+            sorted[n++] = edges[i];
+    }
+    qsort(sorted, n, sizeof *sorted, edge_cmp);
+
+    fprintf(f, "Calls (T-states until the return, including the callees):\n");
+    fprintf(f, "%14s %10s %10s  %-25s %s\n", "T-states", "Calls", "Average",
+            "From", "To");
+    for (i = 0; i < n && i < PROFILE_TOP; i++) {
+        const struct call_edge* e = &sorted[i];
+
+        symbolize(e->site, site, sizeof site);
+        symbolize(e->target, target, sizeof target);
+        fprintf(f, "%14" PRIu64 " %10" PRIu64 " %10" PRIu64
+                "  %04X %-20s %04X %s\n",
+                e->tstates, e->calls, e->tstates / e->calls, e->site, site,
+                e->target, target);
+    }
+    if (lost_calls)
+        fprintf(f, "(%" PRIu64 " calls not followed)\n", lost_calls);
+    fputc('\n', f);
+}
+
+/* One bit per address, bit 0 first, 8K per memory map */
+static void write_coverage(void)
+{
+    static uint8_t bits[MEM_MAPS][Z80_ADDRESS_LIMIT / 8];
+    struct host_file* hf;
+    unsigned int m, pc;
+
+    for (m = 0; m < MEM_MAPS; m++) {
+        if (!maps[m])
+            continue;
+        for (pc = 0; pc < Z80_ADDRESS_LIMIT; pc++) {
+            if (maps[m]->count[pc] || maps[m]->samples[pc])
+                bits[m][pc >> 3] |= 1 << (pc & 7);
+        }
+    }
+
+    hf = dump_file(HF_BINARY, memdump_path, "cover%04u.bin");
+    if (!hf)
+        return;
+
+    fwrite(bits, 1, sizeof bits, hf->f);
+    if (!ferror(hf->f))
+        keep_file(hf);
+    close_file(&hf);
+}
+
+void profile_report(void)
+{
+    struct host_file* hf;
+    uint64_t total = 0;
+    unsigned int m, pc, covered;
+
+    if (!profile_flags)
+        return;
+
+    /* Finish what was running */
+    while (nframes) {
+        nframes--;
+        frames[nframes].edge->tstates += TSTATE - frames[nframes].start;
+    }
+    if (cur.map) {
+        cur.map->tstates[cur.pc] += TSTATE - cur.start;
+        cur.map = NULL;
+    }
+
+    hf = dump_file(HF_TEXT, memdump_path, "profile%04u.txt");
+    if (!hf)
+        return;
+
+    if (profile_flags & PROFILE_EXACT) {
+        for (m = 0; m < MEM_MAPS; m++) {
+            if (!maps[m])
+                continue;
+            for (pc = 0; pc < Z80_ADDRESS_LIMIT; pc++)
+                total += maps[m]->tstates[pc];
+        }
+        fprintf(hf->f, "Exact profile: %" PRIu64 " T-states\n\n", total);
+        report_hotspots(hf->f, false, total);
+        report_calls(hf->f);
+    }
+
+    if (profile_flags & PROFILE_SAMPLE) {
+        fprintf(hf->f, "Sampled profile: %" PRIu64 " samples, every %u "
+                "T-states\n\n", total_samples, profile_interval);
+        report_hotspots(hf->f, true, total_samples);
+    }
+
+    fprintf(hf->f, "Coverage (instructions executed at):\n");
+    for (m = 0; m < MEM_MAPS; m++) {
+        if (!maps[m])
+            continue;
+        covered = 0;
+        for (pc = 0; pc < Z80_ADDRESS_LIMIT; pc++)
+            covered += maps[m]->count[pc] || maps[m]->samples[pc];
+        fprintf(hf->f, "  map %u: %u addresses\n", m, covered);
+    }
+
+    if (!ferror(hf->f))
+        keep_file(hf);
+    close_file(&hf);
+
+    write_coverage();
+}
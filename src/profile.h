@@ -0,0 +1,36 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "compiler.h"
+
+/*
+ * Profiling of the Z80 code, per address and memory map.  The exact
+ * profile runs the CPU in a loop of its own which reports every
+ * instruction; the sampled one looks at PC from z80_poll_external()
+ * every profile_interval T-states, and so does the BASIC line profile.
+ */
+enum profile_flags
+{
+    PROFILE_EXACT = 0x01,
+    PROFILE_SAMPLE = 0x02,
+};
+
+#define PROFILE_INTERVAL 1000 /* Default T-states between samples */
+#define BASIC_PROFILE_INTERVAL 10000 /* ...for the BASIC profile alone */
+
+extern unsigned int profile_flags;
+extern unsigned int profile_interval;
+extern uint64_t profile_next_sample; /* UINT64_MAX if not sampling */
+
+extern void profile_init(unsigned int memflags);
+extern bool profile_add_symbols(const char* filename);
+extern void profile_insn(uint16_t pc, uint16_t sp, uint64_t now);
+extern void profile_sample(void);
+extern void profile_report(void);
+
+/* The BASIC line profile (basicprof.c), taken with --trace basic */
+extern void basic_profile_init(unsigned int memflags);
+extern void basic_profile_sample(unsigned int n);
+extern void basic_profile_report(void);
+
+#endif /* PROFILE_H */
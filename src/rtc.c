@@ -15,6 +15,41 @@ static uint8_t e05time[17 * 2]; /* __ HH MM dd mm YY ?? SS ?? */
 static unsigned int e05bit;
 static uint8_t e05cmd;
 
+/*
+ * In virtual time (--virtual-time), the clock goes by the T-state
+ * counter, from epoch (seconds since 1970, UTC) at T-state 0
+ */
+static bool virtual_time;
+static int64_t virtual_epoch;
+static double tstates_per_fifty; /* 1/50 s, the fraction the clock has */
+
+void rtc_virtual_time(int64_t epoch, double mhz)
+{
+    virtual_time = true;
+    virtual_epoch = epoch;
+    tstates_per_fifty = mhz * 1.0e+6 / 50;
+}
+
+static void latch_tm(const struct tm* tm, unsigned int fifties)
+{
+    bytes[0] = tm->tm_year / 100 + 19;
+    bytes[1] = tm->tm_year % 100;
+    bytes[2] = tm->tm_mon + 1;
+    bytes[3] = tm->tm_mday;
+    bytes[4] = tm->tm_hour;
+    bytes[5] = tm->tm_min;
+    bytes[6] = tm->tm_sec;
+    bytes[7] = fifties;
+}
+
+static void virtual_latch_time(void)
+{
+    const uint64_t fifties = TSTATE / tstates_per_fifty;
+    const time_t t = virtual_epoch + fifties / 50;
+
+    latch_tm(gmtime(&t), fifties % 50);
+}
+
 #ifdef __WIN32__
 
 #    include <windows.h>
@@ -53,21 +88,17 @@ static void sys_latch_time(void)
     t = tv.tv_sec;
     tm = localtime(&t);
 
-    bytes[0] = tm->tm_year / 100 + 19;
-    bytes[1] = tm->tm_year % 100;
-    bytes[2] = tm->tm_mon + 1;
-    bytes[3] = tm->tm_mday;
-    bytes[4] = tm->tm_hour;
-    bytes[5] = tm->tm_min;
-    bytes[6] = tm->tm_sec;
-    bytes[7] = tv.tv_usec / 20000;
+    latch_tm(tm, tv.tv_usec / 20000);
 }
 
 #endif
 
 static void latch_time(void)
 {
-    sys_latch_time();
+    if (virtual_time)
+        virtual_latch_time();
+    else
+        sys_latch_time();
 
     sprintf((char*)e05time, "__%02u%02u%02u%02u%02u??%02u??", bytes[4],
             bytes[5], bytes[3], bytes[2], bytes[1] /* ,??? */,
@@ -3,8 +3,6 @@
 
 #include "compiler.h"
 
-#include <SDL.h>
-
 extern void screen_init(bool, bool);
 extern void screen_reset(void);
 extern void screen_write(int, int);
@@ -15,7 +13,6 @@ extern void event_loop(void);
 extern void key_check(void);
 
 extern volatile int event_pending;
-Uint32 post_periodic(Uint32 interval, void* param);
 
 extern void crtc_out(uint8_t, uint8_t);
 extern uint8_t crtc_in(uint8_t);
@@ -8,13 +8,16 @@ extern "C"
 {
 
 #include "abcio.h"
+#include "abcmem.h"
 #include "clock.h"
 //#include "nstime.h"
+#include "profile.h"
 #include "screen.h"
 #include "screenshot.h"
 #include "trace.h"
 #include "z80.h"
 }
+#include <SDL.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -464,7 +467,9 @@ enum dump_memory_type
 {
     DUMP_NONE,
     DUMP_MEM,
-    DUMP_RAM
+    DUMP_RAM,
+    DUMP_OPSTATS,
+    DUMP_BASIC
 };
 
 static volatile enum dump_memory_type dump_memory_now;
@@ -521,6 +526,14 @@ void event_loop(void)
                     dump_memory_now = DUMP_RAM;
                     break;
 
+                case SDLK_o:
+                    dump_memory_now = DUMP_OPSTATS;
+                    break;
+
+                case SDLK_b:
+                    dump_memory_now = DUMP_BASIC;
+                    break;
+
                 case SDLK_f:
                     faketype = !faketype;
                     break;
@@ -782,7 +795,11 @@ void vsync_screen(void)
 
     if (unlikely(dump_memory_now)) {
         dm = xchg(&dump_memory_now, DUMP_NONE);
-        if (dm)
+        if (dm == DUMP_OPSTATS)
+            z80_opstats_dump();
+        else if (dm == DUMP_BASIC)
+            basic_profile_report();
+        else if (dm)
             dump_memory(dm == DUMP_RAM);
     }
 
@@ -790,15 +807,26 @@ void vsync_screen(void)
         fflush(tracef); /* So we don't buffer indefinitely */
 }
 
-/* Used from the CPU thread context to cause a screen redraw */
+/*
+ * Used from the CPU thread context to cause a screen redraw, if
+ * anything has changed since the last one
+ */
 static void trigger_refresh(void)
 {
     SDL_Event trigger_redraw;
+    bool changed;
 
     SDL_mutexP(screen_mutex);
-    xfr = cpu;
+    changed = mem_dirty_fetch(MEM_DIRTY_SCREEN, MEM_DIRTY_VIDEO,
+                              MEM_DIRTY_VIDEO_PAGES) ||
+              memcmp(&xfr, &cpu, offsetof(struct video_state, vram));
+    if (changed)
+        xfr = cpu;
     SDL_mutexV(screen_mutex);
 
+    if (!changed)
+        return;
+
     memset(&trigger_redraw, 0, sizeof trigger_redraw);
     trigger_redraw.type = SDL_USEREVENT;
     SDL_PushEvent(&trigger_redraw);
@@ -98,6 +98,27 @@ int printer_in(int sel, int port)
     return v;
 }
 
+/* Block transfers through port 0 (see z80_out_block() and z80_in_block()) */
+size_t printer_out_block(int sel, const uint8_t* buf, size_t count)
+{
+    (void)sel;
+
+    abcprint_recv(buf, count);
+    return count;
+}
+
+size_t printer_in_block(int sel, uint8_t* buf, size_t count)
+{
+    size_t done;
+
+    (void)sel;
+
+    for (done = 0; done < count && abcprint_poll(); done++)
+        buf[done] = abcprint_read();
+
+    return done;
+}
+
 /* Hardware-like interface via the ABC800 PR: port */
 static uint8_t dart_pr_ctl[8];
 
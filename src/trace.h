@@ -13,7 +13,9 @@ enum tracing
     TRACE_DISK = 0x04,
     TRACE_CAS = 0x08,
     TRACE_PR = 0x10,
-    TRACE_ALL = 0x1f
+    TRACE_BASIC = 0x20,
+    TRACE_PACE = 0x40,
+    TRACE_ALL = 0x7f
 };
 
 extern int traceflags;
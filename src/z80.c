@@ -26,13 +26,197 @@
  * please do send a report.
  */
 #include "z80.h"
+#include "abcio.h"
+#include "abcmem.h"
+#include "hostfile.h"
+#include "profile.h"
 #include "z80irq.h"
+#include "z80jit.h"
 
 /*
  * The state of our Z-80 registers is kept in this structure:
  */
 struct z80_state_struct z80_state;
 
+/*
+ * Opcode statistics, with Z80_OPSTATS: how many times each opcode in
+ * each group ran, how many times the block instructions went round
+ * again, and the T-states spent in each group.  The slot for an
+ * instruction is worked out when decoding it.  T-states are only added
+ * up when the group changes, which is seldom, and those outside the
+ * instructions (interrupts, HALT and translated code) go in OPS_OTHER.
+ * Only the CPU thread touches these.
+ */
+#if Z80_OPSTATS
+enum opstat_group
+{
+    OPS_MAIN,
+    OPS_CB,
+    OPS_ED,
+    OPS_DD,
+    OPS_FD,
+    OPS_DDCB,
+    OPS_FDCB,
+    OPS_GROUPS,
+    OPS_OTHER = OPS_GROUPS /* Only for T-states */
+};
+
+static struct
+{
+    uint64_t count[OPS_GROUPS << 8];
+    uint64_t repeats[OPS_GROUPS << 8];
+    uint64_t tstates[OPS_OTHER + 1];
+    unsigned int group; /* Running since start */
+    uint64_t start;
+} opstats = {{0}, {0}, {0}, OPS_OTHER, 0};
+
+static cold_func void opstat_group(unsigned int group, uint64_t now)
+{
+    opstats.tstates[opstats.group] += now - opstats.start;
+    opstats.group = group;
+    opstats.start = now;
+}
+
+static inline void opstat_next(unsigned int slot, uint64_t now)
+{
+    if (unlikely(slot >> 8 != opstats.group))
+        opstat_group(slot >> 8, now);
+    opstats.count[slot]++;
+}
+
+static inline void opstat_other(uint64_t now)
+{
+    if (opstats.group != OPS_OTHER)
+        opstat_group(OPS_OTHER, now);
+}
+
+/* op is the ED opcode of the incrementing version */
+static inline void opstat_repeats(uint8_t op, int dir, unsigned int n)
+{
+    opstats.repeats[OPS_ED << 8 | op | (dir < 0 ? 8 : 0)] += n;
+}
+
+/*
+ * Write the statistics as CSV: a line per opcode that has run, then the
+ * totals per group.  Called on the CPU thread.
+ */
+void z80_opstats_dump(void)
+{
+    /* Name, opcode prefix and DAsm() table and index register */
+    static const struct
+    {
+        const char* name;
+        const char* prefix;
+        int table;
+        char xreg;
+    } groups[OPS_GROUPS] = {
+        {"main", "", 0, '?'},   {"CB", "CB", 1, '?'},
+        {"ED", "ED", 2, '?'},   {"DD", "DD", 4, 'X'},
+        {"FD", "FD", 4, 'Y'},   {"DDCB", "DDCB", 5, 'X'},
+        {"FDCB", "FDCB", 5, 'Y'}};
+    uint64_t count, repeats;
+    struct host_file* hf;
+    unsigned int g, op, slot;
+    char mnemonic[64];
+
+    hf = dump_file(HF_TEXT, memdump_path, "opstats%04u.csv");
+    if (!hf)
+        return;
+
+    opstat_group(opstats.group, TSTATE); /* Up to date */
+
+    fprintf(hf->f, "group,opcode,mnemonic,count,repeats,tstates\n");
+    for (g = 0; g < OPS_GROUPS; g++) {
+        for (op = 0; op < 256; op++) {
+            slot = g << 8 | op;
+            if (!opstats.count[slot])
+                continue;
+            z80_opcode_name(mnemonic, groups[g].table, groups[g].xreg, op);
+            fprintf(hf->f, "%s,%s%02X,\"%s\",%" PRIu64 ",%" PRIu64 ",\n",
+                    groups[g].name, groups[g].prefix, op, mnemonic,
+                    opstats.count[slot], opstats.repeats[slot]);
+        }
+    }
+
+    for (g = 0; g < OPS_GROUPS; g++) {
+        count = repeats = 0;
+        for (op = 0; op < 256; op++) {
+            count += opstats.count[g << 8 | op];
+            repeats += opstats.repeats[g << 8 | op];
+        }
+        fprintf(hf->f,
+                "%s,,\"(total)\",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                groups[g].name, count, repeats, opstats.tstates[g]);
+    }
+    fprintf(hf->f, "other,,\"(interrupts, HALT, translated code)\",,,%" PRIu64
+            "\n", opstats.tstates[OPS_OTHER]);
+
+    if (!ferror(hf->f))
+        keep_file(hf);
+
+    close_file(&hf);
+}
+#else
+#    define opstat_next(slot, now) ((void)0)
+#    define opstat_other(now) ((void)0)
+#    define opstat_repeats(op, dir, n) ((void)0)
+
+void z80_opstats_dump(void)
+{
+}
+#endif
+
+/*
+ * Memory accesses from the CPU, recorded for the trace if TRACED.  This
+ * checks the trace flags, except in the CPU loop (see z80loop.h.)
+ * Reads are also looked at by read watchpoints, if there are any.
+ */
+#define TRACED tracing(TRACE_CPU)
+
+static inline uint8_t cpu_mem_read(uint16_t address, bool traced)
+{
+    uint8_t value = mem_read_notrace(address);
+
+    if (traced)
+        mem_trace(address, value, 1, false);
+    if (unlikely(mem_watch_reads))
+        mem_watch_read(address, value);
+    return value;
+}
+
+static inline uint16_t cpu_mem_read_word(uint16_t address, bool traced)
+{
+    uint16_t value = mem_read_word_notrace(address);
+
+    if (traced)
+        mem_trace(address, value, 2, false);
+    if (unlikely(mem_watch_reads)) {
+        mem_watch_read(address, value);
+        mem_watch_read(address + 1, value >> 8);
+    }
+    return value;
+}
+
+static inline void cpu_mem_write(uint16_t address, uint8_t value, bool traced)
+{
+    if (traced)
+        mem_trace(address, value, 1, true);
+    mem_write_notrace(address, value);
+}
+
+static inline void cpu_mem_write_word(uint16_t address, uint16_t value,
+                                      bool traced)
+{
+    if (traced)
+        mem_trace(address, value, 2, true);
+    mem_write_word_notrace(address, value);
+}
+
+#define mem_read(a) cpu_mem_read(a, TRACED)
+#define mem_read_word(a) cpu_mem_read_word(a, TRACED)
+#define mem_write(a, v) cpu_mem_write(a, v, TRACED)
+#define mem_write_word(a, v) cpu_mem_write_word(a, v, TRACED)
+
 static void diffstate(void);
 
 /*
@@ -162,6 +346,85 @@ static int parity(unsigned value)
     return (parity_table[value]);
 }
 
+/*
+ * Flag lookup tables, filled in once by init_flag_tables().  None of
+ * them include bits 3 and 5 of F, which are left as they are.
+ */
+static uint8_t szp_table[256];         /* sign, zero and parity of a byte */
+static uint8_t inc_table[256];         /* flags after INC, except carry */
+static uint8_t dec_table[256];         /* flags after DEC, except carry */
+static uint8_t add_table[2][256][256]; /* [carry][a][b] for ADD, ADC */
+static uint8_t sub_table[2][256][256]; /* [carry][a][b] for SUB, SBC, CP */
+static uint16_t daa_table[0x800];      /* [A, C, N, H] -> A and flags */
+
+/*
+ * Lazy flags: most flag results are overwritten before anything looks
+ * at them, so with Z80_LAZY_FLAGS the operations above only remember
+ * which table entry holds their flags.  F is brought up to date the
+ * next time it is used through REG_F or REG_AF (conditional jumps,
+ * PUSH AF, ADC etc.), before tracing and translated code, and when
+ * z80_run_until() returns.  Off by default, since with the flag tables the
+ * bookkeeping costs about as much as it saves on the BASIC ROMs.
+ */
+#ifndef Z80_LAZY_FLAGS
+#    define Z80_LAZY_FLAGS 0
+#endif
+
+#if Z80_LAZY_FLAGS
+static struct
+{
+    const uint8_t* flags; /* table entry with the new flags, or NULL */
+    uint8_t keep;         /* bits of F left alone by the operation */
+    uint8_t set;          /* extra flags to set */
+} lazy;
+
+static inline void sync_flags(void)
+{
+    if (lazy.flags) {
+        z80_state.af.byte.low =
+            (z80_state.af.byte.low & lazy.keep) | *lazy.flags | lazy.set;
+        lazy.flags = NULL;
+    }
+}
+
+static inline uint8_t* flags_reg(void)
+{
+    sync_flags();
+    return &z80_state.af.byte.low;
+}
+
+static inline uint16_t* af_reg(void)
+{
+    sync_flags();
+    return &z80_state.af.word;
+}
+
+#    undef REG_F
+#    define REG_F (*flags_reg())
+#    undef REG_AF
+#    define REG_AF (*af_reg())
+
+/*
+ * An operation which keeps some of the flags needs the previous ones
+ * in place first.
+ */
+#    define SET_FLAGS(entry, keep_mask, set_mask)                              \
+        do {                                                                   \
+            if ((uint8_t)(keep_mask) & ALL_FLAGS_MASK)                         \
+                sync_flags();                                                  \
+            lazy.flags = &(entry);                                             \
+            lazy.keep = (uint8_t)(keep_mask);                                  \
+            lazy.set = (set_mask);                                             \
+        } while (0)
+#else
+static inline void sync_flags(void)
+{
+}
+
+#    define SET_FLAGS(entry, keep_mask, set_mask)                              \
+        (REG_F = (REG_F & (keep_mask)) | (entry) | (set_mask))
+#endif
+
 static void add_r(uint8_t jump)
 {
     z80_state.rc += jump;
@@ -172,13 +435,13 @@ static void inc_r(void)
     add_r(1);
 }
 
-static void do_add_flags(int a, int b, int result)
+static uint8_t add_flags(int a, int b, int result)
 {
     /*
      * Compute the flag values for a + b = result operation
      */
     int index;
-    int f;
+    uint8_t f;
 
     /*
      * sign, carry, and overflow depend upon values of bit 7.
@@ -187,22 +450,19 @@ static void do_add_flags(int a, int b, int result)
      * up the flag values in the above tables.
      */
 
-    f = REG_F & ~(SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | OVERFLOW_MASK |
-                  SUBTRACT_MASK | CARRY_MASK);
-
     index = ((a & 0x88) >> 1) | ((b & 0x88) >> 2) | ((result & 0x88) >> 3);
-    f |= half_carry_table[index & 7] | sign_carry_overflow_table[index >> 4];
+    f = half_carry_table[index & 7] | sign_carry_overflow_table[index >> 4];
 
     if ((result & 0xFF) == 0)
         f |= ZERO_MASK;
 
-    REG_F = f;
+    return f;
 }
 
-static void do_sub_flags(int a, int b, int result)
+static uint8_t sub_flags(int a, int b, int result)
 {
     int index;
-    int f;
+    uint8_t f;
 
     /*
      * sign, carry, and overflow depend upon values of bit 7.
@@ -211,17 +471,14 @@ static void do_sub_flags(int a, int b, int result)
      * up the flag values in the above tables.
      */
 
-    f = (REG_F | SUBTRACT_MASK) &
-        ~(SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | OVERFLOW_MASK | CARRY_MASK);
-
     index = ((a & 0x88) >> 1) | ((b & 0x88) >> 2) | ((result & 0x88) >> 3);
-    f |= subtract_half_carry_table[index & 7] |
-         subtract_sign_carry_overflow_table[index >> 4];
+    f = SUBTRACT_MASK | subtract_half_carry_table[index & 7] |
+        subtract_sign_carry_overflow_table[index >> 4];
 
     if ((result & 0xFF) == 0)
         f |= ZERO_MASK;
 
-    REG_F = f;
+    return f;
 }
 
 static void do_adc_word_flags(int a, int b, int result)
@@ -302,41 +559,12 @@ static void do_sbc_word_flags(int a, int b, int result)
 
 static void do_flags_dec_byte(int value)
 {
-    uint8_t clear, set;
-
-    clear = OVERFLOW_MASK | HALF_CARRY_MASK | ZERO_MASK | SIGN_MASK;
-    set = SUBTRACT_MASK;
-
-    if (value == 0x7f)
-        set |= OVERFLOW_MASK;
-    if ((value & 0xF) == 0xF)
-        set |= HALF_CARRY_MASK;
-    if (value == 0)
-        set |= ZERO_MASK;
-    if (value & 0x80)
-        set |= SIGN_MASK;
-
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(dec_table[value & 0xFF], ~(ALL_FLAGS_MASK & ~CARRY_MASK), 0);
 }
 
 static void do_flags_inc_byte(int value)
 {
-    uint8_t clear, set;
-
-    clear =
-        SUBTRACT_MASK | OVERFLOW_MASK | HALF_CARRY_MASK | ZERO_MASK | SIGN_MASK;
-    set = 0;
-
-    if (value == 0x80)
-        set |= OVERFLOW_MASK;
-    if ((value & 0xF) == 0)
-        set |= HALF_CARRY_MASK;
-    if (value == 0)
-        set |= ZERO_MASK;
-    if (value & 0x80)
-        set |= SIGN_MASK;
-
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(inc_table[value & 0xFF], ~(ALL_FLAGS_MASK & ~CARRY_MASK), 0);
 }
 
 /*
@@ -345,117 +573,62 @@ static void do_flags_inc_byte(int value)
  */
 static void do_and_byte(int value)
 {
-    int result;
-    uint8_t clear, set;
-
-    result = (REG_A &= value);
-
-    clear = CARRY_MASK | SUBTRACT_MASK | PARITY_MASK | ZERO_MASK | SIGN_MASK;
-    set = HALF_CARRY_MASK;
-
-    if (parity(result))
-        set |= PARITY_MASK;
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (result & 0x80)
-        set |= SIGN_MASK;
-
-    REG_F = (REG_F & ~clear) | set;
+    REG_A &= value;
+    SET_FLAGS(szp_table[REG_A], ~ALL_FLAGS_MASK, HALF_CARRY_MASK);
 }
 
 static void do_or_byte(int value)
 {
-    int result; /* the result of the or operation */
-    uint8_t clear, set;
-
-    result = (REG_A |= value);
-
-    clear = CARRY_MASK | SUBTRACT_MASK | PARITY_MASK | HALF_CARRY_MASK |
-            ZERO_MASK | SIGN_MASK;
-    set = 0;
-
-    if (parity(result))
-        set |= PARITY_MASK;
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (result & 0x80)
-        set |= SIGN_MASK;
-
-    REG_F = (REG_F & ~clear) | set;
+    REG_A |= value;
+    SET_FLAGS(szp_table[REG_A], ~ALL_FLAGS_MASK, 0);
 }
 
 static void do_xor_byte(int value)
 {
-    int result; /* the result of the xor operation */
-    uint8_t clear, set;
-
-    result = (REG_A ^= value);
-
-    clear = CARRY_MASK | SUBTRACT_MASK | PARITY_MASK | HALF_CARRY_MASK |
-            ZERO_MASK | SIGN_MASK;
-    set = 0;
-
-    if (parity(result))
-        set |= PARITY_MASK;
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (result & 0x80)
-        set |= SIGN_MASK;
-
-    REG_F = (REG_F & ~clear) | set;
+    REG_A ^= value;
+    SET_FLAGS(szp_table[REG_A], ~ALL_FLAGS_MASK, 0);
 }
 
 static void do_add_byte(int value)
 {
-    int a, result;
+    uint8_t a = REG_A;
 
-    result = (a = REG_A) + value;
-    REG_A = result;
-    do_add_flags(a, value, result);
+    REG_A = a + value;
+    SET_FLAGS(add_table[0][a][value & 0xFF], ~ALL_FLAGS_MASK, 0);
 }
 
 static void do_adc_byte(int value)
 {
-    int a, result;
+    uint8_t a = REG_A;
+    int carry = CARRY_FLAG;
 
-    if (CARRY_FLAG)
-        result = (a = REG_A) + value + 1;
-    else
-        result = (a = REG_A) + value;
-    REG_A = result;
-    do_add_flags(a, value, result);
+    REG_A = a + value + carry;
+    SET_FLAGS(add_table[carry][a][value & 0xFF], ~ALL_FLAGS_MASK, 0);
 }
 
 static void do_sub_byte(int value)
 {
-    int a, result;
+    uint8_t a = REG_A;
 
-    result = (a = REG_A) - value;
-    REG_A = result;
-    do_sub_flags(a, value, result);
+    REG_A = a - value;
+    SET_FLAGS(sub_table[0][a][value & 0xFF], ~ALL_FLAGS_MASK, 0);
 }
 
 static void do_negate(void)
 {
-    int a;
+    uint8_t a = REG_A;
 
-    a = REG_A;
     REG_A = -a;
-    do_sub_flags(0, a, REG_A);
-    if (a == 0)
-        REG_F |= CARRY_MASK;
+    SET_FLAGS(sub_table[0][0][a], ~ALL_FLAGS_MASK, a == 0 ? CARRY_MASK : 0);
 }
 
 static void do_sbc_byte(int value)
 {
-    int a, result;
+    uint8_t a = REG_A;
+    int carry = CARRY_FLAG;
 
-    if (CARRY_FLAG)
-        result = (a = REG_A) - (value + 1);
-    else
-        result = (a = REG_A) - value;
-    REG_A = result;
-    do_sub_flags(a, value, result);
+    REG_A = a - value - carry;
+    SET_FLAGS(sub_table[carry][a][value & 0xFF], ~ALL_FLAGS_MASK, 0);
 }
 
 static void do_adc_word(int value)
@@ -498,10 +671,64 @@ static void do_add_word(wordregister* ix, int value)
 
 static void do_cp(int value) /* compare this value with A's contents */
 {
-    int a, result;
+    SET_FLAGS(sub_table[0][REG_A][value & 0xFF], ~ALL_FLAGS_MASK, 0);
+}
+
+/*
+ * The repeated block instructions run as many iterations as they can
+ * in one go, rather than once per pass through the CPU loop, as long
+ * as nothing could have happened in between: not single stepping, no
+ * tracing, no interrupt waiting to be taken, and not past the
+ * deadline of z80_run_until().  Returns the number of iterations, of
+ * 21 T-states each, out of count remaining which can be run ahead of
+ * the last one.
+ */
+uint64_t z80_run_deadline; /* Set by z80_run_until(), see z80_shorten_run() */
+
+static inline bool nmi_pending(void)
+{
+    return z80_state.nminterrupt && !z80_state.nmi_in_progress;
+}
+
+static inline bool int_pending(void)
+{
+    return z80_state.iff1 && !z80_state.ei_shadow && poll_irq();
+}
+
+static unsigned int block_run_ahead(unsigned int count)
+{
+    uint64_t deadline;
+    unsigned int n;
+
+    if (tracing(TRACE_CPU) || nmi_pending() || int_pending())
+        return 0;
+
+    deadline = z80_run_deadline;
+    if (deadline <= TSTATE)
+        return 0;
+
+    n = count - 1;
+    if ((deadline - TSTATE) / 21 < n)
+        n = (deadline - TSTATE) / 21;
+    return n;
+}
 
-    result = (a = REG_A) - value;
-    do_sub_flags(a, value, result);
+/*
+ * Limit n iterations writing to addr onwards in the direction dir so
+ * that they stop short of the instruction itself, since overwriting
+ * that changes what runs next.
+ */
+static unsigned int block_clear_of_insn(uint16_t addr, int dir,
+                                        unsigned int n)
+{
+    unsigned int i, len;
+
+    for (i = 1; i <= 2; i++) {
+        len = (uint16_t)(dir > 0 ? REG_PC - i - addr : addr - (REG_PC - i));
+        if (len < n)
+            n = len;
+    }
+    return n;
 }
 
 /* dir == 1 for CPI, -1 for CPD */
@@ -517,12 +744,62 @@ static void do_cpid(int dir)
         SET_OVERFLOW();
 }
 
+/*
+ * Skip up to n bytes not matching A for CPIR/CPDR; returns the number
+ * skipped.  The flags are left to the next CPI/CPD, which sets them all.
+ */
+static unsigned int cpid_bulk(int dir, unsigned int n)
+{
+    unsigned int done, offs, len, i;
+    const uint8_t* p;
+    const uint8_t* match;
+
+    if (mem_watch_reads)
+        return 0;
+
+    for (done = 0; done < n; done += len) {
+        offs = REG_HL & MEM_PAGE_MASK;
+        p = &mem_view->read[REG_HL >> MEM_PAGE_SHIFT][offs];
+
+        if (dir > 0) {
+            len = MEM_PAGE_SIZE - offs;
+            if (len > n - done)
+                len = n - done;
+            match = memchr(p, REG_A, len);
+            i = match ? (unsigned int)(match - p) : len;
+        } else {
+            len = offs + 1;
+            if (len > n - done)
+                len = n - done;
+            for (i = 0; i < len && p[-(int)i] != REG_A; i++)
+                ;
+        }
+
+        REG_HL += dir * (int)i;
+        REG_BC -= i;
+        if (i < len)
+            return done + i;
+    }
+
+    return done;
+}
+
 /* dir == 1 for CPIR, -1 for CPDR */
 static void do_cpidr(int dir)
 {
+    unsigned int n = block_run_ahead(REG_BC ? REG_BC : 0x10000);
+
+    if (n) {
+        n = cpid_bulk(dir, n);
+        TSTATE += 21 * n;
+        add_r(2 * n);
+        opstat_repeats(0xb1, dir, n);
+    }
+
     do_cpid(dir);
 
     if (REG_BC != 0 && !ZERO_FLAG) {
+        opstat_repeats(0xb1, dir, 1);
         TSTATE += 5;
         REG_PC -= 2;
     }
@@ -548,29 +825,9 @@ static int rl_byte(int value)
      * operation, setting flags as appropriate.
      */
 
-    uint8_t clear, set;
-    int result;
-
-    clear = SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK |
-            SUBTRACT_MASK | CARRY_MASK;
-    set = 0;
-
-    if (CARRY_FLAG) {
-        result = ((value << 1) & 0xFF) | 1;
-    } else {
-        result = (value << 1) & 0xFF;
-    }
-
-    if (result & 0x80)
-        set |= SIGN_MASK;
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (parity(result))
-        set |= PARITY_MASK;
-    if (value & 0x80)
-        set |= CARRY_MASK;
+    int result = ((value << 1) | CARRY_FLAG) & 0xFF;
 
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[result], ~ALL_FLAGS_MASK, value >> 7);
 
     return result;
 }
@@ -582,29 +839,9 @@ static int rr_byte(int value)
      * operation, setting flags as appropriate.
      */
 
-    uint8_t clear, set;
-    int result;
-
-    clear = SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK |
-            SUBTRACT_MASK | CARRY_MASK;
-    set = 0;
-
-    if (CARRY_FLAG) {
-        result = (value >> 1) | 0x80;
-    } else {
-        result = (value >> 1);
-    }
-
-    if (result & 0x80)
-        set |= SIGN_MASK;
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (parity(result))
-        set |= PARITY_MASK;
-    if (value & 0x1)
-        set |= CARRY_MASK;
+    int result = (value >> 1) | (CARRY_FLAG << 7);
 
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[result], ~ALL_FLAGS_MASK, value & 0x1);
 
     return result;
 }
@@ -616,56 +853,18 @@ static int rlc_byte(int value)
      * This does not do the right thing for the RLCA instruction.
      */
 
-    uint8_t clear, set;
-    int result;
-
-    clear = SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK |
-            SUBTRACT_MASK | CARRY_MASK;
-    set = 0;
-
-    if (value & 0x80) {
-        result = ((value << 1) & 0xFF) | 1;
-        set |= CARRY_MASK;
-    } else {
-        result = (value << 1) & 0xFF;
-    }
-
-    if (result & 0x80)
-        set |= SIGN_MASK;
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (parity(result))
-        set |= PARITY_MASK;
+    int result = ((value << 1) | (value >> 7)) & 0xFF;
 
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[result], ~ALL_FLAGS_MASK, value >> 7);
 
     return result;
 }
 
 static int rrc_byte(int value)
 {
-    uint8_t clear, set;
-    int result;
-
-    clear = SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK |
-            SUBTRACT_MASK | CARRY_MASK;
-    set = 0;
-
-    if (value & 0x1) {
-        result = (value >> 1) | 0x80;
-        set |= CARRY_MASK;
-    } else {
-        result = (value >> 1); /* fixed /jonas-y */
-    }
-
-    if (result & 0x80)
-        set |= SIGN_MASK;
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (parity(result))
-        set |= PARITY_MASK;
+    int result = (value >> 1) | ((value & 0x1) << 7);
 
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[result], ~ALL_FLAGS_MASK, value & 0x1);
 
     return result;
 }
@@ -745,25 +944,9 @@ static void do_rrca(void)
 
 static int sla_byte(int value)
 {
-    uint8_t clear, set;
-    int result;
-
-    clear = SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK |
-            SUBTRACT_MASK | CARRY_MASK;
-    set = 0;
-
-    result = value << 1;
+    int result = (value << 1) & 0xFF;
 
-    if (result & 0x80)
-        set |= SIGN_MASK;
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (parity(result))
-        set |= PARITY_MASK;
-    if (value & 0x80)
-        set |= CARRY_MASK;
-
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[result], ~ALL_FLAGS_MASK, value >> 7);
 
     return result;
 }
@@ -771,78 +954,27 @@ static int sla_byte(int value)
 /* SLL is an undocumented instruction which shifts left and sets the LSB */
 static int sll_byte(int value)
 {
-    uint8_t clear, set;
-    int result;
-
-    clear = SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK |
-            SUBTRACT_MASK | CARRY_MASK;
-    set = 0;
-
-    result = (value << 1) | 1;
+    int result = ((value << 1) | 1) & 0xFF;
 
-    if (result & 0x80)
-        set |= SIGN_MASK;
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (parity(result))
-        set |= PARITY_MASK;
-    if (value & 0x80)
-        set |= CARRY_MASK;
-
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[result], ~ALL_FLAGS_MASK, value >> 7);
 
     return result;
 }
 
 static int sra_byte(int value)
 {
-    uint8_t clear, set;
-    int result;
-
-    clear = SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK |
-            SUBTRACT_MASK | CARRY_MASK;
-    set = 0;
-
-    if (value & 0x80) {
-        result = (value >> 1) & 0x80;
-        set |= SIGN_MASK;
-    } else {
-        result = value >> 1;
-    }
-
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (parity(result))
-        set |= PARITY_MASK;
-    if (value & 0x1)
-        set |= CARRY_MASK;
+    int result = (value >> 1) | (value & 0x80);
 
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[result], ~ALL_FLAGS_MASK, value & 0x1);
 
     return result;
 }
 
 static int srl_byte(int value)
 {
-    uint8_t clear, set;
-    int result;
-
-    clear = SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK |
-            SUBTRACT_MASK | CARRY_MASK;
-    set = 0;
-
-    result = value >> 1;
-
-    if (result & 0x80)
-        set |= SIGN_MASK;
-    if (result == 0)
-        set |= ZERO_MASK;
-    if (parity(result))
-        set |= PARITY_MASK;
-    if (value & 0x1)
-        set |= CARRY_MASK;
+    int result = value >> 1;
 
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[result], ~ALL_FLAGS_MASK, value & 0x1);
 
     return result;
 }
@@ -862,11 +994,77 @@ static void do_ldid(int dir)
         SET_OVERFLOW();
 }
 
-static void do_ldidr(int dir)
-{
+/*
+ * Copy up to n bytes for LDIR/LDDR, as long as the destination is plain
+ * RAM or ROM; returns the number copied.  Overlapping copies are done a
+ * byte at a time, like the Z80 does them.
+ */
+static unsigned int ldid_bulk(int dir, unsigned int n)
+{
+    unsigned int done, soffs, doffs, len, i;
+    const uint8_t* src;
+    uint8_t* dst;
+
+    n = block_clear_of_insn(REG_DE, dir, n);
+    if (mem_watch_reads)
+        return 0;
+
+    for (done = 0; done < n; done += len) {
+        dst = mem_view->write[REG_DE >> MEM_PAGE_SHIFT];
+        if (!dst)
+            break;
+
+        soffs = REG_HL & MEM_PAGE_MASK;
+        doffs = REG_DE & MEM_PAGE_MASK;
+        src = &mem_view->read[REG_HL >> MEM_PAGE_SHIFT][soffs];
+        dst += doffs;
+        *mem_view->dirty[REG_DE >> MEM_PAGE_SHIFT] = MEM_DIRTY_ALL;
+
+        if (dir > 0) {
+            len = MEM_PAGE_SIZE - (soffs > doffs ? soffs : doffs);
+            if (len > n - done)
+                len = n - done;
+            if (dst > src && dst < src + len) {
+                for (i = 0; i < len; i++)
+                    dst[i] = src[i];
+            } else {
+                memmove(dst, src, len);
+            }
+        } else {
+            len = (soffs < doffs ? soffs : doffs) + 1;
+            if (len > n - done)
+                len = n - done;
+            if (dst < src && dst > src - len) {
+                for (i = 0; i < len; i++)
+                    dst[-(int)i] = src[-(int)i];
+            } else {
+                memmove(dst - (len - 1), src - (len - 1), len);
+            }
+        }
+
+        REG_HL += dir * (int)len;
+        REG_DE += dir * (int)len;
+        REG_BC -= len;
+    }
+
+    return done;
+}
+
+static void do_ldidr(int dir)
+{
+    unsigned int n = block_run_ahead(REG_BC ? REG_BC : 0x10000);
+
+    if (n) {
+        n = ldid_bulk(dir, n);
+        TSTATE += 21 * n;
+        add_r(2 * n);
+        opstat_repeats(0xb0, dir, n);
+    }
+
     do_ldid(dir);
 
     if (REG_BC != 0) {
+        opstat_repeats(0xb0, dir, 1);
         TSTATE += 5;
         REG_PC -= 2;
     }
@@ -878,25 +1076,21 @@ static void do_ld_a_ir(uint8_t val)
 
     clear =
         SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | OVERFLOW_MASK | SUBTRACT_MASK;
-    set = 0;
 
     REG_A = val;
 
-    if (REG_A & 0x80)
-        set |= SIGN_MASK;
-    if (REG_A == 0)
-        set |= ZERO_MASK;
-
+    set = szp_table[val] & (SIGN_MASK | ZERO_MASK);
     if (z80_state.iff2)
         set |= OVERFLOW_MASK;
 
     REG_F = (REG_F & ~clear) | set;
 }
 
-static void do_daa(void)
+static void compute_daa(void)
 {
     /*
      * The bizzare decimal-adjust-accumulator instruction....
+     * Only used to fill in daa_table.
      */
 
     int high_nibble, low_nibble, add, carry, subtract_flag;
@@ -1000,17 +1194,72 @@ static void do_daa(void)
         CLEAR_CARRY();
 }
 
+static void do_daa(void)
+{
+    int index = REG_A | (REG_F & (CARRY_MASK | SUBTRACT_MASK)) << 8 |
+                (REG_F & HALF_CARRY_MASK) << 6;
+    uint16_t af = daa_table[index];
+
+    REG_A = af >> 8;
+    REG_F = (REG_F & ~ALL_FLAGS_MASK) | (af & 0xFF);
+}
+
+static void init_flag_tables(void)
+{
+    static bool initialized;
+    uint16_t saved_af;
+    int a, b, c;
+
+    if (initialized)
+        return;
+
+    for (a = 0; a < 256; a++) {
+        uint8_t szp = a & SIGN_MASK;
+
+        if (a == 0)
+            szp |= ZERO_MASK;
+        if (parity(a))
+            szp |= PARITY_MASK;
+        szp_table[a] = szp;
+
+        inc_table[a] = (szp & ~PARITY_MASK) | (a == 0x80 ? OVERFLOW_MASK : 0) |
+                       ((a & 0xF) == 0 ? HALF_CARRY_MASK : 0);
+        dec_table[a] = (szp & ~PARITY_MASK) | SUBTRACT_MASK |
+                       (a == 0x7f ? OVERFLOW_MASK : 0) |
+                       ((a & 0xF) == 0xF ? HALF_CARRY_MASK : 0);
+
+        for (b = 0; b < 256; b++) {
+            for (c = 0; c < 2; c++) {
+                add_table[c][a][b] = add_flags(a, b, a + b + c);
+                sub_table[c][a][b] = sub_flags(a, b, a - b - c);
+            }
+        }
+    }
+
+    /* DAA depends on too many cases to redo here, so just run it */
+    saved_af = REG_AF;
+    for (a = 0; a < 0x800; a++) {
+        REG_A = a;
+        REG_F = ((a >> 8) & (CARRY_MASK | SUBTRACT_MASK)) |
+                ((a >> 6) & HALF_CARRY_MASK);
+        compute_daa();
+        daa_table[a] = (REG_A << 8) | (REG_F & ALL_FLAGS_MASK);
+    }
+    REG_AF = saved_af;
+
+    initialized = true;
+}
+
 static void do_rld(void)
 {
     /*
      * Rotate-left-decimal.
      */
     int old_value, new_value;
-    uint8_t clear, set;
+    uint8_t clear;
 
     clear =
         SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK | SUBTRACT_MASK;
-    set = 0;
 
     old_value = mem_read(REG_HL);
 
@@ -1020,14 +1269,7 @@ static void do_rld(void)
     /* rotate high bits of old value into low bits of a */
     REG_A = (REG_A & 0xf0) | (old_value >> 4);
 
-    if (REG_A & 0x80)
-        set |= SIGN_MASK;
-    if (REG_A == 0)
-        set |= ZERO_MASK;
-    if (parity(REG_A))
-        set |= PARITY_MASK;
-
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[REG_A], ~clear, 0);
     mem_write(REG_HL, new_value);
 }
 
@@ -1037,11 +1279,10 @@ static void do_rrd(void)
      * Rotate-right-decimal.
      */
     int old_value, new_value;
-    uint8_t clear, set;
+    uint8_t clear;
 
     clear =
         SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK | SUBTRACT_MASK;
-    set = 0;
 
     old_value = mem_read(REG_HL);
 
@@ -1051,14 +1292,7 @@ static void do_rrd(void)
     /* rotate low bits of old value into low bits of a */
     REG_A = (REG_A & 0xf0) | (old_value & 0x0f);
 
-    if (REG_A & 0x80)
-        set |= SIGN_MASK;
-    if (REG_A == 0)
-        set |= ZERO_MASK;
-    if (parity(REG_A))
-        set |= PARITY_MASK;
-
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[REG_A], ~clear, 0);
     mem_write(REG_HL, new_value);
 }
 
@@ -1082,9 +1316,27 @@ static void do_inid(int dir)
 
 static void do_inidr(int dir)
 {
+    uint8_t buf[256];
+    unsigned int n, i;
+
+    n = block_run_ahead(REG_B ? REG_B : 256);
+    n = block_clear_of_insn(REG_HL, dir, n);
+    if (n) {
+        n = z80_in_block(REG_C, buf, n);
+        for (i = 0; i < n; i++) {
+            mem_write(REG_HL, buf[i]);
+            REG_HL += dir;
+        }
+        REG_B -= n;
+        TSTATE += 21 * n;
+        add_r(2 * n);
+        opstat_repeats(0xb2, dir, n);
+    }
+
     do_inid(dir);
 
     if (REG_B != 0) {
+        opstat_repeats(0xb2, dir, 1);
         TSTATE += 5;
         REG_PC -= 2;
     }
@@ -1098,24 +1350,16 @@ static int in_with_flags(int port)
      */
 
     int value;
-    uint8_t clear, set;
+    uint8_t clear;
 
     clear =
         SIGN_MASK | ZERO_MASK | HALF_CARRY_MASK | PARITY_MASK | SUBTRACT_MASK;
-    set = 0;
 
     value = z80_in(port);
 
-    if (value & 0x80)
-        set |= SIGN_MASK;
-    if (value == 0)
-        set |= ZERO_MASK;
-    if (parity(value))
-        set |= PARITY_MASK;
-
     /* What should the half-carry do?  Is this a mistake? */
 
-    REG_F = (REG_F & ~clear) | set;
+    SET_FLAGS(szp_table[value], ~clear, 0);
 
     return value;
 }
@@ -1136,9 +1380,25 @@ static void do_outid(int dir)
 
 static void do_outidr(int dir)
 {
+    uint8_t buf[256];
+    unsigned int n, i;
+
+    n = block_run_ahead(REG_B ? REG_B : 256);
+    if (n) {
+        for (i = 0; i < n; i++)
+            buf[i] = mem_read((uint16_t)(REG_HL + dir * (int)i));
+        n = z80_out_block(REG_C, buf, n);
+        REG_HL += dir * (int)n;
+        REG_B -= n;
+        TSTATE += 21 * n;
+        add_r(2 * n);
+        opstat_repeats(0xb3, dir, n);
+    }
+
     do_outid(dir);
 
     if (REG_B != 0) {
+        opstat_repeats(0xb3, dir, 1);
         TSTATE += 5;
         REG_PC -= 2;
     }
@@ -1157,6 +1417,7 @@ static void do_ei(void)
 {
     z80_state.iff1 = z80_state.iff2 = true;
     z80_state.ei_shadow = true;
+    z80_attention(Z80_ATTN_IRQ); /* Look again after the next instruction */
 }
 
 static void do_im0(void)
@@ -1248,2322 +1509,2154 @@ static void do_int(void)
     inc_r();
 }
 
-static uint16_t get_hl_addr(wordregister* ix)
+/*
+ * Instruction decoding.
+ *
+ * Instructions are predecoded a straight-line block at a time into the
+ * code_page of the memory they live in (see abcmem.c), with any DD/FD
+ * prefixes folded in; the handlers then take their operands from the
+ * decoded bytes rather than fetching them from memory.  Instructions
+ * which cannot be cached (crossing a page boundary, prefix chains, or
+ * in memory which keeps getting written to) are decoded on the fly.
+ */
+#ifndef Z80_DECODE_CACHE
+#    define Z80_DECODE_CACHE 1
+#endif
+
+/*
+ * Operand bytes following each main group opcode:
+ * D = one more for a displacement if DD/FD prefixed
+ * J = may transfer control, ends a block
+ * X = uses HL, so DD/FD make it use IX/IY instead
+ *
+ * The CB and ED sub-opcodes count as operands here.
+ */
+#define D 4
+#define J 8
+#define X 16
+// clang-format off
+static const uint8_t insn_operands[256] = {
+    /*        0      1      2      3      4      5      6      7      8      9      a      b      c      d      e      f */
+    /* 00 */ 0,     2,     0,     0,     0,     0,     1,     0,     0,     X,     0,     0,     0,     0,     1,     0,
+    /* 10 */ 1|J,   2,     0,     0,     0,     0,     1,     0,     1|J,   X,     0,     0,     0,     0,     1,     0,
+    /* 20 */ 1|J,   2|X,   2|X,   X,     X,     X,     1|X,   0,     1|J,   X,     2|X,   X,     X,     X,     1|X,   0,
+    /* 30 */ 1|J,   2,     2,     0,     D|X,   D|X,   1|D|X, 0,     1|J,   X,     2,     0,     0,     0,     1,     0,
+    /* 40 */ 0,     0,     0,     0,     X,     X,     D|X,   0,     0,     0,     0,     0,     X,     X,     D|X,   0,
+    /* 50 */ 0,     0,     0,     0,     X,     X,     D|X,   0,     0,     0,     0,     0,     X,     X,     D|X,   0,
+    /* 60 */ X,     X,     X,     X,     X,     X,     D|X,   X,     X,     X,     X,     X,     X,     X,     D|X,   X,
+    /* 70 */ D|X,   D|X,   D|X,   D|X,   D|X,   D|X,   J,     D|X,   0,     0,     0,     0,     X,     X,     D|X,   0,
+    /* 80 */ 0,     0,     0,     0,     X,     X,     D|X,   0,     0,     0,     0,     0,     X,     X,     D|X,   0,
+    /* 90 */ 0,     0,     0,     0,     X,     X,     D|X,   0,     0,     0,     0,     0,     X,     X,     D|X,   0,
+    /* a0 */ 0,     0,     0,     0,     X,     X,     D|X,   0,     0,     0,     0,     0,     X,     X,     D|X,   0,
+    /* b0 */ 0,     0,     0,     0,     X,     X,     D|X,   0,     0,     0,     0,     0,     X,     X,     D|X,   0,
+    /* c0 */ J,     0,     2|J,   2|J,   2|J,   0,     1,     J,     J,     J,     2|J,   1|D|X, 2|J,   2|J,   1,     J,
+    /* d0 */ J,     0,     2|J,   1,     2|J,   0,     1,     J,     J,     0,     2|J,   1,     2|J,   0,     1,     J,
+    /* e0 */ J,     X,     2|J,   X,     2|J,   X,     1,     J,     J,     J|X,   2|J,   X,     2|J,   1,     1,     J,
+    /* f0 */ J,     0,     2|J,   0,     2|J,   0,     1,     J,     J,     X,     2|J,   0,     2|J,   0,     1,     J,
+};
+// clang-format on
+#undef D
+#undef J
+#undef X
+
+/* Longest block decoded in one go */
+#define MAX_BLOCK_INSNS 32
+
+/* The instruction being executed */
+static const uint8_t* insn_bytes;
+static uint16_t insn_addr; /* Address of insn_bytes[0] */
+
+static inline uint8_t op_fetch(uint16_t address)
+{
+    return insn_bytes[(uint16_t)(address - insn_addr)];
+}
+
+static inline uint16_t op_fetch_word(uint16_t address)
 {
-    if (ix == &z80_state.hl) {
-        return ix->word;
-    } else {
-        TSTATE += 8; /* Ouch! */
-        return ix->word + (int8_t)mem_fetch(REG_PC++);
+    return op_fetch(address) + (op_fetch(address + 1) << 8);
+}
+
+/*
+ * Idle loops: wait loops which do nothing but poll memory updated by
+ * interrupt handlers, or ports without side effects, until something
+ * happens.  Their heads are configured with z80_add_idle_loop() before
+ * running the code, and dispatch to idle_loop() in the CPU loop.
+ */
+#define MAX_IDLE_LOOPS 8
+#define IDLE_LOOP Z80_DISPATCH_SPECIAL /* Dispatch for the head of one */
+
+static uint16_t idle_loops[MAX_IDLE_LOOPS];
+static unsigned int nidle_loops;
+static unsigned int idle_epoch; /* Bumped by polls and interrupts */
+bool z80_idle; /* Skipped ahead since z80_poll_external() last looked */
+
+void z80_add_idle_loop(uint16_t pc)
+{
+    if (nidle_loops < MAX_IDLE_LOOPS)
+        idle_loops[nidle_loops++] = pc;
+}
+
+static bool is_idle_loop(uint16_t pc)
+{
+    unsigned int i;
+
+    for (i = 0; i < nidle_loops; i++) {
+        if (idle_loops[i] == pc)
+            return true;
     }
+    return false;
 }
 
 /*
- * Extended instructions which have 0xCB as the first byte:
+ * Traps: routines with a native version (see hle.c), which is called
+ * instead when the CPU gets to the first instruction.  Like idle
+ * loops, they are configured with z80_add_trap() before running the
+ * code.
  */
+#define MAX_TRAPS 32
+#define TRAP (IDLE_LOOP + 1) /* Dispatch for the entry point of one */
 
-static void do_CB_instruction(wordregister* ix)
+static struct
 {
-    uint8_t instruction;
-    uint16_t addr;
-    uint8_t data;
+    uint16_t pc;
+    z80_trap_func func;
+    void* arg;
+} traps[MAX_TRAPS];
+static unsigned int ntraps;
+static bool in_trap; /* Trap functions are not reentered */
+
+void z80_add_trap(uint16_t pc, z80_trap_func func, void* arg)
+{
+    if (ntraps < MAX_TRAPS) {
+        traps[ntraps].pc = pc;
+        traps[ntraps].func = func;
+        traps[ntraps].arg = arg;
+        ntraps++;
+    }
+}
 
-    if (ix == &z80_state.hl) {
-        /*
-         * Normal operation sans DD/FD prefix
-         */
+static int find_trap(uint16_t pc)
+{
+    unsigned int i;
 
-        instruction = mem_fetch(REG_PC++);
-        inc_r();
+    for (i = 0; i < ntraps; i++) {
+        if (traps[i].pc == pc)
+            return i;
+    }
+    return -1;
+}
 
-        /* (HL) = 7 additional clocks, otherwise 4 */
-        if ((instruction & 7) == 6) {
-            TSTATE += (instruction & 0xc0) == 0x40 ? 8 : 11;
-        } else {
-            TSTATE += 4;
+/*
+ * The time taken by the routine of the last trap.  It is charged at
+ * the return address, while the stack is as it was, a slice at a time
+ * in the CPU loop, so that interrupts are not held off until the end
+ * of a long routine.  Their handlers see the results of all of it,
+ * though.  Z80_ATTN_STALL stays set meanwhile, to keep the instruction
+ * at the return address out of the fast path until it has all been
+ * charged.  Anything which leaves without pushing onto the stack, as
+ * an interrupt does, drops the rest.
+ */
+static struct
+{
+    uint64_t left;
+    uint16_t pc, sp;
+} stall;
+
+static void stall_end(void)
+{
+    stall.left = 0;
+    atomic_clear_bit(&z80_state.attention, Z80_ATTN_STALL);
+}
+
+void z80_stall(uint64_t tstates)
+{
+    stall.left = tstates;
+    stall.pc = REG_PC;
+    stall.sp = REG_SP;
+    if (tstates)
+        z80_attention(Z80_ATTN_STALL);
+}
+
+/* Charge the next slice of the stall at the current PC, if any */
+static inline bool stalled(void)
+{
+    uint64_t n;
+
+    if (likely(!stall.left))
+        return false;
+
+    if (REG_PC != stall.pc || REG_SP != stall.sp) {
+        if (REG_SP >= stall.sp) /* Not in an interrupt handler */
+            stall_end();
+        return false;
+    }
+
+    /* Up to the deadline, as HALT does, unless something is pending */
+    n = 4;
+    if (!(z80_state.attention & ~(1U << Z80_ATTN_STALL)) &&
+        z80_run_deadline > TSTATE + n)
+        n = z80_run_deadline - TSTATE;
+    if (n >= stall.left) {
+        n = stall.left;
+        stall_end();
+    } else {
+        stall.left -= n;
+    }
+    TSTATE += n;
+    return true;
+}
+
+#if Z80_OPSTATS
+/* The opcode statistics slot for an instruction, after any prefix */
+static unsigned int opstat_slot_of(uint8_t prefix, const uint8_t* bytes)
+{
+    const unsigned int group =
+        prefix == 0xdd ? OPS_DD : prefix == 0xfd ? OPS_FD : OPS_MAIN;
+
+    switch (bytes[0]) {
+    case 0xcb:
+        if (group != OPS_MAIN) /* The opcode follows the displacement */
+            return (group - OPS_DD + OPS_DDCB) << 8 | bytes[2];
+        return OPS_CB << 8 | bytes[1];
+    case 0xed:
+        return OPS_ED << 8 | bytes[1];
+    default:
+        return group << 8 | bytes[0];
+    }
+}
+#endif
+
+/*
+ * Decode the instruction at addr.  Returns true if it may transfer
+ * control.
+ */
+static bool decode_insn(uint16_t addr, struct z80_insn* insn)
+{
+    uint16_t pc = addr;
+    uint8_t op, sub, prefix = 0;
+    unsigned int i, n;
+
+    insn->index = 0;
+    insn->clk = 0;
+    insn->hits = 0;
+    insn->jit = 0;
+
+    op = mem_fetch_m1(pc++);
+    while (op == 0xdd || op == 0xfd) {
+        prefix = op;
+        insn->index = op == 0xdd ? 1 : 2;
+        insn->clk += clk_main[op];
+        op = mem_fetch(pc++);
+    }
+    insn->oplen = pc - addr;
+    insn->clk += clk_main[op];
+
+    n = insn_operands[op] & 3;
+    if (insn->index && (insn_operands[op] & 4))
+        n++;
+    if (!(insn_operands[op] & 16))
+        insn->index = 0; /* The prefix makes no difference */
+
+    insn->bytes[0] = op;
+    if (is_idle_loop(addr))
+        insn->dispatch = IDLE_LOOP;
+    else if (find_trap(addr) >= 0)
+        insn->dispatch = TRAP;
+    else
+        insn->dispatch = insn->index << 8 | op;
+    for (i = 1; i <= n; i++)
+        insn->bytes[i] = mem_fetch(pc++);
+
+#if Z80_OPSTATS
+    insn->stat = opstat_slot_of(prefix, insn->bytes);
+#else
+    (void)prefix;
+#endif
+
+    if (op == 0xed) {
+        sub = insn->bytes[1];
+        if ((sub & 0xc7) == 0x43) { /* ld (nn),rr / ld rr,(nn) */
+            insn->bytes[2] = mem_fetch(pc++);
+            insn->bytes[3] = mem_fetch(pc++);
         }
+        insn->len = pc - addr;
+        /* retn/reti, repeated block instructions */
+        return (sub & 0xc7) == 0x45 || (sub & 0xf4) == 0xb0;
+    }
 
-        switch (instruction) {
-        case 0x47: /* bit 0, a */
-            do_test_bit(REG_A, 0);
-            break;
-        case 0x40: /* bit 0, b */
-            do_test_bit(REG_B, 0);
-            break;
-        case 0x41: /* bit 0, c */
-            do_test_bit(REG_C, 0);
-            break;
-        case 0x42: /* bit 0, d */
-            do_test_bit(REG_D, 0);
-            break;
-        case 0x43: /* bit 0, e */
-            do_test_bit(REG_E, 0);
-            break;
-        case 0x44: /* bit 0, h */
-            do_test_bit(REG_H, 0);
-            break;
-        case 0x45: /* bit 0, l */
-            do_test_bit(REG_L, 0);
-            break;
-        case 0x4F: /* bit 1, a */
-            do_test_bit(REG_A, 1);
-            break;
-        case 0x48: /* bit 1, b */
-            do_test_bit(REG_B, 1);
-            break;
-        case 0x49: /* bit 1, c */
-            do_test_bit(REG_C, 1);
-            break;
-        case 0x4A: /* bit 1, d */
-            do_test_bit(REG_D, 1);
-            break;
-        case 0x4B: /* bit 1, e */
-            do_test_bit(REG_E, 1);
-            break;
-        case 0x4C: /* bit 1, h */
-            do_test_bit(REG_H, 1);
-            break;
-        case 0x4D: /* bit 1, l */
-            do_test_bit(REG_L, 1);
-            break;
-        case 0x57: /* bit 2, a */
-            do_test_bit(REG_A, 2);
-            break;
-        case 0x50: /* bit 2, b */
-            do_test_bit(REG_B, 2);
-            break;
-        case 0x51: /* bit 2, c */
-            do_test_bit(REG_C, 2);
-            break;
-        case 0x52: /* bit 2, d */
-            do_test_bit(REG_D, 2);
-            break;
-        case 0x53: /* bit 2, e */
-            do_test_bit(REG_E, 2);
-            break;
-        case 0x54: /* bit 2, h */
-            do_test_bit(REG_H, 2);
-            break;
-        case 0x55: /* bit 2, l */
-            do_test_bit(REG_L, 2);
-            break;
-        case 0x5F: /* bit 3, a */
-            do_test_bit(REG_A, 3);
-            break;
-        case 0x58: /* bit 3, b */
-            do_test_bit(REG_B, 3);
-            break;
-        case 0x59: /* bit 3, c */
-            do_test_bit(REG_C, 3);
-            break;
-        case 0x5A: /* bit 3, d */
-            do_test_bit(REG_D, 3);
-            break;
-        case 0x5B: /* bit 3, e */
-            do_test_bit(REG_E, 3);
-            break;
-        case 0x5C: /* bit 3, h */
-            do_test_bit(REG_H, 3);
-            break;
-        case 0x5D: /* bit 3, l */
-            do_test_bit(REG_L, 3);
-            break;
-        case 0x67: /* bit 4, a */
-            do_test_bit(REG_A, 4);
-            break;
-        case 0x60: /* bit 4, b */
-            do_test_bit(REG_B, 4);
-            break;
-        case 0x61: /* bit 4, c */
-            do_test_bit(REG_C, 4);
-            break;
-        case 0x62: /* bit 4, d */
-            do_test_bit(REG_D, 4);
-            break;
-        case 0x63: /* bit 4, e */
-            do_test_bit(REG_E, 4);
-            break;
-        case 0x64: /* bit 4, h */
-            do_test_bit(REG_H, 4);
-            break;
-        case 0x65: /* bit 4, l */
-            do_test_bit(REG_L, 4);
-            break;
-        case 0x6F: /* bit 5, a */
-            do_test_bit(REG_A, 5);
-            break;
-        case 0x68: /* bit 5, b */
-            do_test_bit(REG_B, 5);
-            break;
-        case 0x69: /* bit 5, c */
-            do_test_bit(REG_C, 5);
-            break;
-        case 0x6A: /* bit 5, d */
-            do_test_bit(REG_D, 5);
-            break;
-        case 0x6B: /* bit 5, e */
-            do_test_bit(REG_E, 5);
-            break;
-        case 0x6C: /* bit 5, h */
-            do_test_bit(REG_H, 5);
-            break;
-        case 0x6D: /* bit 5, l */
-            do_test_bit(REG_L, 5);
-            break;
-        case 0x77: /* bit 6, a */
-            do_test_bit(REG_A, 6);
-            break;
-        case 0x70: /* bit 6, b */
-            do_test_bit(REG_B, 6);
-            break;
-        case 0x71: /* bit 6, c */
-            do_test_bit(REG_C, 6);
-            break;
-        case 0x72: /* bit 6, d */
-            do_test_bit(REG_D, 6);
-            break;
-        case 0x73: /* bit 6, e */
-            do_test_bit(REG_E, 6);
-            break;
-        case 0x74: /* bit 6, h */
-            do_test_bit(REG_H, 6);
-            break;
-        case 0x75: /* bit 6, l */
-            do_test_bit(REG_L, 6);
-            break;
-        case 0x7F: /* bit 7, a */
-            do_test_bit(REG_A, 7);
-            break;
-        case 0x78: /* bit 7, b */
-            do_test_bit(REG_B, 7);
-            break;
-        case 0x79: /* bit 7, c */
-            do_test_bit(REG_C, 7);
-            break;
-        case 0x7A: /* bit 7, d */
-            do_test_bit(REG_D, 7);
-            break;
-        case 0x7B: /* bit 7, e */
-            do_test_bit(REG_E, 7);
-            break;
-        case 0x7C: /* bit 7, h */
-            do_test_bit(REG_H, 7);
-            break;
-        case 0x7D: /* bit 7, l */
-            do_test_bit(REG_L, 7);
-            break;
+    insn->len = pc - addr;
+    return insn_operands[op] & 8;
+}
 
-        case 0x46: /* bit 0, (hl) */
-            do_test_bit(mem_read(REG_HL), 0);
-            break;
-        case 0x4E: /* bit 1, (hl) */
-            do_test_bit(mem_read(REG_HL), 1);
-            break;
-        case 0x56: /* bit 2, (hl) */
-            do_test_bit(mem_read(REG_HL), 2);
-            break;
-        case 0x5E: /* bit 3, (hl) */
-            do_test_bit(mem_read(REG_HL), 3);
-            break;
-        case 0x66: /* bit 4, (hl) */
-            do_test_bit(mem_read(REG_HL), 4);
-            break;
-        case 0x6E: /* bit 5, (hl) */
-            do_test_bit(mem_read(REG_HL), 5);
-            break;
-        case 0x76: /* bit 6, (hl) */
-            do_test_bit(mem_read(REG_HL), 6);
-            break;
-        case 0x7E: /* bit 7, (hl) */
-            do_test_bit(mem_read(REG_HL), 7);
+#if Z80_DECODE_CACHE
+/*
+ * Decode a block starting at addr into cp, stopping after an
+ * instruction which may transfer control, at the end of the page, or
+ * when running into already decoded instructions.
+ */
+static void decode_block(struct code_page* cp, uint16_t addr)
+{
+    struct z80_insn* block[MAX_BLOCK_INSNS];
+    struct z80_insn* insn;
+    unsigned int n, offs, run_clk;
+    bool jump;
+
+    run_clk = 0;
+    for (n = 0; n < MAX_BLOCK_INSNS; n++) {
+        offs = addr & MEM_PAGE_MASK;
+        insn = &cp->insn[offs];
+        if (insn->oplen) {
+            run_clk = insn->run_clk;
             break;
+        }
 
-        case 0x87: /* res 0, a */
-            REG_A &= ~(1 << 0);
-            break;
-        case 0x80: /* res 0, b */
-            REG_B &= ~(1 << 0);
-            break;
-        case 0x81: /* res 0, c */
-            REG_C &= ~(1 << 0);
-            break;
-        case 0x82: /* res 0, d */
-            REG_D &= ~(1 << 0);
-            break;
-        case 0x83: /* res 0, e */
-            REG_E &= ~(1 << 0);
-            break;
-        case 0x84: /* res 0, h */
-            REG_H &= ~(1 << 0);
-            break;
-        case 0x85: /* res 0, l */
-            REG_L &= ~(1 << 0);
-            break;
-        case 0x8F: /* res 1, a */
-            REG_A &= ~(1 << 1);
-            break;
-        case 0x88: /* res 1, b */
-            REG_B &= ~(1 << 1);
-            break;
-        case 0x89: /* res 1, c */
-            REG_C &= ~(1 << 1);
-            break;
-        case 0x8A: /* res 1, d */
-            REG_D &= ~(1 << 1);
-            break;
-        case 0x8B: /* res 1, e */
-            REG_E &= ~(1 << 1);
-            break;
-        case 0x8C: /* res 1, h */
-            REG_H &= ~(1 << 1);
-            break;
-        case 0x8D: /* res 1, l */
-            REG_L &= ~(1 << 1);
-            break;
-        case 0x97: /* res 2, a */
-            REG_A &= ~(1 << 2);
-            break;
-        case 0x90: /* res 2, b */
-            REG_B &= ~(1 << 2);
-            break;
-        case 0x91: /* res 2, c */
-            REG_C &= ~(1 << 2);
-            break;
-        case 0x92: /* res 2, d */
-            REG_D &= ~(1 << 2);
-            break;
-        case 0x93: /* res 2, e */
-            REG_E &= ~(1 << 2);
-            break;
-        case 0x94: /* res 2, h */
-            REG_H &= ~(1 << 2);
-            break;
-        case 0x95: /* res 2, l */
-            REG_L &= ~(1 << 2);
-            break;
-        case 0x9F: /* res 3, a */
-            REG_A &= ~(1 << 3);
-            break;
-        case 0x98: /* res 3, b */
-            REG_B &= ~(1 << 3);
-            break;
-        case 0x99: /* res 3, c */
-            REG_C &= ~(1 << 3);
+        jump = decode_insn(addr, insn);
+        if (insn->oplen > 2 || offs + insn->len > MEM_PAGE_SIZE) {
+            insn->oplen = 0; /* Not cacheable */
             break;
-        case 0x9A: /* res 3, d */
-            REG_D &= ~(1 << 3);
-            break;
-        case 0x9B: /* res 3, e */
-            REG_E &= ~(1 << 3);
-            break;
-        case 0x9C: /* res 3, h */
-            REG_H &= ~(1 << 3);
-            break;
-        case 0x9D: /* res 3, l */
-            REG_L &= ~(1 << 3);
-            break;
-        case 0xA7: /* res 4, a */
-            REG_A &= ~(1 << 4);
-            break;
-        case 0xA0: /* res 4, b */
-            REG_B &= ~(1 << 4);
-            break;
-        case 0xA1: /* res 4, c */
-            REG_C &= ~(1 << 4);
-            break;
-        case 0xA2: /* res 4, d */
-            REG_D &= ~(1 << 4);
-            break;
-        case 0xA3: /* res 4, e */
-            REG_E &= ~(1 << 4);
-            break;
-        case 0xA4: /* res 4, h */
-            REG_H &= ~(1 << 4);
-            break;
-        case 0xA5: /* res 4, l */
-            REG_L &= ~(1 << 4);
-            break;
-        case 0xAF: /* res 5, a */
-            REG_A &= ~(1 << 5);
-            break;
-        case 0xA8: /* res 5, b */
-            REG_B &= ~(1 << 5);
-            break;
-        case 0xA9: /* res 5, c */
-            REG_C &= ~(1 << 5);
-            break;
-        case 0xAA: /* res 5, d */
-            REG_D &= ~(1 << 5);
-            break;
-        case 0xAB: /* res 5, e */
-            REG_E &= ~(1 << 5);
-            break;
-        case 0xAC: /* res 5, h */
-            REG_H &= ~(1 << 5);
-            break;
-        case 0xAD: /* res 5, l */
-            REG_L &= ~(1 << 5);
-            break;
-        case 0xB7: /* res 6, a */
-            REG_A &= ~(1 << 6);
-            break;
-        case 0xB0: /* res 6, b */
-            REG_B &= ~(1 << 6);
-            break;
-        case 0xB1: /* res 6, c */
-            REG_C &= ~(1 << 6);
-            break;
-        case 0xB2: /* res 6, d */
-            REG_D &= ~(1 << 6);
-            break;
-        case 0xB3: /* res 6, e */
-            REG_E &= ~(1 << 6);
-            break;
-        case 0xB4: /* res 6, h */
-            REG_H &= ~(1 << 6);
-            break;
-        case 0xB5: /* res 6, l */
-            REG_L &= ~(1 << 6);
-            break;
-        case 0xBF: /* res 7, a */
-            REG_A &= ~(1 << 7);
-            break;
-        case 0xB8: /* res 7, b */
-            REG_B &= ~(1 << 7);
-            break;
-        case 0xB9: /* res 7, c */
-            REG_C &= ~(1 << 7);
-            break;
-        case 0xBA: /* res 7, d */
-            REG_D &= ~(1 << 7);
-            break;
-        case 0xBB: /* res 7, e */
-            REG_E &= ~(1 << 7);
-            break;
-        case 0xBC: /* res 7, h */
-            REG_H &= ~(1 << 7);
-            break;
-        case 0xBD: /* res 7, l */
-            REG_L &= ~(1 << 7);
-            break;
-
-        case 0x86: /* res 0, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 0));
-            break;
-        case 0x8E: /* res 1, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 1));
-            break;
-        case 0x96: /* res 2, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 2));
-            break;
-        case 0x9E: /* res 3, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 3));
-            break;
-        case 0xA6: /* res 4, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 4));
-            break;
-        case 0xAE: /* res 5, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 5));
-            break;
-        case 0xB6: /* res 6, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 6));
-            break;
-        case 0xBE: /* res 7, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 7));
+        }
+
+        block[n] = insn;
+        addr += insn->len;
+        if (jump || !(addr & MEM_PAGE_MASK)) {
+            n++;
             break;
+        }
+    }
 
-        case 0x17: /* rl a */
-            REG_A = rl_byte(REG_A);
-            break;
-        case 0x10: /* rl b */
-            REG_B = rl_byte(REG_B);
-            break;
-        case 0x11: /* rl c */
-            REG_C = rl_byte(REG_C);
-            break;
-        case 0x12: /* rl d */
-            REG_D = rl_byte(REG_D);
-            break;
-        case 0x13: /* rl e */
-            REG_E = rl_byte(REG_E);
-            break;
-        case 0x14: /* rl h */
-            REG_H = rl_byte(REG_H);
-            break;
-        case 0x15: /* rl l */
-            REG_L = rl_byte(REG_L);
-            break;
-        case 0x16: /* rl (hl) */
-            mem_write(REG_HL, rl_byte(mem_read(REG_HL)));
-            break;
+    while (n--) {
+        run_clk += block[n]->clk;
+        block[n]->run_clk = run_clk < UINT16_MAX ? run_clk : UINT16_MAX;
+    }
+}
+#endif
 
-        case 0x07: /* rlc a */
-            REG_A = rlc_byte(REG_A);
-            break;
-        case 0x00: /* rlc b */
-            REG_B = rlc_byte(REG_B);
-            break;
-        case 0x01: /* rlc c */
-            REG_C = rlc_byte(REG_C);
-            break;
-        case 0x02: /* rlc d */
-            REG_D = rlc_byte(REG_D);
-            break;
-        case 0x03: /* rlc e */
-            REG_E = rlc_byte(REG_E);
-            break;
-        case 0x04: /* rlc h */
-            REG_H = rlc_byte(REG_H);
-            break;
-        case 0x05: /* rlc l */
-            REG_L = rlc_byte(REG_L);
-            break;
-        case 0x06: /* rlc (hl) */
-            mem_write(REG_HL, rlc_byte(mem_read(REG_HL)));
-            break;
+/*
+ * Get the decoded instruction at PC.  code_cache holds the code page
+ * for the memory page last executed from; no_code (which is always
+ * empty) stands in for memory which isn't cached.
+ */
+static struct code_page no_code;
+static struct
+{
+    struct code_page* cp;
+    unsigned int base;
+} code_cache = {&no_code, ~0U};
 
-        case 0x1F: /* rr a */
-            REG_A = rr_byte(REG_A);
-            break;
-        case 0x18: /* rr b */
-            REG_B = rr_byte(REG_B);
-            break;
-        case 0x19: /* rr c */
-            REG_C = rr_byte(REG_C);
-            break;
-        case 0x1A: /* rr d */
-            REG_D = rr_byte(REG_D);
-            break;
-        case 0x1B: /* rr e */
-            REG_E = rr_byte(REG_E);
-            break;
-        case 0x1C: /* rr h */
-            REG_H = rr_byte(REG_H);
-            break;
-        case 0x1D: /* rr l */
-            REG_L = rr_byte(REG_L);
-            break;
-        case 0x1E: /* rr (hl) */
-            mem_write(REG_HL, rr_byte(mem_read(REG_HL)));
-            break;
+/* Called when the memory map or the contents of a code page changes */
+void z80_code_changed(void)
+{
+    code_cache.base = ~0U;
+}
 
-        case 0x0F: /* rrc a */
-            REG_A = rrc_byte(REG_A);
-            break;
-        case 0x08: /* rrc b */
-            REG_B = rrc_byte(REG_B);
-            break;
-        case 0x09: /* rrc c */
-            REG_C = rrc_byte(REG_C);
-            break;
-        case 0x0A: /* rrc d */
-            REG_D = rrc_byte(REG_D);
-            break;
-        case 0x0B: /* rrc e */
-            REG_E = rrc_byte(REG_E);
-            break;
-        case 0x0C: /* rrc h */
-            REG_H = rrc_byte(REG_H);
-            break;
-        case 0x0D: /* rrc l */
-            REG_L = rrc_byte(REG_L);
-            break;
-        case 0x0E: /* rrc (hl) */
-            mem_write(REG_HL, rrc_byte(mem_read(REG_HL)));
-            break;
+static inline const struct z80_insn* set_insn(const struct z80_insn* insn,
+                                              uint16_t pc)
+{
+    insn_bytes = insn->bytes;
+    insn_addr = pc + insn->oplen - 1;
+    return insn;
+}
 
-        case 0xC7: /* set 0, a */
-            REG_A |= (1 << 0);
-            break;
-        case 0xC0: /* set 0, b */
-            REG_B |= (1 << 0);
-            break;
-        case 0xC1: /* set 0, c */
-            REG_C |= (1 << 0);
-            break;
-        case 0xC2: /* set 0, d */
-            REG_D |= (1 << 0);
-            break;
-        case 0xC3: /* set 0, e */
-            REG_E |= (1 << 0);
-            break;
-        case 0xC4: /* set 0, h */
-            REG_H |= (1 << 0);
-            break;
-        case 0xC5: /* set 0, l */
-            REG_L |= (1 << 0);
-            break;
-        case 0xCF: /* set 1, a */
-            REG_A |= (1 << 1);
-            break;
-        case 0xC8: /* set 1, b */
-            REG_B |= (1 << 1);
-            break;
-        case 0xC9: /* set 1, c */
-            REG_C |= (1 << 1);
-            break;
-        case 0xCA: /* set 1, d */
-            REG_D |= (1 << 1);
-            break;
-        case 0xCB: /* set 1, e */
-            REG_E |= (1 << 1);
-            break;
-        case 0xCC: /* set 1, h */
-            REG_H |= (1 << 1);
-            break;
-        case 0xCD: /* set 1, l */
-            REG_L |= (1 << 1);
-            break;
-        case 0xD7: /* set 2, a */
-            REG_A |= (1 << 2);
-            break;
-        case 0xD0: /* set 2, b */
-            REG_B |= (1 << 2);
-            break;
-        case 0xD1: /* set 2, c */
-            REG_C |= (1 << 2);
-            break;
-        case 0xD2: /* set 2, d */
-            REG_D |= (1 << 2);
-            break;
-        case 0xD3: /* set 2, e */
-            REG_E |= (1 << 2);
-            break;
-        case 0xD4: /* set 2, h */
-            REG_H |= (1 << 2);
-            break;
-        case 0xD5: /* set 2, l */
-            REG_L |= (1 << 2);
-            break;
-        case 0xDF: /* set 3, a */
-            REG_A |= (1 << 3);
-            break;
-        case 0xD8: /* set 3, b */
-            REG_B |= (1 << 3);
-            break;
-        case 0xD9: /* set 3, c */
-            REG_C |= (1 << 3);
-            break;
-        case 0xDA: /* set 3, d */
-            REG_D |= (1 << 3);
-            break;
-        case 0xDB: /* set 3, e */
-            REG_E |= (1 << 3);
-            break;
-        case 0xDC: /* set 3, h */
-            REG_H |= (1 << 3);
-            break;
-        case 0xDD: /* set 3, l */
-            REG_L |= (1 << 3);
-            break;
-        case 0xE7: /* set 4, a */
-            REG_A |= (1 << 4);
-            break;
-        case 0xE0: /* set 4, b */
-            REG_B |= (1 << 4);
-            break;
-        case 0xE1: /* set 4, c */
-            REG_C |= (1 << 4);
-            break;
-        case 0xE2: /* set 4, d */
-            REG_D |= (1 << 4);
-            break;
-        case 0xE3: /* set 4, e */
-            REG_E |= (1 << 4);
-            break;
-        case 0xE4: /* set 4, h */
-            REG_H |= (1 << 4);
-            break;
-        case 0xE5: /* set 4, l */
-            REG_L |= (1 << 4);
-            break;
-        case 0xEF: /* set 5, a */
-            REG_A |= (1 << 5);
-            break;
-        case 0xE8: /* set 5, b */
-            REG_B |= (1 << 5);
-            break;
-        case 0xE9: /* set 5, c */
-            REG_C |= (1 << 5);
-            break;
-        case 0xEA: /* set 5, d */
-            REG_D |= (1 << 5);
-            break;
-        case 0xEB: /* set 5, e */
-            REG_E |= (1 << 5);
-            break;
-        case 0xEC: /* set 5, h */
-            REG_H |= (1 << 5);
-            break;
-        case 0xED: /* set 5, l */
-            REG_L |= (1 << 5);
-            break;
-        case 0xF7: /* set 6, a */
-            REG_A |= (1 << 6);
-            break;
-        case 0xF0: /* set 6, b */
-            REG_B |= (1 << 6);
-            break;
-        case 0xF1: /* set 6, c */
-            REG_C |= (1 << 6);
-            break;
-        case 0xF2: /* set 6, d */
-            REG_D |= (1 << 6);
-            break;
-        case 0xF3: /* set 6, e */
-            REG_E |= (1 << 6);
-            break;
-        case 0xF4: /* set 6, h */
-            REG_H |= (1 << 6);
-            break;
-        case 0xF5: /* set 6, l */
-            REG_L |= (1 << 6);
-            break;
-        case 0xFF: /* set 7, a */
-            REG_A |= (1 << 7);
-            break;
-        case 0xF8: /* set 7, b */
-            REG_B |= (1 << 7);
-            break;
-        case 0xF9: /* set 7, c */
-            REG_C |= (1 << 7);
-            break;
-        case 0xFA: /* set 7, d */
-            REG_D |= (1 << 7);
-            break;
-        case 0xFB: /* set 7, e */
-            REG_E |= (1 << 7);
-            break;
-        case 0xFC: /* set 7, h */
-            REG_H |= (1 << 7);
-            break;
-        case 0xFD: /* set 7, l */
-            REG_L |= (1 << 7);
-            break;
+static cold_func const struct z80_insn* fetch_insn_slow(uint16_t pc)
+{
+    static struct z80_insn decoded;
 
-        case 0xC6: /* set 0, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) | (1 << 0));
-            break;
-        case 0xCE: /* set 1, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) | (1 << 1));
-            break;
-        case 0xD6: /* set 2, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) | (1 << 2));
-            break;
-        case 0xDE: /* set 3, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) | (1 << 3));
-            break;
-        case 0xE6: /* set 4, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) | (1 << 4));
-            break;
-        case 0xEE: /* set 5, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) | (1 << 5));
-            break;
-        case 0xF6: /* set 6, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) | (1 << 6));
-            break;
-        case 0xFE: /* set 7, (hl) */
-            mem_write(REG_HL, mem_read(REG_HL) | (1 << 7));
-            break;
+#if Z80_DECODE_CACHE
+    struct z80_insn* insn;
 
-        case 0x27: /* sla a */
-            REG_A = sla_byte(REG_A);
-            break;
-        case 0x20: /* sla b */
-            REG_B = sla_byte(REG_B);
-            break;
-        case 0x21: /* sla c */
-            REG_C = sla_byte(REG_C);
-            break;
-        case 0x22: /* sla d */
-            REG_D = sla_byte(REG_D);
-            break;
-        case 0x23: /* sla e */
-            REG_E = sla_byte(REG_E);
-            break;
-        case 0x24: /* sla h */
-            REG_H = sla_byte(REG_H);
-            break;
-        case 0x25: /* sla l */
-            REG_L = sla_byte(REG_L);
-            break;
-        case 0x26: /* sla (hl) */
-            mem_write(REG_HL, sla_byte(mem_read(REG_HL)));
-            break;
+    if ((pc & ~MEM_PAGE_MASK) != code_cache.base) {
+        code_cache.cp = mem_code_page(pc);
+        if (!code_cache.cp)
+            code_cache.cp = &no_code;
+        code_cache.base = pc & ~MEM_PAGE_MASK;
+    }
 
-        case 0x37: /* sll a */
-            REG_A = sll_byte(REG_A);
-            break;
-        case 0x30: /* sll b */
-            REG_B = sll_byte(REG_B);
-            break;
-        case 0x31: /* sll c */
-            REG_C = sll_byte(REG_C);
-            break;
-        case 0x32: /* sll d */
-            REG_D = sll_byte(REG_D);
-            break;
-        case 0x33: /* sll e */
-            REG_E = sll_byte(REG_E);
-            break;
-        case 0x34: /* sll h */
-            REG_H = sll_byte(REG_H);
-            break;
-        case 0x35: /* sll l */
-            REG_L = sll_byte(REG_L);
-            break;
-        case 0x36: /* sll (hl) */
-            mem_write(REG_HL, sll_byte(mem_read(REG_HL)));
-            break;
+    if (code_cache.cp != &no_code) {
+        insn = &code_cache.cp->insn[pc & MEM_PAGE_MASK];
+        if (!insn->oplen)
+            decode_block(code_cache.cp, pc);
+        if (insn->oplen) {
+            mem_set_m1_page(pc);
+            return set_insn(insn, pc);
+        }
+    }
+#endif
 
-        case 0x2F: /* sra a */
-            REG_A = sra_byte(REG_A);
-            break;
-        case 0x28: /* sra b */
-            REG_B = sra_byte(REG_B);
-            break;
-        case 0x29: /* sra c */
-            REG_C = sra_byte(REG_C);
-            break;
-        case 0x2A: /* sra d */
-            REG_D = sra_byte(REG_D);
-            break;
-        case 0x2B: /* sra e */
-            REG_E = sra_byte(REG_E);
-            break;
-        case 0x2C: /* sra h */
-            REG_H = sra_byte(REG_H);
-            break;
-        case 0x2D: /* sra l */
-            REG_L = sra_byte(REG_L);
-            break;
-        case 0x2E: /* sra (hl) */
-            mem_write(REG_HL, sra_byte(mem_read(REG_HL)));
-            break;
+    decode_insn(pc, &decoded);
+    return set_insn(&decoded, pc);
+}
 
-        case 0x3F: /* srl a */
-            REG_A = srl_byte(REG_A);
-            break;
-        case 0x38: /* srl b */
-            REG_B = srl_byte(REG_B);
-            break;
-        case 0x39: /* srl c */
-            REG_C = srl_byte(REG_C);
-            break;
-        case 0x3A: /* srl d */
-            REG_D = srl_byte(REG_D);
-            break;
-        case 0x3B: /* srl e */
-            REG_E = srl_byte(REG_E);
-            break;
-        case 0x3C: /* srl h */
-            REG_H = srl_byte(REG_H);
-            break;
-        case 0x3D: /* srl l */
-            REG_L = srl_byte(REG_L);
-            break;
-        case 0x3E: /* srl (hl) */
-            mem_write(REG_HL, srl_byte(mem_read(REG_HL)));
-            break;
+static inline const struct z80_insn* fetch_insn(uint16_t pc)
+{
+#if Z80_DECODE_CACHE
+    if (likely((pc & ~MEM_PAGE_MASK) == code_cache.base)) {
+        const struct z80_insn* insn = &code_cache.cp->insn[pc & MEM_PAGE_MASK];
+        if (likely(insn->oplen)) {
+            mem_set_m1(pc);
+            return set_insn(insn, pc);
         }
-    } else {
-        /*
-         * Indexed instructions are weird.  They ALWAYS take the source from
-         * (Ix+d) and ALWAYS write the result back, but ALSO write the result
-         * to a GPR unless the register specifier is 6.  BIT never writes
-         * anything back to either memory or GPR.
-         */
-
-        addr = ix->word + (int8_t)mem_fetch(REG_PC++);
-        instruction = mem_fetch(REG_PC++);
-        /* No R increment here, for some reason */
-
-        TSTATE += ((instruction & 0xc0) == 0x40) ? 12 : 15;
-
-        data = mem_read(addr);
-
-        switch (instruction & 0xc0) {
-        case 0x00:
-            switch (instruction & ~7) {
-            case 0x00: /* RLC */
-                data = rlc_byte(data);
-                break;
-            case 0x08: /* RRC */
-                data = rrc_byte(data);
-                break;
-            case 0x10: /* RL */
-                data = rl_byte(data);
-                break;
-            case 0x18: /* RR */
-                data = rr_byte(data);
-                break;
-            case 0x20: /* SLA */
-                data = sla_byte(data);
-                break;
-            case 0x28: /* SRA */
-                data = sra_byte(data);
-                break;
-            case 0x30: /* SLL */
-                data = sll_byte(data);
-                break;
-            case 0x38: /* SRL */
-                data = srl_byte(data);
-                break;
-            }
-            break;
-
-        case 0x40: /* BIT */
-            do_test_bit(data, (instruction >> 3) & 7);
-            return; /* No writeback! */
+    }
+#endif
 
-        case 0x80: /* RES */
-            data &= ~(1 << ((instruction >> 3) & 7));
-            break;
+    return fetch_insn_slow(pc);
+}
 
-        case 0xc0: /* SET */
-            data |= (1 << ((instruction >> 3) & 7));
-            break;
-        }
+/*
+ * Fetch the next instruction into instruction, and account for the
+ * prefix and opcode bytes.  The main group is dispatched on the opcode
+ * plus 256 times the index register, so that the instructions using HL
+ * have separate handlers for HL, IX and IY (see z80index.h), or on
+ * IDLE_LOOP or TRAP.
+ */
+#define FETCH_INSTRUCTION()                                                    \
+    do {                                                                       \
+        const struct z80_insn* insn_ = fetch_insn(REG_PC);                     \
+        opstat_next(insn_->stat, TSTATE);                                      \
+        REG_PC += insn_->oplen;                                                \
+        TSTATE += insn_->clk;                                                  \
+        add_r(insn_->oplen);                                                   \
+        instruction = insn_->dispatch;                                         \
+    } while (0)
 
-        switch (instruction & 7) {
-        case 0:
-            REG_B = data;
-            break;
-        case 1:
-            REG_C = data;
-            break;
-        case 2:
-            REG_D = data;
-            break;
-        case 3:
-            REG_E = data;
-            break;
-        case 4:
-            REG_H = data;
-            break;
-        case 5:
-            REG_L = data;
-            break;
-        case 6:
-            /* Only memory */
-            break;
-        case 7:
-            REG_A = data;
-            break;
-        }
+/*
+ * Opcode dispatch.
+ *
+ * With Z80_THREADED_DISPATCH, each opcode group (main, CB, ED and the
+ * DDCB/FDCB indexed-CB group) has its own table of handler addresses and
+ * SWITCH() is a computed goto through it; every main-group handler ends
+ * with its own copy of the fetch-and-dispatch sequence (NEXT_INSTRUCTION),
+ * so the host branch predictor sees one indirect jump per handler rather
+ * than one for the whole instruction set.  Otherwise, this is an ordinary
+ * switch statement.  Handler labels are named <group>_<opcode>, with the
+ * opcode in uppercase hex.
+ */
+#ifndef Z80_THREADED_DISPATCH
+#    ifdef __GNUC__
+#        define Z80_THREADED_DISPATCH 1
+#    else
+#        define Z80_THREADED_DISPATCH 0
+#    endif
+#endif
+
+#if Z80_THREADED_DISPATCH
+#    define OPCODE(grp, op) grp##_##op
+#    define DEFAULT(grp) grp##_default
+#    define SWITCH(grp, op) goto* grp##_table[op];
+
+#    define OPTAB1(grp, h, l) &&grp##_0x##h##l
+#    define OPTAB16(grp, h)                                                    \
+        OPTAB1(grp, h, 0), OPTAB1(grp, h, 1), OPTAB1(grp, h, 2),               \
+            OPTAB1(grp, h, 3), OPTAB1(grp, h, 4), OPTAB1(grp, h, 5),           \
+            OPTAB1(grp, h, 6), OPTAB1(grp, h, 7), OPTAB1(grp, h, 8),           \
+            OPTAB1(grp, h, 9), OPTAB1(grp, h, A), OPTAB1(grp, h, B),           \
+            OPTAB1(grp, h, C), OPTAB1(grp, h, D), OPTAB1(grp, h, E),           \
+            OPTAB1(grp, h, F)
+#    define OPTAB256(grp)                                                      \
+        OPTAB16(grp, 0), OPTAB16(grp, 1), OPTAB16(grp, 2), OPTAB16(grp, 3),    \
+            OPTAB16(grp, 4), OPTAB16(grp, 5), OPTAB16(grp, 6),                 \
+            OPTAB16(grp, 7), OPTAB16(grp, 8), OPTAB16(grp, 9),                 \
+            OPTAB16(grp, A), OPTAB16(grp, B), OPTAB16(grp, C),                 \
+            OPTAB16(grp, D), OPTAB16(grp, E), OPTAB16(grp, F)
+
+/* Computed goto and label addresses are GNU extensions */
+#    pragma GCC diagnostic ignored "-Wpedantic"
+#else
+#    define OPCODE(grp, op) case op
+#    define DEFAULT(grp) default
+#    define SWITCH(grp, op) switch (op)
+#endif
 
-        mem_write(addr, data);
-    }
-}
+/*
+ * Extended instructions which have 0xCB as the first byte:
+ */
 
-static void do_ED_instruction(wordregister* ix)
+static void do_CB_instruction(void)
 {
     uint8_t instruction;
 
-    (void)ix; /* DD/FD has no effect */
-
-    /*
-     * Undocumented instruction notes:
-     * ED 00-3F = NOP
-     * ED 80-BF = NOP unless documented
-     * ED C0-FF = NOP
-     * ED 40-7F duplicate:
-     *   NEG       at ED4C, ED54, ED5C, ED64, ED6C, ED74, ED7C
-     *   NOP       at ED77, ED7F
-     *   RETN      at ED55, ED65, ED75
-     *   RETI      at ED5D, ED6D, ED7D
-     *   IM ?      at ED4E, ED6E
-     *   IM 0      at ED66
-     *   IM 1      at ED76
-     *   IM 2      at ED7E
-     *   IN F,(C)  at ED70
-     *   OUT (C),0 at ED71  -- OUT (C),0FFh for CMOS Z80
-     */
+#if Z80_THREADED_DISPATCH
+    static const void* const cb_table[256] = {OPTAB256(cb)};
+#endif
 
-    instruction = mem_fetch(REG_PC++);
+    instruction = op_fetch(REG_PC++);
     inc_r();
-    TSTATE += clk_ED[instruction];
-
-    switch (instruction) {
-    case 0x4A: /* adc hl, bc */
-        do_adc_word(REG_BC);
-        break;
-    case 0x5A: /* adc hl, de */
-        do_adc_word(REG_DE);
-        break;
-    case 0x6A: /* adc hl, hl */
-        do_adc_word(REG_HL);
-        break;
-    case 0x7A: /* adc hl, sp */
-        do_adc_word(REG_SP);
-        break;
-
-    case 0xA9: /* cpd */
-        do_cpid(-1);
-        break;
-    case 0xB9: /* cpdr */
-        do_cpidr(-1);
-        break;
-
-    case 0xA1: /* cpi */
-        do_cpid(+1);
-        break;
-    case 0xB1: /* cpir */
-        do_cpidr(+1);
-        break;
-
-    case 0x46: /* im 0 */
-    case 0x66:
-    case 0x4E:
-    case 0x6E:
-        do_im0();
-        break;
-    case 0x56: /* im 1 */
-    case 0x76:
-        do_im1();
-        break;
-    case 0x5E: /* im 2 */
-    case 0x7E:
-        do_im2();
-        break;
-
-    case 0x78: /* in a, (c) */
-        REG_A = in_with_flags(REG_C);
-        break;
-    case 0x40: /* in b, (c) */
-        REG_B = in_with_flags(REG_C);
-        break;
-    case 0x48: /* in c, (c) */
-        REG_C = in_with_flags(REG_C);
-        break;
-    case 0x50: /* in d, (c) */
-        REG_D = in_with_flags(REG_C);
-        break;
-    case 0x58: /* in e, (c) */
-        REG_E = in_with_flags(REG_C);
-        break;
-    case 0x60: /* in h, (c) */
-        REG_H = in_with_flags(REG_C);
-        break;
-    case 0x68: /* in l, (c) */
-        REG_L = in_with_flags(REG_C);
-        break;
 
-    case 0xAA: /* ind */
-        do_inid(-1);
-        break;
-    case 0xBA: /* indr */
-        do_inidr(-1);
-        break;
-    case 0xA2: /* ini */
-        do_inid(+1);
-        break;
-    case 0xB2: /* inir */
-        do_inidr(+1);
-        break;
+    /* (HL) = 7 additional clocks, otherwise 4 */
+    if ((instruction & 7) == 6) {
+        TSTATE += (instruction & 0xc0) == 0x40 ? 8 : 11;
+    } else {
+        TSTATE += 4;
+    }
 
-    case 0x57: /* ld a, i */
-        do_ld_a_ir(REG_I);
-        break;
-    case 0x47: /* ld i, a */
-        REG_I = REG_A;
-        break;
-
-    case 0x5F: /* ld a, r */
-        do_ld_a_ir(REG_R);
-        break;
-    case 0x4F: /* ld r, a */
-        z80_state.rf = z80_state.rc = REG_A;
-        break;
-
-    case 0x4B: /* ld bc, (address) */
-        REG_BC = mem_read_word(mem_fetch_word(REG_PC));
-        REG_PC += 2;
-        break;
-    case 0x5B: /* ld de, (address) */
-        REG_DE = mem_read_word(mem_fetch_word(REG_PC));
-        REG_PC += 2;
-        break;
-    case 0x6B: /* ld hl, (address) */
-        /* this instruction is redundant with the 2A instruction */
-        REG_HL = mem_read_word(mem_fetch_word(REG_PC));
-        REG_PC += 2;
-        break;
-    case 0x7B: /* ld sp, (address) */
-        REG_SP = mem_read_word(mem_fetch_word(REG_PC));
-        REG_PC += 2;
-        break;
-
-    case 0x43: /* ld (address), bc */
-        mem_write_word(mem_fetch_word(REG_PC), REG_BC);
-        REG_PC += 2;
-        break;
-    case 0x53: /* ld (address), de */
-        mem_write_word(mem_fetch_word(REG_PC), REG_DE);
-        REG_PC += 2;
-        break;
-    case 0x63: /* ld (address), hl */
-        mem_write_word(mem_fetch_word(REG_PC), REG_HL);
-        REG_PC += 2;
-        break;
-    case 0x73: /* ld (address), sp */
-        mem_write_word(mem_fetch_word(REG_PC), REG_SP);
-        REG_PC += 2;
-        break;
-
-    case 0xA8: /* ldd */
-        do_ldid(-1);
-        break;
-    case 0xB8: /* lddr */
-        do_ldidr(-1);
-        break;
-    case 0xA0: /* ldi */
-        do_ldid(+1);
-        break;
-    case 0xB0: /* ldir */
-        do_ldidr(+1);
-        break;
-
-    case 0x44: /* neg */
-    case 0x4C:
-    case 0x54:
-    case 0x5C:
-    case 0x64:
-    case 0x6C:
-    case 0x74:
-    case 0x7C:
-        do_negate();
-        break;
-
-    case 0x79: /* out (c), a */
-        z80_out(REG_C, REG_A);
-        break;
-    case 0x41: /* out (c), b */
-        z80_out(REG_C, REG_B);
-        break;
-    case 0x49: /* out (c), c */
-        z80_out(REG_C, REG_C);
-        break;
-    case 0x51: /* out (c), d */
-        z80_out(REG_C, REG_D);
-        break;
-    case 0x59: /* out (c), e */
-        z80_out(REG_C, REG_E);
-        break;
-    case 0x61: /* out (c), h */
-        z80_out(REG_C, REG_H);
-        break;
-    case 0x69: /* out (c), l */
-        z80_out(REG_C, REG_L);
-        break;
-    case 0x71: /* out (c), 0 */
-        z80_out(REG_C, 0);
-        break;
-
-    case 0xAB: /* outd */
-        do_outid(-1);
-        break;
-    case 0xBB: /* outdr */
-        do_outidr(-1);
-        break;
-    case 0xA3: /* outi */
-        do_outid(+1);
-        break;
-    case 0xB3: /* outir */
-        do_outidr(+1);
-        break;
-
-    case 0x4D: /* reti */
-    case 0x5D:
-    case 0x6D:
-    case 0x7D: {
-        REG_PC = mem_read_word(REG_SP);
-        REG_SP += 2;
-        z80_state.iff1 = z80_state.iff2;
-        z80_state.signal_eoi = true; /* Send EOI before next instruction */
-    } break;
-
-    case 0x45: /* retn */
-    case 0x55:
-    case 0x65:
-    case 0x75:
-        REG_PC = mem_read_word(REG_SP);
-        REG_SP += 2;
-        z80_state.iff1 = z80_state.iff2;
-        z80_state.nmi_in_progress = false;
-        break;
-
-    case 0x6F: /* rld */
-        do_rld();
-        break;
-
-    case 0x67: /* rrd */
-        do_rrd();
-        break;
-
-    case 0x42: /* sbc hl, bc */
-        do_sbc_word(REG_BC);
-        break;
-    case 0x52: /* sbc hl, de */
-        do_sbc_word(REG_DE);
-        break;
-    case 0x62: /* sbc hl, hl */
-        do_sbc_word(REG_HL);
-        break;
-    case 0x72: /* sbc hl, sp */
-        do_sbc_word(REG_SP);
-        break;
-
-    default:
-        /* Assume all others are NOP */
-        break;
-    }
-}
-
-static inline void check_eoi(void)
-{
-    if (!likely(z80_state.signal_eoi))
+    SWITCH(cb, instruction) {
+    OPCODE(cb, 0x47): /* bit 0, a */
+        do_test_bit(REG_A, 0);
+        return;
+    OPCODE(cb, 0x40): /* bit 0, b */
+        do_test_bit(REG_B, 0);
+        return;
+    OPCODE(cb, 0x41): /* bit 0, c */
+        do_test_bit(REG_C, 0);
+        return;
+    OPCODE(cb, 0x42): /* bit 0, d */
+        do_test_bit(REG_D, 0);
+        return;
+    OPCODE(cb, 0x43): /* bit 0, e */
+        do_test_bit(REG_E, 0);
+        return;
+    OPCODE(cb, 0x44): /* bit 0, h */
+        do_test_bit(REG_H, 0);
+        return;
+    OPCODE(cb, 0x45): /* bit 0, l */
+        do_test_bit(REG_L, 0);
+        return;
+    OPCODE(cb, 0x4F): /* bit 1, a */
+        do_test_bit(REG_A, 1);
+        return;
+    OPCODE(cb, 0x48): /* bit 1, b */
+        do_test_bit(REG_B, 1);
+        return;
+    OPCODE(cb, 0x49): /* bit 1, c */
+        do_test_bit(REG_C, 1);
+        return;
+    OPCODE(cb, 0x4A): /* bit 1, d */
+        do_test_bit(REG_D, 1);
+        return;
+    OPCODE(cb, 0x4B): /* bit 1, e */
+        do_test_bit(REG_E, 1);
+        return;
+    OPCODE(cb, 0x4C): /* bit 1, h */
+        do_test_bit(REG_H, 1);
+        return;
+    OPCODE(cb, 0x4D): /* bit 1, l */
+        do_test_bit(REG_L, 1);
+        return;
+    OPCODE(cb, 0x57): /* bit 2, a */
+        do_test_bit(REG_A, 2);
+        return;
+    OPCODE(cb, 0x50): /* bit 2, b */
+        do_test_bit(REG_B, 2);
+        return;
+    OPCODE(cb, 0x51): /* bit 2, c */
+        do_test_bit(REG_C, 2);
+        return;
+    OPCODE(cb, 0x52): /* bit 2, d */
+        do_test_bit(REG_D, 2);
+        return;
+    OPCODE(cb, 0x53): /* bit 2, e */
+        do_test_bit(REG_E, 2);
+        return;
+    OPCODE(cb, 0x54): /* bit 2, h */
+        do_test_bit(REG_H, 2);
+        return;
+    OPCODE(cb, 0x55): /* bit 2, l */
+        do_test_bit(REG_L, 2);
+        return;
+    OPCODE(cb, 0x5F): /* bit 3, a */
+        do_test_bit(REG_A, 3);
+        return;
+    OPCODE(cb, 0x58): /* bit 3, b */
+        do_test_bit(REG_B, 3);
+        return;
+    OPCODE(cb, 0x59): /* bit 3, c */
+        do_test_bit(REG_C, 3);
+        return;
+    OPCODE(cb, 0x5A): /* bit 3, d */
+        do_test_bit(REG_D, 3);
+        return;
+    OPCODE(cb, 0x5B): /* bit 3, e */
+        do_test_bit(REG_E, 3);
+        return;
+    OPCODE(cb, 0x5C): /* bit 3, h */
+        do_test_bit(REG_H, 3);
+        return;
+    OPCODE(cb, 0x5D): /* bit 3, l */
+        do_test_bit(REG_L, 3);
+        return;
+    OPCODE(cb, 0x67): /* bit 4, a */
+        do_test_bit(REG_A, 4);
+        return;
+    OPCODE(cb, 0x60): /* bit 4, b */
+        do_test_bit(REG_B, 4);
+        return;
+    OPCODE(cb, 0x61): /* bit 4, c */
+        do_test_bit(REG_C, 4);
+        return;
+    OPCODE(cb, 0x62): /* bit 4, d */
+        do_test_bit(REG_D, 4);
+        return;
+    OPCODE(cb, 0x63): /* bit 4, e */
+        do_test_bit(REG_E, 4);
+        return;
+    OPCODE(cb, 0x64): /* bit 4, h */
+        do_test_bit(REG_H, 4);
+        return;
+    OPCODE(cb, 0x65): /* bit 4, l */
+        do_test_bit(REG_L, 4);
+        return;
+    OPCODE(cb, 0x6F): /* bit 5, a */
+        do_test_bit(REG_A, 5);
+        return;
+    OPCODE(cb, 0x68): /* bit 5, b */
+        do_test_bit(REG_B, 5);
+        return;
+    OPCODE(cb, 0x69): /* bit 5, c */
+        do_test_bit(REG_C, 5);
+        return;
+    OPCODE(cb, 0x6A): /* bit 5, d */
+        do_test_bit(REG_D, 5);
+        return;
+    OPCODE(cb, 0x6B): /* bit 5, e */
+        do_test_bit(REG_E, 5);
+        return;
+    OPCODE(cb, 0x6C): /* bit 5, h */
+        do_test_bit(REG_H, 5);
+        return;
+    OPCODE(cb, 0x6D): /* bit 5, l */
+        do_test_bit(REG_L, 5);
+        return;
+    OPCODE(cb, 0x77): /* bit 6, a */
+        do_test_bit(REG_A, 6);
+        return;
+    OPCODE(cb, 0x70): /* bit 6, b */
+        do_test_bit(REG_B, 6);
+        return;
+    OPCODE(cb, 0x71): /* bit 6, c */
+        do_test_bit(REG_C, 6);
+        return;
+    OPCODE(cb, 0x72): /* bit 6, d */
+        do_test_bit(REG_D, 6);
+        return;
+    OPCODE(cb, 0x73): /* bit 6, e */
+        do_test_bit(REG_E, 6);
+        return;
+    OPCODE(cb, 0x74): /* bit 6, h */
+        do_test_bit(REG_H, 6);
+        return;
+    OPCODE(cb, 0x75): /* bit 6, l */
+        do_test_bit(REG_L, 6);
+        return;
+    OPCODE(cb, 0x7F): /* bit 7, a */
+        do_test_bit(REG_A, 7);
+        return;
+    OPCODE(cb, 0x78): /* bit 7, b */
+        do_test_bit(REG_B, 7);
+        return;
+    OPCODE(cb, 0x79): /* bit 7, c */
+        do_test_bit(REG_C, 7);
+        return;
+    OPCODE(cb, 0x7A): /* bit 7, d */
+        do_test_bit(REG_D, 7);
+        return;
+    OPCODE(cb, 0x7B): /* bit 7, e */
+        do_test_bit(REG_E, 7);
+        return;
+    OPCODE(cb, 0x7C): /* bit 7, h */
+        do_test_bit(REG_H, 7);
+        return;
+    OPCODE(cb, 0x7D): /* bit 7, l */
+        do_test_bit(REG_L, 7);
         return;
 
-    if (tracing(TRACE_IO)) {
-        fprintf(tracef, "[%12" PRIu64 "] EOI: RETI executed\n", TSTATE);
-    }
-
-    z80_state.signal_eoi = false;
-    z80_eoi();
-}
-
-int z80_run(bool continuous, bool halted)
-{
-    uint8_t instruction;
-    uint16_t address; /* generic temps */
-    wordregister* ix;
-
-    /* loop to do a z80 instruction */
-    do {
-        if (tracing(TRACE_CPU)) {
-            diffstate();
-            tracemem();
-            fputc('\n', tracef);
-        }
-        check_eoi();
-        for (;;) {
-            /* Poll for external event */
-            if (z80_poll_external())
-                return halted;
-
-            /* Check for an interrupt */
-            if (z80_state.nminterrupt && !z80_state.nmi_in_progress) {
-                halted = false;
-                do_nmi();
-            } else if (z80_state.iff1 && !z80_state.ei_shadow && poll_irq()) {
-                halted = false;
-                do_int();
-            }
-            z80_state.ei_shadow = false;
-            if (!halted)
-                break;
-            TSTATE += 4;
-
-            if (!continuous)
-                return halted;
-        }
+    OPCODE(cb, 0x46): /* bit 0, (hl) */
+        do_test_bit(mem_read(REG_HL), 0);
+        return;
+    OPCODE(cb, 0x4E): /* bit 1, (hl) */
+        do_test_bit(mem_read(REG_HL), 1);
+        return;
+    OPCODE(cb, 0x56): /* bit 2, (hl) */
+        do_test_bit(mem_read(REG_HL), 2);
+        return;
+    OPCODE(cb, 0x5E): /* bit 3, (hl) */
+        do_test_bit(mem_read(REG_HL), 3);
+        return;
+    OPCODE(cb, 0x66): /* bit 4, (hl) */
+        do_test_bit(mem_read(REG_HL), 4);
+        return;
+    OPCODE(cb, 0x6E): /* bit 5, (hl) */
+        do_test_bit(mem_read(REG_HL), 5);
+        return;
+    OPCODE(cb, 0x76): /* bit 6, (hl) */
+        do_test_bit(mem_read(REG_HL), 6);
+        return;
+    OPCODE(cb, 0x7E): /* bit 7, (hl) */
+        do_test_bit(mem_read(REG_HL), 7);
+        return;
 
-        if (tracing(TRACE_CPU)) {
-            fprintf(tracef, "[%12" PRIu64 "] PC=%04X ", TSTATE, REG_PC);
-            disassemble(z80_state.pc.word);
-        }
+    OPCODE(cb, 0x87): /* res 0, a */
+        REG_A &= ~(1 << 0);
+        return;
+    OPCODE(cb, 0x80): /* res 0, b */
+        REG_B &= ~(1 << 0);
+        return;
+    OPCODE(cb, 0x81): /* res 0, c */
+        REG_C &= ~(1 << 0);
+        return;
+    OPCODE(cb, 0x82): /* res 0, d */
+        REG_D &= ~(1 << 0);
+        return;
+    OPCODE(cb, 0x83): /* res 0, e */
+        REG_E &= ~(1 << 0);
+        return;
+    OPCODE(cb, 0x84): /* res 0, h */
+        REG_H &= ~(1 << 0);
+        return;
+    OPCODE(cb, 0x85): /* res 0, l */
+        REG_L &= ~(1 << 0);
+        return;
+    OPCODE(cb, 0x8F): /* res 1, a */
+        REG_A &= ~(1 << 1);
+        return;
+    OPCODE(cb, 0x88): /* res 1, b */
+        REG_B &= ~(1 << 1);
+        return;
+    OPCODE(cb, 0x89): /* res 1, c */
+        REG_C &= ~(1 << 1);
+        return;
+    OPCODE(cb, 0x8A): /* res 1, d */
+        REG_D &= ~(1 << 1);
+        return;
+    OPCODE(cb, 0x8B): /* res 1, e */
+        REG_E &= ~(1 << 1);
+        return;
+    OPCODE(cb, 0x8C): /* res 1, h */
+        REG_H &= ~(1 << 1);
+        return;
+    OPCODE(cb, 0x8D): /* res 1, l */
+        REG_L &= ~(1 << 1);
+        return;
+    OPCODE(cb, 0x97): /* res 2, a */
+        REG_A &= ~(1 << 2);
+        return;
+    OPCODE(cb, 0x90): /* res 2, b */
+        REG_B &= ~(1 << 2);
+        return;
+    OPCODE(cb, 0x91): /* res 2, c */
+        REG_C &= ~(1 << 2);
+        return;
+    OPCODE(cb, 0x92): /* res 2, d */
+        REG_D &= ~(1 << 2);
+        return;
+    OPCODE(cb, 0x93): /* res 2, e */
+        REG_E &= ~(1 << 2);
+        return;
+    OPCODE(cb, 0x94): /* res 2, h */
+        REG_H &= ~(1 << 2);
+        return;
+    OPCODE(cb, 0x95): /* res 2, l */
+        REG_L &= ~(1 << 2);
+        return;
+    OPCODE(cb, 0x9F): /* res 3, a */
+        REG_A &= ~(1 << 3);
+        return;
+    OPCODE(cb, 0x98): /* res 3, b */
+        REG_B &= ~(1 << 3);
+        return;
+    OPCODE(cb, 0x99): /* res 3, c */
+        REG_C &= ~(1 << 3);
+        return;
+    OPCODE(cb, 0x9A): /* res 3, d */
+        REG_D &= ~(1 << 3);
+        return;
+    OPCODE(cb, 0x9B): /* res 3, e */
+        REG_E &= ~(1 << 3);
+        return;
+    OPCODE(cb, 0x9C): /* res 3, h */
+        REG_H &= ~(1 << 3);
+        return;
+    OPCODE(cb, 0x9D): /* res 3, l */
+        REG_L &= ~(1 << 3);
+        return;
+    OPCODE(cb, 0xA7): /* res 4, a */
+        REG_A &= ~(1 << 4);
+        return;
+    OPCODE(cb, 0xA0): /* res 4, b */
+        REG_B &= ~(1 << 4);
+        return;
+    OPCODE(cb, 0xA1): /* res 4, c */
+        REG_C &= ~(1 << 4);
+        return;
+    OPCODE(cb, 0xA2): /* res 4, d */
+        REG_D &= ~(1 << 4);
+        return;
+    OPCODE(cb, 0xA3): /* res 4, e */
+        REG_E &= ~(1 << 4);
+        return;
+    OPCODE(cb, 0xA4): /* res 4, h */
+        REG_H &= ~(1 << 4);
+        return;
+    OPCODE(cb, 0xA5): /* res 4, l */
+        REG_L &= ~(1 << 4);
+        return;
+    OPCODE(cb, 0xAF): /* res 5, a */
+        REG_A &= ~(1 << 5);
+        return;
+    OPCODE(cb, 0xA8): /* res 5, b */
+        REG_B &= ~(1 << 5);
+        return;
+    OPCODE(cb, 0xA9): /* res 5, c */
+        REG_C &= ~(1 << 5);
+        return;
+    OPCODE(cb, 0xAA): /* res 5, d */
+        REG_D &= ~(1 << 5);
+        return;
+    OPCODE(cb, 0xAB): /* res 5, e */
+        REG_E &= ~(1 << 5);
+        return;
+    OPCODE(cb, 0xAC): /* res 5, h */
+        REG_H &= ~(1 << 5);
+        return;
+    OPCODE(cb, 0xAD): /* res 5, l */
+        REG_L &= ~(1 << 5);
+        return;
+    OPCODE(cb, 0xB7): /* res 6, a */
+        REG_A &= ~(1 << 6);
+        return;
+    OPCODE(cb, 0xB0): /* res 6, b */
+        REG_B &= ~(1 << 6);
+        return;
+    OPCODE(cb, 0xB1): /* res 6, c */
+        REG_C &= ~(1 << 6);
+        return;
+    OPCODE(cb, 0xB2): /* res 6, d */
+        REG_D &= ~(1 << 6);
+        return;
+    OPCODE(cb, 0xB3): /* res 6, e */
+        REG_E &= ~(1 << 6);
+        return;
+    OPCODE(cb, 0xB4): /* res 6, h */
+        REG_H &= ~(1 << 6);
+        return;
+    OPCODE(cb, 0xB5): /* res 6, l */
+        REG_L &= ~(1 << 6);
+        return;
+    OPCODE(cb, 0xBF): /* res 7, a */
+        REG_A &= ~(1 << 7);
+        return;
+    OPCODE(cb, 0xB8): /* res 7, b */
+        REG_B &= ~(1 << 7);
+        return;
+    OPCODE(cb, 0xB9): /* res 7, c */
+        REG_C &= ~(1 << 7);
+        return;
+    OPCODE(cb, 0xBA): /* res 7, d */
+        REG_D &= ~(1 << 7);
+        return;
+    OPCODE(cb, 0xBB): /* res 7, e */
+        REG_E &= ~(1 << 7);
+        return;
+    OPCODE(cb, 0xBC): /* res 7, h */
+        REG_H &= ~(1 << 7);
+        return;
+    OPCODE(cb, 0xBD): /* res 7, l */
+        REG_L &= ~(1 << 7);
+        return;
 
-        ix = &z80_state.hl; /* Not an index instruction */
+    OPCODE(cb, 0x86): /* res 0, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 0));
+        return;
+    OPCODE(cb, 0x8E): /* res 1, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 1));
+        return;
+    OPCODE(cb, 0x96): /* res 2, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 2));
+        return;
+    OPCODE(cb, 0x9E): /* res 3, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 3));
+        return;
+    OPCODE(cb, 0xA6): /* res 4, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 4));
+        return;
+    OPCODE(cb, 0xAE): /* res 5, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 5));
+        return;
+    OPCODE(cb, 0xB6): /* res 6, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 6));
+        return;
+    OPCODE(cb, 0xBE): /* res 7, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 7));
+        return;
 
-        instruction = mem_fetch_m1(REG_PC++);
+    OPCODE(cb, 0x17): /* rl a */
+        REG_A = rl_byte(REG_A);
+        return;
+    OPCODE(cb, 0x10): /* rl b */
+        REG_B = rl_byte(REG_B);
+        return;
+    OPCODE(cb, 0x11): /* rl c */
+        REG_C = rl_byte(REG_C);
+        return;
+    OPCODE(cb, 0x12): /* rl d */
+        REG_D = rl_byte(REG_D);
+        return;
+    OPCODE(cb, 0x13): /* rl e */
+        REG_E = rl_byte(REG_E);
+        return;
+    OPCODE(cb, 0x14): /* rl h */
+        REG_H = rl_byte(REG_H);
+        return;
+    OPCODE(cb, 0x15): /* rl l */
+        REG_L = rl_byte(REG_L);
+        return;
+    OPCODE(cb, 0x16): /* rl (hl) */
+        mem_write(REG_HL, rl_byte(mem_read(REG_HL)));
+        return;
 
-    indexed:
-        TSTATE += clk_main[instruction];
-        inc_r();
+    OPCODE(cb, 0x07): /* rlc a */
+        REG_A = rlc_byte(REG_A);
+        return;
+    OPCODE(cb, 0x00): /* rlc b */
+        REG_B = rlc_byte(REG_B);
+        return;
+    OPCODE(cb, 0x01): /* rlc c */
+        REG_C = rlc_byte(REG_C);
+        return;
+    OPCODE(cb, 0x02): /* rlc d */
+        REG_D = rlc_byte(REG_D);
+        return;
+    OPCODE(cb, 0x03): /* rlc e */
+        REG_E = rlc_byte(REG_E);
+        return;
+    OPCODE(cb, 0x04): /* rlc h */
+        REG_H = rlc_byte(REG_H);
+        return;
+    OPCODE(cb, 0x05): /* rlc l */
+        REG_L = rlc_byte(REG_L);
+        return;
+    OPCODE(cb, 0x06): /* rlc (hl) */
+        mem_write(REG_HL, rlc_byte(mem_read(REG_HL)));
+        return;
 
-        switch (instruction) {
-        case 0xCB: /* CB.. extended instruction */
-            do_CB_instruction(ix);
-            break;
-        case 0xDD: /* DD.. extended instruction */
-            ix = &z80_state.ix;
-            instruction = mem_fetch(REG_PC++);
-            goto indexed;
-        case 0xED: /* ED.. extended instruction */
-            do_ED_instruction(ix);
-            break;
-        case 0xFD: /* FD.. extended instruction */
-            ix = &z80_state.iy;
-            instruction = mem_fetch(REG_PC++);
-            goto indexed;
+    OPCODE(cb, 0x1F): /* rr a */
+        REG_A = rr_byte(REG_A);
+        return;
+    OPCODE(cb, 0x18): /* rr b */
+        REG_B = rr_byte(REG_B);
+        return;
+    OPCODE(cb, 0x19): /* rr c */
+        REG_C = rr_byte(REG_C);
+        return;
+    OPCODE(cb, 0x1A): /* rr d */
+        REG_D = rr_byte(REG_D);
+        return;
+    OPCODE(cb, 0x1B): /* rr e */
+        REG_E = rr_byte(REG_E);
+        return;
+    OPCODE(cb, 0x1C): /* rr h */
+        REG_H = rr_byte(REG_H);
+        return;
+    OPCODE(cb, 0x1D): /* rr l */
+        REG_L = rr_byte(REG_L);
+        return;
+    OPCODE(cb, 0x1E): /* rr (hl) */
+        mem_write(REG_HL, rr_byte(mem_read(REG_HL)));
+        return;
 
-        case 0x8F: /* adc a, a */
-            do_adc_byte(REG_A);
-            break;
-        case 0x88: /* adc a, b */
-            do_adc_byte(REG_B);
-            break;
-        case 0x89: /* adc a, c */
-            do_adc_byte(REG_C);
-            break;
-        case 0x8A: /* adc a, d */
-            do_adc_byte(REG_D);
-            break;
-        case 0x8B: /* adc a, e */
-            do_adc_byte(REG_E);
-            break;
-        case 0x8C: /* adc a, h */
-            do_adc_byte(ix->byte.high);
-            break;
-        case 0x8D: /* adc a, l */
-            do_adc_byte(ix->byte.low);
-            break;
-        case 0xCE: /* adc a, value */
-            do_adc_byte(mem_fetch(REG_PC++));
-            break;
-        case 0x8E: /* adc a, (hl) */
-            do_adc_byte(mem_read(get_hl_addr(ix)));
-            break;
+    OPCODE(cb, 0x0F): /* rrc a */
+        REG_A = rrc_byte(REG_A);
+        return;
+    OPCODE(cb, 0x08): /* rrc b */
+        REG_B = rrc_byte(REG_B);
+        return;
+    OPCODE(cb, 0x09): /* rrc c */
+        REG_C = rrc_byte(REG_C);
+        return;
+    OPCODE(cb, 0x0A): /* rrc d */
+        REG_D = rrc_byte(REG_D);
+        return;
+    OPCODE(cb, 0x0B): /* rrc e */
+        REG_E = rrc_byte(REG_E);
+        return;
+    OPCODE(cb, 0x0C): /* rrc h */
+        REG_H = rrc_byte(REG_H);
+        return;
+    OPCODE(cb, 0x0D): /* rrc l */
+        REG_L = rrc_byte(REG_L);
+        return;
+    OPCODE(cb, 0x0E): /* rrc (hl) */
+        mem_write(REG_HL, rrc_byte(mem_read(REG_HL)));
+        return;
 
-        case 0x87: /* add a, a */
-            do_add_byte(REG_A);
-            break;
-        case 0x80: /* add a, b */
-            do_add_byte(REG_B);
-            break;
-        case 0x81: /* add a, c */
-            do_add_byte(REG_C);
-            break;
-        case 0x82: /* add a, d */
-            do_add_byte(REG_D);
-            break;
-        case 0x83: /* add a, e */
-            do_add_byte(REG_E);
-            break;
-        case 0x84: /* add a, h */
-            do_add_byte(ix->byte.high);
-            break;
-        case 0x85: /* add a, l */
-            do_add_byte(ix->byte.low);
-            break;
-        case 0xC6: /* add a, value */
-            do_add_byte(mem_fetch(REG_PC++));
-            break;
-        case 0x86: /* add a, (hl) */
-            do_add_byte(mem_read(get_hl_addr(ix)));
-            break;
+    OPCODE(cb, 0xC7): /* set 0, a */
+        REG_A |= (1 << 0);
+        return;
+    OPCODE(cb, 0xC0): /* set 0, b */
+        REG_B |= (1 << 0);
+        return;
+    OPCODE(cb, 0xC1): /* set 0, c */
+        REG_C |= (1 << 0);
+        return;
+    OPCODE(cb, 0xC2): /* set 0, d */
+        REG_D |= (1 << 0);
+        return;
+    OPCODE(cb, 0xC3): /* set 0, e */
+        REG_E |= (1 << 0);
+        return;
+    OPCODE(cb, 0xC4): /* set 0, h */
+        REG_H |= (1 << 0);
+        return;
+    OPCODE(cb, 0xC5): /* set 0, l */
+        REG_L |= (1 << 0);
+        return;
+    OPCODE(cb, 0xCF): /* set 1, a */
+        REG_A |= (1 << 1);
+        return;
+    OPCODE(cb, 0xC8): /* set 1, b */
+        REG_B |= (1 << 1);
+        return;
+    OPCODE(cb, 0xC9): /* set 1, c */
+        REG_C |= (1 << 1);
+        return;
+    OPCODE(cb, 0xCA): /* set 1, d */
+        REG_D |= (1 << 1);
+        return;
+    OPCODE(cb, 0xCB): /* set 1, e */
+        REG_E |= (1 << 1);
+        return;
+    OPCODE(cb, 0xCC): /* set 1, h */
+        REG_H |= (1 << 1);
+        return;
+    OPCODE(cb, 0xCD): /* set 1, l */
+        REG_L |= (1 << 1);
+        return;
+    OPCODE(cb, 0xD7): /* set 2, a */
+        REG_A |= (1 << 2);
+        return;
+    OPCODE(cb, 0xD0): /* set 2, b */
+        REG_B |= (1 << 2);
+        return;
+    OPCODE(cb, 0xD1): /* set 2, c */
+        REG_C |= (1 << 2);
+        return;
+    OPCODE(cb, 0xD2): /* set 2, d */
+        REG_D |= (1 << 2);
+        return;
+    OPCODE(cb, 0xD3): /* set 2, e */
+        REG_E |= (1 << 2);
+        return;
+    OPCODE(cb, 0xD4): /* set 2, h */
+        REG_H |= (1 << 2);
+        return;
+    OPCODE(cb, 0xD5): /* set 2, l */
+        REG_L |= (1 << 2);
+        return;
+    OPCODE(cb, 0xDF): /* set 3, a */
+        REG_A |= (1 << 3);
+        return;
+    OPCODE(cb, 0xD8): /* set 3, b */
+        REG_B |= (1 << 3);
+        return;
+    OPCODE(cb, 0xD9): /* set 3, c */
+        REG_C |= (1 << 3);
+        return;
+    OPCODE(cb, 0xDA): /* set 3, d */
+        REG_D |= (1 << 3);
+        return;
+    OPCODE(cb, 0xDB): /* set 3, e */
+        REG_E |= (1 << 3);
+        return;
+    OPCODE(cb, 0xDC): /* set 3, h */
+        REG_H |= (1 << 3);
+        return;
+    OPCODE(cb, 0xDD): /* set 3, l */
+        REG_L |= (1 << 3);
+        return;
+    OPCODE(cb, 0xE7): /* set 4, a */
+        REG_A |= (1 << 4);
+        return;
+    OPCODE(cb, 0xE0): /* set 4, b */
+        REG_B |= (1 << 4);
+        return;
+    OPCODE(cb, 0xE1): /* set 4, c */
+        REG_C |= (1 << 4);
+        return;
+    OPCODE(cb, 0xE2): /* set 4, d */
+        REG_D |= (1 << 4);
+        return;
+    OPCODE(cb, 0xE3): /* set 4, e */
+        REG_E |= (1 << 4);
+        return;
+    OPCODE(cb, 0xE4): /* set 4, h */
+        REG_H |= (1 << 4);
+        return;
+    OPCODE(cb, 0xE5): /* set 4, l */
+        REG_L |= (1 << 4);
+        return;
+    OPCODE(cb, 0xEF): /* set 5, a */
+        REG_A |= (1 << 5);
+        return;
+    OPCODE(cb, 0xE8): /* set 5, b */
+        REG_B |= (1 << 5);
+        return;
+    OPCODE(cb, 0xE9): /* set 5, c */
+        REG_C |= (1 << 5);
+        return;
+    OPCODE(cb, 0xEA): /* set 5, d */
+        REG_D |= (1 << 5);
+        return;
+    OPCODE(cb, 0xEB): /* set 5, e */
+        REG_E |= (1 << 5);
+        return;
+    OPCODE(cb, 0xEC): /* set 5, h */
+        REG_H |= (1 << 5);
+        return;
+    OPCODE(cb, 0xED): /* set 5, l */
+        REG_L |= (1 << 5);
+        return;
+    OPCODE(cb, 0xF7): /* set 6, a */
+        REG_A |= (1 << 6);
+        return;
+    OPCODE(cb, 0xF0): /* set 6, b */
+        REG_B |= (1 << 6);
+        return;
+    OPCODE(cb, 0xF1): /* set 6, c */
+        REG_C |= (1 << 6);
+        return;
+    OPCODE(cb, 0xF2): /* set 6, d */
+        REG_D |= (1 << 6);
+        return;
+    OPCODE(cb, 0xF3): /* set 6, e */
+        REG_E |= (1 << 6);
+        return;
+    OPCODE(cb, 0xF4): /* set 6, h */
+        REG_H |= (1 << 6);
+        return;
+    OPCODE(cb, 0xF5): /* set 6, l */
+        REG_L |= (1 << 6);
+        return;
+    OPCODE(cb, 0xFF): /* set 7, a */
+        REG_A |= (1 << 7);
+        return;
+    OPCODE(cb, 0xF8): /* set 7, b */
+        REG_B |= (1 << 7);
+        return;
+    OPCODE(cb, 0xF9): /* set 7, c */
+        REG_C |= (1 << 7);
+        return;
+    OPCODE(cb, 0xFA): /* set 7, d */
+        REG_D |= (1 << 7);
+        return;
+    OPCODE(cb, 0xFB): /* set 7, e */
+        REG_E |= (1 << 7);
+        return;
+    OPCODE(cb, 0xFC): /* set 7, h */
+        REG_H |= (1 << 7);
+        return;
+    OPCODE(cb, 0xFD): /* set 7, l */
+        REG_L |= (1 << 7);
+        return;
 
-        case 0x09: /* add hl, bc */
-            do_add_word(ix, REG_BC);
-            break;
-        case 0x19: /* add hl, de */
-            do_add_word(ix, REG_DE);
-            break;
-        case 0x29: /* add hl, hl */
-            do_add_word(ix, ix->word);
-            break;
-        case 0x39: /* add hl, sp */
-            do_add_word(ix, REG_SP);
-            break;
+    OPCODE(cb, 0xC6): /* set 0, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) | (1 << 0));
+        return;
+    OPCODE(cb, 0xCE): /* set 1, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) | (1 << 1));
+        return;
+    OPCODE(cb, 0xD6): /* set 2, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) | (1 << 2));
+        return;
+    OPCODE(cb, 0xDE): /* set 3, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) | (1 << 3));
+        return;
+    OPCODE(cb, 0xE6): /* set 4, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) | (1 << 4));
+        return;
+    OPCODE(cb, 0xEE): /* set 5, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) | (1 << 5));
+        return;
+    OPCODE(cb, 0xF6): /* set 6, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) | (1 << 6));
+        return;
+    OPCODE(cb, 0xFE): /* set 7, (hl) */
+        mem_write(REG_HL, mem_read(REG_HL) | (1 << 7));
+        return;
 
-        case 0xA7: /* and a */
-            do_and_byte(REG_A);
-            break;
-        case 0xA0: /* and b */
-            do_and_byte(REG_B);
-            break;
-        case 0xA1: /* and c */
-            do_and_byte(REG_C);
-            break;
-        case 0xA2: /* and d */
-            do_and_byte(REG_D);
-            break;
-        case 0xA3: /* and e */
-            do_and_byte(REG_E);
-            break;
-        case 0xA4: /* and h */
-            do_and_byte(ix->byte.high);
-            break;
-        case 0xA5: /* and l */
-            do_and_byte(ix->byte.low);
-            break;
-        case 0xE6: /* and value */
-            do_and_byte(mem_fetch(REG_PC++));
-            break;
-        case 0xA6: /* and (hl) */
-            do_and_byte(mem_read(get_hl_addr(ix)));
-            break;
+    OPCODE(cb, 0x27): /* sla a */
+        REG_A = sla_byte(REG_A);
+        return;
+    OPCODE(cb, 0x20): /* sla b */
+        REG_B = sla_byte(REG_B);
+        return;
+    OPCODE(cb, 0x21): /* sla c */
+        REG_C = sla_byte(REG_C);
+        return;
+    OPCODE(cb, 0x22): /* sla d */
+        REG_D = sla_byte(REG_D);
+        return;
+    OPCODE(cb, 0x23): /* sla e */
+        REG_E = sla_byte(REG_E);
+        return;
+    OPCODE(cb, 0x24): /* sla h */
+        REG_H = sla_byte(REG_H);
+        return;
+    OPCODE(cb, 0x25): /* sla l */
+        REG_L = sla_byte(REG_L);
+        return;
+    OPCODE(cb, 0x26): /* sla (hl) */
+        mem_write(REG_HL, sla_byte(mem_read(REG_HL)));
+        return;
 
-        case 0xCD: /* call address */
-            address = mem_fetch_word(REG_PC);
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_PC + 2);
-            REG_PC = address;
-            break;
+    OPCODE(cb, 0x37): /* sll a */
+        REG_A = sll_byte(REG_A);
+        return;
+    OPCODE(cb, 0x30): /* sll b */
+        REG_B = sll_byte(REG_B);
+        return;
+    OPCODE(cb, 0x31): /* sll c */
+        REG_C = sll_byte(REG_C);
+        return;
+    OPCODE(cb, 0x32): /* sll d */
+        REG_D = sll_byte(REG_D);
+        return;
+    OPCODE(cb, 0x33): /* sll e */
+        REG_E = sll_byte(REG_E);
+        return;
+    OPCODE(cb, 0x34): /* sll h */
+        REG_H = sll_byte(REG_H);
+        return;
+    OPCODE(cb, 0x35): /* sll l */
+        REG_L = sll_byte(REG_L);
+        return;
+    OPCODE(cb, 0x36): /* sll (hl) */
+        mem_write(REG_HL, sll_byte(mem_read(REG_HL)));
+        return;
 
-        case 0xC4: /* call nz, address */
-            if (!ZERO_FLAG) {
-                address = mem_fetch_word(REG_PC);
-                REG_SP -= 2;
-                mem_write_word(REG_SP, REG_PC + 2);
-                REG_PC = address;
-                TSTATE += 7;
-                break;
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xCC: /* call z, address */
-            if (ZERO_FLAG) {
-                address = mem_fetch_word(REG_PC);
-                REG_SP -= 2;
-                mem_write_word(REG_SP, REG_PC + 2);
-                REG_PC = address;
-                TSTATE += 7;
-                break;
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xD4: /* call nc, address */
-            if (!CARRY_FLAG) {
-                address = mem_fetch_word(REG_PC);
-                REG_SP -= 2;
-                mem_write_word(REG_SP, REG_PC + 2);
-                REG_PC = address;
-                TSTATE += 7;
-                break;
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xDC: /* call c, address */
-            if (CARRY_FLAG) {
-                address = mem_fetch_word(REG_PC);
-                REG_SP -= 2;
-                mem_write_word(REG_SP, REG_PC + 2);
-                REG_PC = address;
-                TSTATE += 7;
-                break;
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xE4: /* call po, address */
-            if (!PARITY_FLAG) {
-                address = mem_fetch_word(REG_PC);
-                REG_SP -= 2;
-                mem_write_word(REG_SP, REG_PC + 2);
-                REG_PC = address;
-                TSTATE += 7;
-                break;
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xEC: /* call pe, address */
-            if (PARITY_FLAG) {
-                address = mem_fetch_word(REG_PC);
-                REG_SP -= 2;
-                mem_write_word(REG_SP, REG_PC + 2);
-                REG_PC = address;
-                TSTATE += 7;
-                break;
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xF4: /* call p, address */
-            if (!SIGN_FLAG) {
-                address = mem_fetch_word(REG_PC);
-                REG_SP -= 2;
-                mem_write_word(REG_SP, REG_PC + 2);
-                REG_PC = address;
-                TSTATE += 7;
-                break;
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xFC: /* call m, address */
-            if (SIGN_FLAG) {
-                address = mem_fetch_word(REG_PC);
-                REG_SP -= 2;
-                mem_write_word(REG_SP, REG_PC + 2);
-                REG_PC = address;
-                TSTATE += 7;
-                break;
-            } else {
-                REG_PC += 2;
-            }
-            break;
+    OPCODE(cb, 0x2F): /* sra a */
+        REG_A = sra_byte(REG_A);
+        return;
+    OPCODE(cb, 0x28): /* sra b */
+        REG_B = sra_byte(REG_B);
+        return;
+    OPCODE(cb, 0x29): /* sra c */
+        REG_C = sra_byte(REG_C);
+        return;
+    OPCODE(cb, 0x2A): /* sra d */
+        REG_D = sra_byte(REG_D);
+        return;
+    OPCODE(cb, 0x2B): /* sra e */
+        REG_E = sra_byte(REG_E);
+        return;
+    OPCODE(cb, 0x2C): /* sra h */
+        REG_H = sra_byte(REG_H);
+        return;
+    OPCODE(cb, 0x2D): /* sra l */
+        REG_L = sra_byte(REG_L);
+        return;
+    OPCODE(cb, 0x2E): /* sra (hl) */
+        mem_write(REG_HL, sra_byte(mem_read(REG_HL)));
+        return;
 
-        case 0x3F: /* ccf */
-            REG_F = (REG_F ^ CARRY_MASK) & ~SUBTRACT_MASK;
-            break;
+    OPCODE(cb, 0x3F): /* srl a */
+        REG_A = srl_byte(REG_A);
+        return;
+    OPCODE(cb, 0x38): /* srl b */
+        REG_B = srl_byte(REG_B);
+        return;
+    OPCODE(cb, 0x39): /* srl c */
+        REG_C = srl_byte(REG_C);
+        return;
+    OPCODE(cb, 0x3A): /* srl d */
+        REG_D = srl_byte(REG_D);
+        return;
+    OPCODE(cb, 0x3B): /* srl e */
+        REG_E = srl_byte(REG_E);
+        return;
+    OPCODE(cb, 0x3C): /* srl h */
+        REG_H = srl_byte(REG_H);
+        return;
+    OPCODE(cb, 0x3D): /* srl l */
+        REG_L = srl_byte(REG_L);
+        return;
+    OPCODE(cb, 0x3E): /* srl (hl) */
+        mem_write(REG_HL, srl_byte(mem_read(REG_HL)));
+        return;
+    }
+}
 
-        case 0xBF: /* cp a */
-            do_cp(REG_A);
-            break;
-        case 0xB8: /* cp b */
-            do_cp(REG_B);
-            break;
-        case 0xB9: /* cp c */
-            do_cp(REG_C);
-            break;
-        case 0xBA: /* cp d */
-            do_cp(REG_D);
-            break;
-        case 0xBB: /* cp e */
-            do_cp(REG_E);
-            break;
-        case 0xBC: /* cp h */
-            do_cp(ix->byte.high);
-            break;
-        case 0xBD: /* cp l */
-            do_cp(ix->byte.low);
-            break;
-        case 0xFE: /* cp value */
-            do_cp(mem_fetch(REG_PC++));
-            break;
-        case 0xBE: /* cp (hl) */
-            do_cp(mem_read(get_hl_addr(ix)));
-            break;
+/*
+ * Indexed DDCB/FDCB instructions; base is the value of IX or IY
+ */
+static void do_xCB_instruction(uint16_t base)
+{
+    uint8_t instruction;
+    uint16_t addr;
+    uint8_t data;
 
-        case 0x2F: /* cpl */
-            REG_A = ~REG_A;
-            REG_F |= (HALF_CARRY_MASK | SUBTRACT_MASK);
-            break;
+#if Z80_THREADED_DISPATCH
+    static const void* const xcb_table[32] = {OPTAB16(xcb, 0),
+                                              OPTAB16(xcb, 1)};
+#endif
 
-        case 0x27: /* daa */
-            do_daa();
-            break;
+    /*
+     * Indexed instructions are weird.  They ALWAYS take the source from
+     * (Ix+d) and ALWAYS write the result back, but ALSO write the result
+     * to a GPR unless the register specifier is 6.  BIT never writes
+     * anything back to either memory or GPR.
+     */
 
-        case 0x3D: /* dec a */
-            do_flags_dec_byte(--REG_A);
-            break;
-        case 0x05: /* dec b */
-            do_flags_dec_byte(--REG_B);
-            break;
-        case 0x0D: /* dec c */
-            do_flags_dec_byte(--REG_C);
-            break;
-        case 0x15: /* dec d */
-            do_flags_dec_byte(--REG_D);
-            break;
-        case 0x1D: /* dec e */
-            do_flags_dec_byte(--REG_E);
-            break;
-        case 0x25: /* dec h */
-            do_flags_dec_byte(--ix->byte.high);
-            break;
-        case 0x2D: /* dec l */
-            do_flags_dec_byte(--ix->byte.low);
-            break;
+    addr = base + (int8_t)op_fetch(REG_PC++);
+    instruction = op_fetch(REG_PC++);
+    /* No R increment here, for some reason */
+
+    TSTATE += ((instruction & 0xc0) == 0x40) ? 12 : 15;
+
+    data = mem_read(addr);
+
+    SWITCH(xcb, instruction >> 3) {
+    OPCODE(xcb, 0x00): /* RLC */
+        data = rlc_byte(data);
+        goto writeback;
+    OPCODE(xcb, 0x01): /* RRC */
+        data = rrc_byte(data);
+        goto writeback;
+    OPCODE(xcb, 0x02): /* RL */
+        data = rl_byte(data);
+        goto writeback;
+    OPCODE(xcb, 0x03): /* RR */
+        data = rr_byte(data);
+        goto writeback;
+    OPCODE(xcb, 0x04): /* SLA */
+        data = sla_byte(data);
+        goto writeback;
+    OPCODE(xcb, 0x05): /* SRA */
+        data = sra_byte(data);
+        goto writeback;
+    OPCODE(xcb, 0x06): /* SLL */
+        data = sll_byte(data);
+        goto writeback;
+    OPCODE(xcb, 0x07): /* SRL */
+        data = srl_byte(data);
+        goto writeback;
+
+    OPCODE(xcb, 0x08): /* BIT */
+    OPCODE(xcb, 0x09):
+    OPCODE(xcb, 0x0A):
+    OPCODE(xcb, 0x0B):
+    OPCODE(xcb, 0x0C):
+    OPCODE(xcb, 0x0D):
+    OPCODE(xcb, 0x0E):
+    OPCODE(xcb, 0x0F):
+        do_test_bit(data, (instruction >> 3) & 7);
+        return; /* No writeback! */
+
+    OPCODE(xcb, 0x10): /* RES */
+    OPCODE(xcb, 0x11):
+    OPCODE(xcb, 0x12):
+    OPCODE(xcb, 0x13):
+    OPCODE(xcb, 0x14):
+    OPCODE(xcb, 0x15):
+    OPCODE(xcb, 0x16):
+    OPCODE(xcb, 0x17):
+        data &= ~(1 << ((instruction >> 3) & 7));
+        goto writeback;
+
+    OPCODE(xcb, 0x18): /* SET */
+    OPCODE(xcb, 0x19):
+    OPCODE(xcb, 0x1A):
+    OPCODE(xcb, 0x1B):
+    OPCODE(xcb, 0x1C):
+    OPCODE(xcb, 0x1D):
+    OPCODE(xcb, 0x1E):
+    OPCODE(xcb, 0x1F):
+        data |= (1 << ((instruction >> 3) & 7));
+        goto writeback;
+    }
 
-        case 0x35: /* dec (hl) */
-        {
-            uint16_t addr = get_hl_addr(ix);
-            uint8_t value = mem_read(addr) - 1;
-            mem_write(addr, value);
-            do_flags_dec_byte(value);
-        } break;
-
-        case 0x0B: /* dec bc */
-            REG_BC--;
-            break;
-        case 0x1B: /* dec de */
-            REG_DE--;
-            break;
-        case 0x2B: /* dec hl */
-            ix->word--;
-            break;
-        case 0x3B: /* dec sp */
-            REG_SP--;
-            break;
+writeback:
+    switch (instruction & 7) {
+    case 0:
+        REG_B = data;
+        break;
+    case 1:
+        REG_C = data;
+        break;
+    case 2:
+        REG_D = data;
+        break;
+    case 3:
+        REG_E = data;
+        break;
+    case 4:
+        REG_H = data;
+        break;
+    case 5:
+        REG_L = data;
+        break;
+    case 6:
+        /* Only memory */
+        break;
+    case 7:
+        REG_A = data;
+        break;
+    }
 
-        case 0xF3: /* di */
-            do_di();
-            break;
+    mem_write(addr, data);
+}
 
-        case 0x10: /* djnz offset */
-            /* Zaks says no flag changes. */
-            if (--REG_B != 0) {
-                REG_PC += ((int8_t)mem_fetch(REG_PC));
-                TSTATE += 5;
-            }
-            REG_PC++;
-            break;
+static void do_ED_instruction(void)
+{
+    uint8_t instruction;
 
-        case 0xFB: /* ei */
-            do_ei();
-            break;
+#if Z80_THREADED_DISPATCH
+    // clang-format off
+#    define E(x) &&ed_0x##x
+#    define N &&ed_default     /* Believed to be NOPs */
+    static const void* const ed_table[256] = {
+        /* 00 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 08 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 10 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 18 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 20 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 28 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 30 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 38 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 40 */ E(40), E(41), E(42), E(43), E(44), E(45), E(46), E(47),
+        /* 48 */ E(48), E(49), E(4A), E(4B), E(4C), E(4D), E(4E), E(4F),
+        /* 50 */ E(50), E(51), E(52), E(53), E(54), E(55), E(56), E(57),
+        /* 58 */ E(58), E(59), E(5A), E(5B), E(5C), E(5D), E(5E), E(5F),
+        /* 60 */ E(60), E(61), E(62), E(63), E(64), E(65), E(66), E(67),
+        /* 68 */ E(68), E(69), E(6A), E(6B), E(6C), E(6D), E(6E), E(6F),
+        /* 70 */ N,     E(71), E(72), E(73), E(74), E(75), E(76), N,
+        /* 78 */ E(78), E(79), E(7A), E(7B), E(7C), E(7D), E(7E), N,
+        /* 80 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 88 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 90 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* 98 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* a0 */ E(A0), E(A1), E(A2), E(A3), N,     N,     N,     N,
+        /* a8 */ E(A8), E(A9), E(AA), E(AB), N,     N,     N,     N,
+        /* b0 */ E(B0), E(B1), E(B2), E(B3), N,     N,     N,     N,
+        /* b8 */ E(B8), E(B9), E(BA), E(BB), N,     N,     N,     N,
+        /* c0 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* c8 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* d0 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* d8 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* e0 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* e8 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* f0 */ N,     N,     N,     N,     N,     N,     N,     N,
+        /* f8 */ N,     N,     N,     N,     N,     N,     N,     N,
+    };
+#    undef E
+#    undef N
+    // clang-format on
+#endif
 
-        case 0x08: /* ex af, af' */
-        {
-            uint16_t temp;
-            temp = REG_AF;
-            REG_AF = REG_AF_PRIME;
-            REG_AF_PRIME = temp;
-        } break;
+    /*
+     * Undocumented instruction notes:
+     * ED 00-3F = NOP
+     * ED 80-BF = NOP unless documented
+     * ED C0-FF = NOP
+     * ED 40-7F duplicate:
+     *   NEG       at ED4C, ED54, ED5C, ED64, ED6C, ED74, ED7C
+     *   NOP       at ED77, ED7F
+     *   RETN      at ED55, ED65, ED75
+     *   RETI      at ED5D, ED6D, ED7D
+     *   IM ?      at ED4E, ED6E
+     *   IM 0      at ED66
+     *   IM 1      at ED76
+     *   IM 2      at ED7E
+     *   IN F,(C)  at ED70
+     *   OUT (C),0 at ED71  -- OUT (C),0FFh for CMOS Z80
+     */
 
-        case 0xEB: /* ex de, hl */
-        {
-            uint16_t temp;
-            temp = REG_DE;
-            REG_DE = ix->word;
-            ix->word = temp;
-        } break;
+    instruction = op_fetch(REG_PC++);
+    inc_r();
+    TSTATE += clk_ED[instruction];
 
-        case 0xE3: /* ex (sp), hl */
-        {
-            uint16_t temp;
-            temp = mem_read_word(REG_SP);
-            mem_write_word(REG_SP, ix->word);
-            ix->word = temp;
-        } break;
+    SWITCH(ed, instruction) {
+    OPCODE(ed, 0x4A): /* adc hl, bc */
+        do_adc_word(REG_BC);
+        return;
+    OPCODE(ed, 0x5A): /* adc hl, de */
+        do_adc_word(REG_DE);
+        return;
+    OPCODE(ed, 0x6A): /* adc hl, hl */
+        do_adc_word(REG_HL);
+        return;
+    OPCODE(ed, 0x7A): /* adc hl, sp */
+        do_adc_word(REG_SP);
+        return;
 
-        case 0xD9: /* exx */
-        {
-            uint16_t tmp;
-            tmp = REG_BC_PRIME;
-            REG_BC_PRIME = REG_BC;
-            REG_BC = tmp;
-            tmp = REG_DE_PRIME;
-            REG_DE_PRIME = REG_DE;
-            REG_DE = tmp;
-            tmp = REG_HL_PRIME;
-            REG_HL_PRIME = REG_HL;
-            REG_HL = tmp;
-        } break;
-
-        case 0x76: /* halt */
-            halted = 1;
-            break;
+    OPCODE(ed, 0xA9): /* cpd */
+        do_cpid(-1);
+        return;
+    OPCODE(ed, 0xB9): /* cpdr */
+        do_cpidr(-1);
+        return;
 
-        case 0xDB: /* in a, (port) */
-            REG_A = z80_in(mem_fetch(REG_PC++));
-            break;
+    OPCODE(ed, 0xA1): /* cpi */
+        do_cpid(+1);
+        return;
+    OPCODE(ed, 0xB1): /* cpir */
+        do_cpidr(+1);
+        return;
 
-        case 0x3C: /* inc a */
-            REG_A++;
-            do_flags_inc_byte(REG_A);
-            break;
-        case 0x04: /* inc b */
-            REG_B++;
-            do_flags_inc_byte(REG_B);
-            break;
-        case 0x0C: /* inc c */
-            REG_C++;
-            do_flags_inc_byte(REG_C);
-            break;
-        case 0x14: /* inc d */
-            REG_D++;
-            do_flags_inc_byte(REG_D);
-            break;
-        case 0x1C: /* inc e */
-            REG_E++;
-            do_flags_inc_byte(REG_E);
-            break;
-        case 0x24: /* inc h */
-            ix->byte.high++;
-            do_flags_inc_byte(ix->byte.high);
-            break;
-        case 0x2C: /* inc l */
-            ix->byte.low++;
-            do_flags_inc_byte(ix->byte.low);
-            break;
+    OPCODE(ed, 0x46): /* im 0 */
+    OPCODE(ed, 0x66):
+    OPCODE(ed, 0x4E):
+    OPCODE(ed, 0x6E):
+        do_im0();
+        return;
+    OPCODE(ed, 0x56): /* im 1 */
+    OPCODE(ed, 0x76):
+        do_im1();
+        return;
+    OPCODE(ed, 0x5E): /* im 2 */
+    OPCODE(ed, 0x7E):
+        do_im2();
+        return;
 
-        case 0x34: /* inc (hl) */
-        {
-            uint16_t addr = get_hl_addr(ix);
-            uint8_t value = mem_read(addr) + 1;
-            mem_write(addr, value);
-            do_flags_inc_byte(value);
-        } break;
-
-        case 0x03: /* inc bc */
-            REG_BC++;
-            break;
-        case 0x13: /* inc de */
-            REG_DE++;
-            break;
-        case 0x23: /* inc hl */
-            ix->word++;
-            break;
-        case 0x33: /* inc sp */
-            REG_SP++;
-            break;
+    OPCODE(ed, 0x78): /* in a, (c) */
+        REG_A = in_with_flags(REG_C);
+        return;
+    OPCODE(ed, 0x40): /* in b, (c) */
+        REG_B = in_with_flags(REG_C);
+        return;
+    OPCODE(ed, 0x48): /* in c, (c) */
+        REG_C = in_with_flags(REG_C);
+        return;
+    OPCODE(ed, 0x50): /* in d, (c) */
+        REG_D = in_with_flags(REG_C);
+        return;
+    OPCODE(ed, 0x58): /* in e, (c) */
+        REG_E = in_with_flags(REG_C);
+        return;
+    OPCODE(ed, 0x60): /* in h, (c) */
+        REG_H = in_with_flags(REG_C);
+        return;
+    OPCODE(ed, 0x68): /* in l, (c) */
+        REG_L = in_with_flags(REG_C);
+        return;
 
-        case 0xC3: /* jp address */
-            REG_PC = mem_fetch_word(REG_PC);
-            break;
+    OPCODE(ed, 0xAA): /* ind */
+        do_inid(-1);
+        return;
+    OPCODE(ed, 0xBA): /* indr */
+        do_inidr(-1);
+        return;
+    OPCODE(ed, 0xA2): /* ini */
+        do_inid(+1);
+        return;
+    OPCODE(ed, 0xB2): /* inir */
+        do_inidr(+1);
+        return;
 
-        case 0xE9: /* jp (hl) */
-            REG_PC = ix->word;
-            break;
+    OPCODE(ed, 0x57): /* ld a, i */
+        do_ld_a_ir(REG_I);
+        return;
+    OPCODE(ed, 0x47): /* ld i, a */
+        REG_I = REG_A;
+        return;
 
-        case 0xC2: /* jp nz, address */
-            if (!ZERO_FLAG) {
-                REG_PC = mem_fetch_word(REG_PC);
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xCA: /* jp z, address */
-            if (ZERO_FLAG) {
-                REG_PC = mem_fetch_word(REG_PC);
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xD2: /* jp nc, address */
-            if (!CARRY_FLAG) {
-                REG_PC = mem_fetch_word(REG_PC);
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xDA: /* jp c, address */
-            if (CARRY_FLAG) {
-                REG_PC = mem_fetch_word(REG_PC);
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xE2: /* jp po, address */
-            if (!PARITY_FLAG) {
-                REG_PC = mem_fetch_word(REG_PC);
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xEA: /* jp pe, address */
-            if (PARITY_FLAG) {
-                REG_PC = mem_fetch_word(REG_PC);
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xF2: /* jp p, address */
-            if (!SIGN_FLAG) {
-                REG_PC = mem_fetch_word(REG_PC);
-            } else {
-                REG_PC += 2;
-            }
-            break;
-        case 0xFA: /* jp m, address */
-            if (SIGN_FLAG) {
-                REG_PC = mem_fetch_word(REG_PC);
-            } else {
-                REG_PC += 2;
-            }
-            break;
+    OPCODE(ed, 0x5F): /* ld a, r */
+        do_ld_a_ir(REG_R);
+        return;
+    OPCODE(ed, 0x4F): /* ld r, a */
+        z80_state.rf = z80_state.rc = REG_A;
+        return;
 
-        case 0x18: /* jr offset */
-            REG_PC += (int8_t)mem_fetch(REG_PC);
-            REG_PC++;
-            break;
+    OPCODE(ed, 0x4B): /* ld bc, (address) */
+        REG_BC = mem_read_word(op_fetch_word(REG_PC));
+        REG_PC += 2;
+        return;
+    OPCODE(ed, 0x5B): /* ld de, (address) */
+        REG_DE = mem_read_word(op_fetch_word(REG_PC));
+        REG_PC += 2;
+        return;
+    OPCODE(ed, 0x6B): /* ld hl, (address) */
+        /* this instruction is redundant with the 2A instruction */
+        REG_HL = mem_read_word(op_fetch_word(REG_PC));
+        REG_PC += 2;
+        return;
+    OPCODE(ed, 0x7B): /* ld sp, (address) */
+        REG_SP = mem_read_word(op_fetch_word(REG_PC));
+        REG_PC += 2;
+        return;
 
-        case 0x20: /* jr nz, offset */
-            if (!ZERO_FLAG) {
-                REG_PC += (int8_t)mem_fetch(REG_PC);
-                TSTATE += 5;
-            }
-            REG_PC++;
-            break;
-        case 0x28: /* jr z, offset */
-            if (ZERO_FLAG) {
-                REG_PC += (int8_t)mem_fetch(REG_PC);
-                TSTATE += 5;
-            }
-            REG_PC++;
-            break;
-        case 0x30: /* jr nc, offset */
-            if (!CARRY_FLAG) {
-                REG_PC += (int8_t)mem_fetch(REG_PC);
-                TSTATE += 5;
-            }
-            REG_PC++;
-            break;
-        case 0x38: /* jr c, offset */
-            if (CARRY_FLAG) {
-                REG_PC += (int8_t)mem_fetch(REG_PC);
-                TSTATE += 5;
-            }
-            REG_PC++;
-            break;
+    OPCODE(ed, 0x43): /* ld (address), bc */
+        mem_write_word(op_fetch_word(REG_PC), REG_BC);
+        REG_PC += 2;
+        return;
+    OPCODE(ed, 0x53): /* ld (address), de */
+        mem_write_word(op_fetch_word(REG_PC), REG_DE);
+        REG_PC += 2;
+        return;
+    OPCODE(ed, 0x63): /* ld (address), hl */
+        mem_write_word(op_fetch_word(REG_PC), REG_HL);
+        REG_PC += 2;
+        return;
+    OPCODE(ed, 0x73): /* ld (address), sp */
+        mem_write_word(op_fetch_word(REG_PC), REG_SP);
+        REG_PC += 2;
+        return;
 
-        case 0x7F: /* ld a, a */
-            REG_A = REG_A;
-            break;
-        case 0x78: /* ld a, b */
-            REG_A = REG_B;
-            break;
-        case 0x79: /* ld a, c */
-            REG_A = REG_C;
-            break;
-        case 0x7A: /* ld a, d */
-            REG_A = REG_D;
-            break;
-        case 0x7B: /* ld a, e */
-            REG_A = REG_E;
-            break;
-        case 0x7C: /* ld a, h */
-            REG_A = ix->byte.high;
-            break;
-        case 0x7D: /* ld a, l */
-            REG_A = ix->byte.low;
-            break;
-        case 0x47: /* ld b, a */
-            REG_B = REG_A;
-            break;
-        case 0x40: /* ld b, b */
-            REG_B = REG_B;
-            break;
-        case 0x41: /* ld b, c */
-            REG_B = REG_C;
-            break;
-        case 0x42: /* ld b, d */
-            REG_B = REG_D;
-            break;
-        case 0x43: /* ld b, e */
-            REG_B = REG_E;
-            break;
-        case 0x44: /* ld b, h */
-            REG_B = ix->byte.high;
-            break;
-        case 0x45: /* ld b, l */
-            REG_B = ix->byte.low;
-            break;
-        case 0x4F: /* ld c, a */
-            REG_C = REG_A;
-            break;
-        case 0x48: /* ld c, b */
-            REG_C = REG_B;
-            break;
-        case 0x49: /* ld c, c */
-            REG_C = REG_C;
-            break;
-        case 0x4A: /* ld c, d */
-            REG_C = REG_D;
-            break;
-        case 0x4B: /* ld c, e */
-            REG_C = REG_E;
-            break;
-        case 0x4C: /* ld c, h */
-            REG_C = ix->byte.high;
-            break;
-        case 0x4D: /* ld c, l */
-            REG_C = ix->byte.low;
-            break;
-        case 0x57: /* ld d, a */
-            REG_D = REG_A;
-            break;
-        case 0x50: /* ld d, b */
-            REG_D = REG_B;
-            break;
-        case 0x51: /* ld d, c */
-            REG_D = REG_C;
-            break;
-        case 0x52: /* ld d, d */
-            REG_D = REG_D;
-            break;
-        case 0x53: /* ld d, e */
-            REG_D = REG_E;
-            break;
-        case 0x54: /* ld d, h */
-            REG_D = ix->byte.high;
-            break;
-        case 0x55: /* ld d, l */
-            REG_D = ix->byte.low;
-            break;
-        case 0x5F: /* ld e, a */
-            REG_E = REG_A;
-            break;
-        case 0x58: /* ld e, b */
-            REG_E = REG_B;
-            break;
-        case 0x59: /* ld e, c */
-            REG_E = REG_C;
-            break;
-        case 0x5A: /* ld e, d */
-            REG_E = REG_D;
-            break;
-        case 0x5B: /* ld e, e */
-            REG_E = REG_E;
-            break;
-        case 0x5C: /* ld e, h */
-            REG_E = ix->byte.high;
-            break;
-        case 0x5D: /* ld e, l */
-            REG_E = ix->byte.low;
-            break;
-        case 0x67: /* ld h, a */
-            ix->byte.high = REG_A;
-            break;
-        case 0x60: /* ld h, b */
-            ix->byte.high = REG_B;
-            break;
-        case 0x61: /* ld h, c */
-            ix->byte.high = REG_C;
-            break;
-        case 0x62: /* ld h, d */
-            ix->byte.high = REG_D;
-            break;
-        case 0x63: /* ld h, e */
-            ix->byte.high = REG_E;
-            break;
-        case 0x64: /* ld h, h */
-            ix->byte.high = ix->byte.high;
-            break;
-        case 0x65: /* ld h, l */
-            ix->byte.high = ix->byte.low;
-            break;
-        case 0x6F: /* ld l, a */
-            ix->byte.low = REG_A;
-            break;
-        case 0x68: /* ld l, b */
-            ix->byte.low = REG_B;
-            break;
-        case 0x69: /* ld l, c */
-            ix->byte.low = REG_C;
-            break;
-        case 0x6A: /* ld l, d */
-            ix->byte.low = REG_D;
-            break;
-        case 0x6B: /* ld l, e */
-            ix->byte.low = REG_E;
-            break;
-        case 0x6C: /* ld l, h */
-            ix->byte.low = ix->byte.high;
-            break;
-        case 0x6D: /* ld l, l */
-            ix->byte.low = ix->byte.low;
-            break;
+    OPCODE(ed, 0xA8): /* ldd */
+        do_ldid(-1);
+        return;
+    OPCODE(ed, 0xB8): /* lddr */
+        do_ldidr(-1);
+        return;
+    OPCODE(ed, 0xA0): /* ldi */
+        do_ldid(+1);
+        return;
+    OPCODE(ed, 0xB0): /* ldir */
+        do_ldidr(+1);
+        return;
 
-        case 0x02: /* ld (bc), a */
-            mem_write(REG_BC, REG_A);
-            break;
-        case 0x12: /* ld (de), a */
-            mem_write(REG_DE, REG_A);
-            break;
-        case 0x77: /* ld (hl), a */
-            mem_write(get_hl_addr(ix), REG_A);
-            break;
-        case 0x70: /* ld (hl), b */
-            mem_write(get_hl_addr(ix), REG_B);
-            break;
-        case 0x71: /* ld (hl), c */
-            mem_write(get_hl_addr(ix), REG_C);
-            break;
-        case 0x72: /* ld (hl), d */
-            mem_write(get_hl_addr(ix), REG_D);
-            break;
-        case 0x73: /* ld (hl), e */
-            mem_write(get_hl_addr(ix), REG_E);
-            break;
-        case 0x74: /* ld (hl), h */
-            mem_write(get_hl_addr(ix), REG_H);
-            break;
-        case 0x75: /* ld (hl), l */
-            mem_write(get_hl_addr(ix), REG_L);
-            break;
+    OPCODE(ed, 0x44): /* neg */
+    OPCODE(ed, 0x4C):
+    OPCODE(ed, 0x54):
+    OPCODE(ed, 0x5C):
+    OPCODE(ed, 0x64):
+    OPCODE(ed, 0x6C):
+    OPCODE(ed, 0x74):
+    OPCODE(ed, 0x7C):
+        do_negate();
+        return;
 
-        case 0x7E: /* ld a, (hl) */
-            REG_A = mem_read(get_hl_addr(ix));
-            break;
-        case 0x46: /* ld b, (hl) */
-            REG_B = mem_read(get_hl_addr(ix));
-            break;
-        case 0x4E: /* ld c, (hl) */
-            REG_C = mem_read(get_hl_addr(ix));
-            break;
-        case 0x56: /* ld d, (hl) */
-            REG_D = mem_read(get_hl_addr(ix));
-            break;
-        case 0x5E: /* ld e, (hl) */
-            REG_E = mem_read(get_hl_addr(ix));
-            break;
-        case 0x66: /* ld h, (hl) */
-            REG_H = mem_read(get_hl_addr(ix));
-            break;
-        case 0x6E: /* ld l, (hl) */
-            REG_L = mem_read(get_hl_addr(ix));
-            break;
+    OPCODE(ed, 0x79): /* out (c), a */
+        z80_out(REG_C, REG_A);
+        return;
+    OPCODE(ed, 0x41): /* out (c), b */
+        z80_out(REG_C, REG_B);
+        return;
+    OPCODE(ed, 0x49): /* out (c), c */
+        z80_out(REG_C, REG_C);
+        return;
+    OPCODE(ed, 0x51): /* out (c), d */
+        z80_out(REG_C, REG_D);
+        return;
+    OPCODE(ed, 0x59): /* out (c), e */
+        z80_out(REG_C, REG_E);
+        return;
+    OPCODE(ed, 0x61): /* out (c), h */
+        z80_out(REG_C, REG_H);
+        return;
+    OPCODE(ed, 0x69): /* out (c), l */
+        z80_out(REG_C, REG_L);
+        return;
+    OPCODE(ed, 0x71): /* out (c), 0 */
+        z80_out(REG_C, 0);
+        return;
 
-        case 0x3E: /* ld a, value */
-            REG_A = mem_fetch(REG_PC++);
-            break;
-        case 0x06: /* ld b, value */
-            REG_B = mem_fetch(REG_PC++);
-            break;
-        case 0x0E: /* ld c, value */
-            REG_C = mem_fetch(REG_PC++);
-            break;
-        case 0x16: /* ld d, value */
-            REG_D = mem_fetch(REG_PC++);
-            break;
-        case 0x1E: /* ld e, value */
-            REG_E = mem_fetch(REG_PC++);
-            break;
-        case 0x26: /* ld h, value */
-            ix->byte.high = mem_fetch(REG_PC++);
-            break;
-        case 0x2E: /* ld l, value */
-            ix->byte.low = mem_fetch(REG_PC++);
-            break;
+    OPCODE(ed, 0xAB): /* outd */
+        do_outid(-1);
+        return;
+    OPCODE(ed, 0xBB): /* outdr */
+        do_outidr(-1);
+        return;
+    OPCODE(ed, 0xA3): /* outi */
+        do_outid(+1);
+        return;
+    OPCODE(ed, 0xB3): /* outir */
+        do_outidr(+1);
+        return;
 
-        case 0x01: /* ld bc, value */
-            REG_BC = mem_fetch_word(REG_PC);
-            REG_PC += 2;
-            break;
-        case 0x11: /* ld de, value */
-            REG_DE = mem_fetch_word(REG_PC);
-            REG_PC += 2;
-            break;
-        case 0x21: /* ld hl, value */
-            ix->word = mem_fetch_word(REG_PC);
-            REG_PC += 2;
-            break;
-        case 0x31: /* ld sp, value */
-            REG_SP = mem_fetch_word(REG_PC);
-            REG_PC += 2;
-            break;
+    OPCODE(ed, 0x4D): /* reti */
+    OPCODE(ed, 0x5D):
+    OPCODE(ed, 0x6D):
+    OPCODE(ed, 0x7D): {
+        REG_PC = mem_read_word(REG_SP);
+        REG_SP += 2;
+        z80_state.iff1 = z80_state.iff2;
+        z80_attention(Z80_ATTN_EOI); /* Send EOI before next instruction */
+        if (z80_state.iff1)
+            z80_attention(Z80_ATTN_IRQ);
+    } return;
+
+    OPCODE(ed, 0x45): /* retn */
+    OPCODE(ed, 0x55):
+    OPCODE(ed, 0x65):
+    OPCODE(ed, 0x75):
+        REG_PC = mem_read_word(REG_SP);
+        REG_SP += 2;
+        z80_state.iff1 = z80_state.iff2;
+        z80_state.nmi_in_progress = false;
+        if (z80_state.nminterrupt)
+            z80_attention(Z80_ATTN_NMI);
+        if (z80_state.iff1)
+            z80_attention(Z80_ATTN_IRQ);
+        return;
 
-        case 0x3A: /* ld a, (address) */
-            /* this one is missing from Zaks */
-            REG_A = mem_read(mem_fetch_word(REG_PC));
-            REG_PC += 2;
-            break;
+    OPCODE(ed, 0x6F): /* rld */
+        do_rld();
+        return;
 
-        case 0x0A: /* ld a, (bc) */
-            REG_A = mem_read(REG_BC);
-            break;
-        case 0x1A: /* ld a, (de) */
-            REG_A = mem_read(REG_DE);
-            break;
+    OPCODE(ed, 0x67): /* rrd */
+        do_rrd();
+        return;
 
-        case 0x32: /* ld (address), a */
-            mem_write(mem_fetch_word(REG_PC), REG_A);
-            REG_PC += 2;
-            break;
+    OPCODE(ed, 0x42): /* sbc hl, bc */
+        do_sbc_word(REG_BC);
+        return;
+    OPCODE(ed, 0x52): /* sbc hl, de */
+        do_sbc_word(REG_DE);
+        return;
+    OPCODE(ed, 0x62): /* sbc hl, hl */
+        do_sbc_word(REG_HL);
+        return;
+    OPCODE(ed, 0x72): /* sbc hl, sp */
+        do_sbc_word(REG_SP);
+        return;
 
-        case 0x22: /* ld (address), hl */
-            mem_write_word(mem_fetch_word(REG_PC), ix->word);
-            REG_PC += 2;
-            break;
+    DEFAULT(ed):
+        /* Assume all others are NOP */
+        return;
+    }
+}
 
-        case 0x36: /* ld (hl), value */
-        {
-            uint16_t addr = get_hl_addr(ix);
-            mem_write(addr, mem_fetch(REG_PC++));
-            break;
+#if Z80_JIT
+/*
+ * Support for translated code (see z80jit.c)
+ */
+static void jit_cb(const struct z80_insn* insn, uint16_t pc)
+{
+    set_insn(insn, pc);
+    REG_PC = pc + insn->oplen;
+    if (insn->index)
+        do_xCB_instruction(insn->index == 1 ? REG_IX : REG_IY);
+    else
+        do_CB_instruction();
+    sync_flags();
+}
+
+static void jit_ed(const struct z80_insn* insn, uint16_t pc)
+{
+    set_insn(insn, pc);
+    REG_PC = pc + insn->oplen;
+    do_ED_instruction();
+    sync_flags();
+}
+
+/* Translated code uses F directly, so it has to be up to date */
+#    define JIT_FLAGS(op)                                                      \
+        static void jit_##op(int value)                                        \
+        {                                                                      \
+            op(value);                                                         \
+            sync_flags();                                                      \
         }
 
-        case 0x2A: /* ld hl, (address) */
-            ix->word = mem_read_word(mem_fetch_word(REG_PC));
-            REG_PC += 2;
-            break;
+JIT_FLAGS(do_add_byte)
+JIT_FLAGS(do_adc_byte)
+JIT_FLAGS(do_sub_byte)
+JIT_FLAGS(do_sbc_byte)
+JIT_FLAGS(do_and_byte)
+JIT_FLAGS(do_xor_byte)
+JIT_FLAGS(do_or_byte)
+JIT_FLAGS(do_cp)
+JIT_FLAGS(do_flags_inc_byte)
+JIT_FLAGS(do_flags_dec_byte)
+
+const struct z80_jit_helpers z80_jit_helpers = {
+    .code_base = &code_cache.base,
+    .alu = {jit_do_add_byte, jit_do_adc_byte, jit_do_sub_byte, jit_do_sbc_byte,
+            jit_do_and_byte, jit_do_xor_byte, jit_do_or_byte, jit_do_cp},
+    .inc_flags = jit_do_flags_inc_byte,
+    .dec_flags = jit_do_flags_dec_byte,
+    .add_word = do_add_word,
+    .rot_a = {do_rlca, do_rrca, do_rla, do_rra},
+    .daa = do_daa,
+    .cb = jit_cb,
+    .ed = jit_ed,
+};
 
-        case 0xF9: /* ld sp, hl */
-            REG_SP = ix->word;
-            break;
+/*
+ * Run the translated block at PC, translating it first once it has
+ * been entered often enough.  Not while an interrupt is waiting to be
+ * taken at the next instruction boundary (after EI.)
+ */
+static bool jit_run(void)
+{
+    uint16_t pc = REG_PC;
+    struct z80_insn* insn;
+
+    if ((pc & ~MEM_PAGE_MASK) != code_cache.base)
+        return false;
+
+    insn = &code_cache.cp->insn[pc & MEM_PAGE_MASK];
+    if (!insn->oplen)
+        return false;
+
+    if (!insn->jit) {
+        if (++insn->hits < Z80_JIT_THRESHOLD)
+            return false;
+        insn->jit = z80_jit_translate(code_cache.cp, pc);
+        if (!insn->jit)
+            return false; /* Flushed */
+    }
 
-        case 0x00: /* nop */
-            break;
+    if (insn->jit == Z80_JIT_NONE || insn->dispatch >= Z80_DISPATCH_SPECIAL)
+        return false;
 
-        case 0xF6: /* or value */
-            do_or_byte(mem_fetch(REG_PC++));
-            break;
+    if ((z80_state.nminterrupt && !z80_state.nmi_in_progress) ||
+        (z80_state.iff1 && poll_irq()))
+        return false;
 
-        case 0xB7: /* or a */
-            do_or_byte(REG_A);
-            break;
-        case 0xB0: /* or b */
-            do_or_byte(REG_B);
-            break;
-        case 0xB1: /* or c */
-            do_or_byte(REG_C);
-            break;
-        case 0xB2: /* or d */
-            do_or_byte(REG_D);
-            break;
-        case 0xB3: /* or e */
-            do_or_byte(REG_E);
-            break;
-        case 0xB4: /* or h */
-            do_or_byte(ix->byte.high);
-            break;
-        case 0xB5: /* or l */
-            do_or_byte(ix->byte.low);
-            break;
+    /* Not when a read has to be reported as soon as it is done */
+    if (mem_watch_reads)
+        return false;
 
-        case 0xB6: /* or (hl) */
-            do_or_byte(mem_read(get_hl_addr(ix)));
-            break;
+    sync_flags();
+    return z80_jit_run(insn->jit);
+}
+#endif
 
-        case 0xD3: /* out (port), a */
-            z80_out(mem_fetch(REG_PC++), REG_A);
-            break;
+static inline void check_eoi(void)
+{
+    if (likely(!(z80_state.attention & (1U << Z80_ATTN_EOI))) ||
+        !atomic_test_clear_bit(&z80_state.attention, Z80_ATTN_EOI))
+        return;
 
-        case 0xC1: /* pop bc */
-            REG_BC = mem_read_word(REG_SP);
-            REG_SP += 2;
-            break;
-        case 0xD1: /* pop de */
-            REG_DE = mem_read_word(REG_SP);
-            REG_SP += 2;
-            break;
-        case 0xE1: /* pop hl */
-            ix->word = mem_read_word(REG_SP);
-            REG_SP += 2;
-            break;
-        case 0xF1: /* pop af */
-            REG_AF = mem_read_word(REG_SP);
-            REG_SP += 2;
-            break;
+    if (tracing(TRACE_IO)) {
+        fprintf(tracef, "[%12" PRIu64 "] EOI: RETI executed\n", TSTATE);
+    }
 
-        case 0xC5: /* push bc */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_BC);
-            break;
-        case 0xD5: /* push de */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_DE);
-            break;
-        case 0xE5: /* push hl */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, ix->word);
-            break;
-        case 0xF5: /* push af */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_AF);
-            break;
+    z80_eoi();
+}
 
-        case 0xC9: /* ret */
-            REG_PC = mem_read_word(REG_SP);
-            REG_SP += 2;
-            break;
+/* Report the watchpoints hit by the instruction just run */
+static inline void check_watch(void)
+{
+    if (likely(!(z80_state.attention & (1U << Z80_ATTN_WATCH))) ||
+        !atomic_test_clear_bit(&z80_state.attention, Z80_ATTN_WATCH))
+        return;
 
-        case 0xC0: /* ret nz */
-            if (!ZERO_FLAG) {
-                REG_PC = mem_read_word(REG_SP);
-                REG_SP += 2;
-                TSTATE += 6;
-            }
-            break;
-        case 0xC8: /* ret z */
-            if (ZERO_FLAG) {
-                REG_PC = mem_read_word(REG_SP);
-                REG_SP += 2;
-                TSTATE += 6;
-            }
-            break;
-        case 0xD0: /* ret nc */
-            if (!CARRY_FLAG) {
-                REG_PC = mem_read_word(REG_SP);
-                REG_SP += 2;
-                TSTATE += 6;
-            }
-            break;
-        case 0xD8: /* ret c */
-            if (CARRY_FLAG) {
-                REG_PC = mem_read_word(REG_SP);
-                REG_SP += 2;
-                TSTATE += 6;
-            }
-            break;
-        case 0xE0: /* ret po */
-            if (!PARITY_FLAG) {
-                REG_PC = mem_read_word(REG_SP);
-                REG_SP += 2;
-                TSTATE += 6;
-            }
-            break;
-        case 0xE8: /* ret pe */
-            if (PARITY_FLAG) {
-                REG_PC = mem_read_word(REG_SP);
-                REG_SP += 2;
-                TSTATE += 6;
-            }
-            break;
-        case 0xF0: /* ret p */
-            if (!SIGN_FLAG) {
-                REG_PC = mem_read_word(REG_SP);
-                REG_SP += 2;
-                TSTATE += 6;
-            }
-            break;
-        case 0xF8: /* ret m */
-            if (SIGN_FLAG) {
-                REG_PC = mem_read_word(REG_SP);
-                REG_SP += 2;
-                TSTATE += 6;
-            }
-            break;
+    mem_watch_report(TSTATE);
+}
 
-        case 0x17: /* rla */
-            do_rla();
-            break;
+/*
+ * Check for an interrupt; returns true if one was taken.  An attention
+ * bit for an interrupt which cannot be taken yet is dropped; RETN, EI
+ * and EOI raise it again when that changes.  After EI, the IRQ bit is
+ * kept for the instruction in the shadow.
+ */
+static inline bool check_interrupts(void)
+{
+    const unsigned int attn = z80_state.attention;
+
+    if (likely(!(attn & ((1U << Z80_ATTN_NMI) | (1U << Z80_ATTN_IRQ)))))
+        return false;
+
+    if (nmi_pending()) {
+        idle_epoch++;
+        do_nmi();
+        return true;
+    } else if (int_pending()) {
+        idle_epoch++;
+        do_int();
+        return true;
+    }
 
-        case 0x07: /* rlca */
-            do_rlca();
-            break;
+    /* Check again after clearing, so a new request is not lost */
+    if (attn & (1U << Z80_ATTN_NMI)) {
+        atomic_clear_bit(&z80_state.attention, Z80_ATTN_NMI);
+        if (nmi_pending())
+            z80_attention(Z80_ATTN_NMI);
+    }
+    if ((attn & (1U << Z80_ATTN_IRQ)) && !z80_state.ei_shadow) {
+        atomic_clear_bit(&z80_state.attention, Z80_ATTN_IRQ);
+        if (int_pending())
+            z80_attention(Z80_ATTN_IRQ);
+    }
+    return false;
+}
 
-        case 0x1F: /* rra */
-            do_rra();
-            break;
+/*
+ * Compare memory as seen by the CPU with the copy from the last call,
+ * and update the copy.  Only the pages which have been written to or
+ * mapped differently since then need looking at.
+ */
+static bool idle_mem_same(void)
+{
+    static uint8_t mem[Z80_ADDRESS_LIMIT];
+    static const uint8_t* mapped[MEM_PAGE_COUNT];
+    uint64_t dirty[2];
+    unsigned int addr, page, d;
+    bool same = true;
+
+    dirty[0] = mem_dirty_fetch(MEM_DIRTY_IDLE, 0, 64);
+    dirty[1] = mem_dirty_fetch(MEM_DIRTY_IDLE, 64, MEM_DIRTY_PAGES - 64);
+    dirty[1] |= UINT64_C(1) << (MEM_DIRTY_OTHER - 64);
+
+    for (addr = 0; addr < Z80_ADDRESS_LIMIT; addr += MEM_PAGE_SIZE) {
+        const uint8_t* data = mem_get_page(addr)->data;
+
+        page = addr >> MEM_PAGE_SHIFT;
+        d = mem_view->dirty[page] - mem_dirty;
+        if (data == mapped[page] && !((dirty[d >> 6] >> (d & 63)) & 1))
+            continue;
+        mapped[page] = data;
+
+        if (memcmp(&mem[addr], data, MEM_PAGE_SIZE)) {
+            memcpy(&mem[addr], data, MEM_PAGE_SIZE);
+            same = false;
+        }
+    }
+    return same;
+}
 
-        case 0x0F: /* rrca */
-            do_rrca();
-            break;
+/*
+ * The head of an idle loop has just been fetched.  If the registers
+ * and then all of memory are the same as the last time around, with no
+ * poll or interrupt since, the next pass will be the same again, and
+ * so will all the passes until the run deadline; skip them, leaving
+ * the rest of the last one to run normally.  Returns the dispatch for
+ * the instruction itself.
+ */
+static unsigned int idle_loop(void)
+{
+    static struct
+    {
+        wordregister regs[12]; /* AF through HL' */
+        uint64_t tc;
+        unsigned int epoch;
+        uint8_t rc;
+        bool mem; /* idle_mem_same() has a copy from the last time */
+    } last;
+    const struct z80_insn* insn = fetch_insn(last_m1_address);
+    uint64_t start, n;
+    unsigned int clk;
+
+    if (tracing(TRACE_CPU) || mem_watch_reads)
+        goto done; /* Every pass has to be seen */
+
+    sync_flags();
+    if (last.epoch != idle_epoch ||
+        memcmp(last.regs, &z80_state, sizeof last.regs)) {
+        memcpy(last.regs, &z80_state, sizeof last.regs);
+        last.epoch = idle_epoch;
+        last.mem = false;
+    } else if (!last.mem) {
+        idle_mem_same();
+        last.mem = true;
+    } else if (idle_mem_same()) {
+        /* Passes of clk T-states from the start of this one */
+        clk = TSTATE - last.tc;
+        start = TSTATE - insn->clk;
+        if (clk && z80_run_deadline > start + clk) {
+            n = (z80_run_deadline - 1 - start) / clk;
+            TSTATE += n * clk;
+            add_r(n * (uint8_t)(z80_state.rc - last.rc));
+            z80_idle = true;
+        }
+    }
+    last.tc = TSTATE;
+    last.rc = z80_state.rc;
 
-        case 0xC7: /* rst 00h */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_PC);
-            REG_PC = 0x00;
-            break;
-        case 0xCF: /* rst 08h */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_PC);
-            REG_PC = 0x08;
-            break;
-        case 0xD7: /* rst 10h */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_PC);
-            REG_PC = 0x10;
-            break;
-        case 0xDF: /* rst 18h */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_PC);
-            REG_PC = 0x18;
-            break;
-        case 0xE7: /* rst 20h */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_PC);
-            REG_PC = 0x20;
-            break;
-        case 0xEF: /* rst 28h */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_PC);
-            REG_PC = 0x28;
-            break;
-        case 0xF7: /* rst 30h */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_PC);
-            REG_PC = 0x30;
-            break;
-        case 0xFF: /* rst 38h */
-            REG_SP -= 2;
-            mem_write_word(REG_SP, REG_PC);
-            REG_PC = 0x38;
-            break;
+done:
+    return insn->index << 8 | insn->bytes[0];
+}
 
-        case 0x37: /* scf */
-            REG_F = (REG_F | CARRY_MASK) & ~(SUBTRACT_MASK | HALF_CARRY_MASK);
-            break;
+/*
+ * The entry point of a trap has just been fetched.  Returns TRAP if
+ * the trap function did the work, in which case the state is as of
+ * the return from the routine (apart from any time left to charge with
+ * z80_stall()), and otherwise the dispatch for the
+ * instruction itself.  Traps are not taken when tracing, so that the
+ * trace shows the real code.
+ */
+static unsigned int run_trap(void)
+{
+    const uint16_t pc = last_m1_address;
+    const struct z80_insn* insn = fetch_insn(pc);
+    const int t = find_trap(pc);
+    bool done;
+
+    if (t < 0 || in_trap || tracing(TRACE_CPU))
+        goto done;
+
+    /* Back out the fetch; the trap function starts at the entry point */
+    REG_PC = pc;
+    TSTATE -= insn->clk;
+    add_r(-insn->oplen);
+    sync_flags();
+
+    in_trap = true;
+    done = traps[t].func(traps[t].arg);
+    in_trap = false;
+    if (done)
+        return TRAP;
+
+    insn = fetch_insn(pc);
+    REG_PC = pc + insn->oplen;
+    TSTATE += insn->clk;
+    add_r(insn->oplen);
+
+done:
+    return insn->index << 8 | insn->bytes[0];
+}
 
-        case 0x9F: /* sbc a, a */
-            do_sbc_byte(REG_A);
-            break;
-        case 0x98: /* sbc a, b */
-            do_sbc_byte(REG_B);
-            break;
-        case 0x99: /* sbc a, c */
-            do_sbc_byte(REG_C);
-            break;
-        case 0x9A: /* sbc a, d */
-            do_sbc_byte(REG_D);
-            break;
-        case 0x9B: /* sbc a, e */
-            do_sbc_byte(REG_E);
-            break;
-        case 0x9C: /* sbc a, h */
-            do_sbc_byte(ix->byte.high);
-            break;
-        case 0x9D: /* sbc a, l */
-            do_sbc_byte(ix->byte.low);
-            break;
-        case 0xDE: /* sbc a, value */
-            do_sbc_byte(mem_fetch(REG_PC++));
-            break;
-        case 0x9E: /* sbc a, (hl) */
-            do_sbc_byte(mem_read(get_hl_addr(ix)));
-            break;
+/*
+ * Run the routine at PC until it returns to the address on the top of
+ * the stack, and any arguments above it which it drops, with interrupts
+ * held off and no traps taken, so that a trap function can check itself
+ * against the real code.  Returns false if it has not returned after
+ * limit T-states.
+ */
+bool z80_run_subroutine(uint64_t limit)
+{
+    const uint64_t deadline = z80_run_deadline, end = TSTATE + limit;
+    const uint16_t ret = mem_read_word(REG_SP), sp = REG_SP + 2;
+    const bool iff1 = z80_state.iff1, nmi = z80_state.nmi_in_progress;
+    bool done;
 
-        case 0x97: /* sub a, a */
-            do_sub_byte(REG_A);
-            break;
-        case 0x90: /* sub a, b */
-            do_sub_byte(REG_B);
-            break;
-        case 0x91: /* sub a, c */
-            do_sub_byte(REG_C);
-            break;
-        case 0x92: /* sub a, d */
-            do_sub_byte(REG_D);
-            break;
-        case 0x93: /* sub a, e */
-            do_sub_byte(REG_E);
-            break;
-        case 0x94: /* sub a, h */
-            do_sub_byte(ix->byte.high);
-            break;
-        case 0x95: /* sub a, l */
-            do_sub_byte(ix->byte.low);
-            break;
-        case 0xD6: /* sub a, value */
-            do_sub_byte(mem_fetch(REG_PC++));
-            break;
-        case 0x96: /* sub a, (hl) */
-            do_sub_byte(mem_read(get_hl_addr(ix)));
-            break;
+    z80_state.iff1 = false;
+    z80_state.nmi_in_progress = true;
+    while (!(done = REG_PC == ret && REG_SP >= sp) && TSTATE < end)
+        z80_run_until(TSTATE + 1, false);
+    z80_state.iff1 = iff1;
+    z80_state.nmi_in_progress = nmi;
+
+    /* Anything which came in meanwhile was dropped by check_interrupts() */
+    if (nmi_pending())
+        z80_attention(Z80_ATTN_NMI);
+    if (int_pending())
+        z80_attention(Z80_ATTN_IRQ);
+
+    z80_run_deadline = deadline;
+    return done;
+}
 
-        case 0xEE: /* xor value */
-            do_xor_byte(mem_fetch(REG_PC++));
-            break;
+/*
+ * The CPU loop keeps PC, SP and the T-state counter in the locals pc, sp
+ * and tstate, so that they can stay in host registers.  REGS_OUT()
+ * stores them into z80_state, for anything outside the loop which may
+ * look at them; REGS_IN() loads them back after anything which may have
+ * changed them.
+ */
+#define REGS_OUT()                                                             \
+    (z80_state.pc.word = pc, z80_state.sp.word = sp, z80_state.tc = tstate)
+#define REGS_IN()                                                              \
+    (pc = z80_state.pc.word, sp = z80_state.sp.word, tstate = z80_state.tc)
+#define REGS_CALL(call)                                                        \
+    do {                                                                       \
+        REGS_OUT();                                                            \
+        call;                                                                  \
+        REGS_IN();                                                             \
+    } while (0)
 
-        case 0xAF: /* xor a */
-            do_xor_byte(REG_A);
-            break;
-        case 0xA8: /* xor b */
-            do_xor_byte(REG_B);
-            break;
-        case 0xA9: /* xor c */
-            do_xor_byte(REG_C);
-            break;
-        case 0xAA: /* xor d */
-            do_xor_byte(REG_D);
-            break;
-        case 0xAB: /* xor e */
-            do_xor_byte(REG_E);
-            break;
-        case 0xAC: /* xor h */
-            do_xor_byte(ix->byte.high);
-            break;
-        case 0xAD: /* xor l */
-            do_xor_byte(ix->byte.low);
-            break;
-        case 0xAE: /* xor (hl) */
-            do_xor_byte(mem_read(get_hl_addr(ix)));
-            break;
+/*
+ * End of a main-group handler.  The threaded version fetches and
+ * dispatches the next instruction directly until the run deadline,
+ * unless an attention bit is set; the full loop in z80loop.h sets the
+ * deadline to 0 whenever it has to see every instruction (tracing or
+ * looking for translated code.)
+ */
+#if Z80_THREADED_DISPATCH
+#    define NEXT_INSTRUCTION                                                   \
+        {                                                                      \
+            if (unlikely(z80_state.attention || tstate >= deadline))           \
+                continue;                                                      \
+            FETCH_INSTRUCTION();                                               \
+            goto* main_table[instruction];                                     \
+        }
+#else
+#    define NEXT_INSTRUCTION break
+#endif
+
+/* Finish the trace line for an instruction with what it changed */
+static void trace_end(void)
+{
+    sync_flags();
+    diffstate();
+    tracemem();
+    fputc('\n', tracef);
+}
+
+/*
+ * Instantiate the CPU loop with and without tracing, and for the exact
+ * profile; z80_run() runs the one matching the trace and profile flags.
+ */
+#define RUN_RETRACE 2
+
+#undef TRACED
+#define TRACED false
+#define PROFILED false
+#define RUN_LOOP run_untraced
+#include "z80loop.h"
+#undef RUN_LOOP
+
+#undef TRACED
+#define TRACED true
+#define RUN_LOOP run_traced
+#include "z80loop.h"
+#undef RUN_LOOP
+
+#undef TRACED
+#undef PROFILED
+#define TRACED false
+#define PROFILED true
+#define RUN_LOOP run_profiled
+#include "z80loop.h"
+#undef RUN_LOOP
+#undef PROFILED
+
+#undef TRACED
+#define TRACED tracing(TRACE_CPU)
+
+/*
+ * Run at least one instruction, and then until TSTATE reaches deadline
+ * or z80_quit is signalled.  Interrupts are taken as they come in, but
+ * nothing is polled; timers and devices are up to the caller.  Returns
+ * true if the CPU is halted.
+ */
+int z80_run_until(uint64_t deadline, bool halted)
+{
+    static bool was_traced;
+    int status;
+
+    z80_run_deadline = deadline;
+    idle_epoch++; /* Anything may have changed since the last time */
+    do {
+        if (tracing(TRACE_CPU)) {
+            if (!was_traced)
+                trace_end(); /* Registers as of when tracing started */
+            was_traced = true;
+            status = run_traced(halted);
+        } else if (profile_flags & PROFILE_EXACT) {
+            was_traced = false;
+            status = run_profiled(halted);
+        } else {
+            was_traced = false;
+            status = run_untraced(halted);
         }
+        halted = status & ~RUN_RETRACE;
+    } while (status & RUN_RETRACE);
+
+    sync_flags();
+    return halted;
+}
+
+/*
+ * Run one instruction, or in slices up to the next time
+ * z80_poll_external() has anything to do until it says to stop.
+ */
+int z80_run(bool continuous, bool halted)
+{
+    do {
+        if (z80_poll_external())
+            break;
+        halted = z80_run_until(continuous ? z80_poll_deadline() : TSTATE + 1,
+                               halted);
     } while (continuous);
+
     return halted;
 }
 
 void z80_reset(void)
 {
+    init_flag_tables();
+
     REG_PC = 0;
+    stall_end();
     z80_state.i = 0;
     z80_state.iff1 = false;
     z80_state.iff2 = false;
     z80_state.ei_shadow = false;
     z80_state.interrupt_mode = 0;
     z80_state.nmi_in_progress = false;
-    z80_state.signal_eoi = false;
+    atomic_clear_bit(&z80_state.attention, Z80_ATTN_EOI);
+    if (z80_state.nminterrupt)
+        z80_attention(Z80_ATTN_NMI);
     /* z80_state.r = 0; */
 }
 
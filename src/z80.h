@@ -19,8 +19,6 @@
 #include "compiler.h"
 #include "trace.h"
 
-#include <SDL.h>
-
 struct twobyte
 {
 #if WORDS_LITTLEENDIAN
@@ -68,11 +66,13 @@ struct z80_state_struct
     uint8_t rf; /* fixed part of register R (bit 7) */
 
     uint8_t interrupt_mode;
-    bool iff1, iff2, ei_shadow, signal_eoi;
+    bool iff1, iff2, ei_shadow;
 
     bool nmi_in_progress;      /* to prevent multiple simultaneous NMIs */
     volatile bool nminterrupt; /* used to signal a non maskable interrupt */
 
+    volatile unsigned int attention; /* Z80_ATTN_* work for the CPU loop */
+
     uint64_t tc; /* T-state (clock cycle) counter */
 };
 
@@ -168,14 +168,57 @@ struct z80_state_struct
 #define SIGN_FLAG (REG_F & SIGN_MASK)
 
 extern struct z80_state_struct z80_state;
+
+/*
+ * Bits in z80_state.attention.  The CPU loop only tests this word
+ * (and its poll deadline) between instructions, so anything that may
+ * need the slow path taken has to set a bit here.  The loop clears
+ * NMI and IRQ again once it finds nothing it can take yet.
+ */
+enum z80_attn
+{
+    Z80_ATTN_NMI,      /* z80_nmi(), or RETN with another NMI waiting */
+    Z80_ATTN_IRQ,      /* z80_interrupt(), EI, RETI/RETN or EOI */
+    Z80_ATTN_EOI,      /* RETI executed, send EOI before next instruction */
+    Z80_ATTN_QUIT,     /* z80_quit set */
+    Z80_ATTN_WATCH,    /* Watchpoint hit, for mem_watch_report() */
+    Z80_ATTN_DEADLINE, /* z80_run_deadline lowered by z80_shorten_run() */
+    Z80_ATTN_STALL,    /* z80_stall() time left to charge */
+};
+
+static inline void z80_attention(enum z80_attn what)
+{
+    atomic_set_bit(&z80_state.attention, what);
+}
+
 /* Signal an NMI */
 static inline void z80_nmi(void)
 {
     z80_state.nminterrupt = true;
+    z80_attention(Z80_ATTN_NMI);
 }
 
 extern void z80_reset(void);
 extern int z80_run(bool, bool);
+extern int z80_run_until(uint64_t, bool);
+extern uint64_t z80_run_deadline;
+
+/* Make the running z80_run_until() return by when, if that is sooner */
+static inline void z80_shorten_run(uint64_t when)
+{
+    if (when < z80_run_deadline) {
+        z80_run_deadline = when;
+        z80_attention(Z80_ATTN_DEADLINE);
+    }
+}
+
+extern bool z80_idle;
+extern void z80_add_idle_loop(uint16_t);
+typedef bool (*z80_trap_func)(void*);
+extern void z80_add_trap(uint16_t, z80_trap_func, void*);
+extern void z80_stall(uint64_t);
+extern bool z80_run_subroutine(uint64_t);
+extern void z80_code_changed(void);
 extern uint8_t mem_read(uint16_t);
 extern uint8_t mem_fetch(uint16_t);
 extern uint8_t mem_fetch_m1(uint16_t);
@@ -185,15 +228,83 @@ extern uint8_t* mem_get_addr(uint16_t);
 extern uint16_t mem_read_word(uint16_t);
 extern uint16_t mem_fetch_word(uint16_t);
 extern void mem_write_word(uint16_t, uint16_t);
+extern void mem_move(uint16_t, uint16_t, unsigned int);
+extern void mem_fill(uint16_t, uint8_t, unsigned int);
 extern void tracemem(void);
 extern void z80_out(int, uint8_t);
 extern int z80_in(int);
+extern size_t z80_out_block(int, const uint8_t*, size_t);
+extern size_t z80_in_block(int, uint8_t*, size_t);
 extern int disassemble(int);
 extern int DAsm(uint16_t pc, char* T, int* target);
+extern void z80_opcode_name(char* T, int table, char XReg, uint8_t I);
 extern bool z80_poll_external(void);
+extern uint64_t z80_poll_deadline(void);
 
 extern uint8_t ram[]; /* Array for plain RAM */
 
+/*
+ * Memory is mapped in pages of this size
+ */
+#define MEM_PAGE_SHIFT 10
+#define MEM_PAGE_SIZE (1U << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE - 1)
+#define MEM_PAGE_COUNT (Z80_ADDRESS_LIMIT / MEM_PAGE_SIZE)
+
+/*
+ * Count the instructions executed, by opcode (see z80_opstats_dump())
+ */
+#ifndef Z80_OPSTATS
+#    define Z80_OPSTATS 0
+#endif
+
+extern void z80_opstats_dump(void);
+
+/*
+ * A predecoded instruction.  Any DD/FD prefixes are folded into the
+ * instruction; bytes[] holds the opcode following them and its operands.
+ */
+struct z80_insn
+{
+    uint16_t len;      /* Total length in bytes */
+    uint16_t oplen;    /* Prefix and opcode bytes; 0 = not decoded */
+    uint16_t clk;      /* Base T-states for prefixes and opcode */
+    uint16_t run_clk;  /* Base T-states from here to the end of the block */
+    uint32_t jit;      /* Translated block starting here (see z80jit.c) */
+    uint8_t index;     /* 0 = HL, 1 = IX, 2 = IY; 0 if not using HL */
+    uint8_t hits;      /* Times entered before being translated */
+    uint8_t bytes[4];
+    uint16_t dispatch; /* Handler in the CPU loop: index << 8 | opcode */
+#if Z80_OPSTATS
+    uint16_t stat; /* Slot in the opcode statistics */
+#endif
+};
+
+/* z80_insn.dispatch for idle loops and traps, which the CPU loop handles */
+#define Z80_DISPATCH_SPECIAL (3 << 8)
+
+/*
+ * Decoded instructions for one page of memory, indexed by the offset
+ * into the page.  Shared between all the mappings of the same memory.
+ */
+struct code_page
+{
+    bool stale;          /* Written to since decoded */
+    bool hooked;         /* Writes are being watched */
+    unsigned int resets; /* Number of times flushed due to writes */
+    struct z80_insn insn[MEM_PAGE_SIZE];
+};
+
+extern uint16_t last_m1_address;
+extern struct code_page* mem_code_page(uint16_t addr);
+extern void mem_flush_code(void);
+
+/* Latch an M1 address without fetching */
+static inline void mem_set_m1(uint16_t address)
+{
+    last_m1_address = address;
+}
+
 extern void mem_init(unsigned int flags, const char* memfile);
 #define MEMFL_NOBASIC 1
 #define MEMFL_NODEV 2
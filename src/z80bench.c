@@ -0,0 +1,799 @@
+/*
+ * Headless benchmark of the Z80 core
+ *
+ * Runs a set of workloads on the CPU core and memory map alone, without
+ * SDL, a screen or real time: BASIC programs run by the ABC80 ROM,
+ * synthetic loops of block moves, arithmetic and memory accesses, and
+ * optionally a CP/M exerciser such as ZEXDOC given as an Intel hex
+ * file.  Everything runs by the T-state counter, so each workload
+ * executes exactly the same instructions every time.
+ *
+ * Each workload is run twice: once an instruction at a time to count
+ * the instructions, and once flat out to time them.  The results are
+ * written to stdout as CSV, one line per workload, and for the
+ * exerciser one more line per test with whether its CRC was right.
+ * A failed test makes the exit status 1.
+ *
+ * With -r, it instead runs random instructions and prints digests of
+ * the machine state, for comparing builds of the core which should
+ * behave the same (the lazy_flags test.)
+ */
+#include "compiler.h"
+#include "abcio.h"
+#include "abcmem.h"
+#include "abcprintd.h"
+#include "clock.h"
+#include "nstime.h"
+#include "screen.h"
+#include "trace.h"
+#include "z80.h"
+#include "z80irq.h"
+#include "z80jit.h"
+
+#ifdef HAVE_UNISTD_H
+#    include <unistd.h>
+#endif
+
+#define DEFAULT_TSTATES UINT64_C(200000000) /* Per workload */
+
+#define NMI_PERIOD 60000   /* ABC80 clock interrupt, 50 Hz at 3 MHz */
+#define KEY_PERIOD 150000  /* Between key down and up, and the next key */
+#define BOOT_TSTATES 3000000 /* For BASIC to set itself up */
+
+/*
+ * What the front end and the screen code provide in the simulator
+ */
+int traceflags;
+FILE* tracef;
+static uint8_t screen_ram[2048];
+uint8_t* const video_ram = screen_ram;
+bool startup_width40;
+enum model model = MODEL_ABC80;
+unsigned int kilobytes = 64;
+bool old_basic;
+const char* program_name = "z80bench";
+const char *fileop_path, *lpr_command;
+FILE* console_file;
+volatile bool z80_quit;
+
+void setmode40(bool width40)
+{
+    abc80_mem_mode40(width40);
+}
+
+void crtc_out(uint8_t port, uint8_t v)
+{
+    (void)port;
+    (void)v;
+}
+
+uint8_t crtc_in(uint8_t port)
+{
+    (void)port;
+    return 0xff;
+}
+
+void vsync_screen(void)
+{
+}
+
+void abcprint_init(void)
+{
+}
+
+void abcprint_recv(const void* data, size_t len)
+{
+    (void)data;
+    (void)len;
+}
+
+void abc800_ctc_out(uint8_t port, uint8_t v)
+{
+    (void)port;
+    (void)v;
+}
+
+uint8_t abc800_ctc_in(uint8_t port)
+{
+    (void)port;
+    return 0xff;
+}
+
+void abc800_ctc_init(void)
+{
+}
+
+/*
+ * The events of the workload being run, in T-states from reset
+ */
+static struct
+{
+    uint64_t end;      /* Stop here */
+    uint64_t next_nmi; /* UINT64_MAX if no clock interrupt */
+    uint64_t next_key;
+    const char* keys; /* Still to be typed, or NULL */
+    bool key_down;
+    bool halted;
+    bool done;      /* The program has finished */
+    bool counting;  /* In the pass counting the instructions */
+    uint64_t start; /* TSTATE when the pass started */
+    uint64_t t0;    /* nstime() when the timed pass started */
+    uint64_t insns; /* Counted so far */
+} run;
+
+bool z80_poll_external(void)
+{
+    if (run.done || TSTATE >= run.end)
+        return true;
+
+    if (TSTATE >= run.next_nmi) {
+        z80_nmi();
+        run.next_nmi += NMI_PERIOD;
+    }
+
+    if (run.keys && TSTATE >= run.next_key) {
+        if (!run.key_down) {
+            keyboard_down(*run.keys == '\n' ? 13 : *run.keys);
+            run.key_down = true;
+        } else {
+            keyboard_up();
+            run.key_down = false;
+            if (!*++run.keys)
+                run.keys = NULL;
+        }
+        run.next_key += KEY_PERIOD;
+    }
+
+    return false;
+}
+
+uint64_t z80_poll_deadline(void)
+{
+    uint64_t deadline = run.end;
+
+    if (run.next_nmi < deadline)
+        deadline = run.next_nmi;
+    if (run.keys && run.next_key < deadline)
+        deadline = run.next_key;
+    return deadline;
+}
+
+/*
+ * The workloads.  A BASIC one is typed in and RUN before the timing
+ * starts, so the programs should not end; the code of a synthetic one
+ * is put at SYNTH_ORG and started with the ROM mapped but not running.
+ */
+#define SYNTH_ORG 0x8000
+#define SYNTH_STACK 0xf000
+#define CPM_ORG 0x0100
+
+enum workload_type
+{
+    WL_BASIC,
+    WL_SYNTH,
+    WL_CPM,
+};
+
+struct workload
+{
+    const char* name;
+    enum workload_type type;
+    const char* basic;
+    const uint8_t* code;
+    size_t len;
+};
+
+// clang-format off
+static const uint8_t synth_ldir[] = {
+    0x21, 0x00, 0x90,           /* 8000 LD HL,9000h */
+    0x11, 0x00, 0xa0,           /* 8003 LD DE,0A000h */
+    0x01, 0x00, 0x10,           /* 8006 LD BC,1000h */
+    0xed, 0xb0,                 /* 8009 LDIR */
+    0x18, 0xf3,                 /* 800B JR 8000h */
+};
+
+static const uint8_t synth_alu[] = {
+    0x06, 0x00,                 /* 8000 LD B,0 */
+    0x80,                       /* 8002 ADD A,B */
+    0x8f,                       /* 8003 ADC A,A */
+    0xa9,                       /* 8004 XOR C */
+    0x4f,                       /* 8005 LD C,A */
+    0x91,                       /* 8006 SUB C */
+    0xe6, 0x5a,                 /* 8007 AND 5Ah */
+    0xb2,                       /* 8009 OR D */
+    0x57,                       /* 800A LD D,A */
+    0x10, 0xf5,                 /* 800B DJNZ 8002h */
+    0x18, 0xf1,                 /* 800D JR 8000h */
+};
+
+static const uint8_t synth_mem[] = {
+    0xdd, 0x21, 0x00, 0xa0,     /* 8000 LD IX,0A000h */
+    0x21, 0x00, 0x90,           /* 8004 LD HL,9000h */
+    0x06, 0x00,                 /* 8007 LD B,0 */
+    0x7e,                       /* 8009 LD A,(HL) */
+    0x3c,                       /* 800A INC A */
+    0x77,                       /* 800B LD (HL),A */
+    0x23,                       /* 800C INC HL */
+    0xdd, 0x86, 0x01,           /* 800D ADD A,(IX+1) */
+    0xdd, 0x77, 0x00,           /* 8010 LD (IX+0),A */
+    0xdd, 0x23,                 /* 8013 INC IX */
+    0xe5,                       /* 8015 PUSH HL */
+    0xe1,                       /* 8016 POP HL */
+    0x10, 0xf0,                 /* 8017 DJNZ 8009h */
+    0x18, 0xe5,                 /* 8019 JR 8000h */
+};
+
+static const struct workload workloads[] = {
+    { "basic-float", WL_BASIC,
+      "10 X=SQR(X+2)*SIN(X)/3+1\n"
+      "20 GOTO 10\n"
+      "RUN\n", NULL, 0 },
+    { "basic-int", WL_BASIC,
+      "10 FOR I%=1 TO 30000\n"
+      "20 J%=I%+1\n"
+      "30 NEXT I%\n"
+      "40 GOTO 10\n"
+      "RUN\n", NULL, 0 },
+    { "basic-string", WL_BASIC,
+      "10 A$=A$+\"AB\"\n"
+      "20 IF LEN(A$)>60 THEN A$=\"\"\n"
+      "30 GOTO 10\n"
+      "RUN\n", NULL, 0 },
+    { "basic-print", WL_BASIC,
+      "10 PRINT \"THE QUICK BROWN FOX\";I\n"
+      "20 I=I+1\n"
+      "30 GOTO 10\n"
+      "RUN\n", NULL, 0 },
+    { "ldir", WL_SYNTH, NULL, synth_ldir, sizeof synth_ldir },
+    { "alu", WL_SYNTH, NULL, synth_alu, sizeof synth_alu },
+    { "mem", WL_SYNTH, NULL, synth_mem, sizeof synth_mem },
+    { "cpm", WL_CPM, NULL, NULL, 0 },
+    { NULL, WL_BASIC, NULL, NULL, 0 }
+};
+// clang-format on
+
+static uint64_t tstates = DEFAULT_TSTATES;
+static const char* cpm_file;
+
+/*
+ * The exerciser's tests, from its console output: each test prints
+ * "<name>....  OK" or "<name>.... ERROR **** crc expected:... found:..."
+ * when it is done.  The counting pass records the results and where
+ * each test ends; the timed pass only the host time.
+ */
+#define CPM_MAX_TESTS 128
+
+struct cpm_test
+{
+    char name[64];
+    bool ok;
+    uint64_t tstates; /* From the start of the pass to the end of the test */
+    uint64_t insns;
+    uint64_t ns;
+};
+
+static struct
+{
+    struct cpm_test tests[CPM_MAX_TESTS];
+    int ntests;
+    char line[128];
+    size_t len;
+} cpm;
+
+static void cpm_line(void)
+{
+    struct cpm_test* t;
+    char* dots;
+
+    cpm.line[cpm.len] = '\0';
+    cpm.len = 0;
+
+    dots = strstr(cpm.line, "....");
+    if (!dots || cpm.ntests >= CPM_MAX_TESTS)
+        return; /* Not the end of a test */
+
+    t = &cpm.tests[cpm.ntests++];
+    if (!run.counting) {
+        t->ns = nstime() - run.t0;
+        return;
+    }
+
+    t->ok = !!strstr(dots, "OK");
+    while (dots > cpm.line && dots[-1] == ' ')
+        dots--;
+    snprintf(t->name, sizeof t->name, "%.*s", (int)(dots - cpm.line),
+             cpm.line);
+    t->tstates = TSTATE - run.start;
+    t->insns = run.insns;
+}
+
+static void cpm_putc(uint8_t c)
+{
+    putc(c, stderr);
+
+    if (c == '\n')
+        cpm_line();
+    else if (c != '\r' && cpm.len < sizeof cpm.line - 1)
+        cpm.line[cpm.len++] = c;
+}
+
+/*
+ * The CP/M system calls the exercisers use: print a character (C = 2)
+ * or a $-terminated string (C = 9), to stderr to keep stdout for the
+ * results.  Going to 0 ends the program.
+ */
+static bool cpm_running;
+
+static bool cpm_bdos(void* arg)
+{
+    uint16_t p;
+    uint8_t c;
+
+    (void)arg;
+
+    if (!cpm_running)
+        return false;
+
+    switch (REG_C) {
+    case 2:
+        cpm_putc(REG_E);
+        break;
+    case 9:
+        for (p = REG_DE; (c = mem_read(p)) != '$'; p++)
+            cpm_putc(c);
+        break;
+    default:
+        break;
+    }
+
+    REG_PC = mem_read_word(REG_SP);
+    REG_SP += 2;
+    return true;
+}
+
+static bool cpm_boot(void* arg)
+{
+    (void)arg;
+
+    if (!cpm_running)
+        return false;
+
+    run.done = true;
+    z80_attention(Z80_ATTN_QUIT);
+    return true;
+}
+
+static int gethex(const char* p, int n)
+{
+    char buf[5];
+
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    return strtol(buf, NULL, 16);
+}
+
+/* Load an Intel hex file into RAM */
+static bool load_ihex(const char* filename)
+{
+    FILE* f;
+    char line[600];
+    unsigned int len, addr;
+    const char* p;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s: %s\n", program_name, filename,
+                strerror(errno));
+        return false;
+    }
+
+    while (fgets(line, sizeof line, f)) {
+        if (line[0] != ':' || strlen(line) < 11) {
+            fprintf(stderr, "%s: %s: invalid Intel hex file\n", program_name,
+                    filename);
+            fclose(f);
+            return false;
+        }
+        if (gethex(line + 7, 2) == 1)
+            break; /* End of file record */
+        if (gethex(line + 7, 2) != 0)
+            continue; /* Not a data record */
+
+        len = gethex(line + 1, 2);
+        addr = gethex(line + 3, 4);
+        for (p = line + 9; len-- && p[0] && p[1]; p += 2)
+            ram[addr++ & 0xffff] = gethex(p, 2);
+    }
+
+    fclose(f);
+    return true;
+}
+
+/*
+ * Reset the machine and set up the workload, up to where it is to be
+ * timed from; false if it cannot be run
+ */
+static bool setup(const struct workload* wl)
+{
+    size_t i;
+
+    memset(&z80_state, 0, sizeof z80_state);
+    memset(ram, 0, Z80_ADDRESS_LIMIT);
+    memset(screen_ram, ' ', sizeof screen_ram);
+    mem_init(wl->type == WL_CPM ? MEMFL_NOBASIC | MEMFL_NODEV : 0, NULL);
+    z80_reset();
+
+    memset(&run, 0, sizeof run);
+    run.next_nmi = UINT64_MAX;
+    cpm_running = false;
+    cpm.ntests = 0;
+    cpm.len = 0;
+
+    switch (wl->type) {
+    case WL_BASIC:
+        run.next_nmi = NMI_PERIOD;
+        run.keys = wl->basic;
+        run.next_key = BOOT_TSTATES;
+        run.end = BOOT_TSTATES + 2 * KEY_PERIOD * strlen(wl->basic);
+        break;
+
+    case WL_SYNTH:
+        for (i = 0; i < wl->len; i++)
+            mem_write(SYNTH_ORG + i, wl->code[i]);
+        REG_PC = SYNTH_ORG;
+        REG_SP = SYNTH_STACK;
+        break;
+
+    case WL_CPM:
+        if (!cpm_file) {
+            fprintf(stderr, "%s: the cpm workload needs -c\n", program_name);
+            return false;
+        }
+        if (!load_ihex(cpm_file))
+            return false;
+        /* JP to the top of the TPA, where the stack starts */
+        mem_write(0x0005, 0xc3);
+        mem_write_word(0x0006, 0xfe00);
+        REG_PC = CPM_ORG;
+        REG_SP = 0xfe00;
+        cpm_running = true;
+        break;
+    }
+
+    mem_flush_code();
+    atomic_clear_bit(&z80_state.attention, Z80_ATTN_QUIT);
+    run.halted = z80_run(true, false);
+    run.end = TSTATE + tstates;
+    return true;
+}
+
+struct result
+{
+    uint64_t tstates;
+    uint64_t insns;
+    uint64_t ns;
+};
+
+/* Count the instructions, one at a time */
+static void count_pass(struct result* r)
+{
+    const uint64_t start = TSTATE;
+    bool halted = run.halted;
+#if Z80_JIT
+    const bool jit = z80_jit_enabled;
+
+    z80_jit_enabled = false; /* A translated block runs as a whole */
+#endif
+
+    run.counting = true;
+    run.start = start;
+    while (!z80_poll_external()) {
+        halted = z80_run_until(TSTATE + 1, halted);
+        run.insns++;
+    }
+    r->insns = run.insns;
+    r->tstates = TSTATE - start;
+
+#if Z80_JIT
+    z80_jit_enabled = jit;
+#endif
+}
+
+static void timed_pass(struct result* r)
+{
+    const uint64_t start = TSTATE;
+    uint64_t t0;
+
+    run.start = start;
+    run.t0 = t0 = nstime();
+    z80_run(true, run.halted);
+    r->ns = nstime() - t0;
+
+    if (TSTATE - start != r->tstates) {
+        fprintf(stderr, "%s: warning: ran %" PRIu64 " T-states, counted "
+                "%" PRIu64 "\n", program_name, TSTATE - start, r->tstates);
+    }
+}
+
+static void print_result(const char* name, const char* test,
+                         const struct result* r, const char* result)
+{
+    const char* p;
+    double s = r->ns / 1.0e9;
+
+    if (test) {
+        /* Test names have commas in them */
+        printf("\"%s ", name);
+        for (p = test; *p; p++) {
+            if (*p == '"')
+                putchar('"');
+            putchar(*p);
+        }
+        putchar('"');
+    } else {
+        fputs(name, stdout);
+    }
+
+    printf(",%" PRIu64 ",%" PRIu64 ",%.6f,%.2f,%.2f,%.0f,%s\n", r->tstates,
+           r->insns, s, r->tstates / s / 1.0e6, (double)r->ns / r->insns,
+           r->insns / s, result);
+}
+
+/* Returns false if the workload could not be run or a test failed */
+static bool bench(const struct workload* wl)
+{
+    struct result r, tr;
+    const struct cpm_test* t;
+    const struct cpm_test* prev = NULL;
+    bool ok = true;
+    int i;
+
+    if (!setup(wl))
+        return false;
+    count_pass(&r);
+    if (!setup(wl))
+        return false;
+    timed_pass(&r);
+
+    if (wl->type != WL_CPM) {
+        print_result(wl->name, NULL, &r, "");
+        fflush(stdout);
+        return true;
+    }
+
+    for (i = 0; i < cpm.ntests; i++) {
+        if (!cpm.tests[i].ok)
+            ok = false;
+    }
+    print_result(wl->name, NULL, &r,
+                 !ok ? "fail" : run.done ? "pass" : "incomplete");
+
+    for (i = 0; i < cpm.ntests; i++) {
+        t = &cpm.tests[i];
+        tr.tstates = t->tstates - (prev ? prev->tstates : 0);
+        tr.insns = t->insns - (prev ? prev->insns : 0);
+        tr.ns = t->ns - (prev ? prev->ns : 0);
+        print_result(wl->name, t->name, &tr, t->ok ? "ok" : "error");
+        prev = t;
+    }
+    fflush(stdout);
+    return ok;
+}
+
+/*
+ * Runs of random instructions, each from random registers and interrupt
+ * state, for comparing two builds: all that should differ between them is how
+ * fast they get there.  The flags are where the two sides most often
+ * disagree, so values with the edge cases are favoured.
+ */
+#define RANDOM_DIGEST_EVERY 4096 /* Cases per line of output */
+
+static uint64_t rnd_state = UINT64_C(88172645463325252);
+
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state >> 11;
+}
+
+static uint64_t digest = UINT64_C(0xcbf29ce484222325); /* FNV-1a */
+
+static void digest_add(const void* data, size_t len)
+{
+    const uint8_t* p = data;
+
+    while (len--) {
+        digest ^= *p++;
+        digest *= UINT64_C(0x100000001b3);
+    }
+}
+
+static void digest_state(bool halted)
+{
+    const uint16_t regs[] = {REG_AF,       REG_BC,       REG_DE,
+                             REG_HL,       REG_IX,       REG_IY,
+                             REG_SP,       REG_PC,       REG_AF_PRIME,
+                             REG_BC_PRIME, REG_DE_PRIME, REG_HL_PRIME};
+    const uint8_t misc[] = {REG_I,
+                            REG_R,
+                            z80_state.iff1,
+                            z80_state.iff2,
+                            z80_state.interrupt_mode,
+                            z80_state.nmi_in_progress,
+                            halted};
+
+    digest_add(regs, sizeof regs);
+    digest_add(misc, sizeof misc);
+    digest_add(&z80_state.tc, sizeof z80_state.tc);
+}
+
+static void random_check(unsigned long cases)
+{
+    static uint16_t* const regs[] = {
+        &REG_AF, &REG_BC, &REG_DE, &REG_HL, &REG_IX, &REG_IY,
+        &REG_SP, &REG_AF_PRIME, &REG_BC_PRIME, &REG_DE_PRIME, &REG_HL_PRIME};
+    static const uint8_t prefixes[] = {0xcb, 0xdd, 0xed, 0xfd};
+    unsigned long n;
+    unsigned int i;
+    bool halted;
+
+    mem_init(MEMFL_NOBASIC | MEMFL_NODEV, NULL);
+    z80_reset();
+    for (i = 0; i < Z80_ADDRESS_LIMIT; i++)
+        ram[i] = rnd();
+    for (i = 0; i < sizeof screen_ram; i++)
+        screen_ram[i] = rnd();
+    mem_flush_code();
+
+    for (n = 1; n <= cases; n++) {
+        for (i = 0; i < sizeof regs / sizeof regs[0]; i++) {
+            *regs[i] = rnd();
+            if (!(rnd() & 7))
+                *regs[i] &= 0x00ff;
+            if (!(rnd() & 7))
+                *regs[i] |= 0xff00;
+        }
+        if (!(rnd() & 3))
+            REG_BC &= 7; /* Let block instructions finish */
+        REG_PC = rnd() & 0xfff0;
+        z80_state.i = rnd();
+        z80_state.rc = rnd();
+        z80_state.rf = rnd();
+        z80_state.iff1 = rnd() & 1;
+        z80_state.iff2 = rnd() & 1;
+        z80_state.interrupt_mode = rnd() % 3;
+        z80_state.nmi_in_progress = !(rnd() & 3);
+        z80_attention(Z80_ATTN_IRQ); /* Look for interrupts to take */
+
+        for (i = 0; i < 16; i++)
+            mem_write(REG_PC + i, rnd());
+        if (rnd() & 1) {
+            mem_write(REG_PC, prefixes[rnd() & 3]);
+            if (!(rnd() & 3))
+                mem_write(REG_PC + 1, 0xcb); /* DD CB, FD CB */
+        }
+        if (!(rnd() & 31))
+            z80_nmi();
+
+        /* A few instructions in one go, with flags left pending between */
+        halted = z80_run_until(TSTATE + 1 + (rnd() & 63), false);
+        digest_state(halted);
+
+        if (!(n % RANDOM_DIGEST_EVERY) || n == cases) {
+            digest_add(ram, Z80_ADDRESS_LIMIT);
+            digest_add(screen_ram, sizeof screen_ram);
+            printf("%lu %016" PRIx64 "\n", n, digest);
+        }
+    }
+}
+
+static void usage(void)
+{
+    const struct workload* wl;
+
+    fprintf(stderr,
+            "Usage: %s [-j] [-t tstates] [-c cpm.hex] [workload...]\n"
+            "       %s [-j] -r cases\n"
+            "Benchmark the Z80 core, writing CSV to stdout.\n"
+            "\n"
+            "  -j          translate hot code to native code (--cpu jit)\n"
+            "  -t tstates  T-states to run each workload for [%" PRIu64 "]\n"
+            "  -c file     CP/M program (e.g. ZEXDOC) in Intel hex, for the\n"
+            "              cpm workload; run until done or out of T-states,\n"
+            "              the exit status is 1 if a test fails\n"
+            "  -r cases    instead, run that many bursts of random instructions\n"
+            "              and print digests of the state, to compare builds\n"
+            "\n"
+            "Workloads (default all, cpm only with -c):",
+            program_name, program_name, DEFAULT_TSTATES);
+    for (wl = workloads; wl->name; wl++)
+        fprintf(stderr, " %s", wl->name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static const struct workload* find_workload(const char* name)
+{
+    const struct workload* wl;
+
+    for (wl = workloads; wl->name; wl++) {
+        if (!strcmp(wl->name, name))
+            return wl;
+    }
+    fprintf(stderr, "%s: unknown workload: %s\n", program_name, name);
+    usage();
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    const struct workload* wl;
+    bool use_jit = false;
+    unsigned long random_cases = 0;
+    int status = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "jt:c:r:h")) != -1) {
+        switch (opt) {
+        case 'j':
+            use_jit = true;
+            break;
+        case 't':
+            tstates = strtoull(optarg, NULL, 0);
+            if (!tstates)
+                usage();
+            break;
+        case 'c':
+            cpm_file = optarg;
+            break;
+        case 'r':
+            random_cases = strtoul(optarg, NULL, 0);
+            if (!random_cases)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    for (i = optind; i < argc; i++)
+        find_workload(argv[i]);
+
+    if (use_jit && !z80_jit_init()) {
+        fprintf(stderr, "%s: the JIT is not available on this system\n",
+                program_name);
+        return 1;
+    }
+
+    /* The ABC80 keyboard, as the simulator does it when typing fast */
+    faketype = true;
+    nstime_init();
+    io_init();
+    z80_add_trap(0x0000, cpm_boot, NULL);
+    z80_add_trap(0x0005, cpm_bdos, NULL);
+
+    if (random_cases) {
+        random_check(random_cases);
+        return 0;
+    }
+
+    printf("workload,tstates,instructions,host_s,emulated_mhz,ns_per_insn,"
+           "insns_per_s,result\n");
+    fflush(stdout);
+
+    if (optind < argc) {
+        for (i = optind; i < argc; i++) {
+            if (!bench(find_workload(argv[i])))
+                status = 1;
+        }
+    } else {
+        for (wl = workloads; wl->name; wl++) {
+            if ((wl->type != WL_CPM || cpm_file) && !bench(wl))
+                status = 1;
+        }
+    }
+
+    return status;
+}
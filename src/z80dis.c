@@ -362,3 +362,48 @@ int DAsm(uint16_t pc, char* T, int* target)
     /* Return the number of consumed bytes */
     return (uint16_t)(pc - pc0);
 }
+
+/*
+ * The mnemonic for opcode I in the given table (as for DAsm(); XReg is
+ * X or Y for the index register tables), with n, nn, e and d in place
+ * of the operands.
+ */
+void z80_opcode_name(char* T, int table, char XReg, uint8_t I)
+{
+    const char* P;
+    char PP;
+
+    if (!mtable[table] || !mtable[table][I]) {
+        sprintf(T, "??%s%02X",
+                (table & 4) == 0 ? "" : XReg == 'X' ? "DD" : "FD", I);
+        return;
+    }
+
+    P = mtable[table][I];
+    while ((PP = *P++)) {
+        switch (PP) {
+        case '%':
+            *T++ = XReg;
+            continue;
+        case '*':
+            *T++ = 'n';
+            break;
+        case '#':
+        case '$':
+            T += sprintf(T, "nn");
+            break;
+        case '@':
+            *T++ = 'e';
+            break;
+        case '+':
+            T += sprintf(T, "+d");
+            break;
+        default:
+            *T++ = PP;
+            continue;
+        }
+        if (*P == 'h') /* The hex suffix of the operand */
+            P++;
+    }
+    *T = '\0';
+}
@@ -0,0 +1,416 @@
+/*
+ * Copyright (C) 1992 Clarendon Hill Software.
+ *
+ * Permission is granted to any individual or institution to use, copy,
+ * or redistribute this software, provided this copyright notice is retained.
+ *
+ * This software is provided "as is" without any expressed or implied
+ * warranty.  If this software brings on any sort of damage -- physical,
+ * monetary, emotional, or brain -- too bad.  You've got no one to blame
+ * but yourself.
+ *
+ * The software may be modified for your own purposes, but modified versions
+ * must retain this notice.
+ */
+
+/*
+ * z80index.h:  Main group instructions which use HL.
+ *
+ * This is included three times inside the main switch of z80loop.h,
+ * with HL_INDEX 0, 1 and 2, producing separate handlers for HL, IX and
+ * IY (dispatched on instruction = opcode + 256 * HL_INDEX).  Within the
+ * handlers, HLREG is the register and HL_ADDR() the operand address of
+ * (hl), (ix+d) or (iy+d), so neither costs a test at runtime.
+ */
+
+#if HL_INDEX == 0
+#    define HLREG z80_state.hl
+#    define HL_ADDR() REG_HL
+#    define HL_GROUP main
+#else
+#    if HL_INDEX == 1
+#        define HLREG z80_state.ix
+#        define HL_GROUP ix
+#    else
+#        define HLREG z80_state.iy
+#        define HL_GROUP iy
+#    endif
+#    define HL_ADDR()                                                          \
+        (TSTATE += 8, /* Ouch! */                                              \
+         (uint16_t)(HLREG.word + (int8_t)op_fetch(REG_PC++)))
+#endif
+
+#if Z80_THREADED_DISPATCH
+#    define HL_LABEL(grp, op) OPCODE(grp, op)
+#    define HL_OPCODE(op) HL_LABEL(HL_GROUP, op)
+#else
+#    define HL_OPCODE(op) case HL_INDEX << 8 | (op)
+#endif
+
+        HL_OPCODE(0xCB): /* CB.. extended instruction */
+#if HL_INDEX == 0
+            REGS_CALL(do_CB_instruction());
+#else
+            REGS_CALL(do_xCB_instruction(HLREG.word));
+#endif
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x8C): /* adc a, h */
+            do_adc_byte(HLREG.byte.high);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x8D): /* adc a, l */
+            do_adc_byte(HLREG.byte.low);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x8E): /* adc a, (hl) */
+            do_adc_byte(mem_read(HL_ADDR()));
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x84): /* add a, h */
+            do_add_byte(HLREG.byte.high);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x85): /* add a, l */
+            do_add_byte(HLREG.byte.low);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x86): /* add a, (hl) */
+            do_add_byte(mem_read(HL_ADDR()));
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x09): /* add hl, bc */
+            do_add_word(&HLREG, REG_BC);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x19): /* add hl, de */
+            do_add_word(&HLREG, REG_DE);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x29): /* add hl, hl */
+            do_add_word(&HLREG, HLREG.word);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x39): /* add hl, sp */
+            do_add_word(&HLREG, REG_SP);
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xA4): /* and h */
+            do_and_byte(HLREG.byte.high);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0xA5): /* and l */
+            do_and_byte(HLREG.byte.low);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0xA6): /* and (hl) */
+            do_and_byte(mem_read(HL_ADDR()));
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xBC): /* cp h */
+            do_cp(HLREG.byte.high);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0xBD): /* cp l */
+            do_cp(HLREG.byte.low);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0xBE): /* cp (hl) */
+            do_cp(mem_read(HL_ADDR()));
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x25): /* dec h */
+            do_flags_dec_byte(--HLREG.byte.high);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x2D): /* dec l */
+            do_flags_dec_byte(--HLREG.byte.low);
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x35): /* dec (hl) */
+        {
+            uint16_t addr = HL_ADDR();
+            uint8_t value = mem_read(addr) - 1;
+            mem_write(addr, value);
+            do_flags_dec_byte(value);
+        } NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x2B): /* dec hl */
+            HLREG.word--;
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xEB): /* ex de, hl */
+        {
+            uint16_t temp;
+            temp = REG_DE;
+            REG_DE = HLREG.word;
+            HLREG.word = temp;
+        } NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xE3): /* ex (sp), hl */
+        {
+            uint16_t temp;
+            temp = mem_read_word(REG_SP);
+            mem_write_word(REG_SP, HLREG.word);
+            HLREG.word = temp;
+        } NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x24): /* inc h */
+            HLREG.byte.high++;
+            do_flags_inc_byte(HLREG.byte.high);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x2C): /* inc l */
+            HLREG.byte.low++;
+            do_flags_inc_byte(HLREG.byte.low);
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x34): /* inc (hl) */
+        {
+            uint16_t addr = HL_ADDR();
+            uint8_t value = mem_read(addr) + 1;
+            mem_write(addr, value);
+            do_flags_inc_byte(value);
+        } NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x23): /* inc hl */
+            HLREG.word++;
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xE9): /* jp (hl) */
+            REG_PC = HLREG.word;
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x7C): /* ld a, h */
+            REG_A = HLREG.byte.high;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x7D): /* ld a, l */
+            REG_A = HLREG.byte.low;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x44): /* ld b, h */
+            REG_B = HLREG.byte.high;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x45): /* ld b, l */
+            REG_B = HLREG.byte.low;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x4C): /* ld c, h */
+            REG_C = HLREG.byte.high;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x4D): /* ld c, l */
+            REG_C = HLREG.byte.low;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x54): /* ld d, h */
+            REG_D = HLREG.byte.high;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x55): /* ld d, l */
+            REG_D = HLREG.byte.low;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x5C): /* ld e, h */
+            REG_E = HLREG.byte.high;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x5D): /* ld e, l */
+            REG_E = HLREG.byte.low;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x67): /* ld h, a */
+            HLREG.byte.high = REG_A;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x60): /* ld h, b */
+            HLREG.byte.high = REG_B;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x61): /* ld h, c */
+            HLREG.byte.high = REG_C;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x62): /* ld h, d */
+            HLREG.byte.high = REG_D;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x63): /* ld h, e */
+            HLREG.byte.high = REG_E;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x64): /* ld h, h */
+            HLREG.byte.high = HLREG.byte.high;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x65): /* ld h, l */
+            HLREG.byte.high = HLREG.byte.low;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x6F): /* ld l, a */
+            HLREG.byte.low = REG_A;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x68): /* ld l, b */
+            HLREG.byte.low = REG_B;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x69): /* ld l, c */
+            HLREG.byte.low = REG_C;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x6A): /* ld l, d */
+            HLREG.byte.low = REG_D;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x6B): /* ld l, e */
+            HLREG.byte.low = REG_E;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x6C): /* ld l, h */
+            HLREG.byte.low = HLREG.byte.high;
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x6D): /* ld l, l */
+            HLREG.byte.low = HLREG.byte.low;
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x77): /* ld (hl), a */
+            mem_write(HL_ADDR(), REG_A);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x70): /* ld (hl), b */
+            mem_write(HL_ADDR(), REG_B);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x71): /* ld (hl), c */
+            mem_write(HL_ADDR(), REG_C);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x72): /* ld (hl), d */
+            mem_write(HL_ADDR(), REG_D);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x73): /* ld (hl), e */
+            mem_write(HL_ADDR(), REG_E);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x74): /* ld (hl), h */
+            mem_write(HL_ADDR(), REG_H);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x75): /* ld (hl), l */
+            mem_write(HL_ADDR(), REG_L);
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x7E): /* ld a, (hl) */
+            REG_A = mem_read(HL_ADDR());
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x46): /* ld b, (hl) */
+            REG_B = mem_read(HL_ADDR());
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x4E): /* ld c, (hl) */
+            REG_C = mem_read(HL_ADDR());
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x56): /* ld d, (hl) */
+            REG_D = mem_read(HL_ADDR());
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x5E): /* ld e, (hl) */
+            REG_E = mem_read(HL_ADDR());
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x66): /* ld h, (hl) */
+            REG_H = mem_read(HL_ADDR());
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x6E): /* ld l, (hl) */
+            REG_L = mem_read(HL_ADDR());
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x26): /* ld h, value */
+            HLREG.byte.high = op_fetch(REG_PC++);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x2E): /* ld l, value */
+            HLREG.byte.low = op_fetch(REG_PC++);
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x21): /* ld hl, value */
+            HLREG.word = op_fetch_word(REG_PC);
+            REG_PC += 2;
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x22): /* ld (address), hl */
+            mem_write_word(op_fetch_word(REG_PC), HLREG.word);
+            REG_PC += 2;
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x36): /* ld (hl), value */
+        {
+            uint16_t addr = HL_ADDR();
+            mem_write(addr, op_fetch(REG_PC++));
+            NEXT_INSTRUCTION;
+        }
+
+        HL_OPCODE(0x2A): /* ld hl, (address) */
+            HLREG.word = mem_read_word(op_fetch_word(REG_PC));
+            REG_PC += 2;
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xF9): /* ld sp, hl */
+            REG_SP = HLREG.word;
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xB4): /* or h */
+            do_or_byte(HLREG.byte.high);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0xB5): /* or l */
+            do_or_byte(HLREG.byte.low);
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xB6): /* or (hl) */
+            do_or_byte(mem_read(HL_ADDR()));
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xE1): /* pop hl */
+            HLREG.word = mem_read_word(REG_SP);
+            REG_SP += 2;
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xE5): /* push hl */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, HLREG.word);
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x9C): /* sbc a, h */
+            do_sbc_byte(HLREG.byte.high);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x9D): /* sbc a, l */
+            do_sbc_byte(HLREG.byte.low);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x9E): /* sbc a, (hl) */
+            do_sbc_byte(mem_read(HL_ADDR()));
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0x94): /* sub a, h */
+            do_sub_byte(HLREG.byte.high);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x95): /* sub a, l */
+            do_sub_byte(HLREG.byte.low);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0x96): /* sub a, (hl) */
+            do_sub_byte(mem_read(HL_ADDR()));
+            NEXT_INSTRUCTION;
+
+        HL_OPCODE(0xAC): /* xor h */
+            do_xor_byte(HLREG.byte.high);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0xAD): /* xor l */
+            do_xor_byte(HLREG.byte.low);
+            NEXT_INSTRUCTION;
+        HL_OPCODE(0xAE): /* xor (hl) */
+            do_xor_byte(mem_read(HL_ADDR()));
+            NEXT_INSTRUCTION;
+
+#if HL_INDEX != 0 && Z80_THREADED_DISPATCH
+        /*
+         * Opcodes on which DD/FD have no effect; decode_insn() drops the
+         * prefix, so these are only here to fill in the dispatch table.
+         */
+#    define HL_SAME(op)                                                        \
+        HL_OPCODE(op) : goto OPCODE(main, op);
+        HL_SAME(0x00) HL_SAME(0x01) HL_SAME(0x02) HL_SAME(0x03) HL_SAME(0x04) HL_SAME(0x05)
+        HL_SAME(0x06) HL_SAME(0x07) HL_SAME(0x08) HL_SAME(0x0A) HL_SAME(0x0B) HL_SAME(0x0C)
+        HL_SAME(0x0D) HL_SAME(0x0E) HL_SAME(0x0F) HL_SAME(0x10) HL_SAME(0x11) HL_SAME(0x12)
+        HL_SAME(0x13) HL_SAME(0x14) HL_SAME(0x15) HL_SAME(0x16) HL_SAME(0x17) HL_SAME(0x18)
+        HL_SAME(0x1A) HL_SAME(0x1B) HL_SAME(0x1C) HL_SAME(0x1D) HL_SAME(0x1E) HL_SAME(0x1F)
+        HL_SAME(0x20) HL_SAME(0x27) HL_SAME(0x28) HL_SAME(0x2F) HL_SAME(0x30) HL_SAME(0x31)
+        HL_SAME(0x32) HL_SAME(0x33) HL_SAME(0x37) HL_SAME(0x38) HL_SAME(0x3A) HL_SAME(0x3B)
+        HL_SAME(0x3C) HL_SAME(0x3D) HL_SAME(0x3E) HL_SAME(0x3F) HL_SAME(0x40) HL_SAME(0x41)
+        HL_SAME(0x42) HL_SAME(0x43) HL_SAME(0x47) HL_SAME(0x48) HL_SAME(0x49) HL_SAME(0x4A)
+        HL_SAME(0x4B) HL_SAME(0x4F) HL_SAME(0x50) HL_SAME(0x51) HL_SAME(0x52) HL_SAME(0x53)
+        HL_SAME(0x57) HL_SAME(0x58) HL_SAME(0x59) HL_SAME(0x5A) HL_SAME(0x5B) HL_SAME(0x5F)
+        HL_SAME(0x76) HL_SAME(0x78) HL_SAME(0x79) HL_SAME(0x7A) HL_SAME(0x7B) HL_SAME(0x7F)
+        HL_SAME(0x80) HL_SAME(0x81) HL_SAME(0x82) HL_SAME(0x83) HL_SAME(0x87) HL_SAME(0x88)
+        HL_SAME(0x89) HL_SAME(0x8A) HL_SAME(0x8B) HL_SAME(0x8F) HL_SAME(0x90) HL_SAME(0x91)
+        HL_SAME(0x92) HL_SAME(0x93) HL_SAME(0x97) HL_SAME(0x98) HL_SAME(0x99) HL_SAME(0x9A)
+        HL_SAME(0x9B) HL_SAME(0x9F) HL_SAME(0xA0) HL_SAME(0xA1) HL_SAME(0xA2) HL_SAME(0xA3)
+        HL_SAME(0xA7) HL_SAME(0xA8) HL_SAME(0xA9) HL_SAME(0xAA) HL_SAME(0xAB) HL_SAME(0xAF)
+        HL_SAME(0xB0) HL_SAME(0xB1) HL_SAME(0xB2) HL_SAME(0xB3) HL_SAME(0xB7) HL_SAME(0xB8)
+        HL_SAME(0xB9) HL_SAME(0xBA) HL_SAME(0xBB) HL_SAME(0xBF) HL_SAME(0xC0) HL_SAME(0xC1)
+        HL_SAME(0xC2) HL_SAME(0xC3) HL_SAME(0xC4) HL_SAME(0xC5) HL_SAME(0xC6) HL_SAME(0xC7)
+        HL_SAME(0xC8) HL_SAME(0xC9) HL_SAME(0xCA) HL_SAME(0xCC) HL_SAME(0xCD) HL_SAME(0xCE)
+        HL_SAME(0xCF) HL_SAME(0xD0) HL_SAME(0xD1) HL_SAME(0xD2) HL_SAME(0xD3) HL_SAME(0xD4)
+        HL_SAME(0xD5) HL_SAME(0xD6) HL_SAME(0xD7) HL_SAME(0xD8) HL_SAME(0xD9) HL_SAME(0xDA)
+        HL_SAME(0xDB) HL_SAME(0xDC) HL_SAME(0xDD) HL_SAME(0xDE) HL_SAME(0xDF) HL_SAME(0xE0)
+        HL_SAME(0xE2) HL_SAME(0xE4) HL_SAME(0xE6) HL_SAME(0xE7) HL_SAME(0xE8) HL_SAME(0xEA)
+        HL_SAME(0xEC) HL_SAME(0xED) HL_SAME(0xEE) HL_SAME(0xEF) HL_SAME(0xF0) HL_SAME(0xF1)
+        HL_SAME(0xF2) HL_SAME(0xF3) HL_SAME(0xF4) HL_SAME(0xF5) HL_SAME(0xF6) HL_SAME(0xF7)
+        HL_SAME(0xF8) HL_SAME(0xFA) HL_SAME(0xFB) HL_SAME(0xFC) HL_SAME(0xFD) HL_SAME(0xFE)
+        HL_SAME(0xFF)
+#    undef HL_SAME
+#endif
+
+#undef HLREG
+#undef HL_ADDR
+#undef HL_GROUP
+#undef HL_LABEL
+#undef HL_OPCODE
+#undef HL_INDEX
@@ -74,4 +74,6 @@ void z80_eoi(void)
     irq_mask |= 1U << prio;
     if (irq->eoi)
         irq->eoi(irq);
+    if (poll_irq())
+        z80_attention(Z80_ATTN_IRQ); /* Unmasked a pending interrupt */
 }
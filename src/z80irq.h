@@ -37,6 +37,7 @@ void z80_eoi(void);
 static inline void z80_interrupt(struct z80_irq* irq)
 {
     atomic_set_bit(&irq_pending, irq->prio);
+    z80_attention(Z80_ATTN_IRQ);
 }
 static inline void z80_clear_interrupt(struct z80_irq* irq)
 {
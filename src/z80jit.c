@@ -0,0 +1,862 @@
+/*
+ * z80jit.c: Translate hot blocks of Z80 code into x86-64 machine code.
+ *
+ * A block is the straight-line run of predecoded instructions in a
+ * code_page starting at some address (see decode_block() in z80.c);
+ * once the interpreter loop has entered it Z80_JIT_THRESHOLD times,
+ * the block is translated and the handle for the translation is kept
+ * in the z80_insn it starts at.  Since translations hang off the
+ * decoded instructions, they go away with them when a page of code is
+ * written to or the memory map changes.
+ *
+ * The translated code keeps all the Z80 state in z80_state, and
+ * updates TSTATE, R and the M1 address one instruction at a time just
+ * like the interpreter does.  Flags are computed by calling the same
+ * routines the interpreter uses, memory is accessed through
+ * mem_read()/mem_write(), and CB and ED instructions are handed back
+ * to the interpreter, so the results are identical.
+ *
+ * A block is only entered when no external event is due before its
+ * last instruction starts (see z80_run_until()), and any
+ * instruction which could make an interrupt acceptable or change the
+ * memory map (EI, I/O, RETI/RETN) ends the block, so interrupts are
+ * taken at the same instruction boundaries as when interpreting.
+ * After a write which invalidates code, the block is left at the
+ * following instruction.
+ */
+
+#include "z80jit.h"
+
+#if Z80_JIT
+
+#    include <sys/mman.h>
+
+bool z80_jit_enabled;
+
+#    define JIT_BUFFER_SIZE (8U << 20)
+#    define JIT_ALIGN 16
+#    define JIT_MAX_INSNS 32       /* Instructions per block */
+#    define JIT_MAX_INSN_CODE 160  /* Native code bytes per instruction */
+#    define JIT_MAX_POLL_CLK 128   /* T-states before the last instruction */
+#    define JIT_MAX_BLOCK (JIT_MAX_INSNS * JIT_MAX_INSN_CODE + 64)
+
+struct jit_block
+{
+    uint32_t poll_clk; /* Worst case T-states until the last instruction */
+    uint32_t pad[3];
+    uint8_t code[];
+};
+
+typedef void (*jit_func)(void);
+
+static struct
+{
+    uint8_t* buf;
+    size_t pos;
+} jit;
+
+bool z80_jit_init(void)
+{
+    void* buf;
+
+    buf = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        return false;
+
+    jit.buf = buf;
+    jit.pos = JIT_ALIGN; /* 0 means not translated */
+    z80_jit_enabled = true;
+    return true;
+}
+
+/*
+ * Offsets into z80_state, which is addressed through rbx
+ */
+#    define S(x) ((int)offsetof(struct z80_state_struct, x))
+#    define OFF_A S(af.byte.high)
+#    define OFF_F S(af.byte.low)
+#    define OFF_B S(bc.byte.high)
+#    define OFF_SP S(sp)
+#    define OFF_PC S(pc)
+#    define OFF_RC S(rc)
+#    define OFF_TC S(tc)
+
+/* Byte register by the 3-bit register field (6 is (hl), not a register) */
+static int reg8(unsigned int r, unsigned int index)
+{
+    static const int regs[3][8] = {
+        {S(bc.byte.high), S(bc.byte.low), S(de.byte.high), S(de.byte.low),
+         S(hl.byte.high), S(hl.byte.low), -1, S(af.byte.high)},
+        {S(bc.byte.high), S(bc.byte.low), S(de.byte.high), S(de.byte.low),
+         S(ix.byte.high), S(ix.byte.low), -1, S(af.byte.high)},
+        {S(bc.byte.high), S(bc.byte.low), S(de.byte.high), S(de.byte.low),
+         S(iy.byte.high), S(iy.byte.low), -1, S(af.byte.high)},
+    };
+    return regs[index][r];
+}
+
+/* Word register by the 2-bit register pair field; af selects push/pop */
+static int reg16(unsigned int p, unsigned int index, bool af)
+{
+    static const int hl[3] = {S(hl), S(ix), S(iy)};
+    static const int regs[4] = {S(bc), S(de), -1, S(sp)};
+
+    if (p == 2)
+        return hl[index];
+    if (p == 3 && af)
+        return S(af);
+    return regs[p];
+}
+
+/*
+ * x86-64 code emission
+ */
+enum
+{
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R12 = 12,
+    R13,
+    R14,
+    R15
+};
+
+/* Condition codes for jcc */
+#    define JZ 0x4
+#    define JNZ 0x5
+
+static uint8_t* ep; /* Emit pointer */
+
+static void e8(unsigned int v)
+{
+    *ep++ = v;
+}
+
+static void e16(unsigned int v)
+{
+    e8(v);
+    e8(v >> 8);
+}
+
+static void e32(uint32_t v)
+{
+    e16(v);
+    e16(v >> 16);
+}
+
+static void e64(uint64_t v)
+{
+    e32(v);
+    e32(v >> 32);
+}
+
+static void rex(bool w, unsigned int reg, unsigned int rm)
+{
+    unsigned int r = (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+    if (r)
+        e8(0x40 | r);
+}
+
+/* ModRM for [rbx+disp] with a low register or opcode extension */
+static void m_state(unsigned int reg, int disp)
+{
+    if (disp >= -128 && disp <= 127) {
+        e8(0x43 | (reg << 3));
+        e8(disp);
+    } else {
+        e8(0x83 | (reg << 3));
+        e32(disp);
+    }
+}
+
+/* movzx reg, byte/word [rbx+off] */
+static void ld8(unsigned int reg, int off)
+{
+    e8(0x0f);
+    e8(0xb6);
+    m_state(reg, off);
+}
+
+static void ld16(unsigned int reg, int off)
+{
+    e8(0x0f);
+    e8(0xb7);
+    m_state(reg, off);
+}
+
+/* mov byte/word [rbx+off], reg (al, cl or dl for bytes) */
+static void st8(unsigned int reg, int off)
+{
+    e8(0x88);
+    m_state(reg, off);
+}
+
+static void st16(unsigned int reg, int off)
+{
+    e8(0x66);
+    e8(0x89);
+    m_state(reg, off);
+}
+
+static void st8i(int off, uint8_t v)
+{
+    e8(0xc6);
+    m_state(0, off);
+    e8(v);
+}
+
+static void st16i(int off, uint16_t v)
+{
+    e8(0x66);
+    e8(0xc7);
+    m_state(0, off);
+    e16(v);
+}
+
+/* Group 1 arithmetic on memory: ext = 0 add, 1 or, 4 and, 5 sub, 6 xor */
+static void op8i(unsigned int ext, int off, uint8_t v)
+{
+    e8(0x80);
+    m_state(ext, off);
+    e8(v);
+}
+
+static void op16i(unsigned int ext, int off, int8_t v)
+{
+    e8(0x66);
+    e8(0x83);
+    m_state(ext, off);
+    e8(v);
+}
+
+static void add64i(int off, unsigned int v)
+{
+    e8(0x48);
+    if (v < 128) {
+        e8(0x83);
+        m_state(0, off);
+        e8(v);
+    } else {
+        e8(0x81);
+        m_state(0, off);
+        e32(v);
+    }
+}
+
+static void test8i(int off, uint8_t v)
+{
+    e8(0xf6);
+    m_state(0, off);
+    e8(v);
+}
+
+/* Group 3/4/5 unary operations on a byte: ext = 0 inc, 1 dec, 2 not */
+static void unary8(unsigned int ext, int off)
+{
+    e8(ext < 2 ? 0xfe : 0xf6);
+    m_state(ext, off);
+}
+
+static void mov_rr(unsigned int dst, unsigned int src)
+{
+    rex(false, src, dst);
+    e8(0x89);
+    e8(0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+static void mov_ri(unsigned int reg, uint32_t v)
+{
+    rex(false, 0, reg);
+    e8(0xb8 | (reg & 7));
+    e32(v);
+}
+
+static void mov_ri64(unsigned int reg, uint64_t v)
+{
+    rex(true, 0, reg);
+    e8(0xb8 | (reg & 7));
+    e64(v);
+}
+
+/* movzx dst, src8 (src is al, cl or dl) / movzx dst, src16 */
+static void movzx8_rr(unsigned int dst, unsigned int src)
+{
+    rex(false, dst, src);
+    e8(0x0f);
+    e8(0xb6);
+    e8(0xc0 | (dst & 7) << 3 | (src & 7));
+}
+
+static void movzx16_rr(unsigned int dst, unsigned int src)
+{
+    rex(false, dst, src);
+    e8(0x0f);
+    e8(0xb7);
+    e8(0xc0 | (dst & 7) << 3 | (src & 7));
+}
+
+static void add_ri8(unsigned int reg, int8_t v)
+{
+    rex(false, 0, reg);
+    e8(0x83);
+    e8(0xc0 | (reg & 7));
+    e8(v);
+}
+
+/* lea reg, [rbx+off] */
+static void lea_state(unsigned int reg, int off)
+{
+    rex(true, reg, RBX);
+    e8(0x8d);
+    m_state(reg, off);
+}
+
+static void call_abs(uintptr_t fn)
+{
+    mov_ri64(RAX, fn);
+    e8(0xff);
+    e8(0xd0);
+}
+#    define CALL(f) call_abs((uintptr_t)(f))
+
+/* Returns the location of the rel32 to patch */
+static uint8_t* jcc(unsigned int cc)
+{
+    e8(0x0f);
+    e8(0x80 | cc);
+    e32(0);
+    return ep - 4;
+}
+
+static void patch(uint8_t* where)
+{
+    int32_t rel = ep - (where + 4);
+    memcpy(where, &rel, sizeof rel);
+}
+
+/*
+ * Block entry and exit.  rbx points to z80_state, r12 to
+ * last_m1_address and r13 to the code cache base, which is ~0U if a
+ * write has invalidated code.  r14 and r15 are scratch registers
+ * preserved across calls.  Five pushes keep the stack 16-byte aligned.
+ */
+static void prologue(void)
+{
+    e8(0x53);              /* push rbx */
+    e16(0x5441);           /* push r12 */
+    e16(0x5541);           /* push r13 */
+    e16(0x5641);           /* push r14 */
+    e16(0x5741);           /* push r15 */
+    mov_ri64(RBX, (uintptr_t)&z80_state);
+    mov_ri64(R12, (uintptr_t)&last_m1_address);
+    mov_ri64(R13, (uintptr_t)z80_jit_helpers.code_base);
+}
+
+static void epilogue(void)
+{
+    e16(0x5f41); /* pop r15 */
+    e16(0x5e41); /* pop r14 */
+    e16(0x5d41); /* pop r13 */
+    e16(0x5c41); /* pop r12 */
+    e8(0x5b);    /* pop rbx */
+    e8(0xc3);    /* ret */
+}
+
+static void exit_to(uint16_t pc)
+{
+    st16i(OFF_PC, pc);
+    epilogue();
+}
+
+/* Leave the block at next if the last write invalidated code */
+static void check_code(uint16_t next)
+{
+    uint8_t* skip;
+
+    e8(0x41); /* cmp dword [r13], -1 */
+    e8(0x83);
+    e8(0x7d);
+    e8(0x00);
+    e8(0xff);
+    skip = jcc(JNZ);
+    exit_to(next);
+    patch(skip);
+}
+
+/*
+ * Z80 instruction translation
+ */
+enum jit_result
+{
+    JIT_NEXT, /* Continue with the next instruction */
+    JIT_END,  /* Translated, ends the block */
+    JIT_NO    /* Cannot be translated */
+};
+
+/* Flag tested by each condition code; odd conditions test for set */
+static const uint8_t cond_mask[4] = {ZERO_MASK, CARRY_MASK, PARITY_MASK,
+                                     SIGN_MASK};
+
+/* Jump to the returned location if condition cc is false */
+static uint8_t* jump_unless(unsigned int cc)
+{
+    test8i(OFF_F, cond_mask[cc >> 1]);
+    return jcc(cc & 1 ? JZ : JNZ);
+}
+
+/* Does this main group opcode access (hl) or (ix+d)? */
+static bool uses_hl_mem(uint8_t op)
+{
+    if (op >= 0x40 && op < 0xc0 && op != 0x76)
+        return (op & 7) == 6 || (op & 0xf8) == 0x70;
+    return op >= 0x34 && op <= 0x36;
+}
+
+static void hl_addr(unsigned int reg, const struct z80_insn* insn)
+{
+    ld16(reg, reg16(2, insn->index, false));
+    if (insn->index) {
+        add_ri8(reg, (int8_t)insn->bytes[1]);
+        movzx16_rr(reg, reg);
+    }
+}
+
+static void insn_start(uint16_t pc, const struct z80_insn* insn,
+                       unsigned int extra)
+{
+    e8(0x66); /* mov word [r12], pc */
+    e8(0x41);
+    e8(0xc7);
+    e8(0x04);
+    e8(0x24);
+    e16(pc);
+    add64i(OFF_TC, insn->clk + extra);
+    op8i(0, OFF_RC, insn->oplen);
+}
+
+static void swap16(int a, int b)
+{
+    ld16(RAX, a);
+    ld16(RCX, b);
+    st16(RCX, a);
+    st16(RAX, b);
+}
+
+static void ret_pop(void)
+{
+    ld16(RDI, OFF_SP);
+    CALL(mem_read_word);
+    st16(RAX, OFF_PC);
+    op16i(0, OFF_SP, 2);
+    epilogue();
+}
+
+static void call_to(uint16_t target, uint16_t ret)
+{
+    op16i(5, OFF_SP, 2);
+    ld16(RDI, OFF_SP);
+    mov_ri(RSI, ret);
+    CALL(mem_write_word);
+    exit_to(target);
+}
+
+/* inc (hl) / dec (hl) */
+static void incdec_mem(const struct z80_insn* insn, unsigned int ext,
+                       void (*flags)(int), uint16_t next)
+{
+    hl_addr(RDI, insn);
+    mov_rr(R14, RDI);
+    CALL(mem_read);
+    e8(0xfe); /* inc al / dec al */
+    e8(0xc0 | ext << 3);
+    movzx8_rr(R15, RAX);
+    mov_rr(RDI, R14);
+    mov_rr(RSI, R15);
+    CALL(mem_write);
+    mov_rr(RDI, R15);
+    CALL(flags);
+    check_code(next);
+}
+
+static enum jit_result translate_insn(const struct z80_insn* insn, uint16_t pc)
+{
+    const struct z80_jit_helpers* h = &z80_jit_helpers;
+    const uint8_t op = insn->bytes[0];
+    const unsigned int x = insn->index;
+    const unsigned int r = (op >> 3) & 7, s = op & 7, p = (op >> 4) & 3;
+    const uint16_t next = pc + insn->len;
+    const uint16_t nn = insn->bytes[1] + (insn->bytes[2] << 8);
+    const uint16_t rel = next + (int8_t)insn->bytes[1];
+    uint8_t* skip;
+
+    switch (op) {
+    case 0x76: /* halt */
+    case 0xf3: /* di */
+    case 0xfb: /* ei */
+    case 0xdd: /* Prefix chains are never cached */
+    case 0xfd:
+        return JIT_NO;
+    }
+
+    insn_start(pc, insn, x && uses_hl_mem(op) ? 8 : 0);
+
+    if ((op & 0xc0) == 0x40) {
+        if (r == 6) { /* ld (hl), r */
+            hl_addr(RDI, insn);
+            ld8(RSI, reg8(s, 0));
+            CALL(mem_write);
+            check_code(next);
+        } else if (s == 6) { /* ld r, (hl) */
+            hl_addr(RDI, insn);
+            CALL(mem_read);
+            st8(RAX, reg8(r, 0));
+        } else { /* ld r, r */
+            ld8(RAX, reg8(s, x));
+            st8(RAX, reg8(r, x));
+        }
+        return JIT_NEXT;
+    }
+
+    if ((op & 0xc0) == 0x80) { /* alu a, r / alu a, (hl) */
+        if (s == 6) {
+            hl_addr(RDI, insn);
+            CALL(mem_read);
+            movzx8_rr(RDI, RAX);
+        } else {
+            ld8(RDI, reg8(s, x));
+        }
+        CALL(h->alu[r]);
+        return JIT_NEXT;
+    }
+
+    switch (op & 0xcf) {
+    case 0x01: /* ld rr, value */
+        st16i(reg16(p, x, false), nn);
+        return JIT_NEXT;
+    case 0x03: /* inc rr */
+        op16i(0, reg16(p, x, false), 1);
+        return JIT_NEXT;
+    case 0x0b: /* dec rr */
+        op16i(5, reg16(p, x, false), 1);
+        return JIT_NEXT;
+    case 0x09: /* add hl, rr */
+        lea_state(RDI, reg16(2, x, false));
+        ld16(RSI, reg16(p, x, false));
+        CALL(h->add_word);
+        return JIT_NEXT;
+    case 0xc1: /* pop rr */
+        ld16(RDI, OFF_SP);
+        CALL(mem_read_word);
+        st16(RAX, reg16(p, x, true));
+        op16i(0, OFF_SP, 2);
+        return JIT_NEXT;
+    case 0xc5: /* push rr */
+        op16i(5, OFF_SP, 2);
+        ld16(RDI, OFF_SP);
+        ld16(RSI, reg16(p, x, true));
+        CALL(mem_write_word);
+        check_code(next);
+        return JIT_NEXT;
+    }
+
+    switch (op & 0xc7) {
+    case 0x04: /* inc r */
+        if (r == 6) {
+            incdec_mem(insn, 0, h->inc_flags, next);
+        } else {
+            unary8(0, reg8(r, x));
+            ld8(RDI, reg8(r, x));
+            CALL(h->inc_flags);
+        }
+        return JIT_NEXT;
+    case 0x05: /* dec r */
+        if (r == 6) {
+            incdec_mem(insn, 1, h->dec_flags, next);
+        } else {
+            unary8(1, reg8(r, x));
+            ld8(RDI, reg8(r, x));
+            CALL(h->dec_flags);
+        }
+        return JIT_NEXT;
+    case 0x06: /* ld r, value */
+        if (r == 6) {
+            hl_addr(RDI, insn);
+            mov_ri(RSI, insn->bytes[x ? 2 : 1]);
+            CALL(mem_write);
+            check_code(next);
+        } else {
+            st8i(reg8(r, x), insn->bytes[1]);
+        }
+        return JIT_NEXT;
+    case 0xc0: /* ret cc */
+        skip = jump_unless(r);
+        add64i(OFF_TC, 6);
+        ret_pop();
+        patch(skip);
+        exit_to(next);
+        return JIT_END;
+    case 0xc2: /* jp cc, address */
+        skip = jump_unless(r);
+        exit_to(nn);
+        patch(skip);
+        exit_to(next);
+        return JIT_END;
+    case 0xc4: /* call cc, address */
+        skip = jump_unless(r);
+        add64i(OFF_TC, 7);
+        call_to(nn, next);
+        patch(skip);
+        exit_to(next);
+        return JIT_END;
+    case 0xc6: /* alu a, value */
+        mov_ri(RDI, insn->bytes[1]);
+        CALL(h->alu[r]);
+        return JIT_NEXT;
+    case 0xc7: /* rst */
+        call_to(r << 3, next);
+        return JIT_END;
+    }
+
+    switch (op) {
+    case 0x00: /* nop */
+        return JIT_NEXT;
+    case 0x02: /* ld (bc), a */
+    case 0x12: /* ld (de), a */
+        ld16(RDI, reg16(p, x, false));
+        ld8(RSI, OFF_A);
+        CALL(mem_write);
+        check_code(next);
+        return JIT_NEXT;
+    case 0x0a: /* ld a, (bc) */
+    case 0x1a: /* ld a, (de) */
+        ld16(RDI, reg16(p, x, false));
+        CALL(mem_read);
+        st8(RAX, OFF_A);
+        return JIT_NEXT;
+    case 0x07: /* rlca */
+    case 0x0f: /* rrca */
+    case 0x17: /* rla */
+    case 0x1f: /* rra */
+        CALL(h->rot_a[r]);
+        return JIT_NEXT;
+    case 0x27: /* daa */
+        CALL(h->daa);
+        return JIT_NEXT;
+    case 0x2f: /* cpl */
+        unary8(2, OFF_A);
+        op8i(1, OFF_F, HALF_CARRY_MASK | SUBTRACT_MASK);
+        return JIT_NEXT;
+    case 0x37: /* scf */
+        op8i(1, OFF_F, CARRY_MASK);
+        op8i(4, OFF_F, (uint8_t) ~(SUBTRACT_MASK | HALF_CARRY_MASK));
+        return JIT_NEXT;
+    case 0x3f: /* ccf */
+        op8i(6, OFF_F, CARRY_MASK);
+        op8i(4, OFF_F, (uint8_t)~SUBTRACT_MASK);
+        return JIT_NEXT;
+    case 0x08: /* ex af, af' */
+        swap16(S(af), S(af_prime));
+        return JIT_NEXT;
+    case 0xd9: /* exx */
+        swap16(S(bc), S(bc_prime));
+        swap16(S(de), S(de_prime));
+        swap16(S(hl), S(hl_prime));
+        return JIT_NEXT;
+    case 0xeb: /* ex de, hl */
+        swap16(S(de), reg16(2, x, false));
+        return JIT_NEXT;
+    case 0xe3: /* ex (sp), hl */
+        ld16(RDI, OFF_SP);
+        CALL(mem_read_word);
+        movzx16_rr(R14, RAX);
+        ld16(RDI, OFF_SP);
+        ld16(RSI, reg16(2, x, false));
+        CALL(mem_write_word);
+        mov_rr(RAX, R14);
+        st16(RAX, reg16(2, x, false));
+        check_code(next);
+        return JIT_NEXT;
+    case 0xf9: /* ld sp, hl */
+        ld16(RAX, reg16(2, x, false));
+        st16(RAX, OFF_SP);
+        return JIT_NEXT;
+    case 0x22: /* ld (address), hl */
+        mov_ri(RDI, nn);
+        ld16(RSI, reg16(2, x, false));
+        CALL(mem_write_word);
+        check_code(next);
+        return JIT_NEXT;
+    case 0x2a: /* ld hl, (address) */
+        mov_ri(RDI, nn);
+        CALL(mem_read_word);
+        st16(RAX, reg16(2, x, false));
+        return JIT_NEXT;
+    case 0x32: /* ld (address), a */
+        mov_ri(RDI, nn);
+        ld8(RSI, OFF_A);
+        CALL(mem_write);
+        check_code(next);
+        return JIT_NEXT;
+    case 0x3a: /* ld a, (address) */
+        mov_ri(RDI, nn);
+        CALL(mem_read);
+        st8(RAX, OFF_A);
+        return JIT_NEXT;
+    case 0xcb: /* CB.. extended instruction */
+        mov_ri64(RDI, (uintptr_t)insn);
+        mov_ri(RSI, pc);
+        CALL(h->cb);
+        check_code(next);
+        return JIT_NEXT;
+    case 0xed: /* ED.. extended instruction */
+    {
+        const uint8_t sub = insn->bytes[1];
+
+        mov_ri64(RDI, (uintptr_t)insn);
+        mov_ri(RSI, pc);
+        CALL(h->ed);
+        /* retn/reti, repeated block instructions and I/O leave PC set */
+        if ((sub & 0xc7) == 0x45 || (sub & 0xf4) == 0xb0 ||
+            (sub & 0xc6) == 0x40 || (sub & 0xe6) == 0xa2) {
+            epilogue();
+            return JIT_END;
+        }
+        check_code(next);
+        return JIT_NEXT;
+    }
+    case 0x10: /* djnz offset */
+        unary8(1, OFF_B);
+        skip = jcc(JZ);
+        add64i(OFF_TC, 5);
+        exit_to(rel);
+        patch(skip);
+        exit_to(next);
+        return JIT_END;
+    case 0x18: /* jr offset */
+        exit_to(rel);
+        return JIT_END;
+    case 0x20: /* jr nz, offset */
+    case 0x28: /* jr z, offset */
+    case 0x30: /* jr nc, offset */
+    case 0x38: /* jr c, offset */
+        skip = jump_unless(r - 4);
+        add64i(OFF_TC, 5);
+        exit_to(rel);
+        patch(skip);
+        exit_to(next);
+        return JIT_END;
+    case 0xc3: /* jp address */
+        exit_to(nn);
+        return JIT_END;
+    case 0xc9: /* ret */
+        ret_pop();
+        return JIT_END;
+    case 0xcd: /* call address */
+        call_to(nn, next);
+        return JIT_END;
+    case 0xe9: /* jp (hl) */
+        ld16(RAX, reg16(2, x, false));
+        st16(RAX, OFF_PC);
+        epilogue();
+        return JIT_END;
+    case 0xd3: /* out (port), a */
+        mov_ri(RDI, insn->bytes[1]);
+        ld8(RSI, OFF_A);
+        CALL(z80_out);
+        exit_to(next);
+        return JIT_END;
+    case 0xdb: /* in a, (port) */
+        mov_ri(RDI, insn->bytes[1]);
+        CALL(z80_in);
+        st8(RAX, OFF_A);
+        exit_to(next);
+        return JIT_END;
+    }
+
+    abort(); /* All opcodes are covered above */
+}
+
+/* Upper bound for the T-states of an instruction */
+static unsigned int max_clk(const struct z80_insn* insn)
+{
+    uint8_t op = insn->bytes[0];
+    return insn->clk + (op == 0xcb || op == 0xed ? 20 : 8);
+}
+
+/*
+ * Translate the block at pc.  Returns Z80_JIT_NONE if it cannot be
+ * translated, or 0 if the translation buffer was full and everything
+ * has been flushed, including the decoded instructions.
+ */
+uint32_t z80_jit_translate(const struct code_page* cp, uint16_t pc)
+{
+    struct jit_block* blk;
+    const struct z80_insn* insn;
+    enum jit_result res = JIT_NO;
+    unsigned int n, clk, poll_clk;
+    uint32_t handle;
+
+    if (jit.pos + JIT_MAX_BLOCK > JIT_BUFFER_SIZE) {
+        jit.pos = JIT_ALIGN;
+        mem_flush_code();
+        return 0;
+    }
+
+    handle = jit.pos;
+    blk = (struct jit_block*)(jit.buf + handle);
+    ep = blk->code;
+    prologue();
+
+    n = clk = poll_clk = 0;
+    while (n < JIT_MAX_INSNS && clk <= JIT_MAX_POLL_CLK) {
+        insn = &cp->insn[pc & MEM_PAGE_MASK];
+        if (!insn->oplen)
+            break;
+        if (n && insn->dispatch >= Z80_DISPATCH_SPECIAL)
+            break; /* Leave idle loops and traps to the interpreter */
+
+        res = translate_insn(insn, pc);
+        if (res == JIT_NO)
+            break;
+
+        n++;
+        poll_clk = clk;
+        clk += max_clk(insn);
+        pc += insn->len;
+        if (res == JIT_END || !(pc & MEM_PAGE_MASK))
+            break;
+    }
+
+    if (!n)
+        return Z80_JIT_NONE;
+    if (res != JIT_END)
+        exit_to(pc);
+
+    blk->poll_clk = poll_clk;
+    jit.pos = (ep - jit.buf + JIT_ALIGN - 1) & ~(size_t)(JIT_ALIGN - 1);
+    return handle;
+}
+
+/*
+ * Run a translated block, unless the run deadline comes before the
+ * last instruction.
+ */
+bool z80_jit_run(uint32_t block)
+{
+    const struct jit_block* blk = (const struct jit_block*)(jit.buf + block);
+
+    if (TSTATE + blk->poll_clk >= z80_run_deadline)
+        return false;
+
+    ((jit_func)(uintptr_t)blk->code)();
+    return true;
+}
+
+#endif /* Z80_JIT */
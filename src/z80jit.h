@@ -0,0 +1,54 @@
+#ifndef Z80JIT_H
+#define Z80JIT_H
+
+#include "compiler.h"
+#include "z80.h"
+
+/*
+ * Translation of hot Z80 code blocks into native code (x86-64 Linux)
+ */
+#ifndef Z80_JIT
+#    if defined(__x86_64__) && defined(__linux__) && defined(HAVE_MMAP)
+#        define Z80_JIT 1
+#    else
+#        define Z80_JIT 0
+#    endif
+#endif
+
+/* Times a block is entered from the interpreter before it is translated */
+#ifndef Z80_JIT_THRESHOLD
+#    define Z80_JIT_THRESHOLD 16
+#endif
+
+/* z80_insn.jit for a block which cannot be translated */
+#define Z80_JIT_NONE UINT32_MAX
+
+/* Interpreter routines called from translated code */
+struct z80_jit_helpers
+{
+    const unsigned int* code_base; /* ~0U after code or memory map changes */
+    void (*alu[8])(int);           /* add, adc, sub, sbc, and, xor, or, cp */
+    void (*inc_flags)(int);
+    void (*dec_flags)(int);
+    void (*add_word)(wordregister*, int);
+    void (*rot_a[4])(void); /* rlca, rrca, rla, rra */
+    void (*daa)(void);
+    void (*cb)(const struct z80_insn*, uint16_t);
+    void (*ed)(const struct z80_insn*, uint16_t);
+};
+
+#if Z80_JIT
+extern const struct z80_jit_helpers z80_jit_helpers;
+extern bool z80_jit_enabled;
+extern bool z80_jit_init(void);
+extern uint32_t z80_jit_translate(const struct code_page* cp, uint16_t pc);
+extern bool z80_jit_run(uint32_t block);
+#else
+#    define z80_jit_enabled false
+static inline bool z80_jit_init(void)
+{
+    return false;
+}
+#endif
+
+#endif /* Z80JIT_H */
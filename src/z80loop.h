@@ -0,0 +1,924 @@
+/*
+ * Copyright (C) 1992 Clarendon Hill Software.
+ *
+ * Permission is granted to any individual or institution to use, copy,
+ * or redistribute this software, provided this copyright notice is retained.
+ *
+ * This software is provided "as is" without any expressed or implied
+ * warranty.  If this software brings on any sort of damage -- physical,
+ * monetary, emotional, or brain -- too bad.  You've got no one to blame
+ * but yourself.
+ *
+ * The software may be modified for your own purposes, but modified versions
+ * must retain this notice.
+ */
+
+/*
+ * z80loop.h:  The main CPU loop.
+ *
+ * This is included three times by z80.c, with RUN_LOOP naming the
+ * function and TRACED and PROFILED constant true or false, so that the
+ * untraced loop has no tracing checks (other than to see if tracing has
+ * been turned on) and all its memory accesses are inline.  The profiled
+ * loop reports each instruction to profile_insn().  It returns with
+ * RUN_RETRACE added to halted when the trace flags no longer match
+ * TRACED, and otherwise at the first instruction boundary at or past
+ * z80_run_deadline.
+ *
+ * PC, SP and the T-state counter are kept in locals (see REGS_OUT() in
+ * z80.c); z80_state is only current between the top of the loop and
+ * REGS_IN() before fetching the next instruction.
+ */
+
+#undef REG_PC
+#undef REG_SP
+#undef TSTATE
+#define REG_PC pc
+#define REG_SP sp
+#define TSTATE tstate
+
+static int RUN_LOOP(bool halted)
+{
+    unsigned int instruction;
+    uint16_t address; /* generic temps */
+    uint16_t pc, sp;
+    uint64_t tstate;
+    bool in_trace = false; /* Trace line waiting for the register changes */
+
+#if Z80_THREADED_DISPATCH
+    uint64_t deadline; /* End of the NEXT_INSTRUCTION fast path */
+    static const void* const main_table[3 * 256 + 2] = {
+        OPTAB256(main), OPTAB256(ix), OPTAB256(iy), &&main_IDLE_LOOP,
+        &&main_TRAP};
+#endif
+
+    REGS_IN();
+
+    /* loop to do a z80 instruction */
+    do {
+        REGS_OUT();
+        opstat_other(TSTATE);
+
+        if (TRACED && in_trace) {
+            trace_end();
+            in_trace = false;
+        }
+        check_eoi();
+        check_watch();
+        for (;;) {
+            if (unlikely(z80_state.attention & (1U << Z80_ATTN_QUIT)))
+                return halted;
+
+            if (check_interrupts())
+                halted = false;
+            z80_state.ei_shadow = false;
+            if (unlikely(stalled())) {
+                if (z80_state.tc >= z80_run_deadline)
+                    return halted;
+                continue;
+            }
+            if (!halted)
+                break;
+
+            /* Nothing but another thread can wake us before the deadline */
+            if (!z80_state.attention && z80_state.tc < z80_run_deadline) {
+                z80_state.tc +=
+                    (z80_run_deadline - z80_state.tc + 3) & ~UINT64_C(3);
+                z80_idle = true;
+            } else {
+                z80_state.tc += 4;
+            }
+
+            if (z80_state.tc >= z80_run_deadline)
+                return halted;
+        }
+
+        /* Switch loops if tracing was turned on or off */
+        if (unlikely(tracing(TRACE_CPU) != TRACED))
+            return halted | RUN_RETRACE;
+
+        /* Anything which lowered the deadline is seen to from here on */
+        if (unlikely(z80_state.attention & (1U << Z80_ATTN_DEADLINE)))
+            atomic_clear_bit(&z80_state.attention, Z80_ATTN_DEADLINE);
+
+#if Z80_THREADED_DISPATCH
+        deadline = 0;
+        if (!TRACED && !PROFILED && !z80_jit_enabled)
+            deadline = z80_run_deadline;
+#endif
+
+        if (TRACED) {
+            fprintf(tracef, "[%12" PRIu64 "] PC=%04X ", z80_state.tc,
+                    z80_state.pc.word);
+            disassemble(z80_state.pc.word);
+            in_trace = true;
+        }
+#if Z80_JIT
+        else if (!PROFILED && z80_jit_enabled && jit_run()) {
+            REGS_IN();
+            continue;
+        }
+#endif
+
+        REGS_IN();
+        if (PROFILED)
+            profile_insn(REG_PC, REG_SP, TSTATE);
+        FETCH_INSTRUCTION();
+
+    dispatch:
+        SWITCH(main, instruction) {
+        OPCODE(main, IDLE_LOOP): /* Head of an idle loop */
+            REGS_CALL(instruction = idle_loop());
+            goto dispatch;
+        OPCODE(main, TRAP): /* Entry of a routine with a native version */
+            REGS_CALL(instruction = run_trap());
+            if (instruction != TRAP)
+                goto dispatch;
+            continue; /* Through the full loop, for the stall */
+
+        OPCODE(main, 0xED): /* ED.. extended instruction */
+            REGS_CALL(do_ED_instruction());
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xDD): /* DD/FD prefixes are folded in by decode_insn() */
+        OPCODE(main, 0xFD):
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x8F): /* adc a, a */
+            do_adc_byte(REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x88): /* adc a, b */
+            do_adc_byte(REG_B);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x89): /* adc a, c */
+            do_adc_byte(REG_C);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x8A): /* adc a, d */
+            do_adc_byte(REG_D);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x8B): /* adc a, e */
+            do_adc_byte(REG_E);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xCE): /* adc a, value */
+            do_adc_byte(op_fetch(REG_PC++));
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x87): /* add a, a */
+            do_add_byte(REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x80): /* add a, b */
+            do_add_byte(REG_B);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x81): /* add a, c */
+            do_add_byte(REG_C);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x82): /* add a, d */
+            do_add_byte(REG_D);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x83): /* add a, e */
+            do_add_byte(REG_E);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xC6): /* add a, value */
+            do_add_byte(op_fetch(REG_PC++));
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xA7): /* and a */
+            do_and_byte(REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xA0): /* and b */
+            do_and_byte(REG_B);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xA1): /* and c */
+            do_and_byte(REG_C);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xA2): /* and d */
+            do_and_byte(REG_D);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xA3): /* and e */
+            do_and_byte(REG_E);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xE6): /* and value */
+            do_and_byte(op_fetch(REG_PC++));
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xCD): /* call address */
+            address = op_fetch_word(REG_PC);
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_PC + 2);
+            REG_PC = address;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xC4): /* call nz, address */
+            if (!ZERO_FLAG) {
+                address = op_fetch_word(REG_PC);
+                REG_SP -= 2;
+                mem_write_word(REG_SP, REG_PC + 2);
+                REG_PC = address;
+                TSTATE += 7;
+                NEXT_INSTRUCTION;
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xCC): /* call z, address */
+            if (ZERO_FLAG) {
+                address = op_fetch_word(REG_PC);
+                REG_SP -= 2;
+                mem_write_word(REG_SP, REG_PC + 2);
+                REG_PC = address;
+                TSTATE += 7;
+                NEXT_INSTRUCTION;
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xD4): /* call nc, address */
+            if (!CARRY_FLAG) {
+                address = op_fetch_word(REG_PC);
+                REG_SP -= 2;
+                mem_write_word(REG_SP, REG_PC + 2);
+                REG_PC = address;
+                TSTATE += 7;
+                NEXT_INSTRUCTION;
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xDC): /* call c, address */
+            if (CARRY_FLAG) {
+                address = op_fetch_word(REG_PC);
+                REG_SP -= 2;
+                mem_write_word(REG_SP, REG_PC + 2);
+                REG_PC = address;
+                TSTATE += 7;
+                NEXT_INSTRUCTION;
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xE4): /* call po, address */
+            if (!PARITY_FLAG) {
+                address = op_fetch_word(REG_PC);
+                REG_SP -= 2;
+                mem_write_word(REG_SP, REG_PC + 2);
+                REG_PC = address;
+                TSTATE += 7;
+                NEXT_INSTRUCTION;
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xEC): /* call pe, address */
+            if (PARITY_FLAG) {
+                address = op_fetch_word(REG_PC);
+                REG_SP -= 2;
+                mem_write_word(REG_SP, REG_PC + 2);
+                REG_PC = address;
+                TSTATE += 7;
+                NEXT_INSTRUCTION;
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xF4): /* call p, address */
+            if (!SIGN_FLAG) {
+                address = op_fetch_word(REG_PC);
+                REG_SP -= 2;
+                mem_write_word(REG_SP, REG_PC + 2);
+                REG_PC = address;
+                TSTATE += 7;
+                NEXT_INSTRUCTION;
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xFC): /* call m, address */
+            if (SIGN_FLAG) {
+                address = op_fetch_word(REG_PC);
+                REG_SP -= 2;
+                mem_write_word(REG_SP, REG_PC + 2);
+                REG_PC = address;
+                TSTATE += 7;
+                NEXT_INSTRUCTION;
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x3F): /* ccf */
+            REG_F = (REG_F ^ CARRY_MASK) & ~SUBTRACT_MASK;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xBF): /* cp a */
+            do_cp(REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xB8): /* cp b */
+            do_cp(REG_B);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xB9): /* cp c */
+            do_cp(REG_C);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xBA): /* cp d */
+            do_cp(REG_D);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xBB): /* cp e */
+            do_cp(REG_E);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xFE): /* cp value */
+            do_cp(op_fetch(REG_PC++));
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x2F): /* cpl */
+            REG_A = ~REG_A;
+            REG_F |= (HALF_CARRY_MASK | SUBTRACT_MASK);
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x27): /* daa */
+            do_daa();
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x3D): /* dec a */
+            do_flags_dec_byte(--REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x05): /* dec b */
+            do_flags_dec_byte(--REG_B);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x0D): /* dec c */
+            do_flags_dec_byte(--REG_C);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x15): /* dec d */
+            do_flags_dec_byte(--REG_D);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x1D): /* dec e */
+            do_flags_dec_byte(--REG_E);
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x0B): /* dec bc */
+            REG_BC--;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x1B): /* dec de */
+            REG_DE--;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x3B): /* dec sp */
+            REG_SP--;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xF3): /* di */
+            do_di();
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x10): /* djnz offset */
+            /* Zaks says no flag changes. */
+            if (--REG_B != 0) {
+                REG_PC += ((int8_t)op_fetch(REG_PC));
+                TSTATE += 5;
+            }
+            REG_PC++;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xFB): /* ei */
+            do_ei();
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x08): /* ex af, af' */
+        {
+            uint16_t temp;
+            temp = REG_AF;
+            REG_AF = REG_AF_PRIME;
+            REG_AF_PRIME = temp;
+        } NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xD9): /* exx */
+        {
+            uint16_t tmp;
+            tmp = REG_BC_PRIME;
+            REG_BC_PRIME = REG_BC;
+            REG_BC = tmp;
+            tmp = REG_DE_PRIME;
+            REG_DE_PRIME = REG_DE;
+            REG_DE = tmp;
+            tmp = REG_HL_PRIME;
+            REG_HL_PRIME = REG_HL;
+            REG_HL = tmp;
+        } NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x76): /* halt */
+            halted = 1;
+            continue; /* Wait for an interrupt in the full loop */
+
+        OPCODE(main, 0xDB): /* in a, (port) */
+            address = op_fetch(REG_PC++);
+            REGS_CALL(REG_A = z80_in(address));
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x3C): /* inc a */
+            REG_A++;
+            do_flags_inc_byte(REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x04): /* inc b */
+            REG_B++;
+            do_flags_inc_byte(REG_B);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x0C): /* inc c */
+            REG_C++;
+            do_flags_inc_byte(REG_C);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x14): /* inc d */
+            REG_D++;
+            do_flags_inc_byte(REG_D);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x1C): /* inc e */
+            REG_E++;
+            do_flags_inc_byte(REG_E);
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x03): /* inc bc */
+            REG_BC++;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x13): /* inc de */
+            REG_DE++;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x33): /* inc sp */
+            REG_SP++;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xC3): /* jp address */
+            REG_PC = op_fetch_word(REG_PC);
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xC2): /* jp nz, address */
+            if (!ZERO_FLAG) {
+                REG_PC = op_fetch_word(REG_PC);
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xCA): /* jp z, address */
+            if (ZERO_FLAG) {
+                REG_PC = op_fetch_word(REG_PC);
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xD2): /* jp nc, address */
+            if (!CARRY_FLAG) {
+                REG_PC = op_fetch_word(REG_PC);
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xDA): /* jp c, address */
+            if (CARRY_FLAG) {
+                REG_PC = op_fetch_word(REG_PC);
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xE2): /* jp po, address */
+            if (!PARITY_FLAG) {
+                REG_PC = op_fetch_word(REG_PC);
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xEA): /* jp pe, address */
+            if (PARITY_FLAG) {
+                REG_PC = op_fetch_word(REG_PC);
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xF2): /* jp p, address */
+            if (!SIGN_FLAG) {
+                REG_PC = op_fetch_word(REG_PC);
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xFA): /* jp m, address */
+            if (SIGN_FLAG) {
+                REG_PC = op_fetch_word(REG_PC);
+            } else {
+                REG_PC += 2;
+            }
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x18): /* jr offset */
+            REG_PC += (int8_t)op_fetch(REG_PC);
+            REG_PC++;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x20): /* jr nz, offset */
+            if (!ZERO_FLAG) {
+                REG_PC += (int8_t)op_fetch(REG_PC);
+                TSTATE += 5;
+            }
+            REG_PC++;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x28): /* jr z, offset */
+            if (ZERO_FLAG) {
+                REG_PC += (int8_t)op_fetch(REG_PC);
+                TSTATE += 5;
+            }
+            REG_PC++;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x30): /* jr nc, offset */
+            if (!CARRY_FLAG) {
+                REG_PC += (int8_t)op_fetch(REG_PC);
+                TSTATE += 5;
+            }
+            REG_PC++;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x38): /* jr c, offset */
+            if (CARRY_FLAG) {
+                REG_PC += (int8_t)op_fetch(REG_PC);
+                TSTATE += 5;
+            }
+            REG_PC++;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x7F): /* ld a, a */
+            REG_A = REG_A;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x78): /* ld a, b */
+            REG_A = REG_B;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x79): /* ld a, c */
+            REG_A = REG_C;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x7A): /* ld a, d */
+            REG_A = REG_D;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x7B): /* ld a, e */
+            REG_A = REG_E;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x47): /* ld b, a */
+            REG_B = REG_A;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x40): /* ld b, b */
+            REG_B = REG_B;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x41): /* ld b, c */
+            REG_B = REG_C;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x42): /* ld b, d */
+            REG_B = REG_D;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x43): /* ld b, e */
+            REG_B = REG_E;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x4F): /* ld c, a */
+            REG_C = REG_A;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x48): /* ld c, b */
+            REG_C = REG_B;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x49): /* ld c, c */
+            REG_C = REG_C;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x4A): /* ld c, d */
+            REG_C = REG_D;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x4B): /* ld c, e */
+            REG_C = REG_E;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x57): /* ld d, a */
+            REG_D = REG_A;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x50): /* ld d, b */
+            REG_D = REG_B;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x51): /* ld d, c */
+            REG_D = REG_C;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x52): /* ld d, d */
+            REG_D = REG_D;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x53): /* ld d, e */
+            REG_D = REG_E;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x5F): /* ld e, a */
+            REG_E = REG_A;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x58): /* ld e, b */
+            REG_E = REG_B;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x59): /* ld e, c */
+            REG_E = REG_C;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x5A): /* ld e, d */
+            REG_E = REG_D;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x5B): /* ld e, e */
+            REG_E = REG_E;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x02): /* ld (bc), a */
+            mem_write(REG_BC, REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x12): /* ld (de), a */
+            mem_write(REG_DE, REG_A);
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x3E): /* ld a, value */
+            REG_A = op_fetch(REG_PC++);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x06): /* ld b, value */
+            REG_B = op_fetch(REG_PC++);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x0E): /* ld c, value */
+            REG_C = op_fetch(REG_PC++);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x16): /* ld d, value */
+            REG_D = op_fetch(REG_PC++);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x1E): /* ld e, value */
+            REG_E = op_fetch(REG_PC++);
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x01): /* ld bc, value */
+            REG_BC = op_fetch_word(REG_PC);
+            REG_PC += 2;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x11): /* ld de, value */
+            REG_DE = op_fetch_word(REG_PC);
+            REG_PC += 2;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x31): /* ld sp, value */
+            REG_SP = op_fetch_word(REG_PC);
+            REG_PC += 2;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x3A): /* ld a, (address) */
+            /* this one is missing from Zaks */
+            REG_A = mem_read(op_fetch_word(REG_PC));
+            REG_PC += 2;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x0A): /* ld a, (bc) */
+            REG_A = mem_read(REG_BC);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x1A): /* ld a, (de) */
+            REG_A = mem_read(REG_DE);
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x32): /* ld (address), a */
+            mem_write(op_fetch_word(REG_PC), REG_A);
+            REG_PC += 2;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x00): /* nop */
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xF6): /* or value */
+            do_or_byte(op_fetch(REG_PC++));
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xB7): /* or a */
+            do_or_byte(REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xB0): /* or b */
+            do_or_byte(REG_B);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xB1): /* or c */
+            do_or_byte(REG_C);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xB2): /* or d */
+            do_or_byte(REG_D);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xB3): /* or e */
+            do_or_byte(REG_E);
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xD3): /* out (port), a */
+            address = op_fetch(REG_PC++);
+            REGS_CALL(z80_out(address, REG_A));
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xC1): /* pop bc */
+            REG_BC = mem_read_word(REG_SP);
+            REG_SP += 2;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xD1): /* pop de */
+            REG_DE = mem_read_word(REG_SP);
+            REG_SP += 2;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xF1): /* pop af */
+            REG_AF = mem_read_word(REG_SP);
+            REG_SP += 2;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xC5): /* push bc */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_BC);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xD5): /* push de */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_DE);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xF5): /* push af */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_AF);
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xC9): /* ret */
+            REG_PC = mem_read_word(REG_SP);
+            REG_SP += 2;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xC0): /* ret nz */
+            if (!ZERO_FLAG) {
+                REG_PC = mem_read_word(REG_SP);
+                REG_SP += 2;
+                TSTATE += 6;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xC8): /* ret z */
+            if (ZERO_FLAG) {
+                REG_PC = mem_read_word(REG_SP);
+                REG_SP += 2;
+                TSTATE += 6;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xD0): /* ret nc */
+            if (!CARRY_FLAG) {
+                REG_PC = mem_read_word(REG_SP);
+                REG_SP += 2;
+                TSTATE += 6;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xD8): /* ret c */
+            if (CARRY_FLAG) {
+                REG_PC = mem_read_word(REG_SP);
+                REG_SP += 2;
+                TSTATE += 6;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xE0): /* ret po */
+            if (!PARITY_FLAG) {
+                REG_PC = mem_read_word(REG_SP);
+                REG_SP += 2;
+                TSTATE += 6;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xE8): /* ret pe */
+            if (PARITY_FLAG) {
+                REG_PC = mem_read_word(REG_SP);
+                REG_SP += 2;
+                TSTATE += 6;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xF0): /* ret p */
+            if (!SIGN_FLAG) {
+                REG_PC = mem_read_word(REG_SP);
+                REG_SP += 2;
+                TSTATE += 6;
+            }
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xF8): /* ret m */
+            if (SIGN_FLAG) {
+                REG_PC = mem_read_word(REG_SP);
+                REG_SP += 2;
+                TSTATE += 6;
+            }
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x17): /* rla */
+            do_rla();
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x07): /* rlca */
+            do_rlca();
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x1F): /* rra */
+            do_rra();
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x0F): /* rrca */
+            do_rrca();
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xC7): /* rst 00h */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_PC);
+            REG_PC = 0x00;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xCF): /* rst 08h */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_PC);
+            REG_PC = 0x08;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xD7): /* rst 10h */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_PC);
+            REG_PC = 0x10;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xDF): /* rst 18h */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_PC);
+            REG_PC = 0x18;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xE7): /* rst 20h */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_PC);
+            REG_PC = 0x20;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xEF): /* rst 28h */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_PC);
+            REG_PC = 0x28;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xF7): /* rst 30h */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_PC);
+            REG_PC = 0x30;
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xFF): /* rst 38h */
+            REG_SP -= 2;
+            mem_write_word(REG_SP, REG_PC);
+            REG_PC = 0x38;
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x37): /* scf */
+            REG_F = (REG_F | CARRY_MASK) & ~(SUBTRACT_MASK | HALF_CARRY_MASK);
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x9F): /* sbc a, a */
+            do_sbc_byte(REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x98): /* sbc a, b */
+            do_sbc_byte(REG_B);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x99): /* sbc a, c */
+            do_sbc_byte(REG_C);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x9A): /* sbc a, d */
+            do_sbc_byte(REG_D);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x9B): /* sbc a, e */
+            do_sbc_byte(REG_E);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xDE): /* sbc a, value */
+            do_sbc_byte(op_fetch(REG_PC++));
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0x97): /* sub a, a */
+            do_sub_byte(REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x90): /* sub a, b */
+            do_sub_byte(REG_B);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x91): /* sub a, c */
+            do_sub_byte(REG_C);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x92): /* sub a, d */
+            do_sub_byte(REG_D);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0x93): /* sub a, e */
+            do_sub_byte(REG_E);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xD6): /* sub a, value */
+            do_sub_byte(op_fetch(REG_PC++));
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xEE): /* xor value */
+            do_xor_byte(op_fetch(REG_PC++));
+            NEXT_INSTRUCTION;
+
+        OPCODE(main, 0xAF): /* xor a */
+            do_xor_byte(REG_A);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xA8): /* xor b */
+            do_xor_byte(REG_B);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xA9): /* xor c */
+            do_xor_byte(REG_C);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xAA): /* xor d */
+            do_xor_byte(REG_D);
+            NEXT_INSTRUCTION;
+        OPCODE(main, 0xAB): /* xor e */
+            do_xor_byte(REG_E);
+            NEXT_INSTRUCTION;
+
+#define HL_INDEX 0
+#include "z80index.h"
+#define HL_INDEX 1
+#include "z80index.h"
+#define HL_INDEX 2
+#include "z80index.h"
+        }
+    } while (tstate < z80_run_deadline);
+
+    REGS_OUT();
+    if (TRACED && in_trace)
+        trace_end();
+    return halted;
+}
+
+#undef REG_PC
+#undef REG_SP
+#undef TSTATE
+#define REG_PC (z80_state.pc.word)
+#define REG_SP (z80_state.sp.word)
+#define TSTATE z80_state.tc